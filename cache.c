@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "cache.h"
+#include "lockprof.h"
+
+struct cache_slot {
+  dev_t dev;
+  ino_t ino;
+  uint64_t block;
+  uint32_t len;  // plain text bytes held, less than a block only at the end of a file
+  uint8_t used;
+  uint8_t ref;   // clock reference bit, set by every hit
+  int32_t next;  // next slot in the same hash bucket or -1
+  int32_t tail;  // next short last block in the same tail bucket or -1
+};
+
+// full blocks are spread over the shards a span at a time, the short last block of a file always lives in
+// the shard of span 0 so an invalidation knows where to find it when a write or truncate moves the end
+#define CACHE_SPAN 16
+
+struct cache_shard {
+  pthread_mutex_t mutex;
+  struct cache_slot *slots;
+  int32_t *buckets;
+  int32_t *tails;  // short last blocks hashed by file alone, an invalidation does not know where the end was
+  unsigned char *data;
+  uint32_t count;
+  uint32_t mask;
+  uint32_t hand;
+  uint64_t epoch; // bumped by every invalidation so a fill that raced with a write is dropped
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  uint64_t blocks;
+};
+
+static struct cache_shard *cache_shards = NULL;
+
+static uint64_t cache_mix(uint64_t x) {
+  x ^= x>>33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x>>33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x>>33;
+  return x;
+}
+
+static struct cache_shard* cache_shard(dev_t dev, ino_t ino, uint64_t span) {
+  return &cache_shards[cache_mix(((uint64_t)dev*0x9e3779b97f4a7c15ULL+ino)^(span*0xc2b2ae3d27d4eb4fULL))%CACHE_SHARDS];
+}
+
+static uint32_t cache_bucket(struct cache_shard *shard, dev_t dev, ino_t ino, uint64_t block) {
+  return cache_mix(((uint64_t)ino*0x9e3779b97f4a7c15ULL)^((uint64_t)dev<<48)^block) & shard->mask;
+}
+
+static int32_t cache_find(struct cache_shard *shard, dev_t dev, ino_t ino, uint64_t block) {
+  for(int32_t i=shard->buckets[cache_bucket(shard,dev,ino,block)]; i>=0; i=shard->slots[i].next) {
+    struct cache_slot *slot = &shard->slots[i];
+    if (slot->block==block && slot->ino==ino && slot->dev==dev) return i;
+  }
+  return -1;
+}
+
+static uint32_t cache_tail_bucket(struct cache_shard *shard, dev_t dev, ino_t ino) {
+  return cache_bucket(shard,dev,ino,UINT64_MAX);
+}
+
+static int32_t cache_find_tail(struct cache_shard *shard, dev_t dev, ino_t ino) {
+  for(int32_t i=shard->tails[cache_tail_bucket(shard,dev,ino)]; i>=0; i=shard->slots[i].tail) {
+    struct cache_slot *slot = &shard->slots[i];
+    if (slot->ino==ino && slot->dev==dev) return i;
+  }
+  return -1;
+}
+
+static void cache_unlink(struct cache_shard *shard, int32_t i) {
+  struct cache_slot *slot = &shard->slots[i];
+  int32_t *link = &shard->buckets[cache_bucket(shard,slot->dev,slot->ino,slot->block)];
+  while (*link!=i) link = &shard->slots[*link].next;
+  *link = slot->next;
+  if (slot->len<CACHE_BLOCK) {
+    link = &shard->tails[cache_tail_bucket(shard,slot->dev,slot->ino)];
+    while (*link!=i) link = &shard->slots[*link].tail;
+    *link = slot->tail;
+  }
+  slot->used = 0;
+  slot->ref = 0;
+  shard->blocks--;
+}
+
+int cache_init(uint64_t bytes) {
+  if (bytes==0) return 0;
+  uint64_t count = bytes/CACHE_BLOCK/CACHE_SHARDS;
+  if (count==0) count = 1;
+  uint32_t buckets = 1;
+  while (buckets<count*2) buckets <<= 1;
+  cache_shards = calloc(CACHE_SHARDS,sizeof(struct cache_shard));
+  if (cache_shards==NULL) return -ENOMEM;
+  for(int s=0; s<CACHE_SHARDS; s++) {
+    struct cache_shard *shard = &cache_shards[s];
+    pthread_mutex_init(&shard->mutex,NULL);
+    shard->count = count;
+    shard->mask = buckets-1;
+    shard->slots = calloc(count,sizeof(struct cache_slot));
+    shard->buckets = malloc(buckets*sizeof(int32_t));
+    shard->tails = malloc(buckets*sizeof(int32_t));
+    shard->data = malloc(count*CACHE_BLOCK);
+    if (shard->slots==NULL || shard->buckets==NULL || shard->tails==NULL || shard->data==NULL) {
+      cache_stop();
+      return -ENOMEM;
+    }
+    memset(shard->buckets,0xff,buckets*sizeof(int32_t));
+    memset(shard->tails,0xff,buckets*sizeof(int32_t));
+  }
+  return 0;
+}
+
+int cache_enabled(void) {
+  return cache_shards!=NULL;
+}
+
+static ssize_t cache_copy(struct cache_shard *shard, dev_t dev, ino_t ino, uint64_t block, size_t inner, unsigned char* data, size_t size) {
+  int32_t i = cache_find(shard,dev,ino,block);
+  if (i<0) return -1;
+  struct cache_slot *slot = &shard->slots[i];
+  slot->ref = 1;
+  shard->hits++;
+  if (inner>=slot->len) return 0;
+  size_t len = slot->len-inner<size ? slot->len-inner : size;
+  memcpy(data,&shard->data[(size_t)i*CACHE_BLOCK+inner],len);
+  return len;
+}
+
+ssize_t cache_read(dev_t dev, ino_t ino, off_t ofs, unsigned char* data, size_t size, uint64_t* epoch) {
+  // copies from the one block holding ofs, a miss returns -1 with the epoch to hand to cache_insert
+  uint64_t block = ofs/CACHE_BLOCK;
+  size_t inner = ofs%CACHE_BLOCK;
+  struct cache_shard *shard = cache_shard(dev,ino,block/CACHE_SPAN);
+  struct cache_shard *home = cache_shard(dev,ino,0);
+  lockprof_lock(&shard->mutex,LOCK_CACHE);
+  ssize_t rc = cache_copy(shard,dev,ino,block,inner,data,size);
+  *epoch = shard->epoch;
+  if (rc<0 && shard==home) shard->misses++;
+  lockprof_unlock(&shard->mutex,LOCK_CACHE);
+  if (rc<0 && shard!=home) {
+    lockprof_lock(&home->mutex,LOCK_CACHE);
+    rc = cache_copy(home,dev,ino,block,inner,data,size);
+    *epoch += home->epoch;
+    if (rc<0) home->misses++;
+    lockprof_unlock(&home->mutex,LOCK_CACHE);
+  }
+  return rc;
+}
+
+void cache_insert(dev_t dev, ino_t ino, uint64_t block, const unsigned char* data, size_t len, uint64_t epoch) {
+  struct cache_shard *span = cache_shard(dev,ino,block/CACHE_SPAN);
+  struct cache_shard *home = cache_shard(dev,ino,0);
+  struct cache_shard *shard = len<CACHE_BLOCK ? home : span;
+  struct cache_shard *other = shard==span ? home : span;
+  lockprof_lock(&shard->mutex,LOCK_CACHE);
+  // the epochs only grow so an unchanged sum means no invalidation of the block since it was read
+  uint64_t now = shard->epoch;
+  if (other!=shard) now += __atomic_load_n(&other->epoch,__ATOMIC_ACQUIRE);
+  if (now==epoch && cache_find(shard,dev,ino,block)<0) {
+    // clock eviction gives every referenced block one more pass of the hand
+    int32_t i;
+    for(;;) {
+      i = shard->hand;
+      shard->hand = (shard->hand+1)%shard->count;
+      struct cache_slot *slot = &shard->slots[i];
+      if (!slot->used) break;
+      if (slot->ref) {
+        slot->ref = 0;
+        continue;
+      }
+      cache_unlink(shard,i);
+      shard->evictions++;
+      break;
+    }
+    struct cache_slot *slot = &shard->slots[i];
+    slot->dev = dev;
+    slot->ino = ino;
+    slot->block = block;
+    slot->len = len;
+    slot->used = 1;
+    slot->ref = 1;
+    memcpy(&shard->data[(size_t)i*CACHE_BLOCK],data,len);
+    uint32_t bucket = cache_bucket(shard,dev,ino,block);
+    slot->next = shard->buckets[bucket];
+    shard->buckets[bucket] = i;
+    if (len<CACHE_BLOCK) {
+      bucket = cache_tail_bucket(shard,dev,ino);
+      slot->tail = shard->tails[bucket];
+      shard->tails[bucket] = i;
+    }
+    shard->blocks++;
+  }
+  lockprof_unlock(&shard->mutex,LOCK_CACHE);
+}
+
+static void cache_drop(struct cache_shard *shard, dev_t dev, ino_t ino, uint64_t first, uint64_t last, int tail) {
+  // blocks first to last are dropped, none when first is past last, and with tail the short last block too
+  lockprof_lock(&shard->mutex,LOCK_CACHE);
+  __atomic_add_fetch(&shard->epoch,1,__ATOMIC_RELEASE);
+  if (first<=last && last-first>=shard->count) {
+    // a range wider than the shard costs less to find by walking every slot once
+    for(uint32_t i=0; i<shard->count; i++) {
+      struct cache_slot *slot = &shard->slots[i];
+      if (!slot->used || slot->ino!=ino || slot->dev!=dev) continue;
+      if ((slot->block>=first && slot->block<=last) || (tail && slot->len<CACHE_BLOCK)) {
+        cache_unlink(shard,i);
+        shard->invalidations++;
+      }
+    }
+  } else {
+    for(uint64_t block=first; block<=last; block++) {
+      int32_t i = cache_find(shard,dev,ino,block);
+      if (i<0) continue;
+      cache_unlink(shard,i);
+      shard->invalidations++;
+    }
+    int32_t i;
+    while (tail && (i = cache_find_tail(shard,dev,ino))>=0) {
+      cache_unlink(shard,i);
+      shard->invalidations++;
+    }
+  }
+  lockprof_unlock(&shard->mutex,LOCK_CACHE);
+}
+
+void cache_invalidate(dev_t dev, ino_t ino, off_t from, off_t to) {
+  if (cache_shards==NULL) return;
+  if (from<0) from = 0;
+  uint64_t first = from/CACHE_BLOCK;
+  uint64_t last = to>from ? (uint64_t)(to-1)/CACHE_BLOCK : first;
+  // the short last block goes too because any write or truncate may have moved the end of the file
+  struct cache_shard *home = cache_shard(dev,ino,0);
+  if (last/CACHE_SPAN-first/CACHE_SPAN>=CACHE_SHARDS) {
+    for(int s=0; s<CACHE_SHARDS; s++) cache_drop(&cache_shards[s],dev,ino,first,last,&cache_shards[s]==home);
+    return;
+  }
+  int tail = 1;
+  for(uint64_t span=first/CACHE_SPAN; span<=last/CACHE_SPAN; span++) {
+    uint64_t lo = span*CACHE_SPAN>first ? span*CACHE_SPAN : first;
+    uint64_t hi = span*CACHE_SPAN+CACHE_SPAN-1<last ? span*CACHE_SPAN+CACHE_SPAN-1 : last;
+    struct cache_shard *shard = cache_shard(dev,ino,span);
+    cache_drop(shard,dev,ino,lo,hi,shard==home && tail);
+    if (shard==home) tail = 0;
+  }
+  if (tail) cache_drop(home,dev,ino,1,0,1);
+}
+
+void cache_forget(dev_t dev, ino_t ino) {
+  cache_invalidate(dev,ino,0,INT64_MAX);
+}
+
+void cache_summarise(struct cache_summary* summary) {
+  memset(summary,0,sizeof(struct cache_summary));
+  for(int s=0; cache_shards!=NULL && s<CACHE_SHARDS; s++) {
+    struct cache_shard *shard = &cache_shards[s];
+    lockprof_lock(&shard->mutex,LOCK_CACHE);
+    summary->hits += shard->hits;
+    summary->misses += shard->misses;
+    summary->evictions += shard->evictions;
+    summary->invalidations += shard->invalidations;
+    summary->blocks += shard->blocks;
+    summary->capacity += shard->count;
+    lockprof_unlock(&shard->mutex,LOCK_CACHE);
+  }
+}
+
+void cache_stop(void) {
+  if (cache_shards==NULL) return;
+  struct cache_shard *shards = cache_shards;
+  cache_shards = NULL;
+  for(int s=0; s<CACHE_SHARDS; s++) {
+    // the cache holds plain text so it is wiped before the memory is returned
+    if (shards[s].data!=NULL) memset(shards[s].data,0,(size_t)shards[s].count*CACHE_BLOCK);
+    free(shards[s].data);
+    free(shards[s].slots);
+    free(shards[s].buckets);
+    free(shards[s].tails);
+    pthread_mutex_destroy(&shards[s].mutex);
+  }
+  free(shards);
+}
@@ -0,0 +1,27 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// deciphered plain text is cached in fixed size blocks keyed by backing inode and block index
+#define CACHE_BLOCK 65536
+#define CACHE_SHARDS 64
+
+// totals across all shards for the statistics report and the metrics exporter
+struct cache_summary {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  uint64_t blocks;   // blocks held
+  uint64_t capacity; // blocks that fit
+};
+
+int cache_init(uint64_t bytes);
+int cache_enabled(void);
+ssize_t cache_read(dev_t dev, ino_t ino, off_t ofs, unsigned char* data, size_t size, uint64_t* epoch);
+void cache_insert(dev_t dev, ino_t ino, uint64_t block, const unsigned char* data, size_t len, uint64_t epoch);
+void cache_invalidate(dev_t dev, ino_t ino, off_t from, off_t to);
+void cache_forget(dev_t dev, ino_t ino);
+void cache_summarise(struct cache_summary* summary);
+void cache_stop(void);
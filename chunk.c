@@ -0,0 +1,770 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "sfs.h"
+#include "md5.h"
+#include "chunk.h"
+#include "pool.h"
+#include "rng.h"
+#include "stats.h"
+#include "lockprof.h"
+
+static pthread_mutex_t mutexchunk = PTHREAD_MUTEX_INITIALIZER;
+static chunk_file *chunk_files = NULL;
+
+static void chunk_sync_path(const char* fpath) {
+  // the folder is synced so new chunk files survive a crash, file systems that cannot sync a folder are ignored
+  int fd = stats_open(fpath,O_RDONLY,0);
+  if (fd<0) return;
+  stats_fsync(fd);
+  stats_close(fd);
+}
+
+static int chunk_join(char fpath[PATH_MAX], const char* folder, const char* name) {
+  int len = snprintf(fpath,PATH_MAX,"%s/%s",folder,name);
+  return len<0 || len>=PATH_MAX ? -ENAMETOOLONG : 0;
+}
+
+static void chunk_path(chunk_file* chunk, int64_t index, char fpath[PATH_MAX]) {
+  // chunks are named by the id in the manifest so a rename or a hard link never has to move them
+  char path[PATH_MAX];
+  int len = snprintf(path,sizeof(path),"%s/",CHUNK_DIR);
+  for(int i=0; i<CHUNK_ID; i++) len += snprintf(&path[len],sizeof(path)-len,"%02x",chunk->id[i]);
+  if (index>=0) snprintf(&path[len],sizeof(path)-len,"/%lld",(long long)index);
+  sfs_resolve(chunk->store,path,fpath);
+}
+
+static void chunk_tag(const sfs_header* header, unsigned char plain[CHUNK_MANIFEST], unsigned char tag[CHUNK_TAG]) {
+  // only the daemon knows the rotor of a file, so nothing written through the mount can carry the tag of its file
+  MD5_CTX context;
+  MD5Init(&context);
+  MD5Update(&context,(unsigned char*)header->f_ring,SFS_ROTOR);
+  MD5Update(&context,plain,CHUNK_MANIFEST-CHUNK_TAG);
+  MD5Final(tag,&context);
+  memset(&context,0,sizeof(context));
+}
+
+static int chunk_manifest_write(chunk_file* chunk) {
+  unsigned char plain[CHUNK_MANIFEST];
+  unsigned char out[CHUNK_MANIFEST];
+  memcpy(plain,CHUNK_MAGIC,8);
+  for(int i=0; i<8; i++) plain[8+i] = (uint64_t)chunk->size>>(i*8);
+  memcpy(&plain[16],chunk->id,CHUNK_ID);
+  chunk_tag(&chunk->header,plain,&plain[CHUNK_MANIFEST-CHUNK_TAG]);
+  stats_encipher(chunk->store,&chunk->header,0,plain,out,CHUNK_MANIFEST);
+  int rc = stats_pwrite(chunk->fd,out,CHUNK_MANIFEST,SFS_HEADER);
+  memset(plain,0,CHUNK_MANIFEST);
+  if (rc==0) chunk->dirty = 0;
+  return rc;
+}
+
+static int chunk_manifest_read(sfs_store* store, int fd, const struct stat* st, sfs_header* header, off_t* size, unsigned char id[CHUNK_ID]) {
+  // a manifest is told apart from a small file by its exact size, the magic at the start of its plain text and its tag
+  if (st->st_size!=SFS_HEADER+CHUNK_MANIFEST) return 0;
+  unsigned char in[CHUNK_MANIFEST];
+  unsigned char tag[CHUNK_TAG];
+  ssize_t got = stats_pread(fd,in,CHUNK_MANIFEST,SFS_HEADER);
+  if (got<0) return got;
+  if (got!=CHUNK_MANIFEST) return -EIO;
+  stats_decipher(store,header,0,in,CHUNK_MANIFEST);
+  chunk_tag(header,in,tag);
+  int rc = !memcmp(in,CHUNK_MAGIC,8) && !memcmp(tag,&in[CHUNK_MANIFEST-CHUNK_TAG],CHUNK_TAG);
+  if (rc) {
+    uint64_t value = 0;
+    for(int i=7; i>=0; i--) value = (value<<8) | in[8+i];
+    *size = value;
+    memcpy(id,&in[16],CHUNK_ID);
+  }
+  memset(in,0,CHUNK_MANIFEST);
+  return rc;
+}
+
+static void chunk_pending(chunk_file* chunk, chunk_slot* slot) {
+  // a chunk closed with writes that were never synced is remembered so the next fsync still covers it
+  if (chunk->pending_count==chunk->pending_capacity) {
+    size_t capacity = chunk->pending_capacity ? chunk->pending_capacity*2 : 16;
+    int64_t *pending = realloc(chunk->pending,capacity*sizeof(int64_t));
+    if (pending==NULL) {
+      stats_fsync(slot->fd);
+      return;
+    }
+    chunk->pending = pending;
+    chunk->pending_capacity = capacity;
+  }
+  chunk->pending[chunk->pending_count++] = slot->index;
+}
+
+static void chunk_slot_close(chunk_file* chunk, chunk_slot* slot, int discard) {
+  if (slot->dirty && !discard) chunk_pending(chunk,slot);
+  stats_close(slot->fd);
+  memset(&slot->header,0,sizeof(sfs_header));
+  slot->index = -1;
+  slot->fd = -1;
+  slot->dirty = 0;
+  slot->used = 0;
+}
+
+static void chunk_slots_close(chunk_file* chunk, int64_t from, int discard) {
+  // only called with the lock held alone so no slot is busy
+  for(int i=0; i<CHUNK_SLOTS; i++) {
+    if (chunk->slots[i].index>=from) chunk_slot_close(chunk,&chunk->slots[i],discard);
+  }
+}
+
+static int chunk_create(chunk_file* chunk, int64_t index, sfs_header* header) {
+  char fpath[PATH_MAX];
+  chunk_path(chunk,index,fpath);
+  int fd = stats_open(fpath,O_CREAT | O_EXCL | O_RDWR,0600);
+  if (fd<0) return -errno;
+  // every chunk gets a header of its own from the pool so no two chunks share a rotor
+  unsigned char out[SFS_HEADER];
+  pool_take(chunk->store,header,out);
+  int rc = stats_pwrite(fd,out,SFS_HEADER,0);
+  memset(out,0,SFS_HEADER);
+  if (rc<0) {
+    stats_close(fd);
+    unlink(fpath);
+    memset(header,0,sizeof(sfs_header));
+    return rc;
+  }
+  chunk->created = 1;
+  return fd;
+}
+
+static chunk_slot* chunk_slot_get(chunk_file* chunk, int64_t index, int create, int* err) {
+  pthread_mutex_lock(&chunk->mutex);
+  for(int i=0; i<CHUNK_SLOTS; i++) {
+    chunk_slot *slot = &chunk->slots[i];
+    if (slot->index==index) {
+      slot->busy++;
+      slot->used = ++chunk->tick;
+      pthread_mutex_unlock(&chunk->mutex);
+      return slot;
+    }
+  }
+  sfs_header header;
+  char fpath[PATH_MAX];
+  chunk_path(chunk,index,fpath);
+  int rc = 0;
+  int fd = stats_open(fpath,O_RDWR,0);
+  if (fd<0 && errno==ENOENT && create) {
+    fd = chunk_create(chunk,index,&header);
+    if (fd<0) rc = fd;
+  } else if (fd<0) {
+    rc = -errno;
+  } else {
+    uint64_t sys = stats_clock();
+    rc = sfs_read_header(chunk->store,fd,&header);
+    stats_record(STATS_SYS_PREAD,sys,rc,rc==0 ? SFS_HEADER : 0);
+    if (rc<0) stats_close(fd);
+  }
+  if (rc<0) {
+    pthread_mutex_unlock(&chunk->mutex);
+    *err = rc;
+    return NULL;
+  }
+  // the least recently used idle slot is reused, a temporary one is made when every slot is busy
+  chunk_slot *slot = NULL;
+  for(int i=0; i<CHUNK_SLOTS; i++) {
+    chunk_slot *s = &chunk->slots[i];
+    if (s->busy==0 && (slot==NULL || s->used<slot->used)) slot = s;
+  }
+  if (slot==NULL) {
+    slot = calloc(1,sizeof(chunk_slot));
+    if (slot==NULL) {
+      stats_close(fd);
+      memset(&header,0,sizeof(sfs_header));
+      pthread_mutex_unlock(&chunk->mutex);
+      *err = -ENOMEM;
+      return NULL;
+    }
+    slot->temporary = 1;
+  } else if (slot->index>=0) {
+    chunk_slot_close(chunk,slot,0);
+  }
+  slot->index = index;
+  slot->fd = fd;
+  slot->busy = 1;
+  slot->dirty = 0;
+  slot->used = ++chunk->tick;
+  memcpy(&slot->header,&header,sizeof(sfs_header));
+  memset(&header,0,sizeof(sfs_header));
+  pthread_mutex_unlock(&chunk->mutex);
+  return slot;
+}
+
+static void chunk_slot_put(chunk_file* chunk, chunk_slot* slot) {
+  pthread_mutex_lock(&chunk->mutex);
+  if (--slot->busy==0 && slot->temporary) {
+    chunk_slot_close(chunk,slot,0);
+    free(slot);
+  }
+  pthread_mutex_unlock(&chunk->mutex);
+}
+
+static int chunk_remove(chunk_file* chunk) {
+  // the whole folder goes, including any chunk left behind by an interrupted change
+  chunk_slots_close(chunk,0,1);
+  chunk->pending_count = 0;
+  char fpath[PATH_MAX];
+  char child[PATH_MAX];
+  chunk_path(chunk,-1,fpath);
+  uint64_t sys = stats_clock();
+  DIR *dp = opendir(fpath);
+  stats_record(STATS_SYS_DIR,sys,dp==NULL ? -1 : 0,0);
+  if (dp==NULL) return errno==ENOENT ? 0 : -errno;
+  struct dirent *dent;
+  while ((dent = readdir(dp))!=NULL) {
+    if (!strcmp(dent->d_name,".") || !strcmp(dent->d_name,"..")) continue;
+    // a name that does not fit is left behind and the folder is reported as not removed
+    if (chunk_join(child,fpath,dent->d_name)<0) continue;
+    sys = stats_clock();
+    int rc = unlink(child);
+    stats_record(STATS_SYS_META,sys,rc,0);
+  }
+  closedir(dp);
+  sys = stats_clock();
+  int rc = rmdir(fpath);
+  stats_record(STATS_SYS_META,sys,rc,0);
+  return rc<0 ? -errno : 0;
+}
+
+static int chunk_copy_attributes(int from, int to, const struct stat* st) {
+  // the manifest replaces the file under its name so it takes over everything but the data
+  if (fchown(to,st->st_uid,st->st_gid)<0 && errno!=EPERM) return -errno;
+  if (fchmod(to,st->st_mode & 07777)<0) return -errno;
+#ifdef __APPLE__
+  ssize_t size = flistxattr(from,NULL,0,0);
+#else
+  ssize_t size = flistxattr(from,NULL,0);
+#endif
+  if (size<0) return errno==ENOTSUP ? 0 : -errno;
+  char *names = malloc(size>0 ? size : 1);
+  if (names==NULL) return -ENOMEM;
+#ifdef __APPLE__
+  size = flistxattr(from,names,size,0);
+#else
+  size = flistxattr(from,names,size);
+#endif
+  int rc = size<0 ? -errno : 0;
+  for(char *name=names; rc==0 && name<names+size; name+=strlen(name)+1) {
+#ifdef __APPLE__
+    ssize_t len = fgetxattr(from,name,NULL,0,0,0);
+#else
+    // the system labels a new file itself, only the attributes of the user are copied
+    if (strncmp(name,"user.",5)) continue;
+    ssize_t len = fgetxattr(from,name,NULL,0);
+#endif
+    unsigned char *value = len>=0 ? malloc(len>0 ? len : 1) : NULL;
+    if (len<0) rc = -errno;
+    else if (value==NULL) rc = -ENOMEM;
+#ifdef __APPLE__
+    else if ((len = fgetxattr(from,name,value,len,0,0))<0 || fsetxattr(to,name,value,len,0,0)<0) rc = -errno;
+#else
+    else if ((len = fgetxattr(from,name,value,len))<0 || fsetxattr(to,name,value,len,0)<0) rc = -errno;
+#endif
+    free(value);
+  }
+  free(names);
+#ifdef __APPLE__
+  if (rc==0 && st->st_flags!=0 && fchflags(to,st->st_flags)<0) rc = -errno;
+#endif
+  return rc;
+}
+
+static int chunk_convert(chunk_file* chunk, const char* path) {
+  // called with the lock held alone, the chunks and then a manifest are written and synced beside the file and
+  // the manifest is renamed over it, so a crash at any point leaves either the old data or the split file
+  if (path==NULL) return 0;
+  char fpath[PATH_MAX];
+  sfs_resolve(chunk->store,path,fpath);
+  struct stat st;
+  struct stat named;
+  uint64_t sys = stats_clock();
+  int rc = fstat(chunk->fd,&st);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc<0) return -errno;
+  // a file renamed or unlinked since the request began is left whole, as is one whose second name would keep the old data
+  sys = stats_clock();
+  rc = lstat(fpath,&named);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc<0 || named.st_dev!=st.st_dev || named.st_ino!=st.st_ino || st.st_nlink>1) return 0;
+  off_t size = sfs_plain_size(st.st_size);
+  char folder[PATH_MAX];
+  sfs_resolve(chunk->store,CHUNK_DIR,folder);
+  if (mkdir(folder,0700)<0 && errno!=EEXIST) return -errno;
+  rng_bytes(chunk->id,CHUNK_ID);
+  chunk_path(chunk,-1,folder);
+  if (mkdir(folder,0700)<0) return -errno;
+  unsigned char *buf = malloc(SFS_COPY_CHUNK);
+  if (buf==NULL) rc = -ENOMEM;
+  for(int64_t index=0; rc==0 && index*CHUNK_SIZE<size; index++) {
+    sfs_header header;
+    int fd = chunk_create(chunk,index,&header);
+    if (fd<0) {
+      rc = fd;
+      break;
+    }
+    off_t end = size-index*CHUNK_SIZE<CHUNK_SIZE ? size-index*CHUNK_SIZE : CHUNK_SIZE;
+    for(off_t done=0; rc==0 && done<end; done+=SFS_COPY_CHUNK) {
+      size_t len = end-done<SFS_COPY_CHUNK ? (size_t)(end-done) : SFS_COPY_CHUNK;
+      off_t pos = index*CHUNK_SIZE+done;
+      ssize_t got = stats_pread(chunk->fd,buf,len,sfs_backing_offset(pos));
+      if (got<0) rc = got;
+      else if ((size_t)got!=len) rc = -EIO;
+      if (rc==0) {
+        // each chunk is enciphered again from its own start with its own rotor
+        stats_decipher(chunk->store,&chunk->header,pos,buf,len);
+        stats_encipher(chunk->store,&header,done,buf,buf,len);
+        rc = stats_pwrite(fd,buf,len,SFS_HEADER+done);
+      }
+    }
+    if (rc==0) rc = stats_fsync(fd);
+    stats_close(fd);
+    memset(&header,0,sizeof(sfs_header));
+  }
+  if (buf!=NULL) {
+    memset(buf,0,SFS_COPY_CHUNK);
+    free(buf);
+  }
+  // the manifest keeps the header of the file so the handles and cached headers on it stay valid
+  char temp[PATH_MAX];
+  int old = chunk->fd;
+  int fd = -1;
+  if (rc==0 && (rc = chunk_join(temp,folder,CHUNK_TEMP))==0 && (fd = stats_open(temp,O_CREAT | O_EXCL | O_RDWR,0600))<0) rc = -errno;
+  if (rc==0) {
+    unsigned char in[SFS_HEADER];
+    ssize_t got = stats_pread(old,in,SFS_HEADER,0);
+    rc = got<0 ? (int)got : got!=SFS_HEADER ? -EIO : stats_pwrite(fd,in,SFS_HEADER,0);
+  }
+  if (rc==0) {
+    chunk->fd = fd;
+    chunk->size = size;
+    rc = chunk_manifest_write(chunk);
+  }
+  if (rc==0) rc = chunk_copy_attributes(old,fd,&st);
+  if (rc==0) rc = stats_fsync(fd);
+  if (rc==0) {
+    // the chunks and the manifest must be found after a crash before the file is replaced
+    chunk_sync_path(folder);
+    sfs_resolve(chunk->store,CHUNK_DIR,folder);
+    chunk_sync_path(folder);
+    sys = stats_clock();
+    rc = rename(temp,fpath);
+    stats_record(STATS_SYS_META,sys,rc,0);
+    if (rc<0) rc = -errno;
+  }
+  if (rc<0) {
+    if (fd>=0) stats_close(fd);
+    chunk->fd = old;
+    chunk->size = 0;
+    chunk->dirty = 0;
+    chunk_remove(chunk);
+    memset(chunk->id,0,CHUNK_ID);
+    return rc;
+  }
+  // the file is split, the registry follows the manifest and the folder of the file is synced so the rename lasts
+  if (chunk->origin<0) chunk->origin = old;
+  else stats_close(old);
+  chunk->chunked = 1;
+  chunk->created = 0;
+  sys = stats_clock();
+  rc = fstat(fd,&st);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc==0) {
+    lockprof_lock(&mutexchunk,LOCK_CHUNK);
+    chunk->dev = st.st_dev;
+    chunk->ino = st.st_ino;
+    lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+  }
+  char *slash = strrchr(fpath,'/');
+  if (slash!=NULL && slash>fpath) *slash = 0;
+  chunk_sync_path(fpath);
+  return 0;
+}
+
+chunk_file* chunk_attach(sfs_store* store, const char* fpath, const sfs_header* header) {
+  // the registry opens its own handle so the manifest can be rewritten whatever the flags of the first handle
+  int fd = stats_open(fpath,O_RDWR,0);
+  if (fd<0) fd = stats_open(fpath,O_RDONLY,0);
+  if (fd<0) return NULL;
+  struct stat st;
+  uint64_t sys = stats_clock();
+  int rc = fstat(fd,&st);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc<0 || !S_ISREG(st.st_mode)) {
+    int err = rc<0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    stats_close(fd);
+    errno = err;
+    return NULL;
+  }
+  lockprof_lock(&mutexchunk,LOCK_CHUNK);
+  chunk_file *chunk = chunk_files;
+  while (chunk!=NULL && (chunk->dev!=st.st_dev || chunk->ino!=st.st_ino)) chunk = chunk->next;
+  if (chunk!=NULL) {
+    chunk->refs++;
+    lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+    stats_close(fd);
+    return chunk;
+  }
+  chunk = calloc(1,sizeof(chunk_file));
+  rc = chunk==NULL ? -ENOMEM : 0;
+  if (rc==0) {
+    chunk->store = store;
+    chunk->fd = fd;
+    if (header!=NULL) memcpy(&chunk->header,header,sizeof(sfs_header));
+    else rc = sfs_read_header(store,fd,&chunk->header);
+  }
+  if (rc==0) {
+    rc = chunk_manifest_read(store,fd,&st,&chunk->header,&chunk->size,chunk->id);
+    chunk->chunked = rc>0;
+  }
+  if (rc<0) {
+    if (chunk!=NULL) {
+      memset(chunk,0,sizeof(chunk_file));
+      free(chunk);
+    }
+    lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+    stats_close(fd);
+    errno = -rc;
+    return NULL;
+  }
+  chunk->dev = st.st_dev;
+  chunk->ino = st.st_ino;
+  chunk->key_dev = st.st_dev;
+  chunk->key_ino = st.st_ino;
+  chunk->origin = -1;
+  chunk->refs = 1;
+  for(int i=0; i<CHUNK_SLOTS; i++) {
+    chunk->slots[i].index = -1;
+    chunk->slots[i].fd = -1;
+  }
+  pthread_rwlock_init(&chunk->lock,NULL);
+  pthread_mutex_init(&chunk->mutex,NULL);
+  chunk->next = chunk_files;
+  chunk_files = chunk;
+  lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+  return chunk;
+}
+
+static chunk_file* chunk_find(dev_t dev, ino_t ino) {
+  lockprof_lock(&mutexchunk,LOCK_CHUNK);
+  chunk_file *chunk = chunk_files;
+  while (chunk!=NULL && (chunk->dev!=dev || chunk->ino!=ino)) chunk = chunk->next;
+  if (chunk!=NULL) chunk->refs++;
+  lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+  return chunk;
+}
+
+chunk_file* chunk_lookup(sfs_store* store, const char* fpath) {
+  // only a file that is open or has the size of a manifest can own chunks, anything else is left alone
+  struct stat st;
+  uint64_t sys = stats_clock();
+  int rc = lstat(fpath,&st);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc<0 || !S_ISREG(st.st_mode)) return NULL;
+  chunk_file *chunk = chunk_find(st.st_dev,st.st_ino);
+  if (chunk==NULL && st.st_size==SFS_HEADER+CHUNK_MANIFEST) chunk = chunk_attach(store,fpath,NULL);
+  return chunk;
+}
+
+void chunk_detach(chunk_file* chunk) {
+  if (chunk==NULL) return;
+  lockprof_lock(&mutexchunk,LOCK_CHUNK);
+  if (--chunk->refs>0) {
+    lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+    return;
+  }
+  // the manifest is brought up to date before the entry goes so the next open reads the right size
+  if (chunk->chunked && chunk->dirty && !chunk->unlinked) chunk_manifest_write(chunk);
+  chunk_file **link = &chunk_files;
+  while (*link!=chunk) link = &(*link)->next;
+  *link = chunk->next;
+  lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+  if (chunk->chunked && chunk->unlinked) chunk_remove(chunk);
+  chunk_slots_close(chunk,0,1);
+  stats_close(chunk->fd);
+  if (chunk->origin>=0) stats_close(chunk->origin);
+  pthread_rwlock_destroy(&chunk->lock);
+  pthread_mutex_destroy(&chunk->mutex);
+  free(chunk->pending);
+  memset(chunk,0,sizeof(chunk_file));
+  free(chunk);
+}
+
+void chunk_lock(chunk_file* chunk) {
+  if (chunk!=NULL) pthread_rwlock_wrlock(&chunk->lock);
+}
+
+void chunk_unlock(chunk_file* chunk) {
+  if (chunk!=NULL) pthread_rwlock_unlock(&chunk->lock);
+}
+
+int chunk_reset(chunk_file* chunk, const sfs_header* header) {
+  // a create over the file truncated it and wrote a new header, the caller holds the lock
+  int rc = chunk->chunked ? chunk_remove(chunk) : 0;
+  memcpy(&chunk->header,header,sizeof(sfs_header));
+  memset(chunk->id,0,CHUNK_ID);
+  chunk->chunked = 0;
+  chunk->dirty = 0;
+  chunk->size = 0;
+  return rc;
+}
+
+void chunk_unlinked(chunk_file* chunk) {
+  // the last name of the file is gone so its chunks go with the last handle on it
+  struct stat st;
+  if (chunk==NULL) return;
+  // the lock keeps the handle of the registry from being swapped for a new manifest while it is checked
+  pthread_rwlock_rdlock(&chunk->lock);
+  int rc = fstat(chunk->fd,&st);
+  pthread_rwlock_unlock(&chunk->lock);
+  if (rc<0 || st.st_nlink>0) return;
+  lockprof_lock(&mutexchunk,LOCK_CHUNK);
+  chunk->unlinked = 1;
+  lockprof_unlock(&mutexchunk,LOCK_CHUNK);
+}
+
+int chunk_fstat(chunk_file* chunk, struct stat* st) {
+  if (chunk==NULL) return 0;
+  pthread_rwlock_rdlock(&chunk->lock);
+  int chunked = chunk->chunked;
+  // a handle opened before the file was split still points at the data the manifest replaced
+  if (st->st_dev!=chunk->dev || st->st_ino!=chunk->ino) {
+    uint64_t sys = stats_clock();
+    int rc = fstat(chunk->fd,st);
+    stats_record(STATS_SYS_STAT,sys,rc,0);
+  }
+  if (chunked) st->st_size = chunk->size;
+  pthread_rwlock_unlock(&chunk->lock);
+  return chunked;
+}
+
+void chunk_key(chunk_file* chunk, dev_t* dev, ino_t* ino) {
+  // fixed for the life of the entry, so handles opened before and after the file was split share cached blocks
+  *dev = chunk->key_dev;
+  *ino = chunk->key_ino;
+}
+
+int chunk_stat(sfs_store* store, const char* fpath, struct stat* st) {
+  // returns 1 with the plain text size set when the file is a manifest
+  if (!S_ISREG(st->st_mode) || st->st_size!=SFS_HEADER+CHUNK_MANIFEST) return 0;
+  chunk_file *chunk = chunk_find(st->st_dev,st->st_ino);
+  if (chunk!=NULL) {
+    // an open file may have grown since its manifest was written
+    int rc = chunk_fstat(chunk,st);
+    chunk_detach(chunk);
+    return rc;
+  }
+  int fd = stats_open(fpath,O_RDONLY,0);
+  if (fd<0) return 0;
+  sfs_header header;
+  off_t size = 0;
+  unsigned char id[CHUNK_ID];
+  int rc = sfs_read_header(store,fd,&header);
+  if (rc==0) rc = chunk_manifest_read(store,fd,st,&header,&size,id);
+  if (rc>0) st->st_size = size;
+  stats_close(fd);
+  memset(&header,0,sizeof(sfs_header));
+  return rc>0;
+}
+
+ssize_t chunk_read(chunk_file* chunk, unsigned char* data, size_t size, off_t ofs) {
+  ssize_t rc = 0;
+  pthread_rwlock_rdlock(&chunk->lock);
+  if (!chunk->chunked) {
+    rc = stats_pread(chunk->fd,data,size,sfs_backing_offset(ofs));
+    if (rc>0) stats_decipher(chunk->store,&chunk->header,ofs,data,rc);
+    pthread_rwlock_unlock(&chunk->lock);
+    return rc;
+  }
+  if (ofs>=chunk->size) size = 0;
+  else if ((off_t)size>chunk->size-ofs) size = chunk->size-ofs;
+  size_t done = 0;
+  while (done<size) {
+    off_t pos = ofs+done;
+    int64_t index = pos/CHUNK_SIZE;
+    off_t inner = pos%CHUNK_SIZE;
+    size_t len = CHUNK_SIZE-inner<(off_t)(size-done) ? (size_t)(CHUNK_SIZE-inner) : size-done;
+    int err = 0;
+    chunk_slot *slot = chunk_slot_get(chunk,index,0,&err);
+    ssize_t got = 0;
+    if (slot==NULL && err!=-ENOENT) {
+      rc = err;
+      break;
+    } else if (slot!=NULL) {
+      got = stats_pread(slot->fd,&data[done],len,SFS_HEADER+inner);
+      if (got>0) stats_decipher(chunk->store,&slot->header,inner,&data[done],got);
+      chunk_slot_put(chunk,slot);
+      if (got<0) {
+        rc = got;
+        break;
+      }
+    }
+    // a missing chunk or the part of one past its end is a hole inside the file and reads as zeros
+    memset(&data[done+got],0,len-got);
+    done += len;
+  }
+  pthread_rwlock_unlock(&chunk->lock);
+  return done>0 || rc==0 ? (ssize_t)done : rc;
+}
+
+static int chunk_fill(chunk_file* chunk, chunk_slot* slot, off_t inner) {
+  // the bytes between the end of a chunk and a write past it must hold enciphered zeros, not zero bytes
+  struct stat st;
+  uint64_t sys = stats_clock();
+  int rc = fstat(slot->fd,&st);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc<0) return -errno;
+  off_t end = sfs_plain_size(st.st_size);
+  if (end>=inner) return 0;
+  size_t size = inner-end<SFS_COPY_CHUNK ? (size_t)(inner-end) : SFS_COPY_CHUNK;
+  unsigned char *zeros = calloc(1,size);
+  unsigned char *buf = malloc(size);
+  if (zeros==NULL || buf==NULL) rc = -ENOMEM;
+  for(off_t pos=end; rc==0 && pos<inner; pos+=size) {
+    size_t len = inner-pos<(off_t)size ? (size_t)(inner-pos) : size;
+    stats_encipher(chunk->store,&slot->header,pos,zeros,buf,len);
+    rc = stats_pwrite(slot->fd,buf,len,SFS_HEADER+pos);
+  }
+  free(zeros);
+  free(buf);
+  return rc;
+}
+
+ssize_t chunk_write(chunk_file* chunk, const char* path, const unsigned char* data, size_t size, off_t ofs) {
+  int rc = 0;
+  pthread_rwlock_wrlock(&chunk->lock);
+  if (!chunk->chunked) {
+    // a file is only split once it is larger than one chunk
+    struct stat st;
+    uint64_t sys = stats_clock();
+    rc = fstat(chunk->fd,&st);
+    stats_record(STATS_SYS_STAT,sys,rc,0);
+    if (rc<0) rc = -errno;
+    else if (ofs+(off_t)size>CHUNK_SIZE || sfs_plain_size(st.st_size)>CHUNK_SIZE) rc = chunk_convert(chunk,path);
+  }
+  unsigned char *buf = NULL;
+  if (rc==0) {
+    buf = malloc(size<CHUNK_SIZE ? size : CHUNK_SIZE);
+    if (buf==NULL) rc = -ENOMEM;
+  }
+  if (rc==0 && !chunk->chunked) {
+    stats_encipher(chunk->store,&chunk->header,ofs,data,buf,size);
+    rc = stats_pwrite(chunk->fd,buf,size,sfs_backing_offset(ofs));
+  } else if (rc==0) {
+    for(size_t done=0; rc==0 && done<size; ) {
+      off_t pos = ofs+done;
+      int64_t index = pos/CHUNK_SIZE;
+      off_t inner = pos%CHUNK_SIZE;
+      size_t len = CHUNK_SIZE-inner<(off_t)(size-done) ? (size_t)(CHUNK_SIZE-inner) : size-done;
+      chunk_slot *slot = chunk_slot_get(chunk,index,1,&rc);
+      if (slot==NULL) break;
+      rc = chunk_fill(chunk,slot,inner);
+      if (rc==0) {
+        stats_encipher(chunk->store,&slot->header,inner,&data[done],buf,len);
+        rc = stats_pwrite(slot->fd,buf,len,SFS_HEADER+inner);
+        slot->dirty = 1;
+      }
+      chunk_slot_put(chunk,slot);
+      done += len;
+    }
+    // the new size reaches the manifest on fsync, release or a change of size
+    if (rc==0 && ofs+(off_t)size>chunk->size) {
+      chunk->size = ofs+size;
+      chunk->dirty = 1;
+    }
+  }
+  pthread_rwlock_unlock(&chunk->lock);
+  if (buf!=NULL) {
+    memset(buf,0,size<CHUNK_SIZE ? size : CHUNK_SIZE);
+    free(buf);
+  }
+  return rc<0 ? rc : (ssize_t)size;
+}
+
+int chunk_truncate(chunk_file* chunk, const char* path, off_t size) {
+  int rc = 0;
+  pthread_rwlock_wrlock(&chunk->lock);
+  if (!chunk->chunked && size>CHUNK_SIZE) rc = chunk_convert(chunk,path);
+  if (rc==0 && (!chunk->chunked || size==0)) {
+    // an emptied file goes back to the ordinary format, its chunks are removed once nothing points at them
+    uint64_t sys = stats_clock();
+    rc = ftruncate(chunk->fd,sfs_backing_offset(size));
+    stats_record(STATS_SYS_TRUNCATE,sys,rc,0);
+    if (rc<0) rc = -errno;
+    else if (chunk->chunked) {
+      chunk_remove(chunk);
+      memset(chunk->id,0,CHUNK_ID);
+      chunk->chunked = 0;
+      chunk->dirty = 0;
+      chunk->size = 0;
+    }
+  } else if (rc==0) {
+    off_t old = chunk->size;
+    chunk->size = size;
+    rc = chunk_manifest_write(chunk);
+    if (rc==0 && size<old) {
+      // whole chunks past the new end are removed and the last one kept loses its bytes past the end
+      int64_t last = (size-1)/CHUNK_SIZE;
+      char fpath[PATH_MAX];
+      chunk_slots_close(chunk,last+1,1);
+      for(int64_t index=last+1; index*CHUNK_SIZE<old; index++) {
+        chunk_path(chunk,index,fpath);
+        uint64_t sys = stats_clock();
+        int removed = unlink(fpath);
+        stats_record(STATS_SYS_META,sys,removed<0 && errno!=ENOENT ? -1 : 0,0);
+      }
+      struct stat st;
+      off_t end = SFS_HEADER+size-last*CHUNK_SIZE;
+      chunk_path(chunk,last,fpath);
+      if (stat(fpath,&st)==0 && st.st_size>end) {
+        uint64_t sys = stats_clock();
+        rc = truncate(fpath,end);
+        stats_record(STATS_SYS_TRUNCATE,sys,rc,0);
+        if (rc<0) rc = -errno;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&chunk->lock);
+  return rc;
+}
+
+int chunk_fsync(chunk_file* chunk) {
+  if (chunk==NULL) return 0;
+  int rc = 0;
+  pthread_rwlock_wrlock(&chunk->lock);
+  if (chunk->chunked && chunk->dirty) rc = chunk_manifest_write(chunk);
+  for(int i=0; rc==0 && i<CHUNK_SLOTS; i++) {
+    chunk_slot *slot = &chunk->slots[i];
+    if (slot->index<0 || !slot->dirty) continue;
+    rc = stats_fsync(slot->fd);
+    if (rc==0) slot->dirty = 0;
+  }
+  char fpath[PATH_MAX];
+  while (rc==0 && chunk->pending_count>0) {
+    chunk_path(chunk,chunk->pending[chunk->pending_count-1],fpath);
+    int fd = stats_open(fpath,O_RDONLY,0);
+    // a chunk removed by a truncate since it was written needs no sync
+    if (fd<0 && errno!=ENOENT) rc = -errno;
+    if (fd>=0) {
+      rc = stats_fsync(fd);
+      stats_close(fd);
+    }
+    if (rc==0) chunk->pending_count--;
+  }
+  if (rc==0 && chunk->created) {
+    chunk_path(chunk,-1,fpath);
+    chunk_sync_path(fpath);
+    chunk->created = 0;
+  }
+  pthread_rwlock_unlock(&chunk->lock);
+  return rc;
+}
@@ -0,0 +1,73 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// a -chunk mount keeps a file that grows past one chunk as a manifest and a folder of chunk files,
+// each chunk is an ordinary store file with its own header so a change only rewrites the chunks it touches
+#define CHUNK_SIZE 4194304
+#define CHUNK_DIR "/.safefs-chunks"
+#define CHUNK_MAGIC "SFSCHNK1"
+#define CHUNK_ID 16
+// the plain text of a manifest is the magic, the plain text size, the id that names its chunk folder and a tag,
+// an md5 of the rotor of the file and the rest, so the plain text of an ordinary file can never pass for one
+#define CHUNK_TAG 16
+#define CHUNK_MANIFEST 48
+// a manifest is written and synced here and renamed over the file it replaces
+#define CHUNK_TEMP "manifest"
+// chunk files each file keeps open
+#define CHUNK_SLOTS 8
+
+typedef struct chunk_slot {
+  int64_t index;         // chunk held or -1
+  int fd;
+  int busy;              // readers and writers using the slot, it is only reused when idle
+  int dirty;             // written since the last fsync
+  int temporary;         // opened because every slot was busy, closed when put back
+  uint64_t used;
+  sfs_header header;
+} chunk_slot;
+
+// every handle on a backing file shares one entry on a -chunk mount
+typedef struct chunk_file {
+  dev_t dev;
+  ino_t ino;
+  dev_t key_dev;          // the inode the entry was attached on, which keys the block cache of every handle
+  ino_t key_ino;
+  int fd;                 // opened by the registry on the backing file, the manifest once chunked
+  int origin;             // the file a manifest replaced, held open so its inode is not reused while it is a key
+  int refs;
+  sfs_store *store;
+  sfs_header header;      // of the backing file, enciphers the manifest or the data of an unchunked file
+  int chunked;
+  int dirty;              // the size in the manifest is behind
+  int unlinked;           // the chunks go with the last handle
+  unsigned char id[CHUNK_ID];
+  off_t size;             // plain text size of a chunked file
+  pthread_rwlock_t lock;  // readers share it, writes and changes of size hold it alone
+  pthread_mutex_t mutex;  // guards the slots
+  chunk_slot slots[CHUNK_SLOTS];
+  uint64_t tick;
+  int64_t *pending;       // chunks closed while dirty, synced by the next fsync
+  size_t pending_count;
+  size_t pending_capacity;
+  int created;            // a chunk was added to the folder since the last fsync
+  struct chunk_file *next;
+} chunk_file;
+
+chunk_file* chunk_attach(sfs_store* store, const char* fpath, const sfs_header* header);
+chunk_file* chunk_lookup(sfs_store* store, const char* fpath);
+void chunk_detach(chunk_file* chunk);
+void chunk_lock(chunk_file* chunk);
+void chunk_unlock(chunk_file* chunk);
+int chunk_reset(chunk_file* chunk, const sfs_header* header);
+void chunk_unlinked(chunk_file* chunk);
+int chunk_stat(sfs_store* store, const char* fpath, struct stat* st);
+int chunk_fstat(chunk_file* chunk, struct stat* st);
+void chunk_key(chunk_file* chunk, dev_t* dev, ino_t* ino);
+ssize_t chunk_read(chunk_file* chunk, unsigned char* data, size_t size, off_t ofs);
+ssize_t chunk_write(chunk_file* chunk, const char* path, const unsigned char* data, size_t size, off_t ofs);
+int chunk_truncate(chunk_file* chunk, const char* path, off_t size);
+int chunk_fsync(chunk_file* chunk);
@@ -1,9 +1,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include "cipher.h"
 
+#ifndef __APPLE__
+// glibc has no srandomdev, the seed only has to differ from run to run
+static void srandomdev(void) {
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
+}
+#endif
+
 void check_cipher_accuracy()
 {
 
@@ -53,6 +64,112 @@ void check_cipher_accuracy()
 
 }
 
+void check_cipher_out_of_place() {
+
+  fprintf(stderr,"\nChecking out of place cipher matches in place cipher\n");
+
+  unsigned char f_ring[256];
+  unsigned char r_ring[256];
+  generate_random_rotor(f_ring,r_ring);
+
+  unsigned char offsets[8] = { 0xdb, 0xea, 0xf9, 0x08, 0x17, 0x17, 0x17, 0x17 };
+  int endian = determine_endianness(offsets);
+
+  static unsigned char orig[65536];
+  static unsigned char inplace[65536];
+  static unsigned char out[65536];
+  static unsigned char back[65536];
+  for(int i=0; i<65536; i++) orig[i] = random();
+
+  // unaligned positions and lengths cover the byte loops either side of the word loop
+  int rounds[3] = { 3, 5, 8 };
+  uint64_t pos[4] = { 0, 1, 4093, 397319 };
+  uint64_t len[4] = { 1, 7, 4099, 65536 };
+  for(int r=0; r<3; r++) {
+    for(int p=0; p<4; p++) {
+      for(int l=0; l<4; l++) {
+        memcpy(inplace,orig,len[l]);
+        encipher(f_ring,offsets,pos[p],inplace,0,len[l],endian,rounds[r]);
+        encipher_to(f_ring,offsets,pos[p],orig,out,len[l],endian,rounds[r]);
+        if (memcmp(inplace,out,len[l])) {
+          fprintf(stderr,"encipher_to differs from encipher\n");
+          exit(1);
+        }
+        decipher_to(r_ring,offsets,pos[p],out,back,len[l],endian,rounds[r]);
+        decipher(r_ring,offsets,pos[p],inplace,0,len[l],endian,rounds[r]);
+        if (memcmp(back,orig,len[l]) || memcmp(inplace,orig,len[l])) {
+          fprintf(stderr,"decipher_to differs from decipher\n");
+          exit(1);
+        }
+      }
+    }
+  }
+
+}
+
+void check_random_rotor() {
+
+  fprintf(stderr,"\nChecking random rotors are unbiased permutations\n");
+
+  // every value lands in position 0 about equally often and the reverse rotor undoes the forward one
+  static unsigned long counts[256];
+  memset(counts,0,sizeof(counts));
+  for(int n=0; n<256*400; n++) {
+    unsigned char f_ring[256];
+    unsigned char r_ring[256];
+    generate_random_rotor(f_ring,r_ring);
+    for(int i=0; i<256; i++) {
+      if (r_ring[f_ring[i]]!=i) {
+        fprintf(stderr,"random rotor is not a permutation\n");
+        exit(1);
+      }
+    }
+    counts[f_ring[0]]++;
+  }
+  for(int i=0; i<256; i++) {
+    if (counts[i]<250 || counts[i]>550) {
+      fprintf(stderr,"random rotor is biased: %d appears first %lu times in %d\n",i,counts[i],256*400);
+      exit(1);
+    }
+  }
+
+}
+
+void check_random_fork() {
+
+  fprintf(stderr,"\nChecking a forked child draws different rotors from its parent\n");
+
+  // the parent draws once first so the child inherits a seeded generator
+  unsigned char f_ring[256];
+  unsigned char r_ring[256];
+  generate_random_rotor(f_ring,r_ring);
+  int fds[2];
+  if (pipe(fds)<0) {
+    perror("pipe");
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid<0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid==0) {
+    generate_random_rotor(f_ring,r_ring);
+    _exit(write(fds[1],f_ring,sizeof(f_ring))==sizeof(f_ring) ? 0 : 1);
+  }
+  unsigned char child[256];
+  ssize_t got = read(fds[0],child,sizeof(child));
+  waitpid(pid,NULL,0);
+  close(fds[0]);
+  close(fds[1]);
+  generate_random_rotor(f_ring,r_ring);
+  if (got!=sizeof(child) || !memcmp(child,f_ring,sizeof(child))) {
+    fprintf(stderr,"forked child repeated the rotor of its parent\n");
+    exit(1);
+  }
+
+}
+
 void check_cipher_histogram() {
 
   fprintf(stderr,"\nChecking cipher histogram\n");
@@ -270,6 +387,9 @@ void check_decipher_speed() {
 
 int main(int argc, char** argv) {
   check_cipher_accuracy();
+  check_cipher_out_of_place();
+  check_random_rotor();
+  check_random_fork();
   check_cipher_histogram();
   check_cipher_distribution();
   check_encipher_speed();
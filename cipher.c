@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "cipher.h"
+#include "rng.h"
 
 int determine_endianness(unsigned char offsets[8]) {
   union {
@@ -23,16 +24,20 @@ void generate_random_rotor(unsigned char f_ring[256], unsigned char r_ring[256])
   for(int j=0; j<256; j++) {
     f_ring[j] = j;
   }
-  for(int j=0; j<256; j++) {
-    unsigned char k = random();
+  // a fisher-yates shuffle fed from one bulk draw, the rare draw that would bias it is replaced
+  uint32_t draw[256];
+  rng_bytes(draw,sizeof(draw));
+  for(int j=255; j>0; j--) {
+    uint32_t bound = j+1;
+    uint32_t k = draw[j]>=-bound%bound ? draw[j]%bound : rng_uniform(bound);
     unsigned char f = f_ring[k];
     f_ring[k] = f_ring[j];
     f_ring[j] = f;
-    unsigned char l = f_ring[j];
-    r_ring[l] = j;
-    unsigned char m = f_ring[k];
-    r_ring[m] = k;
   }
+  for(int j=0; j<256; j++) {
+    r_ring[f_ring[j]] = j;
+  }
+  memset(draw,0,sizeof(draw));
 }
 
 void encode_rotor(unsigned char f_ring[256], unsigned char digest[16]) {
@@ -62,7 +67,8 @@ void derive_reverse_rotor(unsigned char f_ring[256], unsigned char r_ring[256])
   }
 }
 
-void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos, unsigned char* data, uint64_t ofs, uint64_t len, int endian, int rounds) {
+void encipher_to(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len, int endian, int rounds) {
+  const unsigned char* source;
   unsigned char* datum;
   unsigned char k;
   union {
@@ -75,9 +81,10 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
       case 3:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k += advance.ix[5];
               k = f_ring[k];
               k += advance.ix[6];
@@ -86,15 +93,17 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
               k = f_ring[k];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 5:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k += advance.ix[3];
               k = f_ring[k];
               k += advance.ix[4];
@@ -107,15 +116,17 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
               k = f_ring[k];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 8:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k += advance.ix[0];
               k = f_ring[k];
               k += advance.ix[1];
@@ -134,6 +145,7 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
               k = f_ring[k];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
@@ -144,9 +156,10 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
       case 3:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k += advance.ix[2];
               k = f_ring[k];
               k += advance.ix[1];
@@ -155,15 +168,17 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
               k = f_ring[k];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 5:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k += advance.ix[4];
               k = f_ring[k];
               k += advance.ix[3];
@@ -176,15 +191,17 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
               k = f_ring[k];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 8:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k += advance.ix[7];
               k = f_ring[k];
               k += advance.ix[6];
@@ -203,6 +220,7 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
               k = f_ring[k];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
@@ -210,7 +228,8 @@ void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos,
   }
 }
 
-void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos, unsigned char* data, uint64_t ofs, uint64_t len, int endian, int rounds) {
+void decipher_to(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len, int endian, int rounds) {
+  const unsigned char* source;
   unsigned char* datum;
   unsigned char k;
   union {
@@ -223,9 +242,10 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
       case 3:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k = r_ring[k];
               k -= advance.ix[7];
               k = r_ring[k];
@@ -234,15 +254,17 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
               k -= advance.ix[5];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 5:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k = r_ring[k];
               k -= advance.ix[7];
               k = r_ring[k];
@@ -255,15 +277,17 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
               k -= advance.ix[3];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 8:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k = r_ring[k];
               k -= advance.ix[7];
               k = r_ring[k];
@@ -282,6 +306,7 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
               k -= advance.ix[0];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
@@ -292,9 +317,10 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
       case 3:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k = r_ring[k];
               k -= advance.ix[0];
               k = r_ring[k];
@@ -303,15 +329,17 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
               k -= advance.ix[2];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 5:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k = r_ring[k];
               k -= advance.ix[0];
               k = r_ring[k];
@@ -324,15 +352,17 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
               k -= advance.ix[4];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
       case 8:
           memcpy(advance.ix,offsets,8);
           advance.position += pos * 0x01030507090b0d0f;
-          datum = &data[ofs];
+          source = in;
+          datum = out;
           for(uint64_t j=len; j; j--) {
-            k = *datum;
+            k = *source;
               k = r_ring[k];
               k -= advance.ix[0];
               k = r_ring[k];
@@ -351,6 +381,7 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
               k -= advance.ix[7];
             *datum = k;
             advance.position += 0x01030507090b0d0f;
+            source++;
             datum++;
           }
         break;
@@ -358,3 +389,10 @@ void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos,
   }
 }
 
+void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos, unsigned char* data, uint64_t ofs, uint64_t len, int endian, int rounds) {
+  encipher_to(f_ring,offsets,pos,&data[ofs],&data[ofs],len,endian,rounds);
+}
+
+void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos, unsigned char* data, uint64_t ofs, uint64_t len, int endian, int rounds) {
+  decipher_to(r_ring,offsets,pos,&data[ofs],&data[ofs],len,endian,rounds);
+}
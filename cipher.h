@@ -1,5 +1,6 @@
 
 #include <unistd.h>
+#include <stdint.h>
 
 int determine_endianness(unsigned char offsets[8]);
 void generate_random_rotor(unsigned char f_ring[256], unsigned char r_ring[256]);
@@ -8,4 +9,7 @@ void decode_rotor(unsigned char f_ring[256], unsigned char digest[16]);
 void derive_reverse_rotor(unsigned char f_ring[256], unsigned char r_ring[256]);
 void encipher(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos, unsigned char* data, uint64_t ofs, uint64_t len, int endian, int rounds);
 void decipher(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos, unsigned char* data, uint64_t ofs, uint64_t len, int endian, int rounds);
+// out of place variants read from in and write to out in the same pass, in may equal out
+void encipher_to(unsigned char f_ring[256], unsigned char offsets[8], uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len, int endian, int rounds);
+void decipher_to(unsigned char r_ring[256], unsigned char offsets[8], uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len, int endian, int rounds);
 
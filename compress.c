@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sfs.h"
+#include "compress.h"
+#include "lz4.h"
+#include "stats.h"
+#include "lockprof.h"
+
+// a file is only compacted when its dead space passes this and outweighs the slots still in use
+#define COMPRESS_COMPACT 1048576
+
+typedef struct compress_known {
+  dev_t dev;
+  ino_t ino;
+  off_t backing;
+  time_t mtime;
+  time_t ctime;
+  off_t size;
+  int compressed;
+} compress_known;
+
+static pthread_mutex_t mutexcompress = PTHREAD_MUTEX_INITIALIZER;
+static compress_file *compress_files = NULL;
+static compress_known compress_known_files[COMPRESS_STATS];
+
+static uint64_t compress_get(const unsigned char* p, int len) {
+  uint64_t value = 0;
+  for(int i=len-1; i>=0; i--) value = (value<<8) | p[i];
+  return value;
+}
+
+static void compress_put(unsigned char* p, uint64_t value, int len) {
+  for(int i=0; i<len; i++) p[i] = value>>(i*8);
+}
+
+static uint32_t compress_round(uint32_t length) {
+  return (length+COMPRESS_SLOT-1)/COMPRESS_SLOT*COMPRESS_SLOT;
+}
+
+static compress_known* compress_known_slot(dev_t dev, ino_t ino) {
+  return &compress_known_files[((uint64_t)ino*0x9e3779b97f4a7c15ULL+(uint64_t)dev)>>52 & (COMPRESS_STATS-1)];
+}
+
+static void compress_remember(const struct stat* st, off_t size, int compressed) {
+  // called with the registry lock held, the backing size and times tell when the entry has gone stale
+  compress_known *known = compress_known_slot(st->st_dev,st->st_ino);
+  known->dev = st->st_dev;
+  known->ino = st->st_ino;
+  known->backing = st->st_size;
+  known->mtime = st->st_mtime;
+  known->ctime = st->st_ctime;
+  known->size = size;
+  known->compressed = compressed;
+}
+
+static int compress_super_write(compress_file* file) {
+  unsigned char plain[COMPRESS_SUPER];
+  unsigned char out[COMPRESS_SUPER];
+  memset(plain,0,COMPRESS_SUPER);
+  memcpy(plain,COMPRESS_MAGIC,8);
+  compress_put(&plain[8],file->size,8);
+  compress_put(&plain[16],file->index,8);
+  compress_put(&plain[24],file->index_count,4);
+  stats_encipher(file->store,&file->header,0,plain,out,COMPRESS_SUPER);
+  return stats_pwrite(file->fd,out,COMPRESS_SUPER,SFS_HEADER);
+}
+
+static int compress_super_read(sfs_store* store, int fd, off_t backing, sfs_header* header, off_t* size, uint64_t* index, size_t* count) {
+  // a superblock is told apart from an ordinary file by its magic and an index that lies inside the file and covers its size
+  if (backing<SFS_HEADER+COMPRESS_SUPER) return 0;
+  unsigned char in[COMPRESS_SUPER];
+  ssize_t got = stats_pread(fd,in,COMPRESS_SUPER,SFS_HEADER);
+  if (got<0) return got;
+  if (got!=COMPRESS_SUPER) return 0;
+  stats_decipher(store,header,0,in,COMPRESS_SUPER);
+  int rc = 0;
+  if (!memcmp(in,COMPRESS_MAGIC,8)) {
+    uint64_t value = compress_get(&in[8],8);
+    uint64_t pos = compress_get(&in[16],8);
+    uint64_t entries = compress_get(&in[24],4);
+    rc = entries==(value+COMPRESS_BLOCK-1)/COMPRESS_BLOCK && pos>=COMPRESS_SUPER && pos+entries*COMPRESS_ENTRY<=(uint64_t)(backing-SFS_HEADER);
+    if (rc) {
+      *size = value;
+      *index = pos;
+      *count = entries;
+    }
+  }
+  memset(in,0,COMPRESS_SUPER);
+  return rc;
+}
+
+static int compress_resize(compress_file* file, size_t count) {
+  // blocks added past the old end are holes until they are written
+  if (count>file->capacity) {
+    size_t capacity = file->capacity ? file->capacity : 16;
+    while (capacity<count) capacity *= 2;
+    compress_block *blocks = realloc(file->blocks,capacity*sizeof(compress_block));
+    if (blocks==NULL) return -ENOMEM;
+    file->blocks = blocks;
+    file->capacity = capacity;
+  }
+  if (count>file->count) memset(&file->blocks[file->count],0,(count-file->count)*sizeof(compress_block));
+  file->count = count;
+  return 0;
+}
+
+static int compress_buffers(compress_file* file) {
+  if (file->plain==NULL) file->plain = malloc(COMPRESS_BLOCK);
+  if (file->packed==NULL) file->packed = malloc(LZ4_BOUND(COMPRESS_BLOCK));
+  return file->plain==NULL || file->packed==NULL ? -ENOMEM : 0;
+}
+
+static int compress_index_read(compress_file* file, off_t backing) {
+  // the slots of a file that crashed before its index was committed are past the index and count as dead
+  size_t len = file->index_count*COMPRESS_ENTRY;
+  unsigned char *in = malloc(len>0 ? len : 1);
+  int rc = in==NULL ? -ENOMEM : compress_resize(file,file->index_count);
+  if (rc==0 && len>0) {
+    ssize_t got = stats_pread(file->fd,in,len,SFS_HEADER+file->index);
+    if (got<0) rc = got;
+    else if ((size_t)got!=len) rc = -EIO;
+  }
+  if (rc==0) stats_decipher(file->store,&file->header,file->index,in,len);
+  uint64_t end = backing-SFS_HEADER;
+  uint64_t live = 0;
+  for(size_t i=0; rc==0 && i<file->count; i++) {
+    compress_block *block = &file->blocks[i];
+    unsigned char *p = &in[i*COMPRESS_ENTRY];
+    block->offset = compress_get(p,8);
+    block->length = compress_get(&p[8],4);
+    block->capacity = compress_get(&p[12],4);
+    block->raw = compress_get(&p[16],4)!=0;
+    if (block->offset==0) {
+      memset(block,0,sizeof(compress_block));
+    } else if (block->offset<COMPRESS_SUPER || block->offset+block->capacity>end || block->length==0 || block->length>block->capacity ||
+               block->length>COMPRESS_BLOCK) {
+      rc = -EIO;
+    } else {
+      live += block->capacity;
+    }
+  }
+  if (in!=NULL) {
+    memset(in,0,len);
+    free(in);
+  }
+  if (rc==0) {
+    file->end = end;
+    file->dead = end>COMPRESS_SUPER+live+len ? end-COMPRESS_SUPER-live-len : 0;
+  }
+  return rc;
+}
+
+static int compress_start(compress_file* file) {
+  // an empty file starts out compressed with no blocks and an empty index just past the superblock
+  int rc = compress_buffers(file);
+  if (rc<0) return rc;
+  file->compressed = 1;
+  file->size = 0;
+  file->count = 0;
+  file->index = COMPRESS_SUPER;
+  file->index_count = 0;
+  file->end = COMPRESS_SUPER;
+  file->dead = 0;
+  file->held = -1;
+  file->held_dirty = 0;
+  file->dirty = 0;
+  rc = compress_super_write(file);
+  if (rc<0) file->compressed = 0;
+  return rc;
+}
+
+static void compress_empty(compress_file* file) {
+  file->compressed = 0;
+  file->size = 0;
+  file->count = 0;
+  file->index = 0;
+  file->index_count = 0;
+  file->end = 0;
+  file->dead = 0;
+  file->held = -1;
+  file->held_dirty = 0;
+  file->dirty = 0;
+}
+
+static int compress_store(compress_file* file, compress_block* block, size_t length, int raw, uint64_t pos, const unsigned char* data) {
+  // data is the stored form of the block, enciphered here at the position of its slot
+  unsigned char *out = file->packed;
+  stats_encipher(file->store,&file->header,pos,data,out,length);
+  int rc = stats_pwrite(file->fd,out,length,SFS_HEADER+pos);
+  if (rc<0) return rc;
+  if (block->offset!=pos) {
+    if (block->offset!=0) file->dead += block->capacity;
+    block->offset = pos;
+    block->capacity = compress_round(length);
+  }
+  block->length = length;
+  block->raw = raw;
+  block->fresh = 1;
+  file->dirty = 1;
+  return 0;
+}
+
+static int compress_flush(compress_file* file) {
+  if (file->held<0 || !file->held_dirty) return 0;
+  compress_block *block = &file->blocks[file->held];
+  off_t len = file->size-file->held*COMPRESS_BLOCK;
+  if (len>COMPRESS_BLOCK) len = COMPRESS_BLOCK;
+  off_t zeros = 0;
+  while (zeros<len && file->plain[zeros]==0) zeros++;
+  if (zeros==len) {
+    // a block of zeros is a hole and takes no space
+    if (block->offset!=0) file->dead += block->capacity;
+    memset(block,0,sizeof(compress_block));
+    file->held_dirty = 0;
+    file->dirty = 1;
+    return 0;
+  }
+  uint64_t clock = stats_clock();
+  size_t length = lz4_compress(file->plain,len,file->packed,len-1);
+  stats_record(STATS_COMPRESS,clock,0,len);
+  int raw = length==0;
+  if (raw) length = len;
+  // a slot no committed index points at is rewritten in place, any other rewrite goes to a new slot at the end
+  uint64_t pos = block->offset;
+  if (pos==0 || !block->fresh || block->capacity<length) {
+    pos = file->end;
+    file->end += compress_round(length);
+  }
+  int rc = compress_store(file,block,length,raw,pos,raw ? file->plain : file->packed);
+  if (rc==0) file->held_dirty = 0;
+  return rc;
+}
+
+static int compress_load(compress_file* file, int64_t index) {
+  if (file->held==index) return 0;
+  int rc = compress_flush(file);
+  if (rc<0) return rc;
+  file->held = -1;
+  compress_block *block = &file->blocks[index];
+  size_t len = 0;
+  if (block->offset!=0) {
+    unsigned char *buf = block->raw ? file->plain : file->packed;
+    ssize_t got = stats_pread(file->fd,buf,block->length,SFS_HEADER+block->offset);
+    if (got<0) return got;
+    if ((size_t)got!=block->length) return -EIO;
+    stats_decipher(file->store,&file->header,block->offset,buf,block->length);
+    len = block->length;
+    if (!block->raw) {
+      uint64_t clock = stats_clock();
+      ssize_t plain = lz4_decompress(file->packed,block->length,file->plain,COMPRESS_BLOCK);
+      stats_record(STATS_DECOMPRESS,clock,plain<0 ? -1 : 0,plain>0 ? plain : 0);
+      if (plain<0) return -EIO;
+      len = plain;
+    }
+  }
+  // the part of a block past what was stored reads as zeros
+  memset(&file->plain[len],0,COMPRESS_BLOCK-len);
+  file->held = index;
+  return 0;
+}
+
+static int compress_slice(compress_file* file, compress_block* block, unsigned char* data, off_t inner, size_t len) {
+  // a hole or a block stored as is is read in place, only the bytes asked for are deciphered
+  size_t stored = block->offset==0 || inner>=block->length ? 0 : block->length-inner;
+  if (stored>len) stored = len;
+  if (stored>0) {
+    ssize_t got = stats_pread(file->fd,data,stored,SFS_HEADER+block->offset+inner);
+    if (got<0) return got;
+    if ((size_t)got!=stored) return -EIO;
+    stats_decipher(file->store,&file->header,block->offset+inner,data,stored);
+  }
+  memset(&data[stored],0,len-stored);
+  return 0;
+}
+
+static int compress_commit(compress_file* file, int sync) {
+  // the index goes to the end before the superblock points at it so a crash leaves the last committed index whole
+  int rc = compress_flush(file);
+  if (rc<0 || !file->dirty) return rc;
+  size_t len = file->count*COMPRESS_ENTRY;
+  unsigned char *out = calloc(1,len>0 ? len : 1);
+  if (out==NULL) return -ENOMEM;
+  for(size_t i=0; i<file->count; i++) {
+    compress_block *block = &file->blocks[i];
+    unsigned char *p = &out[i*COMPRESS_ENTRY];
+    compress_put(p,block->offset,8);
+    compress_put(&p[8],block->length,4);
+    compress_put(&p[12],block->capacity,4);
+    compress_put(&p[16],block->raw,4);
+  }
+  stats_encipher(file->store,&file->header,file->end,out,out,len);
+  if (len>0) rc = stats_pwrite(file->fd,out,len,SFS_HEADER+file->end);
+  free(out);
+  if (rc==0 && sync) rc = stats_fsync(file->fd);
+  if (rc<0) return rc;
+  uint64_t index = file->index;
+  size_t count = file->index_count;
+  file->index = file->end;
+  file->index_count = file->count;
+  rc = compress_super_write(file);
+  if (rc==0 && sync) rc = stats_fsync(file->fd);
+  if (rc<0) {
+    file->index = index;
+    file->index_count = count;
+    return rc;
+  }
+  file->dead += count*COMPRESS_ENTRY;
+  file->end += len;
+  file->dirty = 0;
+  for(size_t i=0; i<file->count; i++) file->blocks[i].fresh = 0;
+  return 0;
+}
+
+static int compress_relocate(compress_file* file, uint64_t pos) {
+  // every stored block is copied to slots of its own length from pos on, enciphered again for its new place
+  unsigned char *buf = file->plain;
+  int rc = 0;
+  for(size_t i=0; rc==0 && i<file->count; i++) {
+    compress_block *block = &file->blocks[i];
+    uint64_t offset = block->offset;
+    if (offset==0) continue;
+    ssize_t got = stats_pread(file->fd,buf,block->length,SFS_HEADER+offset);
+    if (got<0) rc = got;
+    else if ((size_t)got!=block->length) rc = -EIO;
+    if (rc<0) break;
+    stats_decipher(file->store,&file->header,offset,buf,block->length);
+    block->offset = 0;
+    rc = compress_store(file,block,block->length,block->raw,pos,buf);
+    pos += block->capacity;
+  }
+  file->held = -1;
+  file->end = pos;
+  return rc;
+}
+
+static void compress_compact(compress_file* file) {
+  // the live slots are copied past the end and committed, then copied down to the front and committed again,
+  // so whenever the file is cut short the superblock points at a whole copy
+  uint64_t live = 0;
+  for(size_t i=0; i<file->count; i++) {
+    if (file->blocks[i].offset!=0) live += compress_round(file->blocks[i].length);
+  }
+  uint64_t front = COMPRESS_SUPER+live+file->count*COMPRESS_ENTRY;
+  if (file->dead<COMPRESS_COMPACT || file->dead<live || front>file->end) return;
+  int rc = compress_relocate(file,file->end);
+  if (rc==0) rc = compress_commit(file,1);
+  if (rc==0) rc = compress_relocate(file,COMPRESS_SUPER);
+  if (rc==0) rc = compress_commit(file,1);
+  if (rc<0) return;
+  uint64_t sys = stats_clock();
+  rc = ftruncate(file->fd,SFS_HEADER+front);
+  stats_record(STATS_SYS_TRUNCATE,sys,rc,0);
+  if (rc==0) {
+    file->end = front;
+    file->dead = 0;
+  }
+}
+
+compress_file* compress_attach(sfs_store* store, const char* fpath, const sfs_header* header) {
+  // the registry opens its own handle so blocks and the index can be written whatever the flags of the first handle
+  int fd = stats_open(fpath,O_RDWR,0);
+  if (fd<0) fd = stats_open(fpath,O_RDONLY,0);
+  if (fd<0) return NULL;
+  struct stat st;
+  int rc = stats_fstat(fd,&st);
+  if (rc<0 || !S_ISREG(st.st_mode)) {
+    int err = rc<0 ? -rc : S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    stats_close(fd);
+    errno = err;
+    return NULL;
+  }
+  lockprof_lock(&mutexcompress,LOCK_COMPRESS);
+  compress_file *file = compress_files;
+  while (file!=NULL && (file->dev!=st.st_dev || file->ino!=st.st_ino)) file = file->next;
+  if (file!=NULL) {
+    file->refs++;
+    lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+    stats_close(fd);
+    return file;
+  }
+  file = calloc(1,sizeof(compress_file));
+  rc = file==NULL ? -ENOMEM : 0;
+  if (rc==0) {
+    file->store = store;
+    file->fd = fd;
+    file->held = -1;
+    if (header!=NULL) memcpy(&file->header,header,sizeof(sfs_header));
+    else rc = sfs_read_header(store,fd,&file->header);
+  }
+  if (rc==0) {
+    rc = compress_super_read(store,fd,st.st_size,&file->header,&file->size,&file->index,&file->index_count);
+    file->compressed = rc>0;
+  }
+  if (rc>0) rc = compress_buffers(file);
+  if (rc==0 && file->compressed) rc = compress_index_read(file,st.st_size);
+  if (rc<0) {
+    if (file!=NULL) {
+      free(file->blocks);
+      free(file->plain);
+      free(file->packed);
+      memset(file,0,sizeof(compress_file));
+      free(file);
+    }
+    lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+    stats_close(fd);
+    errno = -rc;
+    return NULL;
+  }
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  file->refs = 1;
+  pthread_mutex_init(&file->lock,NULL);
+  file->next = compress_files;
+  compress_files = file;
+  lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+  return file;
+}
+
+static compress_file* compress_find(dev_t dev, ino_t ino) {
+  lockprof_lock(&mutexcompress,LOCK_COMPRESS);
+  compress_file *file = compress_files;
+  while (file!=NULL && (file->dev!=dev || file->ino!=ino)) file = file->next;
+  if (file!=NULL) file->refs++;
+  lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+  return file;
+}
+
+compress_file* compress_lookup(const char* fpath) {
+  // only an open file has state that a create over it must reset
+  struct stat st;
+  uint64_t sys = stats_clock();
+  int rc = lstat(fpath,&st);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc<0 || !S_ISREG(st.st_mode)) return NULL;
+  return compress_find(st.st_dev,st.st_ino);
+}
+
+void compress_detach(compress_file* file) {
+  if (file==NULL) return;
+  lockprof_lock(&mutexcompress,LOCK_COMPRESS);
+  if (--file->refs>0) {
+    lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+    return;
+  }
+  // the held block and the index are written before the entry goes so the next open finds them
+  if (file->compressed && compress_commit(file,0)==0) compress_compact(file);
+  compress_file **link = &compress_files;
+  while (*link!=file) link = &(*link)->next;
+  *link = file->next;
+  struct stat st;
+  if (stats_fstat(file->fd,&st)==0) compress_remember(&st,file->size,file->compressed);
+  lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+  stats_close(file->fd);
+  pthread_mutex_destroy(&file->lock);
+  free(file->blocks);
+  if (file->plain!=NULL) memset(file->plain,0,COMPRESS_BLOCK);
+  free(file->plain);
+  free(file->packed);
+  memset(file,0,sizeof(compress_file));
+  free(file);
+}
+
+void compress_lock(compress_file* file) {
+  if (file!=NULL) pthread_mutex_lock(&file->lock);
+}
+
+void compress_unlock(compress_file* file) {
+  if (file!=NULL) pthread_mutex_unlock(&file->lock);
+}
+
+void compress_reset(compress_file* file, const sfs_header* header) {
+  // a create over the file truncated it and wrote a new header, the caller holds the lock
+  memcpy(&file->header,header,sizeof(sfs_header));
+  compress_empty(file);
+}
+
+void compress_forget(const char* fpath) {
+  // called before the last name of a file may go, so a new file given the same inode is read again
+  struct stat st;
+  if (lstat(fpath,&st)<0 || !S_ISREG(st.st_mode)) return;
+  lockprof_lock(&mutexcompress,LOCK_COMPRESS);
+  compress_known *known = compress_known_slot(st.st_dev,st.st_ino);
+  if (known->dev==st.st_dev && known->ino==st.st_ino) memset(known,0,sizeof(compress_known));
+  lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+}
+
+int compress_fstat(compress_file* file, struct stat* st) {
+  if (file==NULL) return 0;
+  pthread_mutex_lock(&file->lock);
+  int compressed = file->compressed;
+  if (compressed) st->st_size = file->size;
+  pthread_mutex_unlock(&file->lock);
+  return compressed;
+}
+
+int compress_stat(sfs_store* store, const char* fpath, struct stat* st) {
+  // returns 1 with the plain text size set when the file is compressed
+  if (!S_ISREG(st->st_mode) || st->st_size<SFS_HEADER+COMPRESS_SUPER) return 0;
+  compress_file *file = compress_find(st->st_dev,st->st_ino);
+  if (file!=NULL) {
+    // an open file may have changed size since its superblock was written
+    int rc = compress_fstat(file,st);
+    compress_detach(file);
+    return rc;
+  }
+  lockprof_lock(&mutexcompress,LOCK_COMPRESS);
+  compress_known *known = compress_known_slot(st->st_dev,st->st_ino);
+  int rc = -1;
+  if (known->dev==st->st_dev && known->ino==st->st_ino && known->backing==st->st_size && known->mtime==st->st_mtime && known->ctime==st->st_ctime) {
+    rc = known->compressed;
+    if (rc) st->st_size = known->size;
+  }
+  lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+  if (rc>=0) return rc;
+  int fd = stats_open(fpath,O_RDONLY,0);
+  if (fd<0) return 0;
+  sfs_header header;
+  off_t size = 0;
+  uint64_t index;
+  size_t count;
+  rc = sfs_read_header(store,fd,&header);
+  if (rc==0) rc = compress_super_read(store,fd,st->st_size,&header,&size,&index,&count);
+  stats_close(fd);
+  memset(&header,0,sizeof(sfs_header));
+  if (rc<0) return 0;
+  lockprof_lock(&mutexcompress,LOCK_COMPRESS);
+  compress_remember(st,size,rc);
+  lockprof_unlock(&mutexcompress,LOCK_COMPRESS);
+  if (rc>0) st->st_size = size;
+  return rc>0;
+}
+
+ssize_t compress_read(compress_file* file, unsigned char* data, size_t size, off_t ofs) {
+  ssize_t rc = 0;
+  pthread_mutex_lock(&file->lock);
+  if (!file->compressed) {
+    rc = stats_pread(file->fd,data,size,sfs_backing_offset(ofs));
+    if (rc>0) stats_decipher(file->store,&file->header,ofs,data,rc);
+    pthread_mutex_unlock(&file->lock);
+    return rc;
+  }
+  if (ofs>=file->size) size = 0;
+  else if ((off_t)size>file->size-ofs) size = file->size-ofs;
+  // only the blocks the range touches are read and decompressed
+  size_t done = 0;
+  while (done<size) {
+    off_t pos = ofs+done;
+    int64_t index = pos/COMPRESS_BLOCK;
+    off_t inner = pos%COMPRESS_BLOCK;
+    size_t len = COMPRESS_BLOCK-inner<(off_t)(size-done) ? (size_t)(COMPRESS_BLOCK-inner) : size-done;
+    compress_block *block = &file->blocks[index];
+    if (file->held!=index && (block->offset==0 || block->raw)) {
+      rc = compress_slice(file,block,&data[done],inner,len);
+    } else {
+      rc = compress_load(file,index);
+      if (rc==0) memcpy(&data[done],&file->plain[inner],len);
+    }
+    if (rc<0) break;
+    done += len;
+  }
+  pthread_mutex_unlock(&file->lock);
+  return done>0 || rc==0 ? (ssize_t)done : rc;
+}
+
+ssize_t compress_write(compress_file* file, const unsigned char* data, size_t size, off_t ofs) {
+  int rc = 0;
+  pthread_mutex_lock(&file->lock);
+  if (!file->compressed) {
+    // an empty file is compressed from its first write, a file that already holds data stays as it is
+    struct stat st;
+    rc = stats_fstat(file->fd,&st);
+    if (rc==0 && sfs_plain_size(st.st_size)==0) rc = compress_start(file);
+  }
+  if (rc==0 && !file->compressed) {
+    unsigned char *buf = malloc(size>0 ? size : 1);
+    if (buf==NULL) rc = -ENOMEM;
+    else {
+      stats_encipher(file->store,&file->header,ofs,data,buf,size);
+      rc = stats_pwrite(file->fd,buf,size,sfs_backing_offset(ofs));
+      memset(buf,0,size);
+      free(buf);
+    }
+  } else if (rc==0) {
+    // the new size and index reach the superblock on fsync, release or a change of size
+    if (ofs+(off_t)size>file->size) {
+      rc = compress_resize(file,(ofs+size+COMPRESS_BLOCK-1)/COMPRESS_BLOCK);
+      if (rc==0) {
+        file->size = ofs+size;
+        file->dirty = 1;
+      }
+    }
+    for(size_t done=0; rc==0 && done<size; ) {
+      off_t pos = ofs+done;
+      int64_t index = pos/COMPRESS_BLOCK;
+      off_t inner = pos%COMPRESS_BLOCK;
+      size_t len = COMPRESS_BLOCK-inner<(off_t)(size-done) ? (size_t)(COMPRESS_BLOCK-inner) : size-done;
+      if (len==COMPRESS_BLOCK && file->held!=index) {
+        // a block that is written whole is never read
+        rc = compress_flush(file);
+        if (rc==0) file->held = index;
+      } else {
+        rc = compress_load(file,index);
+      }
+      if (rc<0) break;
+      memcpy(&file->plain[inner],&data[done],len);
+      file->held_dirty = 1;
+      done += len;
+    }
+  }
+  pthread_mutex_unlock(&file->lock);
+  return rc<0 ? rc : (ssize_t)size;
+}
+
+int compress_truncate(compress_file* file, off_t size) {
+  int rc = 0;
+  pthread_mutex_lock(&file->lock);
+  if (!file->compressed && size>0) {
+    struct stat st;
+    rc = stats_fstat(file->fd,&st);
+    if (rc==0 && sfs_plain_size(st.st_size)==0) rc = compress_start(file);
+  }
+  if (rc==0 && (!file->compressed || size==0)) {
+    // an emptied file goes back to the ordinary format and is compressed again from its next write
+    uint64_t sys = stats_clock();
+    rc = ftruncate(file->fd,sfs_backing_offset(size));
+    stats_record(STATS_SYS_TRUNCATE,sys,rc,0);
+    if (rc<0) rc = -errno;
+    else compress_empty(file);
+  } else if (rc==0) {
+    size_t count = (size+COMPRESS_BLOCK-1)/COMPRESS_BLOCK;
+    if (size<file->size) {
+      // blocks past the new end are dropped and the last one kept loses its bytes past the end
+      for(size_t i=count; i<file->count; i++) {
+        if (file->blocks[i].offset!=0) file->dead += file->blocks[i].capacity;
+      }
+      if (file->held>=(int64_t)count) {
+        file->held = -1;
+        file->held_dirty = 0;
+      }
+      file->count = count;
+      file->size = size;
+      file->dirty = 1;
+      if (size%COMPRESS_BLOCK!=0) rc = compress_load(file,count-1);
+      if (rc==0 && size%COMPRESS_BLOCK!=0) {
+        memset(&file->plain[size%COMPRESS_BLOCK],0,COMPRESS_BLOCK-size%COMPRESS_BLOCK);
+        file->held_dirty = 1;
+      }
+    } else {
+      rc = compress_resize(file,count);
+      if (rc==0) {
+        file->size = size;
+        file->dirty = 1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&file->lock);
+  return rc;
+}
+
+int compress_fsync(compress_file* file) {
+  if (file==NULL) return 0;
+  pthread_mutex_lock(&file->lock);
+  int rc = file->compressed ? compress_commit(file,1) : 0;
+  pthread_mutex_unlock(&file->lock);
+  return rc;
+}
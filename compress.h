@@ -0,0 +1,66 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// a -compress mount keeps new files as blocks of plain text compressed before they are enciphered,
+// a superblock at the start points at an index of the blocks so any block is read without the others
+#define COMPRESS_BLOCK 16384
+#define COMPRESS_MAGIC "SFSLZ4B1"
+// the plain text of a superblock is the magic, the plain text size, the position of the index and its length
+#define COMPRESS_SUPER 32
+#define COMPRESS_ENTRY 24
+// blocks are stored in slots rounded up to this so a rewrite that grows a little still fits in place
+#define COMPRESS_SLOT 256
+// files whose size was read from their superblock, looked up by inode so a stat opens nothing
+#define COMPRESS_STATS 4096
+
+typedef struct compress_block {
+  uint64_t offset;    // plain text position of the slot or 0 for a block of zeros
+  uint32_t length;    // of the stored bytes
+  uint32_t capacity;  // of the slot
+  int raw;            // stored as is because it did not get smaller
+  int fresh;          // written since the index was last committed so no committed index points at it
+} compress_block;
+
+// every handle on a backing file shares one entry on a -compress mount
+typedef struct compress_file {
+  dev_t dev;
+  ino_t ino;
+  int fd;                 // opened by the registry on the backing file
+  int refs;
+  sfs_store *store;
+  sfs_header header;
+  int compressed;         // the file starts with a superblock, otherwise it is an ordinary file
+  int dirty;              // the size or the index is newer than the superblock
+  off_t size;             // plain text size of a compressed file
+  compress_block *blocks;
+  size_t count;
+  size_t capacity;
+  uint64_t end;           // where new slots are appended
+  uint64_t index;         // position of the committed index
+  size_t index_count;     // entries in the committed index
+  uint64_t dead;          // bytes of slots and indexes that nothing points at any more
+  unsigned char *plain;   // the block last read or written, decompressed
+  unsigned char *packed;
+  int64_t held;           // the block in plain or -1
+  int held_dirty;
+  pthread_mutex_t lock;   // one block is held at a time so readers and writers take turns
+  struct compress_file *next;
+} compress_file;
+
+compress_file* compress_attach(sfs_store* store, const char* fpath, const sfs_header* header);
+compress_file* compress_lookup(const char* fpath);
+void compress_detach(compress_file* file);
+void compress_lock(compress_file* file);
+void compress_unlock(compress_file* file);
+void compress_reset(compress_file* file, const sfs_header* header);
+void compress_forget(const char* fpath);
+int compress_stat(sfs_store* store, const char* fpath, struct stat* st);
+int compress_fstat(compress_file* file, struct stat* st);
+ssize_t compress_read(compress_file* file, unsigned char* data, size_t size, off_t ofs);
+ssize_t compress_write(compress_file* file, const unsigned char* data, size_t size, off_t ofs);
+int compress_truncate(compress_file* file, off_t size);
+int compress_fsync(compress_file* file);
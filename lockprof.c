@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "lockprof.h"
+#include "stats.h"
+#include "logging.h"
+
+// locks taken outside a fuse operation, e.g. by the listener threads, are counted against this op slot
+#define LOCKPROF_OPS (STATS_OPS+1)
+
+struct lockprof_counter {
+  uint64_t acquired;
+  uint64_t contended;
+  uint64_t wait_ns;
+  uint64_t hold_ns;
+  uint64_t wait[STATS_BUCKETS];
+  uint64_t hold[STATS_BUCKETS];
+};
+
+// locks one thread can hold at once, the hold time of any taken deeper than this is not measured
+#define LOCKPROF_HELD 8
+
+// a held lock is found again by its address because striped locks share one id
+struct lockprof_held {
+  pthread_mutex_t *mutex;
+  uint64_t since;
+  struct lockprof_counter *counter;
+};
+
+// each thread owns one block so profiling adds no shared writes of its own,
+// a counter is only allocated for a lock and op pair once the thread takes that lock in that op
+struct lockprof_block {
+  struct lockprof_counter *counter[LOCK_COUNT][LOCKPROF_OPS];
+  struct lockprof_held held[LOCKPROF_HELD];
+  int held_count;
+  int in_use;
+  struct lockprof_block *next;
+};
+
+static const char* lockprof_names[LOCK_COUNT] = { "mutexsum", "mutexlog", "mutexsparse", "mutexcache", "mutexmap", "mutexdirect", "mutexpool", "mutexchunk", "mutexpack", "mutexcompress", "mutexqos", "mutexxattr", "mutexwarm" };
+static const int lockprof_stats[LOCK_COUNT] = { STATS_LOCK_SUM, STATS_LOCK_LOG, STATS_LOCK_SPARSE, STATS_LOCK_CACHE, STATS_LOCK_MAP, STATS_LOCK_DIRECT, STATS_LOCK_POOL, STATS_LOCK_CHUNK, STATS_LOCK_PACK, STATS_LOCK_COMPRESS, STATS_LOCK_QOS, STATS_LOCK_XATTR, STATS_LOCK_WARM };
+
+int lockprof_on = 0;
+
+static pthread_mutex_t mutexprof = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lockprof_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lockprof_key;
+static struct lockprof_block *lockprof_blocks = NULL;
+static __thread struct lockprof_block *lockprof_local = NULL;
+
+static void lockprof_detach(void *block) {
+  pthread_mutex_lock(&mutexprof);
+  ((struct lockprof_block*)block)->in_use = 0;
+  pthread_mutex_unlock(&mutexprof);
+}
+
+static void lockprof_create_key(void) {
+  pthread_key_create(&lockprof_key,lockprof_detach);
+}
+
+static struct lockprof_block* lockprof_attach(void) {
+  int saved = errno;
+  pthread_once(&lockprof_once,lockprof_create_key);
+  pthread_mutex_lock(&mutexprof);
+  struct lockprof_block *block = lockprof_blocks;
+  while (block && block->in_use) block = block->next;
+  if (block==NULL) {
+    block = calloc(1,sizeof(struct lockprof_block));
+    if (block!=NULL) {
+      block->next = lockprof_blocks;
+      lockprof_blocks = block;
+    }
+  }
+  if (block!=NULL) block->in_use = 1;
+  pthread_mutex_unlock(&mutexprof);
+  if (block!=NULL) {
+    pthread_setspecific(lockprof_key,block);
+    lockprof_local = block;
+  }
+  errno = saved;
+  return block;
+}
+
+static struct lockprof_counter* lockprof_counter(int id) {
+  struct lockprof_block *block = lockprof_local ? lockprof_local : lockprof_attach();
+  if (block==NULL) return NULL;
+  int op = stats_current();
+  if (op<0 || op>=STATS_OPS) op = STATS_OPS;
+  struct lockprof_counter *counter = block->counter[id][op];
+  if (counter==NULL) {
+    int saved = errno;
+    counter = calloc(1,sizeof(struct lockprof_counter));
+    errno = saved;
+    // the report reads the pointer from another thread
+    if (counter!=NULL) __atomic_store_n(&block->counter[id][op],counter,__ATOMIC_RELEASE);
+  }
+  return counter;
+}
+
+void lockprof_lock(pthread_mutex_t *mutex, int id) {
+  if (!lockprof_on) {
+    uint64_t start = stats_clock();
+    pthread_mutex_lock(mutex);
+    stats_record(lockprof_stats[id],start,0,0);
+    return;
+  }
+  // the counter is found before the lock is taken so its first allocation is timed as neither a wait nor a hold
+  struct lockprof_counter *counter = lockprof_counter(id);
+  uint64_t start = stats_clock();
+  // only a failed trylock counts as contention and only then is the wait timed again
+  int contended = pthread_mutex_trylock(mutex)!=0;
+  uint64_t acquired = start;
+  if (contended) {
+    pthread_mutex_lock(mutex);
+    acquired = stats_clock();
+  }
+  stats_record(lockprof_stats[id],start,0,0);
+  if (counter==NULL) return;
+  uint64_t ns = acquired - start;
+  counter->acquired++;
+  if (contended) counter->contended++;
+  counter->wait_ns += ns;
+  counter->wait[stats_bucket(ns)]++;
+  struct lockprof_block *block = lockprof_local;
+  if (block->held_count<LOCKPROF_HELD) {
+    struct lockprof_held *held = &block->held[block->held_count++];
+    held->mutex = mutex;
+    held->since = acquired;
+    held->counter = counter;
+  }
+}
+
+void lockprof_unlock(pthread_mutex_t *mutex, int id) {
+  struct lockprof_block *block = lockprof_local;
+  // locks are mostly released in the reverse order they were taken so the search starts at the last one
+  int i = lockprof_on && block!=NULL ? block->held_count-1 : -1;
+  while (i>=0 && block->held[i].mutex!=mutex) i--;
+  if (i>=0) {
+    struct lockprof_held *held = &block->held[i];
+    uint64_t ns = stats_clock() - held->since;
+    held->counter->hold_ns += ns;
+    held->counter->hold[stats_bucket(ns)]++;
+    memmove(held,held+1,(block->held_count-1-i)*sizeof(struct lockprof_held));
+    block->held_count--;
+  }
+  pthread_mutex_unlock(mutex);
+}
+
+static uint64_t lockprof_percentile(uint64_t buckets[STATS_BUCKETS], uint64_t count, int percent) {
+  uint64_t rank = (count*percent+99)/100;
+  uint64_t seen = 0;
+  for(int b=0; b<STATS_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen>=rank && seen>0) return stats_bucket_limit(b);
+  }
+  return 0;
+}
+
+static int lockprof_line(char **text, size_t *size, size_t *capacity, const char* lock, const char* op, struct lockprof_counter *counter) {
+  return stats_append(text,size,capacity,"%-10s %-14s %12llu %12llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+    lock,op,(unsigned long long)counter->acquired,(unsigned long long)counter->contended,
+    counter->wait_ns/1000.0/counter->acquired,
+    lockprof_percentile(counter->wait,counter->acquired,50)/1000.0,
+    lockprof_percentile(counter->wait,counter->acquired,99)/1000.0,
+    counter->hold_ns/1000.0/counter->acquired,
+    lockprof_percentile(counter->hold,counter->acquired,50)/1000.0,
+    lockprof_percentile(counter->hold,counter->acquired,99)/1000.0);
+}
+
+static void lockprof_add(struct lockprof_counter *to, struct lockprof_counter *from) {
+  to->acquired += from->acquired;
+  to->contended += from->contended;
+  to->wait_ns += from->wait_ns;
+  to->hold_ns += from->hold_ns;
+  for(int b=0; b<STATS_BUCKETS; b++) {
+    to->wait[b] += from->wait[b];
+    to->hold[b] += from->hold[b];
+  }
+}
+
+int lockprof_report(char** text, size_t* size) {
+  struct lockprof_counter (*total)[LOCKPROF_OPS] = calloc(LOCK_COUNT,sizeof(*total));
+  if (total==NULL) return -ENOMEM;
+  size_t capacity = 16384;
+  *size = 0;
+  *text = malloc(capacity);
+  if (*text==NULL) {
+    free(total);
+    return -ENOMEM;
+  }
+  pthread_mutex_lock(&mutexprof);
+  for(struct lockprof_block *block=lockprof_blocks; block; block=block->next) {
+    for(int id=0; id<LOCK_COUNT; id++) {
+      for(int op=0; op<LOCKPROF_OPS; op++) {
+        struct lockprof_counter *counter = __atomic_load_n(&block->counter[id][op],__ATOMIC_ACQUIRE);
+        if (counter!=NULL) lockprof_add(&total[id][op],counter);
+      }
+    }
+  }
+  pthread_mutex_unlock(&mutexprof);
+  int rc = stats_append(text,size,&capacity,"%-10s %-14s %12s %12s %10s %10s %10s %10s %10s %10s\n",
+    "lock","op","acquired","contended","wait_avg","wait_p50","wait_p99","hold_avg","hold_p50","hold_p99");
+  for(int id=0; id<LOCK_COUNT && rc==0; id++) {
+    struct lockprof_counter all;
+    memset(&all,0,sizeof(all));
+    for(int op=0; op<LOCKPROF_OPS; op++) lockprof_add(&all,&total[id][op]);
+    if (all.acquired==0) continue;
+    rc = lockprof_line(text,size,&capacity,lockprof_names[id],"all",&all);
+    for(int op=0; op<LOCKPROF_OPS && rc==0; op++) {
+      if (total[id][op].acquired==0) continue;
+      rc = lockprof_line(text,size,&capacity,lockprof_names[id],op<STATS_OPS ? stats_name(op) : "none",&total[id][op]);
+    }
+  }
+  // histogram lines list each non-empty bucket as upper-bound-in-ns:count
+  for(int id=0; id<LOCK_COUNT && rc==0; id++) {
+    struct lockprof_counter all;
+    memset(&all,0,sizeof(all));
+    for(int op=0; op<LOCKPROF_OPS; op++) lockprof_add(&all,&total[id][op]);
+    if (all.acquired==0) continue;
+    for(int kind=0; kind<2 && rc==0; kind++) {
+      uint64_t *buckets = kind ? all.hold : all.wait;
+      rc = stats_append(text,size,&capacity,"histogram %s %s",lockprof_names[id],kind ? "hold" : "wait");
+      for(int b=0; b<STATS_BUCKETS && rc==0; b++) {
+        if (buckets[b]) rc = stats_append(text,size,&capacity," %llu:%llu",
+          (unsigned long long)stats_bucket_limit(b),(unsigned long long)buckets[b]);
+      }
+      if (rc==0) rc = stats_append(text,size,&capacity,"\n");
+    }
+  }
+  free(total);
+  if (rc<0) {
+    free(*text);
+    *text = NULL;
+    *size = 0;
+  }
+  return rc;
+}
+
+void lockprof_dump(FILE* logfile) {
+  if (!lockprof_on) return;
+  char *text;
+  size_t size;
+  if (lockprof_report(&text,&size)==0) {
+    logreport(logfile,"lockprof",text);
+    free(text);
+  }
+}
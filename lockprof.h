@@ -0,0 +1,29 @@
+
+#include <unistd.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// profiled locks: add new process wide locks here and to the names in lockprof.c
+enum lockprof_id {
+  LOCK_SUM,
+  LOCK_LOG,
+  LOCK_SPARSE,
+  LOCK_CACHE,
+  LOCK_MAP,
+  LOCK_DIRECT,
+  LOCK_POOL,
+  LOCK_CHUNK,
+  LOCK_PACK,
+  LOCK_COMPRESS,
+  LOCK_QOS,
+  LOCK_XATTR,
+  LOCK_WARM,
+  LOCK_COUNT
+};
+
+extern int lockprof_on;
+
+void lockprof_lock(pthread_mutex_t *mutex, int id);
+void lockprof_unlock(pthread_mutex_t *mutex, int id);
+int lockprof_report(char** text, size_t* size);
+void lockprof_dump(FILE* logfile);
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+
+// positions are found by a hash of the next 4 bytes, 4096 entries keep the table on the stack and in cache
+#define LZ4_HASH_LOG 12
+#define LZ4_MINMATCH 4
+// the format ends every block with at least 5 literals and starts no match in its last 12 bytes
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_DISTANCE 65535
+
+static uint32_t lz4_read32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v,p,4);
+  return v;
+}
+
+static uint32_t lz4_hash(uint32_t v) {
+  return (v*2654435761u)>>(32-LZ4_HASH_LOG);
+}
+
+static unsigned char* lz4_length(unsigned char* op, size_t len) {
+  for(; len>=255; len-=255) *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+size_t lz4_compress(const unsigned char* in, size_t len, unsigned char* out, size_t capacity) {
+  // returns the compressed length or 0 when it would not fit in capacity
+  const unsigned char *ip = in;
+  const unsigned char *anchor = in;
+  const unsigned char *end = in+len;
+  unsigned char *op = out;
+  unsigned char *oend = out+capacity;
+  if (len>LZ4_MFLIMIT) {
+    uint32_t table[1<<LZ4_HASH_LOG];
+    memset(table,0,sizeof(table));
+    const unsigned char *mflimit = end-LZ4_MFLIMIT;
+    const unsigned char *matchlimit = end-LZ4_LASTLITERALS;
+    while (ip<mflimit) {
+      uint32_t seq = lz4_read32(ip);
+      uint32_t h = lz4_hash(seq);
+      const unsigned char *ref = in+table[h];
+      table[h] = ip-in;
+      // a stale or colliding entry is caught by comparing the bytes, the step grows through data that does not match
+      if (ref>=ip || ip-ref>LZ4_DISTANCE || lz4_read32(ref)!=seq) {
+        ip += 1+((ip-anchor)>>8);
+        continue;
+      }
+      while (ip>anchor && ref>in && ip[-1]==ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const unsigned char *p = ip+LZ4_MINMATCH;
+      const unsigned char *q = ref+LZ4_MINMATCH;
+      while (p<matchlimit && *p==*q) {
+        p++;
+        q++;
+      }
+      size_t literals = ip-anchor;
+      size_t match = p-ip-LZ4_MINMATCH;
+      if ((size_t)(oend-op)<1+literals/255+1+literals+2+match/255+1) return 0;
+      unsigned char *token = op++;
+      *token = (literals>=15 ? 15 : literals)<<4;
+      if (literals>=15) op = lz4_length(op,literals-15);
+      memcpy(op,anchor,literals);
+      op += literals;
+      size_t offset = ip-ref;
+      *op++ = offset;
+      *op++ = offset>>8;
+      *token |= match>=15 ? 15 : match;
+      if (match>=15) op = lz4_length(op,match-15);
+      ip = p;
+      anchor = ip;
+      // the position just before the next search is hashed too so a run that follows a match is found
+      if (ip<mflimit) table[lz4_hash(lz4_read32(ip-2))] = ip-2-in;
+    }
+  }
+  size_t literals = end-anchor;
+  if ((size_t)(oend-op)<1+literals/255+1+literals) return 0;
+  unsigned char *token = op++;
+  *token = (literals>=15 ? 15 : literals)<<4;
+  if (literals>=15) op = lz4_length(op,literals-15);
+  memcpy(op,anchor,literals);
+  op += literals;
+  return op-out;
+}
+
+ssize_t lz4_decompress(const unsigned char* in, size_t len, unsigned char* out, size_t capacity) {
+  // returns the plain length or -1 for input that is not a valid block or does not fit in capacity
+  const unsigned char *ip = in;
+  const unsigned char *iend = in+len;
+  unsigned char *op = out;
+  unsigned char *oend = out+capacity;
+  while (ip<iend) {
+    unsigned token = *ip++;
+    size_t literals = token>>4;
+    if (literals==15) {
+      unsigned char b;
+      do {
+        if (ip>=iend) return -1;
+        b = *ip++;
+        literals += b;
+      } while (b==255);
+    }
+    if ((size_t)(iend-ip)<literals || (size_t)(oend-op)<literals) return -1;
+    memcpy(op,ip,literals);
+    op += literals;
+    ip += literals;
+    // the last sequence has literals only
+    if (ip==iend) break;
+    if (iend-ip<2) return -1;
+    size_t offset = ip[0] | (size_t)ip[1]<<8;
+    ip += 2;
+    if (offset==0 || offset>(size_t)(op-out)) return -1;
+    size_t match = token&15;
+    if (match==15) {
+      unsigned char b;
+      do {
+        if (ip>=iend) return -1;
+        b = *ip++;
+        match += b;
+      } while (b==255);
+    }
+    match += LZ4_MINMATCH;
+    if ((size_t)(oend-op)<match) return -1;
+    const unsigned char *ref = op-offset;
+    size_t i = 0;
+    // a match may overlap the bytes it produces, 8 bytes at a time is safe once they are at least 8 back
+    if (offset>=match) memcpy(op,ref,match);
+    else if (offset>=8) for(; i+8<=match; i+=8) memcpy(&op[i],&ref[i],8);
+    if (offset<match) for(; i<match; i++) op[i] = ref[i];
+    op += match;
+  }
+  return op-out;
+}
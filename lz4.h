@@ -0,0 +1,10 @@
+
+#include <unistd.h>
+#include <stdint.h>
+
+// a compressor and decompressor for the LZ4 block format, with no frame and no checksum
+// the largest output the compressor can need for an input of n bytes
+#define LZ4_BOUND(n) ((n)+(n)/255+16)
+
+size_t lz4_compress(const unsigned char* in, size_t len, unsigned char* out, size_t capacity);
+ssize_t lz4_decompress(const unsigned char* in, size_t len, unsigned char* out, size_t capacity);
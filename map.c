@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "map.h"
+#include "stats.h"
+#include "lockprof.h"
+
+static pthread_mutex_t mutexmap = PTHREAD_MUTEX_INITIALIZER;
+static map_file *map_files = NULL;
+
+static int map_remap(map_file* map, off_t size) {
+  // there is no portable mremap so the old mapping is dropped and the file mapped again at its new size
+  if (map->base!=NULL) {
+    uint64_t sys = stats_clock();
+    int rc = munmap(map->base,map->size);
+    stats_record(STATS_SYS_META,sys,rc,0);
+    map->base = NULL;
+    map->size = 0;
+  }
+  if (size==0) return 0;
+  uint64_t sys = stats_clock();
+  void *base = mmap(NULL,size,map->writable ? PROT_READ | PROT_WRITE : PROT_READ,MAP_SHARED,map->fd,0);
+  stats_record(STATS_SYS_META,sys,base==MAP_FAILED ? -1 : 0,0);
+  if (base==MAP_FAILED) {
+    // a lost mapping is not mistaken for an empty file, the next refresh tries again
+    map->size = -1;
+    return -errno;
+  }
+  map->base = base;
+  map->size = size;
+  return 0;
+}
+
+map_file* map_attach(const char* fpath, int fh) {
+  struct stat st;
+  if (fstat(fh,&st)<0) return NULL;
+  lockprof_lock(&mutexmap,LOCK_MAP);
+  map_file *map = map_files;
+  while (map!=NULL && (map->dev!=st.st_dev || map->ino!=st.st_ino)) map = map->next;
+  if (map!=NULL) {
+    map->refs++;
+    lockprof_unlock(&mutexmap,LOCK_MAP);
+    return map;
+  }
+  map = calloc(1,sizeof(map_file));
+  if (map!=NULL) {
+    // a file that cannot be opened for writing is mapped read only and written through pwrite
+    map->writable = 1;
+    map->fd = open(fpath,O_RDWR);
+    if (map->fd<0) {
+      map->writable = 0;
+      map->fd = open(fpath,O_RDONLY);
+    }
+    if (map->fd<0 || map_remap(map,st.st_size)<0) {
+      if (map->fd>=0) close(map->fd);
+      free(map);
+      map = NULL;
+    }
+  }
+  if (map!=NULL) {
+    map->dev = st.st_dev;
+    map->ino = st.st_ino;
+    map->refs = 1;
+    pthread_rwlock_init(&map->lock,NULL);
+    map->next = map_files;
+    map_files = map;
+  }
+  lockprof_unlock(&mutexmap,LOCK_MAP);
+  return map;
+}
+
+map_file* map_find(dev_t dev, ino_t ino) {
+  lockprof_lock(&mutexmap,LOCK_MAP);
+  map_file *map = map_files;
+  while (map!=NULL && (map->dev!=dev || map->ino!=ino)) map = map->next;
+  if (map!=NULL) map->refs++;
+  lockprof_unlock(&mutexmap,LOCK_MAP);
+  return map;
+}
+
+void map_hold(map_file* map) {
+  lockprof_lock(&mutexmap,LOCK_MAP);
+  map->refs++;
+  lockprof_unlock(&mutexmap,LOCK_MAP);
+}
+
+void map_detach(map_file* map) {
+  lockprof_lock(&mutexmap,LOCK_MAP);
+  if (--map->refs>0) {
+    lockprof_unlock(&mutexmap,LOCK_MAP);
+    return;
+  }
+  map_file **link = &map_files;
+  while (*link!=map) link = &(*link)->next;
+  *link = map->next;
+  lockprof_unlock(&mutexmap,LOCK_MAP);
+  map_remap(map,0);
+  close(map->fd);
+  pthread_rwlock_destroy(&map->lock);
+  free(map);
+}
+
+int map_grow(map_file* map, off_t size) {
+  // the caller holds the lock exclusively
+  uint64_t sys = stats_clock();
+  int rc = ftruncate(map->fd,size);
+  stats_record(STATS_SYS_TRUNCATE,sys,rc,0);
+  if (rc<0) return -errno;
+  return map_remap(map,size);
+}
+
+int map_refresh(map_file* map) {
+  // the caller holds the lock exclusively after changing the size of the file some other way
+  struct stat st;
+  uint64_t sys = stats_clock();
+  int rc = fstat(map->fd,&st);
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  if (rc<0) return -errno;
+  return st.st_size==map->size ? 0 : map_remap(map,st.st_size);
+}
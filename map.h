@@ -0,0 +1,24 @@
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// every handle on a backing file shares one mapping of the whole file, header included, on a -mmap mount
+typedef struct map_file {
+  dev_t dev;
+  ino_t ino;
+  int fd;                 // opened by the registry so the mapping outlives the handle that created it
+  int writable;
+  unsigned char *base;
+  off_t size;             // bytes mapped, always the size of the backing file or -1 when mapping it failed
+  int refs;
+  pthread_rwlock_t lock;  // readers and in place writers share it, anything that changes the size holds it alone
+  struct map_file *next;
+} map_file;
+
+map_file* map_attach(const char* fpath, int fh);
+map_file* map_find(dev_t dev, ino_t ino);
+void map_hold(map_file* map);
+void map_detach(map_file* map);
+int map_grow(map_file* map, off_t size);
+int map_refresh(map_file* map);
@@ -1,6 +1,10 @@
 /* MD5C.C - RSA Data Security, Inc., MD5 message-digest algorithm
  */
 
+/* Derived from the RSA Data Security, Inc. MD5 Message-Digest Algorithm
+  with library memory routines, cheaper F and G functions and MD5Multi.
+ */
+
 /* Copyright (C) 1991-2, RSA Data Security, Inc. Created 1991. All
 rights reserved.
 
@@ -23,6 +27,7 @@ These notices must be retained in any copies of any part of this
 documentation and/or software.
  */
 
+#include <string.h>
 #include "md5.h"
 
 /* Constants for MD5Transform routine.
@@ -50,8 +55,12 @@ static void Encode PROTO_LIST
   ((unsigned char *, UINT4 *, unsigned int));
 static void Decode PROTO_LIST
   ((UINT4 *, unsigned char *, unsigned int));
-static void MD5_memcpy PROTO_LIST ((POINTER, POINTER, unsigned int));
-static void MD5_memset PROTO_LIST ((POINTER, int, unsigned int));
+
+/* The byte loops of the reference code are replaced with the library
+  routines.
+ */
+#define MD5_memcpy(output, input, len) memcpy ((output), (input), (len))
+#define MD5_memset(output, value, len) memset ((output), (value), (len))
 
 static unsigned char PADDING[64] = {
   0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -59,10 +68,12 @@ static unsigned char PADDING[64] = {
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-/* F, G, H and I are basic MD5 functions.
+/* F, G, H and I are basic MD5 functions. F and G select bits with one
+  operation less than the reference form and give the same result in
+  every bit of a UINT4.
  */
-#define F(x, y, z) (((x) & (y)) | ((~x) & (z)))
-#define G(x, y, z) (((x) & (z)) | ((y) & (~z)))
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
 #define H(x, y, z) ((x) ^ (y) ^ (z))
 #define I(x, y, z) ((y) ^ ((x) | (~z)))
 
@@ -94,6 +105,80 @@ Rotation is separate from addition to prevent recomputation.
  (a) += (b); \
   }
 
+/* MD5STEPS runs the 64 steps on a, b, c and d with the words in x. It
+  is shared by the single block and the multi-buffer transforms.
+ */
+#define MD5STEPS(a, b, c, d, x) { \
+  /* Round 1 */                                     \
+  FF (a, b, c, d, x[ 0], S11, 0xd76aa478); /* 1 */  \
+  FF (d, a, b, c, x[ 1], S12, 0xe8c7b756); /* 2 */  \
+  FF (c, d, a, b, x[ 2], S13, 0x242070db); /* 3 */  \
+  FF (b, c, d, a, x[ 3], S14, 0xc1bdceee); /* 4 */  \
+  FF (a, b, c, d, x[ 4], S11, 0xf57c0faf); /* 5 */  \
+  FF (d, a, b, c, x[ 5], S12, 0x4787c62a); /* 6 */  \
+  FF (c, d, a, b, x[ 6], S13, 0xa8304613); /* 7 */  \
+  FF (b, c, d, a, x[ 7], S14, 0xfd469501); /* 8 */  \
+  FF (a, b, c, d, x[ 8], S11, 0x698098d8); /* 9 */  \
+  FF (d, a, b, c, x[ 9], S12, 0x8b44f7af); /* 10 */ \
+  FF (c, d, a, b, x[10], S13, 0xffff5bb1); /* 11 */ \
+  FF (b, c, d, a, x[11], S14, 0x895cd7be); /* 12 */ \
+  FF (a, b, c, d, x[12], S11, 0x6b901122); /* 13 */ \
+  FF (d, a, b, c, x[13], S12, 0xfd987193); /* 14 */ \
+  FF (c, d, a, b, x[14], S13, 0xa679438e); /* 15 */ \
+  FF (b, c, d, a, x[15], S14, 0x49b40821); /* 16 */ \
+ /* Round 2 */                                      \
+  GG (a, b, c, d, x[ 1], S21, 0xf61e2562); /* 17 */ \
+  GG (d, a, b, c, x[ 6], S22, 0xc040b340); /* 18 */ \
+  GG (c, d, a, b, x[11], S23, 0x265e5a51); /* 19 */ \
+  GG (b, c, d, a, x[ 0], S24, 0xe9b6c7aa); /* 20 */ \
+  GG (a, b, c, d, x[ 5], S21, 0xd62f105d); /* 21 */ \
+  GG (d, a, b, c, x[10], S22,  0x2441453); /* 22 */ \
+  GG (c, d, a, b, x[15], S23, 0xd8a1e681); /* 23 */ \
+  GG (b, c, d, a, x[ 4], S24, 0xe7d3fbc8); /* 24 */ \
+  GG (a, b, c, d, x[ 9], S21, 0x21e1cde6); /* 25 */ \
+  GG (d, a, b, c, x[14], S22, 0xc33707d6); /* 26 */ \
+  GG (c, d, a, b, x[ 3], S23, 0xf4d50d87); /* 27 */ \
+  GG (b, c, d, a, x[ 8], S24, 0x455a14ed); /* 28 */ \
+  GG (a, b, c, d, x[13], S21, 0xa9e3e905); /* 29 */ \
+  GG (d, a, b, c, x[ 2], S22, 0xfcefa3f8); /* 30 */ \
+  GG (c, d, a, b, x[ 7], S23, 0x676f02d9); /* 31 */ \
+  GG (b, c, d, a, x[12], S24, 0x8d2a4c8a); /* 32 */ \
+  /* Round 3 */                                     \
+  HH (a, b, c, d, x[ 5], S31, 0xfffa3942); /* 33 */ \
+  HH (d, a, b, c, x[ 8], S32, 0x8771f681); /* 34 */ \
+  HH (c, d, a, b, x[11], S33, 0x6d9d6122); /* 35 */ \
+  HH (b, c, d, a, x[14], S34, 0xfde5380c); /* 36 */ \
+  HH (a, b, c, d, x[ 1], S31, 0xa4beea44); /* 37 */ \
+  HH (d, a, b, c, x[ 4], S32, 0x4bdecfa9); /* 38 */ \
+  HH (c, d, a, b, x[ 7], S33, 0xf6bb4b60); /* 39 */ \
+  HH (b, c, d, a, x[10], S34, 0xbebfbc70); /* 40 */ \
+  HH (a, b, c, d, x[13], S31, 0x289b7ec6); /* 41 */ \
+  HH (d, a, b, c, x[ 0], S32, 0xeaa127fa); /* 42 */ \
+  HH (c, d, a, b, x[ 3], S33, 0xd4ef3085); /* 43 */ \
+  HH (b, c, d, a, x[ 6], S34,  0x4881d05); /* 44 */ \
+  HH (a, b, c, d, x[ 9], S31, 0xd9d4d039); /* 45 */ \
+  HH (d, a, b, c, x[12], S32, 0xe6db99e5); /* 46 */ \
+  HH (c, d, a, b, x[15], S33, 0x1fa27cf8); /* 47 */ \
+  HH (b, c, d, a, x[ 2], S34, 0xc4ac5665); /* 48 */ \
+  /* Round 4 */                                     \
+  II (a, b, c, d, x[ 0], S41, 0xf4292244); /* 49 */ \
+  II (d, a, b, c, x[ 7], S42, 0x432aff97); /* 50 */ \
+  II (c, d, a, b, x[14], S43, 0xab9423a7); /* 51 */ \
+  II (b, c, d, a, x[ 5], S44, 0xfc93a039); /* 52 */ \
+  II (a, b, c, d, x[12], S41, 0x655b59c3); /* 53 */ \
+  II (d, a, b, c, x[ 3], S42, 0x8f0ccc92); /* 54 */ \
+  II (c, d, a, b, x[10], S43, 0xffeff47d); /* 55 */ \
+  II (b, c, d, a, x[ 1], S44, 0x85845dd1); /* 56 */ \
+  II (a, b, c, d, x[ 8], S41, 0x6fa87e4f); /* 57 */ \
+  II (d, a, b, c, x[15], S42, 0xfe2ce6e0); /* 58 */ \
+  II (c, d, a, b, x[ 6], S43, 0xa3014314); /* 59 */ \
+  II (b, c, d, a, x[13], S44, 0x4e0811a1); /* 60 */ \
+  II (a, b, c, d, x[ 4], S41, 0xf7537e82); /* 61 */ \
+  II (d, a, b, c, x[11], S42, 0xbd3af235); /* 62 */ \
+  II (c, d, a, b, x[ 2], S43, 0x2ad7d2bb); /* 63 */ \
+  II (b, c, d, a, x[ 9], S44, 0xeb86d391); /* 64 */ \
+  }
+
 /* MD5 initialization. Begins an MD5 operation, writing a new context.
  */
 void MD5Init (context)
@@ -192,78 +277,7 @@ unsigned char block[64];
 
   Decode (x, block, 64);
 
-  /* Round 1 */
-  FF (a, b, c, d, x[ 0], S11, 0xd76aa478); /* 1 */
-  FF (d, a, b, c, x[ 1], S12, 0xe8c7b756); /* 2 */
-  FF (c, d, a, b, x[ 2], S13, 0x242070db); /* 3 */
-  FF (b, c, d, a, x[ 3], S14, 0xc1bdceee); /* 4 */
-  FF (a, b, c, d, x[ 4], S11, 0xf57c0faf); /* 5 */
-  FF (d, a, b, c, x[ 5], S12, 0x4787c62a); /* 6 */
-  FF (c, d, a, b, x[ 6], S13, 0xa8304613); /* 7 */
-  FF (b, c, d, a, x[ 7], S14, 0xfd469501); /* 8 */
-  FF (a, b, c, d, x[ 8], S11, 0x698098d8); /* 9 */
-  FF (d, a, b, c, x[ 9], S12, 0x8b44f7af); /* 10 */
-  FF (c, d, a, b, x[10], S13, 0xffff5bb1); /* 11 */
-  FF (b, c, d, a, x[11], S14, 0x895cd7be); /* 12 */
-  FF (a, b, c, d, x[12], S11, 0x6b901122); /* 13 */
-  FF (d, a, b, c, x[13], S12, 0xfd987193); /* 14 */
-  FF (c, d, a, b, x[14], S13, 0xa679438e); /* 15 */
-  FF (b, c, d, a, x[15], S14, 0x49b40821); /* 16 */
-
- /* Round 2 */
-  GG (a, b, c, d, x[ 1], S21, 0xf61e2562); /* 17 */
-  GG (d, a, b, c, x[ 6], S22, 0xc040b340); /* 18 */
-  GG (c, d, a, b, x[11], S23, 0x265e5a51); /* 19 */
-  GG (b, c, d, a, x[ 0], S24, 0xe9b6c7aa); /* 20 */
-  GG (a, b, c, d, x[ 5], S21, 0xd62f105d); /* 21 */
-  GG (d, a, b, c, x[10], S22,  0x2441453); /* 22 */
-  GG (c, d, a, b, x[15], S23, 0xd8a1e681); /* 23 */
-  GG (b, c, d, a, x[ 4], S24, 0xe7d3fbc8); /* 24 */
-  GG (a, b, c, d, x[ 9], S21, 0x21e1cde6); /* 25 */
-  GG (d, a, b, c, x[14], S22, 0xc33707d6); /* 26 */
-  GG (c, d, a, b, x[ 3], S23, 0xf4d50d87); /* 27 */
-
-  GG (b, c, d, a, x[ 8], S24, 0x455a14ed); /* 28 */
-  GG (a, b, c, d, x[13], S21, 0xa9e3e905); /* 29 */
-  GG (d, a, b, c, x[ 2], S22, 0xfcefa3f8); /* 30 */
-  GG (c, d, a, b, x[ 7], S23, 0x676f02d9); /* 31 */
-  GG (b, c, d, a, x[12], S24, 0x8d2a4c8a); /* 32 */
-
-  /* Round 3 */
-  HH (a, b, c, d, x[ 5], S31, 0xfffa3942); /* 33 */
-  HH (d, a, b, c, x[ 8], S32, 0x8771f681); /* 34 */
-  HH (c, d, a, b, x[11], S33, 0x6d9d6122); /* 35 */
-  HH (b, c, d, a, x[14], S34, 0xfde5380c); /* 36 */
-  HH (a, b, c, d, x[ 1], S31, 0xa4beea44); /* 37 */
-  HH (d, a, b, c, x[ 4], S32, 0x4bdecfa9); /* 38 */
-  HH (c, d, a, b, x[ 7], S33, 0xf6bb4b60); /* 39 */
-  HH (b, c, d, a, x[10], S34, 0xbebfbc70); /* 40 */
-  HH (a, b, c, d, x[13], S31, 0x289b7ec6); /* 41 */
-  HH (d, a, b, c, x[ 0], S32, 0xeaa127fa); /* 42 */
-  HH (c, d, a, b, x[ 3], S33, 0xd4ef3085); /* 43 */
-  HH (b, c, d, a, x[ 6], S34,  0x4881d05); /* 44 */
-  HH (a, b, c, d, x[ 9], S31, 0xd9d4d039); /* 45 */
-  HH (d, a, b, c, x[12], S32, 0xe6db99e5); /* 46 */
-  HH (c, d, a, b, x[15], S33, 0x1fa27cf8); /* 47 */
-  HH (b, c, d, a, x[ 2], S34, 0xc4ac5665); /* 48 */
-
-  /* Round 4 */
-  II (a, b, c, d, x[ 0], S41, 0xf4292244); /* 49 */
-  II (d, a, b, c, x[ 7], S42, 0x432aff97); /* 50 */
-  II (c, d, a, b, x[14], S43, 0xab9423a7); /* 51 */
-  II (b, c, d, a, x[ 5], S44, 0xfc93a039); /* 52 */
-  II (a, b, c, d, x[12], S41, 0x655b59c3); /* 53 */
-  II (d, a, b, c, x[ 3], S42, 0x8f0ccc92); /* 54 */
-  II (c, d, a, b, x[10], S43, 0xffeff47d); /* 55 */
-  II (b, c, d, a, x[ 1], S44, 0x85845dd1); /* 56 */
-  II (a, b, c, d, x[ 8], S41, 0x6fa87e4f); /* 57 */
-  II (d, a, b, c, x[15], S42, 0xfe2ce6e0); /* 58 */
-  II (c, d, a, b, x[ 6], S43, 0xa3014314); /* 59 */
-  II (b, c, d, a, x[13], S44, 0x4e0811a1); /* 60 */
-  II (a, b, c, d, x[ 4], S41, 0xf7537e82); /* 61 */
-  II (d, a, b, c, x[11], S42, 0xbd3af235); /* 62 */
-  II (c, d, a, b, x[ 2], S43, 0x2ad7d2bb); /* 63 */
-  II (b, c, d, a, x[ 9], S44, 0xeb86d391); /* 64 */
+  MD5STEPS (a, b, c, d, x);
 
   state[0] += a;
   state[1] += b;
@@ -309,31 +323,113 @@ unsigned int len;
    (((UINT4)input[j+2]) << 16) | (((UINT4)input[j+3]) << 24);
 }
 
-/* Note: Replace "for loop" with standard memcpy if possible.
+/* MD5 multi-buffer operation. Digests count messages of inputLen bytes
+  each, MD5_LANES at a time, with one lane of a vector per message. The
+  lanes are UINT4 wide so the digests are the same as those of MD5Init,
+  MD5Update and MD5Final on the same build.
  */
+#if defined (__GNUC__)
+typedef UINT4 MD5_LANE
+  __attribute__ ((vector_size (sizeof (UINT4) * MD5_LANES)));
 
-static void MD5_memcpy (output, input, len)
-POINTER output;
-POINTER input;
-unsigned int len;
+static void MD5TransformLanes (state, blocks)
+MD5_LANE state[4];
+unsigned char *blocks[MD5_LANES];
 {
-  unsigned int i;
+  MD5_LANE a = state[0], b = state[1], c = state[2], d = state[3], x[16];
+  UINT4 word[16];
+  unsigned int i, lane;
+
+  for (lane = 0; lane < MD5_LANES; lane++) {
+ Decode (word, blocks[lane], 64);
+ for (i = 0; i < 16; i++)
+   x[i][lane] = word[i];
+  }
+
+  MD5STEPS (a, b, c, d, x);
 
-  for (i = 0; i < len; i++)
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
 
- output[i] = input[i];
+  /* Zeroize sensitive information.
+*/
+  MD5_memset ((POINTER)x, 0, sizeof (x));
+  MD5_memset ((POINTER)word, 0, sizeof (word));
 }
 
-/* Note: Replace "for loop" with standard memset if possible.
- */
-static void MD5_memset (output, value, len)
-POINTER output;
-int value;
-unsigned int len;
+void MD5Multi (digests, inputs, inputLen, count)
+unsigned char digests[][16];                     /* message digests */
+unsigned char *inputs[];                                /* messages */
+unsigned int inputLen;                         /* length of messages */
+unsigned int count;                             /* number of messages */
 {
-  unsigned int i;
+  MD5_LANE state[4];
+  unsigned char tail[MD5_LANES][128], *blocks[MD5_LANES];
+  unsigned int full = inputLen / 64, rest = inputLen % 64;
+  unsigned int total = full + (rest < 56 ? 1 : 2);
+  unsigned int base, lane, used, blk, i;
+  UINT4 bits[2], out[4];
+
+  /* The padded tail and length are the same shape for every lane */
+  bits[0] = (UINT4)inputLen << 3;
+  bits[1] = (UINT4)inputLen >> 29;
+
+  for (base = 0; base < count; base += MD5_LANES) {
+ used = count - base < MD5_LANES ? count - base : MD5_LANES;
+
+ /* Spare lanes repeat the first message and are not stored */
+ for (lane = 0; lane < MD5_LANES; lane++) {
+   unsigned char *input = inputs[base + (lane < used ? lane : 0)];
+   MD5_memcpy (tail[lane], &input[full * 64], rest);
+   MD5_memset (&tail[lane][rest], 0, sizeof (tail[lane]) - rest);
+   tail[lane][rest] = 0x80;
+   Encode (&tail[lane][(total - full) * 64 - 8], bits, 8);
+ }
+
+ for (i = 0; i < MD5_LANES; i++) {
+   state[0][i] = 0x67452301;
+   state[1][i] = 0xefcdab89;
+   state[2][i] = 0x98badcfe;
+   state[3][i] = 0x10325476;
+ }
+
+ for (blk = 0; blk < total; blk++) {
+   for (lane = 0; lane < MD5_LANES; lane++)
+     blocks[lane] = blk < full ? &inputs[base + (lane < used ? lane : 0)][blk * 64]
+       : tail[lane] + (blk - full) * 64;
+   MD5TransformLanes (state, blocks);
+ }
+
+ for (lane = 0; lane < used; lane++) {
+   for (i = 0; i < 4; i++)
+     out[i] = state[i][lane];
+   Encode (digests[base + lane], out, 16);
+ }
+  }
 
-  for (i = 0; i < len; i++)
- ((char *)output)[i] = (char)value;
+  /* Zeroize sensitive information.
+*/
+  MD5_memset ((POINTER)state, 0, sizeof (state));
+  MD5_memset ((POINTER)tail, 0, sizeof (tail));
+  MD5_memset ((POINTER)out, 0, sizeof (out));
 }
+#else
+void MD5Multi (digests, inputs, inputLen, count)
+unsigned char digests[][16];                     /* message digests */
+unsigned char *inputs[];                                /* messages */
+unsigned int inputLen;                         /* length of messages */
+unsigned int count;                             /* number of messages */
+{
+  MD5_CTX context;
+  unsigned int i;
 
+  /* Without vector types each message is digested on its own */
+  for (i = 0; i < count; i++) {
+ MD5Init (&context);
+ MD5Update (&context, inputs[i], inputLen);
+ MD5Final (digests[i], &context);
+  }
+}
+#endif
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "metrics.h"
+#include "stats.h"
+#include "node.h"
+#include "cache.h"
+#include "xattr.h"
+#include "warm.h"
+
+static int metrics_fd = -1;
+static char metrics_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static int metrics_family(char **text, size_t *size, size_t *capacity, const char* name, const char* type, const char* help) {
+  return stats_append(text,size,capacity,"# TYPE %s %s\n# HELP %s %s\n",name,type,name,help);
+}
+
+int metrics_render(char** text, size_t* size) {
+  struct stats_summary *summary = calloc(STATS_COUNT,sizeof(struct stats_summary));
+  if (summary==NULL) return -ENOMEM;
+  uint64_t inflight = 0;
+  int rc = stats_summarise(summary,&inflight);
+  if (rc<0) {
+    free(summary);
+    return rc;
+  }
+  size_t capacity = 32768;
+  *size = 0;
+  *text = malloc(capacity);
+  if (*text==NULL) {
+    free(summary);
+    return -ENOMEM;
+  }
+  rc = metrics_family(text,size,&capacity,"safefs_operations","counter","FUSE operations completed");
+  for(int id=0; id<STATS_OPS && rc==0; id++) {
+    rc = stats_append(text,size,&capacity,"safefs_operations_total{op=\"%s\"} %llu\n",stats_name(id),(unsigned long long)summary[id].calls);
+  }
+  if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_operation_errors","counter","FUSE operations that returned an error");
+  for(int id=0; id<STATS_OPS && rc==0; id++) {
+    rc = stats_append(text,size,&capacity,"safefs_operation_errors_total{op=\"%s\"} %llu\n",stats_name(id),(unsigned long long)summary[id].errors);
+  }
+  if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_operation_bytes","counter","Bytes returned by read or accepted by write");
+  for(int id=0; id<STATS_OPS && rc==0; id++) {
+    if (summary[id].bytes==0) continue;
+    rc = stats_append(text,size,&capacity,"safefs_operation_bytes_total{op=\"%s\"} %llu\n",stats_name(id),(unsigned long long)summary[id].bytes);
+  }
+  if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_operation_duration_seconds","summary","Latency of FUSE operations, cipher calls, backing syscalls and lock waits");
+  for(int id=0; id<STATS_COUNT && rc==0; id++) {
+    if (summary[id].calls==0) continue;
+    rc = stats_append(text,size,&capacity,
+      "safefs_operation_duration_seconds{op=\"%s\",quantile=\"0.5\"} %.9f\n"
+      "safefs_operation_duration_seconds{op=\"%s\",quantile=\"0.9\"} %.9f\n"
+      "safefs_operation_duration_seconds{op=\"%s\",quantile=\"0.99\"} %.9f\n"
+      "safefs_operation_duration_seconds_sum{op=\"%s\"} %.9f\n"
+      "safefs_operation_duration_seconds_count{op=\"%s\"} %llu\n",
+      stats_name(id),summary[id].p50_ns/1e9,
+      stats_name(id),summary[id].p90_ns/1e9,
+      stats_name(id),summary[id].p99_ns/1e9,
+      stats_name(id),summary[id].total_ns/1e9,
+      stats_name(id),(unsigned long long)summary[id].calls);
+  }
+  if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_cipher_bytes","counter","Bytes passed through the cipher");
+  if (rc==0) rc = stats_append(text,size,&capacity,
+    "safefs_cipher_bytes_total{direction=\"encipher\"} %llu\n"
+    "safefs_cipher_bytes_total{direction=\"decipher\"} %llu\n",
+    (unsigned long long)summary[STATS_ENCIPHER].bytes,(unsigned long long)summary[STATS_DECIPHER].bytes);
+  if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_open_handles","gauge","Open file handles in the node table");
+  if (rc==0) rc = stats_append(text,size,&capacity,"safefs_open_handles %d\n",countLinks());
+  if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_inflight_operations","gauge","FUSE operations being executed by daemon threads");
+  if (rc==0) rc = stats_append(text,size,&capacity,"safefs_inflight_operations %llu\n",(unsigned long long)inflight);
+  if (rc==0 && cache_enabled()) {
+    struct cache_summary cache;
+    cache_summarise(&cache);
+    rc = metrics_family(text,size,&capacity,"safefs_cache_lookups","counter","Block cache lookups by y_read");
+    if (rc==0) rc = stats_append(text,size,&capacity,
+      "safefs_cache_lookups_total{result=\"hit\"} %llu\n"
+      "safefs_cache_lookups_total{result=\"miss\"} %llu\n",
+      (unsigned long long)cache.hits,(unsigned long long)cache.misses);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_cache_evictions","counter","Cached blocks evicted to make room");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_cache_evictions_total %llu\n",(unsigned long long)cache.evictions);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_cache_invalidations","counter","Cached blocks dropped by writes and truncation");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_cache_invalidations_total %llu\n",(unsigned long long)cache.invalidations);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_cache_blocks","gauge","Deciphered blocks held in the cache");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_cache_blocks %llu\n",(unsigned long long)cache.blocks);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_cache_capacity_blocks","gauge","Blocks the cache can hold");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_cache_capacity_blocks %llu\n",(unsigned long long)cache.capacity);
+  }
+  if (rc==0 && xattr_enabled()) {
+    struct xattr_summary xattr;
+    xattr_summarise(&xattr);
+    rc = metrics_family(text,size,&capacity,"safefs_xattr_lookups","counter","Extended attribute cache lookups by y_getxattr and y_listxattr");
+    if (rc==0) rc = stats_append(text,size,&capacity,
+      "safefs_xattr_lookups_total{result=\"hit\"} %llu\n"
+      "safefs_xattr_lookups_total{result=\"miss\"} %llu\n",
+      (unsigned long long)xattr.hits,(unsigned long long)xattr.misses);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_xattr_evictions","counter","Cached extended attributes evicted to make room");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_xattr_evictions_total %llu\n",(unsigned long long)xattr.evictions);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_xattr_invalidations","counter","Cached extended attributes dropped by changes, renames and unlinks");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_xattr_invalidations_total %llu\n",(unsigned long long)xattr.invalidations);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_xattr_bytes","gauge","Bytes held by the extended attribute cache");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_xattr_bytes %llu\n",(unsigned long long)xattr.bytes);
+  }
+  if (rc==0 && warm_enabled()) {
+    struct warm_summary warm;
+    warm_summarise(&warm);
+    rc = metrics_family(text,size,&capacity,"safefs_warm_headers","counter","Headers looked up by y_open among those already decoded");
+    if (rc==0) rc = stats_append(text,size,&capacity,
+      "safefs_warm_headers_total{result=\"hit\"} %llu\n"
+      "safefs_warm_headers_total{result=\"miss\"} %llu\n",
+      (unsigned long long)warm.hits,(unsigned long long)warm.misses);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_warm_prefetched","gauge","Paths of the warm set read at mount");
+    if (rc==0) rc = stats_append(text,size,&capacity,
+      "safefs_warm_prefetched{state=\"done\"} %llu\n"
+      "safefs_warm_prefetched{state=\"missing\"} %llu\n"
+      "safefs_warm_prefetched{state=\"pending\"} %llu\n",
+      (unsigned long long)warm.prefetched,(unsigned long long)warm.missing,(unsigned long long)warm.pending);
+    if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_warm_prefetch_seconds","gauge","Time from mount until the warm set was read");
+    if (rc==0) rc = stats_append(text,size,&capacity,"safefs_warm_prefetch_seconds %.3f\n",warm.prefetch_ns/1e9);
+  }
+  if (rc==0) rc = metrics_family(text,size,&capacity,"safefs_uptime_seconds","gauge","Seconds since the filesystem was mounted");
+  if (rc==0) rc = stats_append(text,size,&capacity,"safefs_uptime_seconds %llu\n# EOF\n",(unsigned long long)stats_uptime());
+  free(summary);
+  if (rc<0) {
+    free(*text);
+    *text = NULL;
+    *size = 0;
+  }
+  return rc;
+}
+
+static void metrics_serve(int fd) {
+  // a scrape is a single http request so read the request head and ignore its content
+  struct timeval timeout = { 1, 0 };
+  setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+  setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+  char request[4096];
+  size_t len = 0;
+  while (len<sizeof(request)-1) {
+    ssize_t rc = read(fd,&request[len],sizeof(request)-1-len);
+    if (rc<=0) break;
+    len += rc;
+    request[len] = 0;
+    if (strstr(request,"\r\n\r\n") || strstr(request,"\n\n")) break;
+  }
+  char *text;
+  size_t size;
+  char head[256];
+  if (metrics_render(&text,&size)<0) {
+    const char *error = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    if (write(fd,error,strlen(error))<0) { }
+    return;
+  }
+  int hlen = snprintf(head,sizeof(head),"HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",size);
+  if (write(fd,head,hlen)==hlen) {
+    size_t sent = 0;
+    while (sent<size) {
+      ssize_t rc = write(fd,&text[sent],size-sent);
+      if (rc<=0) break;
+      sent += rc;
+    }
+  }
+  free(text);
+}
+
+static void* metrics_listener(void *arg) {
+  for(;;) {
+    int fd = accept(metrics_fd,NULL,NULL);
+    if (fd<0) {
+      if (errno==EINTR || errno==ECONNABORTED) continue;
+      break;
+    }
+    metrics_serve(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+int metrics_listen(const char* path) {
+  struct sockaddr_un addr;
+  if (strlen(path)>=sizeof(addr.sun_path)) return -ENAMETOOLONG;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path,path);
+  strcpy(metrics_path,path);
+  metrics_fd = socket(AF_UNIX,SOCK_STREAM,0);
+  if (metrics_fd<0) return -errno;
+  unlink(path);
+  if (bind(metrics_fd,(struct sockaddr*)&addr,sizeof(addr))<0 || chmod(path,0600)<0 || listen(metrics_fd,8)<0) {
+    int rc = -errno;
+    close(metrics_fd);
+    metrics_fd = -1;
+    return rc;
+  }
+  pthread_t thread;
+  int rc = pthread_create(&thread,NULL,metrics_listener,NULL);
+  if (rc!=0) {
+    close(metrics_fd);
+    metrics_fd = -1;
+    unlink(path);
+    return -rc;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void metrics_stop(void) {
+  if (metrics_fd>=0) {
+    // closing the socket ends the accept loop in the listener thread
+    shutdown(metrics_fd,SHUT_RDWR);
+    close(metrics_fd);
+    metrics_fd = -1;
+    unlink(metrics_path);
+  }
+}
@@ -0,0 +1,6 @@
+
+#include <unistd.h>
+
+int metrics_render(char** text, size_t* size);
+int metrics_listen(const char* path);
+void metrics_stop(void);
@@ -2,43 +2,51 @@
 #include <pthread.h>
 #include "node.h"
 #include "logging.h"
+#include "lockprof.h"
 
 pthread_mutex_t mutexsum = PTHREAD_MUTEX_INITIALIZER;
+int links = 0;
 
 btnode* addLink(int key, btnode** node) {
-  pthread_mutex_lock(&mutexsum);
+  lockprof_lock(&mutexsum,LOCK_SUM);
   btnode* prev = NULL;
   while (*node) {
     if ((*node)->key == key) {
+      btnode* found = *node;
       logerr("addLink","Reuse fd=%d",key);
-      pthread_mutex_unlock(&mutexsum);
-      return *node;
+      lockprof_unlock(&mutexsum,LOCK_SUM);
+      return found;
     }
     prev = *node;
     node = &(*node)->next;
   }
-  *node = calloc(1,sizeof(struct btnode));
-  (*node)->key = key;
-  (*node)->prev = prev;
-  pthread_mutex_unlock(&mutexsum);
-  return *node;
+  // the slot may belong to a node that another thread frees once the lock is released
+  btnode* added = calloc(1,sizeof(struct btnode));
+  added->key = key;
+  added->direct = -1;
+  added->prev = prev;
+  *node = added;
+  links++;
+  lockprof_unlock(&mutexsum,LOCK_SUM);
+  return added;
 }
 
 btnode* findLink(int key, btnode** node) {
-  pthread_mutex_lock(&mutexsum);
+  lockprof_lock(&mutexsum,LOCK_SUM);
   while (*node) {
     if ((*node)->key == key) {
-      pthread_mutex_unlock(&mutexsum);
-      return *node;
+      btnode* found = *node;
+      lockprof_unlock(&mutexsum,LOCK_SUM);
+      return found;
     }
     node = &(*node)->next;
   }
-  pthread_mutex_unlock(&mutexsum);
+  lockprof_unlock(&mutexsum,LOCK_SUM);
   return NULL;
 }
 
 void delLink(int key, btnode** node) {
-  pthread_mutex_lock(&mutexsum);
+  lockprof_lock(&mutexsum,LOCK_SUM);
   while (*node) {
     if ((*node)->key == key) {
       btnode* me = *node;
@@ -50,12 +58,22 @@ void delLink(int key, btnode** node) {
       } else {
         *node = (*node)->next;
       }
+      free(me->report);
       free(me);
-      pthread_mutex_unlock(&mutexsum);
+      links--;
+      lockprof_unlock(&mutexsum,LOCK_SUM);
       return;
     }
     node = &(*node)->next;
   }
-  pthread_mutex_unlock(&mutexsum);
+  lockprof_unlock(&mutexsum,LOCK_SUM);
 }
 
+
+int countLinks(void) {
+  // the lock is only held for the read so an exporter does not stall open and release
+  lockprof_lock(&mutexsum,LOCK_SUM);
+  int count = links;
+  lockprof_unlock(&mutexsum,LOCK_SUM);
+  return count;
+}
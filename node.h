@@ -1,9 +1,23 @@
+#include "sfs.h"
+
+struct map_file;
+struct chunk_file;
+struct pack_entry;
+struct compress_file;
+
 typedef struct btnode {
   int key;
-  unsigned char salt[4];
-  unsigned char rotor_digest[16];
-  unsigned char f_ring[256];
-  unsigned char r_ring[256];
+  sfs_header header;
+  char *report; // rendered text of a virtual file such as .safefs-stats
+  size_t report_size;
+  int cached;   // dev and ino hold the backing inode that keys the cached blocks of the file
+  dev_t dev;
+  ino_t ino;
+  struct map_file *map; // shared mapping of the backing file on a -mmap mount
+  int direct;   // second handle on the backing file that bypasses the page cache on a -direct mount or -1
+  struct chunk_file *chunk; // shared chunk state of the backing file on a -chunk mount
+  struct pack_entry *pack;  // index entry of a packed file on a -pack mount, its fd is a placeholder
+  struct compress_file *compress; // shared block index of the backing file on a -compress mount
   struct btnode *next;
   struct btnode *prev;
 } btnode;
@@ -11,4 +25,4 @@ typedef struct btnode {
 btnode* addLink(int key, btnode** node);
 btnode* findLink(int key, btnode** node);
 void delLink(int key, btnode** node);
-
+int countLinks(void);
@@ -0,0 +1,1227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "sfs.h"
+#include "pack.h"
+#include "pool.h"
+#include "stats.h"
+#include "lockprof.h"
+
+#define PACK_FILE 1
+#define PACK_REMOVAL 2
+
+typedef struct pack_segment {
+  uint32_t number;
+  int fd;
+  sfs_header header;
+  uint32_t bytes;  // of whole records, a torn record at the end of an old segment is left out
+  uint32_t live;   // bytes of the records the index points at
+  struct pack_segment *next;
+} pack_segment;
+
+// the packed files of each folder are listed together so a folder is read without a scan of the index
+typedef struct pack_dir {
+  char *path;
+  size_t length;
+  pack_entry *first;
+  size_t count;
+  struct pack_dir *next;
+} pack_dir;
+
+// a record listed by the compactor to be copied
+typedef struct pack_copy {
+  char *path;
+  pack_segment *segment;
+  uint32_t offset;
+  uint32_t length;
+  pack_segment *to;
+  uint32_t moved;
+} pack_copy;
+
+static pthread_mutex_t mutexpack = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pack_waste = PTHREAD_COND_INITIALIZER;
+static sfs_store *pack_store = NULL;
+static pack_moved pack_callback = NULL;
+static pack_entry **pack_table = NULL;
+static size_t pack_buckets = 0;
+static size_t pack_count = 0;
+static pack_dir **pack_dirs = NULL;
+static size_t pack_dir_buckets = 0;
+static size_t pack_dir_count = 0;
+static pack_segment *pack_segments = NULL;
+static pack_segment *pack_active = NULL;
+static uint32_t pack_last = 0;
+static uint64_t pack_seq = 0;
+static uint64_t pack_ino = PACK_INO;
+static dev_t pack_dev = 0;
+static int pack_created = 0;    // a segment was added since the folder was last synced
+static int pack_running = 0;
+static int pack_stopping = 0;
+static int pack_compacting = 0;
+static pthread_t pack_thread;
+
+static uint32_t pack_hash(const void* data, size_t len) {
+  const unsigned char *p = data;
+  uint32_t hash = 2166136261u;
+  for(size_t i=0; i<len; i++) hash = (hash ^ p[i]) * 16777619u;
+  return hash;
+}
+
+static void put16(unsigned char* p, uint16_t v) { p[0] = v; p[1] = v>>8; }
+static void put32(unsigned char* p, uint32_t v) { for(int i=0; i<4; i++) p[i] = v>>(i*8); }
+static void put64(unsigned char* p, uint64_t v) { for(int i=0; i<8; i++) p[i] = v>>(i*8); }
+static uint16_t get16(const unsigned char* p) { return p[0] | (uint16_t)p[1]<<8; }
+static uint32_t get32(const unsigned char* p) { uint32_t v = 0; for(int i=3; i>=0; i--) v = (v<<8) | p[i]; return v; }
+static uint64_t get64(const unsigned char* p) { uint64_t v = 0; for(int i=7; i>=0; i--) v = (v<<8) | p[i]; return v; }
+
+static int pack_sync(int fd) {
+  uint64_t sys = stats_clock();
+  int rc = fsync(fd);
+  stats_record(STATS_SYS_FSYNC,sys,rc,0);
+  return rc<0 ? -errno : 0;
+}
+
+static void pack_sync_dir(void) {
+  // new and removed segments survive a crash once the folder is synced
+  char fpath[PATH_MAX];
+  sfs_resolve(pack_store,PACK_DIR,fpath);
+  int fd = open(fpath,O_RDONLY);
+  if (fd<0) return;
+  pack_sync(fd);
+  close(fd);
+  pack_created = 0;
+}
+
+static int pack_sync_parent(const char* fpath) {
+  // a new backing file survives a crash once the folder that names it is synced
+  char folder[PATH_MAX];
+  snprintf(folder,sizeof(folder),"%s",fpath);
+  char *slash = strrchr(folder,'/');
+  if (slash!=NULL && slash>folder) *slash = 0;
+  int fd = open(folder,O_RDONLY);
+  if (fd<0) return -errno;
+  int rc = pack_sync(fd);
+  close(fd);
+  return rc;
+}
+
+static void pack_segment_path(uint32_t number, char fpath[PATH_MAX]) {
+  char path[64];
+  snprintf(path,sizeof(path),"%s/%08x",PACK_DIR,number);
+  sfs_resolve(pack_store,path,fpath);
+}
+
+static size_t pack_parent(const char* path) {
+  // the folder of "/a" is "/"
+  const char *slash = strrchr(path,'/');
+  return slash==NULL || slash==path ? 1 : (size_t)(slash-path);
+}
+
+static pack_entry* pack_find(const char* path) {
+  pack_entry *entry = pack_table[pack_hash(path,strlen(path))%pack_buckets];
+  while (entry!=NULL && strcmp(entry->path,path)) entry = entry->next;
+  return entry;
+}
+
+static pack_dir* pack_find_dir(const char* path, size_t length) {
+  pack_dir *dir = pack_dirs[pack_hash(path,length)%pack_dir_buckets];
+  while (dir!=NULL && (dir->length!=length || memcmp(dir->path,path,length))) dir = dir->next;
+  return dir;
+}
+
+static void pack_grow(void) {
+  // both tables double as they fill so chains stay short, a failed allocation only makes them longer
+  if (pack_count>=pack_buckets) {
+    pack_entry **table = calloc(pack_buckets*2,sizeof(pack_entry*));
+    if (table!=NULL) {
+      for(size_t i=0; i<pack_buckets; i++) {
+        while (pack_table[i]!=NULL) {
+          pack_entry *entry = pack_table[i];
+          pack_table[i] = entry->next;
+          size_t bucket = pack_hash(entry->path,strlen(entry->path))%(pack_buckets*2);
+          entry->next = table[bucket];
+          table[bucket] = entry;
+        }
+      }
+      free(pack_table);
+      pack_table = table;
+      pack_buckets *= 2;
+    }
+  }
+  if (pack_dir_count>=pack_dir_buckets) {
+    pack_dir **dirs = calloc(pack_dir_buckets*2,sizeof(pack_dir*));
+    if (dirs!=NULL) {
+      for(size_t i=0; i<pack_dir_buckets; i++) {
+        while (pack_dirs[i]!=NULL) {
+          pack_dir *dir = pack_dirs[i];
+          pack_dirs[i] = dir->next;
+          size_t bucket = pack_hash(dir->path,dir->length)%(pack_dir_buckets*2);
+          dir->next = dirs[bucket];
+          dirs[bucket] = dir;
+        }
+      }
+      free(pack_dirs);
+      pack_dirs = dirs;
+      pack_dir_buckets *= 2;
+    }
+  }
+}
+
+static int pack_insert(pack_entry* entry) {
+  size_t length = pack_parent(entry->path);
+  pack_dir *dir = pack_find_dir(entry->path,length);
+  if (dir==NULL) {
+    dir = calloc(1,sizeof(pack_dir));
+    if (dir!=NULL) dir->path = malloc(length+1);
+    if (dir==NULL || dir->path==NULL) {
+      free(dir);
+      return -ENOMEM;
+    }
+    memcpy(dir->path,entry->path,length);
+    dir->path[length] = 0;
+    dir->length = length;
+    size_t bucket = pack_hash(dir->path,length)%pack_dir_buckets;
+    dir->next = pack_dirs[bucket];
+    pack_dirs[bucket] = dir;
+    pack_dir_count++;
+  }
+  entry->prev_sibling = NULL;
+  entry->sibling = dir->first;
+  if (dir->first!=NULL) dir->first->prev_sibling = entry;
+  dir->first = entry;
+  dir->count++;
+  size_t bucket = pack_hash(entry->path,strlen(entry->path))%pack_buckets;
+  entry->next = pack_table[bucket];
+  pack_table[bucket] = entry;
+  pack_count++;
+  pack_grow();
+  return 0;
+}
+
+static void pack_delete(pack_entry* entry) {
+  pack_entry **link = &pack_table[pack_hash(entry->path,strlen(entry->path))%pack_buckets];
+  while (*link!=entry) link = &(*link)->next;
+  *link = entry->next;
+  pack_count--;
+  size_t length = pack_parent(entry->path);
+  pack_dir *dir = pack_find_dir(entry->path,length);
+  if (entry->prev_sibling!=NULL) entry->prev_sibling->sibling = entry->sibling;
+  else dir->first = entry->sibling;
+  if (entry->sibling!=NULL) entry->sibling->prev_sibling = entry->prev_sibling;
+  entry->sibling = NULL;
+  entry->prev_sibling = NULL;
+  if (--dir->count==0) {
+    pack_dir **dlink = &pack_dirs[pack_hash(dir->path,length)%pack_dir_buckets];
+    while (*dlink!=dir) dlink = &(*dlink)->next;
+    *dlink = dir->next;
+    pack_dir_count--;
+    free(dir->path);
+    free(dir);
+  }
+}
+
+static void pack_free(pack_entry* entry) {
+  if (entry->data!=NULL) {
+    memset(entry->data,0,PACK_LIMIT);
+    free(entry->data);
+  }
+  free(entry->path);
+  free(entry->handles);
+  memset(entry,0,sizeof(pack_entry));
+  free(entry);
+}
+
+static void pack_fill(const pack_entry* entry, struct stat* st) {
+  memset(st,0,sizeof(struct stat));
+  st->st_dev = pack_dev;
+  st->st_ino = entry->ino;
+  st->st_mode = entry->mode;
+  st->st_nlink = 1;
+  st->st_uid = entry->uid;
+  st->st_gid = entry->gid;
+  st->st_size = entry->size;
+  st->st_blksize = 4096;
+  st->st_blocks = (entry->size+511)/512;
+  st->st_atime = entry->atime;
+  st->st_mtime = entry->mtime;
+  st->st_ctime = entry->ctime;
+}
+
+static void pack_forget(pack_entry* entry) {
+  // the last record of the entry is no longer live
+  if (entry->segment!=NULL) entry->segment->live -= entry->length;
+  entry->segment = NULL;
+}
+
+static int pack_wasteful(void) {
+  uint64_t bytes = 0;
+  uint64_t live = 0;
+  for(pack_segment *segment=pack_segments; segment!=NULL; segment=segment->next) {
+    bytes += segment->bytes;
+    live += segment->live;
+  }
+  return bytes-live>PACK_SEGMENT && bytes-live>live;
+}
+
+static void pack_wake(void) {
+  // the compactor is woken once the dead records outweigh the live ones
+  if (pack_running && !pack_compacting && pack_wasteful()) pthread_cond_signal(&pack_waste);
+}
+
+static pack_segment* pack_segment_create(uint32_t number, int* err) {
+  // a segment gets a header from the pool like any new file
+  char fpath[PATH_MAX];
+  pack_segment_path(number,fpath);
+  pack_segment *segment = calloc(1,sizeof(pack_segment));
+  if (segment==NULL) {
+    *err = -ENOMEM;
+    return NULL;
+  }
+  uint64_t sys = stats_clock();
+  segment->fd = open(fpath,O_CREAT | O_EXCL | O_RDWR,0600);
+  stats_record(STATS_SYS_OPEN,sys,segment->fd,0);
+  if (segment->fd<0) {
+    *err = -errno;
+    free(segment);
+    return NULL;
+  }
+  unsigned char out[SFS_HEADER];
+  pool_take(pack_store,&segment->header,out);
+  sys = stats_clock();
+  ssize_t put = pwrite(segment->fd,out,SFS_HEADER,0);
+  stats_record(STATS_SYS_PWRITE,sys,put,put>0 ? put : 0);
+  memset(out,0,SFS_HEADER);
+  if (put!=SFS_HEADER) {
+    *err = put<0 ? -errno : -EIO;
+    close(segment->fd);
+    unlink(fpath);
+    memset(segment,0,sizeof(pack_segment));
+    free(segment);
+    return NULL;
+  }
+  segment->number = number;
+  return segment;
+}
+
+static void pack_segment_close(pack_segment* segment, int remove) {
+  close(segment->fd);
+  if (remove) {
+    char fpath[PATH_MAX];
+    pack_segment_path(segment->number,fpath);
+    uint64_t sys = stats_clock();
+    int rc = unlink(fpath);
+    stats_record(STATS_SYS_META,sys,rc,0);
+  }
+  memset(segment,0,sizeof(pack_segment));
+  free(segment);
+}
+
+static int pack_put(pack_segment* segment, unsigned char* rec, size_t len, uint32_t* offset) {
+  // the record is enciphered in place and written after the last whole record of the segment
+  uint32_t at = segment->bytes;
+  uint64_t cipher = stats_clock();
+  sfs_encipher(pack_store,&segment->header,at,rec,len);
+  stats_record(STATS_ENCIPHER,cipher,0,len);
+  uint64_t sys = stats_clock();
+  ssize_t put = pwrite(segment->fd,rec,len,SFS_HEADER+at);
+  stats_record(STATS_SYS_PWRITE,sys,put,put>0 ? put : 0);
+  if (put<0) return -errno;
+  if ((size_t)put!=len) return -EIO;
+  segment->bytes += len;
+  *offset = at;
+  return 0;
+}
+
+static int pack_append(unsigned char* rec, size_t len, pack_segment** where, uint32_t* offset) {
+  int rc = 0;
+  if (pack_active==NULL) {
+    pack_active = pack_segment_create(++pack_last,&rc);
+    if (pack_active==NULL) return rc;
+    pack_active->next = pack_segments;
+    pack_segments = pack_active;
+    pack_created = 1;
+  }
+  pack_segment *segment = pack_active;
+  rc = pack_put(segment,rec,len,offset);
+  if (rc<0) return rc;
+  *where = segment;
+  // a full segment is synced once and only read from then on
+  if (segment->bytes>=PACK_SEGMENT) {
+    pack_sync(segment->fd);
+    pack_active = NULL;
+  }
+  return 0;
+}
+
+static size_t pack_encode(const pack_entry* entry, const char* path, int type, uint64_t seq, const unsigned char* data, unsigned char* out) {
+  size_t plen = strlen(path);
+  size_t dlen = type==PACK_FILE ? entry->size : 0;
+  size_t len = PACK_RECORD+plen+dlen;
+  memset(out,0,PACK_RECORD);
+  put32(out,len);
+  put64(&out[8],seq);
+  if (type==PACK_FILE) {
+    put32(&out[16],entry->mode);
+    put32(&out[20],entry->uid);
+    put32(&out[24],entry->gid);
+    put32(&out[28],entry->size);
+    put64(&out[32],entry->atime);
+    put64(&out[40],entry->mtime);
+    put64(&out[48],entry->ctime);
+  }
+  put16(&out[56],plen);
+  out[58] = type;
+  memcpy(&out[PACK_RECORD],path,plen);
+  if (dlen>0) memcpy(&out[PACK_RECORD+plen],data,dlen);
+  // a record torn by a crash fails the check and ends the replay of its segment
+  put32(&out[4],pack_hash(&out[8],len-8));
+  return len;
+}
+
+static int pack_load(pack_entry* entry, unsigned char* out) {
+  // the plain text of a closed file is read back from the end of its record
+  if (entry->data!=NULL) {
+    memcpy(out,entry->data,entry->size);
+    return 0;
+  }
+  if (entry->size==0) return 0;
+  if (entry->segment==NULL) return -EIO;
+  uint32_t pos = entry->offset+entry->length-entry->size;
+  uint64_t sys = stats_clock();
+  ssize_t got = pread(entry->segment->fd,out,entry->size,SFS_HEADER+pos);
+  stats_record(STATS_SYS_PREAD,sys,got,got>0 ? got : 0);
+  if (got<0) return -errno;
+  if ((size_t)got!=entry->size) return -EIO;
+  uint64_t cipher = stats_clock();
+  sfs_decipher(pack_store,&entry->segment->header,pos,out,entry->size);
+  stats_record(STATS_DECIPHER,cipher,0,entry->size);
+  return 0;
+}
+
+static int pack_record(pack_entry* entry) {
+  // called with the lock held, the entry is written whole so any one record is enough to restore it
+  unsigned char plain[PACK_LIMIT];
+  size_t plen = strlen(entry->path);
+  unsigned char *rec = malloc(PACK_RECORD+plen+entry->size);
+  if (rec==NULL) return -ENOMEM;
+  int rc = pack_load(entry,plain);
+  pack_segment *segment = NULL;
+  uint32_t offset = 0;
+  size_t len = 0;
+  if (rc==0) {
+    uint64_t seq = ++pack_seq;
+    len = pack_encode(entry,entry->path,PACK_FILE,seq,plain,rec);
+    rc = pack_append(rec,len,&segment,&offset);
+    if (rc==0) entry->seq = seq;
+  }
+  if (rc==0) {
+    pack_forget(entry);
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->length = len;
+    segment->live += len;
+    entry->dirty = 0;
+  }
+  memset(plain,0,sizeof(plain));
+  memset(rec,0,PACK_RECORD+plen+entry->size);
+  free(rec);
+  pack_wake();
+  return rc;
+}
+
+static int pack_removal(const char* path) {
+  // a removal is never live, it only hides older records of the path until they are compacted away
+  size_t plen = strlen(path);
+  unsigned char *rec = malloc(PACK_RECORD+plen);
+  if (rec==NULL) return -ENOMEM;
+  pack_segment *segment;
+  uint32_t offset;
+  size_t len = pack_encode(NULL,path,PACK_REMOVAL,++pack_seq,NULL,rec);
+  int rc = pack_append(rec,len,&segment,&offset);
+  free(rec);
+  pack_wake();
+  return rc;
+}
+
+static int pack_handle(pack_entry* entry, int fh) {
+  if (entry->handle_count==entry->handle_capacity) {
+    int capacity = entry->handle_capacity ? entry->handle_capacity*2 : 4;
+    int *handles = realloc(entry->handles,capacity*sizeof(int));
+    if (handles==NULL) return -ENOMEM;
+    entry->handles = handles;
+    entry->handle_capacity = capacity;
+  }
+  entry->handles[entry->handle_count++] = fh;
+  entry->refs++;
+  return 0;
+}
+
+static int pack_hold(pack_entry* entry) {
+  // an open file keeps its plain text in memory
+  if (entry->data!=NULL) return 0;
+  entry->data = malloc(PACK_LIMIT);
+  if (entry->data==NULL) return -ENOMEM;
+  unsigned char *data = entry->data;
+  entry->data = NULL;
+  int rc = pack_load(entry,data);
+  if (rc<0) {
+    free(data);
+    return rc;
+  }
+  entry->data = data;
+  return 0;
+}
+
+static void pack_unhold(pack_entry* entry) {
+  if (entry->data==NULL || entry->dirty || entry->refs>0) return;
+  memset(entry->data,0,PACK_LIMIT);
+  free(entry->data);
+  entry->data = NULL;
+}
+
+static void pack_drop(pack_entry* entry) {
+  // takes the entry out of the index, it is freed now or with its last handle
+  pack_forget(entry);
+  pack_delete(entry);
+  entry->removed = 1;
+  if (entry->refs==0) pack_free(entry);
+}
+
+static void pack_touch(pack_entry* entry) {
+  entry->mtime = time(NULL);
+  entry->ctime = entry->mtime;
+  entry->dirty = 1;
+}
+
+static int pack_move_locked(pack_entry* entry) {
+  // a file that outgrows the limit gets a backing file of its own and every handle on it is pointed there
+  if (entry->moved) return 0;
+  unsigned char plain[PACK_LIMIT];
+  int rc = pack_load(entry,plain);
+  if (rc<0) return rc;
+  char path[PATH_MAX];
+  char fpath[PATH_MAX];
+  if (entry->removed) snprintf(path,sizeof(path),"%s/moving-%llx",PACK_DIR,(unsigned long long)entry->ino);
+  else snprintf(path,sizeof(path),"%s",entry->path);
+  sfs_resolve(pack_store,path,fpath);
+  uint64_t sys = stats_clock();
+  int fd = open(fpath,O_CREAT | O_EXCL | O_RDWR,entry->mode & 07777);
+  stats_record(STATS_SYS_OPEN,sys,fd,0);
+  if (fd<0) {
+    memset(plain,0,sizeof(plain));
+    return -errno;
+  }
+  sfs_header header;
+  unsigned char *out = malloc(SFS_HEADER+entry->size);
+  if (out==NULL) rc = -ENOMEM;
+  if (rc==0) {
+    pool_take(pack_store,&header,out);
+    uint64_t cipher = stats_clock();
+    sfs_encipher_to(pack_store,&header,0,plain,&out[SFS_HEADER],entry->size);
+    stats_record(STATS_ENCIPHER,cipher,0,entry->size);
+    sys = stats_clock();
+    ssize_t put = pwrite(fd,out,SFS_HEADER+entry->size,0);
+    stats_record(STATS_SYS_PWRITE,sys,put,put>0 ? put : 0);
+    if (put<0) rc = -errno;
+    else if ((size_t)put!=SFS_HEADER+entry->size) rc = -EIO;
+    memset(out,0,SFS_HEADER+entry->size);
+  }
+  free(out);
+  memset(plain,0,sizeof(plain));
+  if (rc==0) {
+    struct timeval times[2] = { { entry->atime, 0 }, { entry->mtime, 0 } };
+    futimes(fd,times);
+  }
+  // the backing file and its name are on disk before the removal record hides the packed copy
+  if (rc==0 && !entry->removed) rc = pack_sync(fd);
+  if (rc==0 && !entry->removed) rc = pack_sync_parent(fpath);
+  if (rc<0) {
+    close(fd);
+    unlink(fpath);
+    memset(&header,0,sizeof(sfs_header));
+    return rc;
+  }
+  for(int i=0; i<entry->handle_count; i++) {
+    if (dup2(fd,entry->handles[i])<0 && rc==0) rc = -errno;
+    pack_callback(entry->handles[i],&header);
+  }
+  close(fd);
+  memset(&header,0,sizeof(sfs_header));
+  entry->moved = 1;
+  entry->dirty = 0;
+  if (entry->data!=NULL) {
+    memset(entry->data,0,PACK_LIMIT);
+    free(entry->data);
+    entry->data = NULL;
+  }
+  if (entry->removed) {
+    // an unlinked file lives on only through its handles
+    unlink(fpath);
+  } else {
+    // a crash before the removal is written leaves both, the mount keeps the backing file,
+    // so the entry goes either way and a failed removal is only reported
+    int err = pack_removal(entry->path);
+    if (err<0 && rc==0) rc = err;
+    pack_drop(entry);
+  }
+  return rc;
+}
+
+static int pack_replay(uint32_t number) {
+  // whole records are applied in order, the newest record of each path wins
+  char fpath[PATH_MAX];
+  pack_segment_path(number,fpath);
+  pack_segment *segment = calloc(1,sizeof(pack_segment));
+  if (segment==NULL) return -ENOMEM;
+  segment->number = number;
+  segment->fd = open(fpath,O_RDONLY);
+  if (segment->fd<0) {
+    free(segment);
+    return -errno;
+  }
+  struct stat st;
+  int rc = sfs_read_header(pack_store,segment->fd,&segment->header);
+  if (rc==0 && fstat(segment->fd,&st)<0) rc = -errno;
+  size_t n = rc==0 && st.st_size>SFS_HEADER ? (size_t)(st.st_size-SFS_HEADER) : 0;
+  unsigned char *buf = n>0 ? malloc(n) : NULL;
+  if (n>0 && buf==NULL) rc = -ENOMEM;
+  if (rc==0 && n>0) {
+    uint64_t sys = stats_clock();
+    ssize_t got = pread(segment->fd,buf,n,SFS_HEADER);
+    stats_record(STATS_SYS_PREAD,sys,got,got>0 ? got : 0);
+    if (got<0) rc = -errno;
+    else n = got;
+  }
+  if (rc<0) {
+    free(buf);
+    pack_segment_close(segment,0);
+    return rc;
+  }
+  if (n>0) {
+    uint64_t cipher = stats_clock();
+    sfs_decipher(pack_store,&segment->header,0,buf,n);
+    stats_record(STATS_DECIPHER,cipher,0,n);
+  }
+  size_t off = 0;
+  char path[PATH_MAX];
+  while (off+PACK_RECORD<=n) {
+    unsigned char *rec = &buf[off];
+    uint32_t len = get32(rec);
+    uint32_t size = get32(&rec[28]);
+    uint16_t plen = get16(&rec[56]);
+    int type = rec[58];
+    if (len<PACK_RECORD || len>n-off || plen==0 || plen>=PATH_MAX || size>PACK_LIMIT) break;
+    if ((type!=PACK_FILE && type!=PACK_REMOVAL) || len!=PACK_RECORD+plen+(type==PACK_FILE ? size : 0)) break;
+    if (get32(&rec[4])!=pack_hash(&rec[8],len-8)) break;
+    uint64_t seq = get64(&rec[8]);
+    memcpy(path,&rec[PACK_RECORD],plen);
+    path[plen] = 0;
+    if (seq>pack_seq) pack_seq = seq;
+    pack_entry *entry = pack_find(path);
+    if (entry==NULL) {
+      entry = calloc(1,sizeof(pack_entry));
+      if (entry!=NULL && (entry->path = strdup(path))!=NULL && pack_insert(entry)==0) {
+        entry->removed = 1;
+      } else {
+        if (entry!=NULL) free(entry->path);
+        free(entry);
+        entry = NULL;
+        rc = -ENOMEM;
+      }
+    }
+    if (entry!=NULL && entry->seq<=seq) {
+      // removed entries stay in the index until every segment is read so an older record cannot bring them back
+      pack_forget(entry);
+      entry->seq = seq;
+      entry->removed = type==PACK_REMOVAL;
+      if (type==PACK_FILE) {
+        entry->mode = get32(&rec[16]);
+        entry->uid = get32(&rec[20]);
+        entry->gid = get32(&rec[24]);
+        entry->size = size;
+        entry->atime = get64(&rec[32]);
+        entry->mtime = get64(&rec[40]);
+        entry->ctime = get64(&rec[48]);
+        entry->segment = segment;
+        entry->offset = off;
+        entry->length = len;
+        segment->live += len;
+      }
+    }
+    off += len;
+  }
+  if (buf!=NULL) {
+    memset(buf,0,n);
+    free(buf);
+  }
+  segment->bytes = off;
+  segment->next = pack_segments;
+  pack_segments = segment;
+  if (number>pack_last) pack_last = number;
+  return rc;
+}
+
+static int pack_numbers(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x<y ? -1 : x>y;
+}
+
+static int pack_load_index(void) {
+  char fpath[PATH_MAX];
+  sfs_resolve(pack_store,PACK_DIR,fpath);
+  if (mkdir(fpath,0700)<0 && errno!=EEXIST) return -errno;
+  struct stat st;
+  if (stat(fpath,&st)<0) return -errno;
+  pack_dev = st.st_dev;
+  DIR *dp = opendir(fpath);
+  if (dp==NULL) return -errno;
+  uint32_t *numbers = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  int rc = 0;
+  struct dirent *dent;
+  while (rc==0 && (dent = readdir(dp))!=NULL) {
+    char *end;
+    unsigned long number = strtoul(dent->d_name,&end,16);
+    if (strlen(dent->d_name)!=8 || *end!=0) continue;
+    if (count==capacity) {
+      capacity = capacity ? capacity*2 : 64;
+      uint32_t *grown = realloc(numbers,capacity*sizeof(uint32_t));
+      if (grown==NULL) rc = -ENOMEM;
+      else numbers = grown;
+    }
+    if (rc==0) numbers[count++] = number;
+  }
+  closedir(dp);
+  if (count>0) qsort(numbers,count,sizeof(uint32_t),pack_numbers);
+  for(size_t i=0; rc==0 && i<count; i++) rc = pack_replay(numbers[i]);
+  free(numbers);
+  // a file moved out to a backing file just before a crash is kept there rather than in its record
+  for(size_t i=0; i<pack_buckets; i++) {
+    pack_entry *entry = pack_table[i];
+    while (entry!=NULL) {
+      pack_entry *next = entry->next;
+      sfs_resolve(pack_store,entry->path,fpath);
+      if (entry->removed || lstat(fpath,&st)==0) {
+        pack_forget(entry);
+        pack_delete(entry);
+        pack_free(entry);
+      } else {
+        entry->ino = ++pack_ino;
+      }
+      entry = next;
+    }
+  }
+  return rc;
+}
+
+static int pack_copy_out(pack_copy* copies, size_t count, uint32_t first, pack_segment** out) {
+  // every listed record is copied as it is, so it keeps its sequence number, into as many segments as it takes
+  unsigned char *rec = malloc(PACK_RECORD+PATH_MAX+PACK_LIMIT);
+  if (rec==NULL) return -ENOMEM;
+  pack_segment *segment = NULL;
+  uint32_t number = first;
+  int rc = 0;
+  for(size_t i=0; rc==0 && i<count; i++) {
+    pack_copy *copy = &copies[i];
+    if (segment==NULL || segment->bytes>=PACK_SEGMENT) {
+      if (segment!=NULL) rc = pack_sync(segment->fd);
+      if (rc==0) segment = pack_segment_create(number++,&rc);
+      if (segment==NULL) break;
+      segment->next = *out;
+      *out = segment;
+    }
+    uint64_t sys = stats_clock();
+    ssize_t got = pread(copy->segment->fd,rec,copy->length,SFS_HEADER+copy->offset);
+    stats_record(STATS_SYS_PREAD,sys,got,got>0 ? got : 0);
+    if (got<0) rc = -errno;
+    else if ((size_t)got!=copy->length) rc = -EIO;
+    if (rc==0) {
+      uint64_t cipher = stats_clock();
+      sfs_decipher(pack_store,&copy->segment->header,copy->offset,rec,copy->length);
+      stats_record(STATS_DECIPHER,cipher,0,copy->length);
+      rc = pack_put(segment,rec,copy->length,&copy->moved);
+      copy->to = segment;
+    }
+  }
+  if (rc==0 && segment!=NULL) rc = pack_sync(segment->fd);
+  memset(rec,0,PACK_RECORD+PATH_MAX+PACK_LIMIT);
+  free(rec);
+  return rc;
+}
+
+static void pack_compact(void) {
+  // with the lock, the active segment is sealed and the live records in all segments are listed
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_compacting = 1;
+  if (pack_active!=NULL) {
+    pack_sync(pack_active->fd);
+    pack_active = NULL;
+  }
+  pack_segment *old = pack_segments;
+  pack_segments = NULL;
+  pack_copy *copies = calloc(pack_count>0 ? pack_count : 1,sizeof(pack_copy));
+  size_t count = 0;
+  int rc = copies==NULL ? -ENOMEM : 0;
+  uint64_t bytes = 0;
+  for(size_t i=0; rc==0 && i<pack_buckets; i++) {
+    for(pack_entry *entry=pack_table[i]; rc==0 && entry!=NULL; entry=entry->next) {
+      if (entry->segment==NULL) continue;
+      bytes += entry->length;
+      pack_copy *copy = &copies[count];
+      copy->path = strdup(entry->path);
+      if (copy->path==NULL) rc = -ENOMEM;
+      copy->segment = entry->segment;
+      copy->offset = entry->offset;
+      copy->length = entry->length;
+      if (rc==0) count++;
+    }
+  }
+  // a numbered range is kept for the copies so they never clash with a segment started meanwhile
+  // every output segment but the last holds at least PACK_SEGMENT bytes
+  uint32_t first = pack_last+1;
+  pack_last += bytes/PACK_SEGMENT+1;
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  // without the lock, the old segments are only read and the new ones are not yet known
+  pack_segment *out = NULL;
+  if (rc==0) rc = pack_copy_out(copies,count,first,&out);
+  // with the lock again, entries whose record was copied point at the copy and the old segments go
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  if (rc==0) {
+    for(size_t i=0; i<count; i++) {
+      pack_entry *entry = pack_find(copies[i].path);
+      if (entry!=NULL && entry->segment==copies[i].segment && entry->offset==copies[i].offset) {
+        entry->segment = copies[i].to;
+        entry->offset = copies[i].moved;
+        copies[i].to->live += copies[i].length;
+      }
+    }
+  }
+  pack_segment *keep = rc==0 ? out : old;
+  pack_segment *drop = rc==0 ? old : out;
+  while (keep!=NULL) {
+    pack_segment *next = keep->next;
+    keep->next = pack_segments;
+    pack_segments = keep;
+    keep = next;
+  }
+  while (drop!=NULL) {
+    pack_segment *next = drop->next;
+    pack_segment_close(drop,1);
+    drop = next;
+  }
+  pack_sync_dir();
+  pack_compacting = 0;
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  for(size_t i=0; i<count; i++) free(copies[i].path);
+  free(copies);
+}
+
+static void* pack_compactor(void *arg) {
+  // like the header pool filler the compactor waits holding the lock directly so the wait is not profiled
+  pthread_mutex_lock(&mutexpack);
+  while (!pack_stopping) {
+    if (!pack_wasteful()) {
+      pthread_cond_wait(&pack_waste,&mutexpack);
+      continue;
+    }
+    pthread_mutex_unlock(&mutexpack);
+    pack_compact();
+    pthread_mutex_lock(&mutexpack);
+  }
+  pthread_mutex_unlock(&mutexpack);
+  return NULL;
+}
+
+int pack_start(sfs_store* store, pack_moved moved) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_store = store;
+  pack_callback = moved;
+  pack_stopping = 0;
+  pack_buckets = 1024;
+  pack_dir_buckets = 256;
+  pack_table = calloc(pack_buckets,sizeof(pack_entry*));
+  pack_dirs = calloc(pack_dir_buckets,sizeof(pack_dir*));
+  int rc = pack_table==NULL || pack_dirs==NULL ? -ENOMEM : pack_load_index();
+  if (rc==0) {
+    rc = -pthread_create(&pack_thread,NULL,pack_compactor,NULL);
+    pack_running = (rc==0);
+  }
+  pack_wake();
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+void pack_stop(void) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  int running = pack_running;
+  pack_stopping = 1;
+  pack_running = 0;
+  pthread_cond_signal(&pack_waste);
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  if (running) pthread_join(pack_thread,NULL);
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  for(size_t i=0; i<pack_buckets; i++) {
+    pack_entry *entry = pack_table[i];
+    while (entry!=NULL) {
+      pack_entry *next = entry->next;
+      if (entry->dirty) pack_record(entry);
+      entry = next;
+    }
+  }
+  if (pack_active!=NULL) pack_sync(pack_active->fd);
+  pack_active = NULL;
+  if (pack_created) pack_sync_dir();
+  while (pack_segments!=NULL) {
+    pack_segment *next = pack_segments->next;
+    pack_segment_close(pack_segments,0);
+    pack_segments = next;
+  }
+  for(size_t i=0; i<pack_buckets; i++) {
+    while (pack_table[i]!=NULL) {
+      pack_entry *entry = pack_table[i];
+      pack_delete(entry);
+      pack_free(entry);
+    }
+  }
+  free(pack_table);
+  free(pack_dirs);
+  pack_table = NULL;
+  pack_dirs = NULL;
+  pack_buckets = 0;
+  pack_dir_buckets = 0;
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+}
+
+int pack_stat(const char* path, struct stat* st) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry *entry = pack_find(path);
+  if (entry!=NULL && st!=NULL) pack_fill(entry,st);
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return entry!=NULL;
+}
+
+int pack_list(const char* dir, int (*add)(void* ctx, const char* name, const struct stat* st), void* ctx) {
+  struct stat st;
+  int rc = 0;
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_dir *folder = pack_find_dir(dir,strlen(dir));
+  for(pack_entry *entry=folder!=NULL ? folder->first : NULL; rc==0 && entry!=NULL; entry=entry->sibling) {
+    pack_fill(entry,&st);
+    if (add(ctx,strrchr(entry->path,'/')+1,&st)!=0) rc = -ENOMEM;
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+int pack_children(const char* dir) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_dir *folder = pack_find_dir(dir,strlen(dir));
+  int count = folder!=NULL ? (int)folder->count : 0;
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return count;
+}
+
+int pack_create(const char* path, mode_t mode, int fh, pack_entry** created) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  // a create over a packed file truncates it like an open with O_TRUNC
+  pack_entry *entry = pack_find(path);
+  int rc = 0;
+  if (entry!=NULL) {
+    rc = pack_hold(entry);
+    if (rc==0) rc = pack_handle(entry,fh);
+    if (rc==0) {
+      entry->size = 0;
+      pack_touch(entry);
+    }
+  } else {
+    entry = calloc(1,sizeof(pack_entry));
+    if (entry==NULL) rc = -ENOMEM;
+    if (rc==0 && ((entry->path = strdup(path))==NULL || (entry->data = calloc(1,PACK_LIMIT))==NULL)) rc = -ENOMEM;
+    if (rc==0) rc = pack_handle(entry,fh);
+    if (rc==0) rc = pack_insert(entry);
+    if (rc<0 && entry!=NULL) {
+      pack_free(entry);
+      entry = NULL;
+    }
+    if (rc==0) {
+      // the first record is written on release or fsync so a create and its writes cost one
+      entry->mode = S_IFREG | (mode & 07777);
+      entry->uid = getuid();
+      entry->gid = getgid();
+      entry->ino = ++pack_ino;
+      pack_touch(entry);
+      entry->atime = entry->mtime;
+    }
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  *created = rc==0 ? entry : NULL;
+  return rc<0 ? rc : 1;
+}
+
+pack_entry* pack_open(const char* path, int fh, int truncate) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry *entry = pack_find(path);
+  int rc = entry==NULL ? -ENOENT : pack_hold(entry);
+  if (rc==0) rc = pack_handle(entry,fh);
+  if (rc==0 && truncate && entry->size>0) {
+    entry->size = 0;
+    pack_touch(entry);
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  errno = -rc;
+  return rc==0 ? entry : NULL;
+}
+
+ssize_t pack_read(pack_entry* entry, unsigned char* data, size_t size, off_t ofs, int* moved) {
+  ssize_t rc = 0;
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  *moved = entry->moved;
+  if (!entry->moved && ofs<entry->size) {
+    rc = entry->size-ofs<(off_t)size ? entry->size-ofs : (off_t)size;
+    memcpy(data,&entry->data[ofs],rc);
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+ssize_t pack_write(pack_entry* entry, const unsigned char* data, size_t size, off_t ofs, int* moved) {
+  ssize_t rc = 0;
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  if (!entry->moved && ofs+(off_t)size>PACK_LIMIT) rc = pack_move_locked(entry);
+  *moved = entry->moved;
+  if (!entry->moved && rc==0) {
+    if (ofs>entry->size) memset(&entry->data[entry->size],0,ofs-entry->size);
+    memcpy(&entry->data[ofs],data,size);
+    if (ofs+size>entry->size) entry->size = ofs+size;
+    pack_touch(entry);
+    rc = size;
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+static void pack_resize(pack_entry* entry, off_t size) {
+  if (size>entry->size) memset(&entry->data[entry->size],0,size-entry->size);
+  entry->size = size;
+  pack_touch(entry);
+}
+
+int pack_ftruncate(pack_entry* entry, off_t size, int* moved) {
+  int rc = 0;
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  if (!entry->moved && size>PACK_LIMIT) rc = pack_move_locked(entry);
+  *moved = entry->moved;
+  if (!entry->moved && rc==0) pack_resize(entry,size);
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+int pack_fstat(pack_entry* entry, struct stat* st) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  int packed = !entry->moved;
+  if (packed) pack_fill(entry,st);
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return packed;
+}
+
+int pack_fsync(pack_entry* entry, int* moved) {
+  int rc = 0;
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  *moved = entry->moved;
+  if (!entry->moved && !entry->removed) {
+    if (entry->dirty) rc = pack_record(entry);
+    // a sealed segment was synced when it filled
+    if (rc==0 && entry->segment!=NULL && entry->segment==pack_active) rc = pack_sync(pack_active->fd);
+    if (rc==0 && pack_created) pack_sync_dir();
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+int pack_move(pack_entry* entry) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  int rc = pack_move_locked(entry);
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+void pack_release(pack_entry* entry, int fh) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  for(int i=0; i<entry->handle_count; i++) {
+    if (entry->handles[i]==fh) {
+      entry->handles[i] = entry->handles[--entry->handle_count];
+      break;
+    }
+  }
+  if (--entry->refs==0) {
+    // the plain text stays held if its record could not be written so it is tried again
+    if (!entry->removed && entry->dirty) pack_record(entry);
+    if (entry->removed) pack_free(entry);
+    else pack_unhold(entry);
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+}
+
+int pack_unlink(const char* path) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry *entry = pack_find(path);
+  int rc = entry==NULL ? 0 : pack_removal(path);
+  if (entry!=NULL && rc==0) {
+    pack_drop(entry);
+    rc = 1;
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc;
+}
+
+static int pack_rename_locked(pack_entry* entry, const char* path2) {
+  // the record under the new path is written before the removal of the old one
+  char *path = entry->path;
+  char *renamed = strdup(path2);
+  if (renamed==NULL) return -ENOMEM;
+  int held = entry->data!=NULL;
+  int rc = pack_hold(entry);
+  pack_entry *target = pack_find(path2);
+  if (rc==0) {
+    pack_delete(entry);
+    entry->path = renamed;
+    rc = pack_insert(entry);
+    if (rc<0) {
+      entry->path = path;
+      pack_insert(entry);
+    }
+  }
+  if (rc==0) {
+    entry->ctime = time(NULL);
+    rc = pack_record(entry);
+    if (rc<0) {
+      pack_delete(entry);
+      entry->path = path;
+      pack_insert(entry);
+    }
+  }
+  if (rc==0) {
+    pack_removal(path);
+    if (target!=NULL) pack_drop(target);
+    free(path);
+  } else {
+    free(renamed);
+  }
+  if (!held) pack_unhold(entry);
+  return rc;
+}
+
+int pack_rename(const char* path, const char* path2) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry *entry = pack_find(path);
+  int rc = 0;
+  if (entry!=NULL && strcmp(path,path2)) rc = pack_rename_locked(entry,path2);
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc<0 ? rc : entry!=NULL;
+}
+
+int pack_rename_dir(const char* path, const char* path2) {
+  // the packed files anywhere below a renamed folder follow it
+  size_t length = strlen(path);
+  int rc = 0;
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry **moving = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  for(size_t i=0; rc==0 && i<pack_dir_buckets; i++) {
+    for(pack_dir *dir=pack_dirs[i]; rc==0 && dir!=NULL; dir=dir->next) {
+      if (dir->length<length || memcmp(dir->path,path,length) || (dir->length>length && dir->path[length]!='/')) continue;
+      for(pack_entry *entry=dir->first; rc==0 && entry!=NULL; entry=entry->sibling) {
+        if (count==capacity) {
+          capacity = capacity ? capacity*2 : 64;
+          pack_entry **grown = realloc(moving,capacity*sizeof(pack_entry*));
+          if (grown==NULL) rc = -ENOMEM;
+          else moving = grown;
+        }
+        if (rc==0) moving[count++] = entry;
+      }
+    }
+  }
+  // every new name must fit before any file moves, so a name too long leaves the folder as it was
+  char renamed[PATH_MAX];
+  for(size_t i=0; rc==0 && i<count; i++) {
+    if (snprintf(renamed,sizeof(renamed),"%s%s",path2,&moving[i]->path[length])>=(int)sizeof(renamed)) rc = -ENAMETOOLONG;
+  }
+  for(size_t i=0; rc==0 && i<count; i++) {
+    snprintf(renamed,sizeof(renamed),"%s%s",path2,&moving[i]->path[length]);
+    rc = pack_rename_locked(moving[i],renamed);
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  free(moving);
+  return rc;
+}
+
+static int pack_change(const char* path, int what, uint32_t a, uint32_t b, int64_t c, int64_t d) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry *entry = pack_find(path);
+  int rc = 0;
+  if (entry!=NULL) {
+    if (what==0) entry->mode = S_IFREG | (a & 07777);
+    if (what==1 && a!=(uint32_t)-1) entry->uid = a;
+    if (what==1 && b!=(uint32_t)-1) entry->gid = b;
+    if (what==2) {
+      entry->atime = c;
+      entry->mtime = d;
+    }
+    entry->ctime = time(NULL);
+    rc = pack_record(entry);
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc<0 ? rc : entry!=NULL;
+}
+
+int pack_chmod(const char* path, mode_t mode) {
+  return pack_change(path,0,mode,0,0,0);
+}
+
+int pack_chown(const char* path, uid_t uid, gid_t gid) {
+  return pack_change(path,1,uid,gid,0,0);
+}
+
+int pack_utime(const char* path, time_t atime, time_t mtime) {
+  return pack_change(path,2,0,0,atime,mtime);
+}
+
+int pack_truncate(const char* path, off_t size) {
+  // returns 0 once a file that grows past the limit has been moved to a backing file for the caller to truncate
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry *entry = pack_find(path);
+  int rc = 0;
+  if (entry!=NULL && size>PACK_LIMIT) {
+    rc = pack_move_locked(entry);
+    entry = NULL;
+  } else if (entry!=NULL) {
+    int held = entry->data!=NULL;
+    rc = pack_hold(entry);
+    if (rc==0) {
+      pack_resize(entry,size);
+      rc = pack_record(entry);
+    }
+    if (!held) pack_unhold(entry);
+  }
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc<0 ? rc : entry!=NULL;
+}
+
+int pack_promote(const char* path) {
+  lockprof_lock(&mutexpack,LOCK_PACK);
+  pack_entry *entry = pack_find(path);
+  int rc = entry!=NULL ? pack_move_locked(entry) : 0;
+  lockprof_unlock(&mutexpack,LOCK_PACK);
+  return rc<0 ? rc : entry!=NULL;
+}
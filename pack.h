@@ -0,0 +1,72 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// a -pack mount keeps files no larger than a limit as records appended to shared segment files,
+// each segment is an ordinary store file so the records are enciphered with its header
+#define PACK_LIMIT 4096
+#define PACK_DIR "/.safefs-pack"
+// a segment takes no more records once it holds this much
+#define PACK_SEGMENT 4194304
+// a record is this fixed part followed by the path and the plain text of the file
+#define PACK_RECORD 60
+// packed files get inode numbers from here up so they never meet those of backing files
+#define PACK_INO 0x4000000000000000ULL
+
+struct pack_segment;
+
+// every packed file has an entry in the index, handles on it share the entry
+typedef struct pack_entry {
+  char *path;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t size;
+  int64_t atime;
+  int64_t mtime;
+  int64_t ctime;
+  uint64_t seq;                   // of the last record written for the entry
+  uint64_t ino;
+  struct pack_segment *segment;   // holding the last record or NULL before the first one is written
+  uint32_t offset;
+  uint32_t length;
+  unsigned char *data;            // plain text held while the file is open
+  int dirty;                      // the held plain text or attributes are newer than the record
+  int removed;                    // no longer in the index, freed with its last handle
+  int moved;                      // outgrew the limit, its handles now refer to a backing file
+  int refs;
+  int *handles;
+  int handle_count;
+  int handle_capacity;
+  struct pack_entry *next;        // in the path table
+  struct pack_entry *sibling;     // in the folder list
+  struct pack_entry *prev_sibling;
+} pack_entry;
+
+// called for every handle on a file that has just been moved out to a backing file of its own
+typedef void (*pack_moved)(int fh, const sfs_header* header);
+
+int pack_start(sfs_store* store, pack_moved moved);
+void pack_stop(void);
+int pack_stat(const char* path, struct stat* st);
+int pack_list(const char* dir, int (*add)(void* ctx, const char* name, const struct stat* st), void* ctx);
+int pack_children(const char* dir);
+int pack_create(const char* path, mode_t mode, int fh, pack_entry** entry);
+pack_entry* pack_open(const char* path, int fh, int truncate);
+ssize_t pack_read(pack_entry* entry, unsigned char* data, size_t size, off_t ofs, int* moved);
+ssize_t pack_write(pack_entry* entry, const unsigned char* data, size_t size, off_t ofs, int* moved);
+int pack_ftruncate(pack_entry* entry, off_t size, int* moved);
+int pack_fstat(pack_entry* entry, struct stat* st);
+int pack_fsync(pack_entry* entry, int* moved);
+int pack_move(pack_entry* entry);
+void pack_release(pack_entry* entry, int fh);
+int pack_unlink(const char* path);
+int pack_rename(const char* path, const char* path2);
+int pack_rename_dir(const char* path, const char* path2);
+int pack_chmod(const char* path, mode_t mode);
+int pack_chown(const char* path, uid_t uid, gid_t gid);
+int pack_utime(const char* path, time_t atime, time_t mtime);
+int pack_truncate(const char* path, off_t size);
+int pack_promote(const char* path);
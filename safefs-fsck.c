@@ -0,0 +1,371 @@
+/*
+ * Check every file header of a safefs store without mounting it.
+ *
+ * Folders are shared out to a pool of threads as they are found, so a wide or deep tree keeps every
+ * core busy while it is still being walked. Each thread opens the files of a folder in batches,
+ * asks the kernel to read all of their headers ahead, then reads and decodes the batch together.
+ * A header is good when its decoded rotor is a permutation of the 256 byte values, so the reverse
+ * rotor derived from it covers every value. Files too short to hold a header are reported too.
+ *
+ * The scrub runs at a low priority and asks for its reads not to displace the pages of a live mount,
+ * so it can be run against a mounted store. It only reads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "sfs.h"
+
+// files of one folder are opened and read ahead this many at a time
+#define FSCK_BATCH 64
+#define FSCK_JOURNAL "/.safefs-rekey"
+
+typedef struct fsck_totals {
+  uint64_t files;
+  uint64_t folders;
+  uint64_t bytes;      // plain text of the files with a header
+  uint64_t short_files;
+  uint64_t bad;
+  uint64_t errors;
+  uint64_t other;      // links and special files, which hold no header
+} fsck_totals;
+
+static sfs_store store;
+static char **folders = NULL;
+static size_t folder_count = 0;
+static size_t folder_capacity = 0;
+static int busy = 0;               // threads walking a folder, which may still queue more
+static uint64_t rate = 0;          // files a second across all threads or 0 for no limit
+static uint64_t claimed = 0;
+static struct timespec begin;
+static pthread_mutex_t mutexjob = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t condjob = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t mutexreport = PTHREAD_MUTEX_INITIALIZER;
+
+static void report(const char* what, const char* folder, const char* name, int error) {
+  // a problem is reported with the backing path, the name of a file is joined to its folder
+  const char *slash = *name && strcmp(folder,"/") ? "/" : "";
+  pthread_mutex_lock(&mutexreport);
+  if (error) fprintf(stderr,"Failed to %s [%s%s%s%s]: %s\n",what,store.rootdir,folder,slash,name,strerror(error));
+  else fprintf(stderr,"%s [%s%s%s%s]\n",what,store.rootdir,folder,slash,name);
+  pthread_mutex_unlock(&mutexreport);
+}
+
+static int push_folder(const char* path) {
+  char *copy = strdup(path);
+  if (copy==NULL) return -ENOMEM;
+  pthread_mutex_lock(&mutexjob);
+  if (folder_count==folder_capacity) {
+    size_t capacity = folder_capacity ? folder_capacity*2 : 1024;
+    char **grown = realloc(folders,capacity*sizeof(char*));
+    if (grown==NULL) {
+      pthread_mutex_unlock(&mutexjob);
+      free(copy);
+      return -ENOMEM;
+    }
+    folders = grown;
+    folder_capacity = capacity;
+  }
+  folders[folder_count++] = copy;
+  pthread_cond_signal(&condjob);
+  pthread_mutex_unlock(&mutexjob);
+  return 0;
+}
+
+static char* pop_folder(void) {
+  // the walk is over once the queue is empty and no thread is left that could add to it
+  pthread_mutex_lock(&mutexjob);
+  while (folder_count==0 && busy>0) pthread_cond_wait(&condjob,&mutexjob);
+  char *path = NULL;
+  if (folder_count>0) {
+    path = folders[--folder_count];
+    busy++;
+  } else {
+    pthread_cond_broadcast(&condjob);
+  }
+  pthread_mutex_unlock(&mutexjob);
+  return path;
+}
+
+static void done_folder(void) {
+  pthread_mutex_lock(&mutexjob);
+  if (--busy==0 && folder_count==0) pthread_cond_broadcast(&condjob);
+  pthread_mutex_unlock(&mutexjob);
+}
+
+static void throttle(int count) {
+  // with -r the threads share one budget of files a second counted from the start of the scrub
+  if (rate==0) return;
+  pthread_mutex_lock(&mutexjob);
+  claimed += count;
+  uint64_t due = claimed*1000000/rate;
+  pthread_mutex_unlock(&mutexjob);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  uint64_t spent = (now.tv_sec-begin.tv_sec)*1000000+(now.tv_nsec-begin.tv_nsec)/1000;
+  if (due>spent) usleep(due-spent);
+}
+
+static void read_ahead(int fd) {
+  // the header reads of a batch are started together so a cold store is read with many requests in flight
+#if defined(__APPLE__)
+  struct radvisory advice = { 0, SFS_HEADER };
+  fcntl(fd,F_RDADVISE,&advice);
+#elif defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd,0,SFS_HEADER,POSIX_FADV_WILLNEED);
+#endif
+}
+
+static void read_once(int fd) {
+  // a page read only for the scrub should be the first to go, not the pages a live mount is using
+#if defined(__APPLE__)
+  fcntl(fd,F_NOCACHE,1);
+#elif defined(POSIX_FADV_NOREUSE)
+  posix_fadvise(fd,0,SFS_HEADER,POSIX_FADV_NOREUSE);
+#endif
+}
+
+static int rotor_is_permutation(const sfs_header* header) {
+  unsigned char seen[256];
+  memset(seen,0,sizeof(seen));
+  for(int i=0; i<256; i++) seen[header->f_ring[i]] = 1;
+  for(int i=0; i<256; i++) {
+    if (!seen[i] || header->r_ring[header->f_ring[i]]!=i) return 0;
+  }
+  return 1;
+}
+
+static void check_batch(int dir, const char* folder, char names[][NAME_MAX+1], int count, fsck_totals* totals) {
+  int fds[FSCK_BATCH];
+  unsigned char raw[FSCK_BATCH][SFS_HEADER];
+  sfs_header headers[FSCK_BATCH];
+  int ready[FSCK_BATCH];
+  throttle(count);
+  for(int i=0; i<count; i++) {
+    int flags = O_RDONLY | O_NOFOLLOW;
+#ifdef O_NOATIME
+    flags |= O_NOATIME;
+#endif
+    fds[i] = openat(dir,names[i],flags);
+#ifdef O_NOATIME
+    // only the owner of a file may open it without updating its access time
+    if (fds[i]<0 && errno==EPERM) fds[i] = openat(dir,names[i],flags & ~O_NOATIME);
+#endif
+    struct stat st;
+    if (fds[i]<0) {
+      report("open",folder,names[i],errno);
+      totals->errors++;
+    } else if (fstat(fds[i],&st)<0) {
+      report("stat",folder,names[i],errno);
+      totals->errors++;
+    } else if (st.st_size<SFS_HEADER) {
+      report("Short file",folder,names[i],0);
+      totals->short_files++;
+    } else {
+      totals->bytes += sfs_plain_size(st.st_size);
+      read_once(fds[i]);
+      read_ahead(fds[i]);
+      continue;
+    }
+    if (fds[i]>=0) close(fds[i]);
+    fds[i] = -1;
+  }
+  int n = 0;
+  for(int i=0; i<count; i++) {
+    if (fds[i]<0) continue;
+    ssize_t len = pread(fds[i],raw[n],SFS_HEADER,0);
+    if (len<0) report("read",folder,names[i],errno);
+    else if (len!=SFS_HEADER) report("read",folder,names[i],EIO);
+    if (len==SFS_HEADER) ready[n++] = i;
+    else totals->errors++;
+    close(fds[i]);
+  }
+  // the digests of the whole batch are derived in one multi-buffer pass
+  sfs_decode_headers(&store,raw,headers,n);
+  for(int i=0; i<n; i++) {
+    if (rotor_is_permutation(&headers[i])) continue;
+    report("Bad header",folder,names[ready[i]],0);
+    totals->bad++;
+  }
+  totals->files += count;
+  memset(raw,0,sizeof(raw));
+  memset(headers,0,sizeof(headers));
+}
+
+static void check_folder(const char* folder, fsck_totals* totals, char names[][NAME_MAX+1]) {
+  char fpath[PATH_MAX];
+  if (sfs_resolve(&store,folder,fpath)<0) {
+    report("open folder",folder,"",ENAMETOOLONG);
+    totals->errors++;
+    return;
+  }
+  int dir = open(fpath,O_RDONLY | O_DIRECTORY);
+  DIR *dp = dir<0 ? NULL : fdopendir(dir);
+  if (dp==NULL) {
+    report("open folder",folder,"",errno);
+    totals->errors++;
+    if (dir>=0) close(dir);
+    return;
+  }
+  totals->folders++;
+  const char *prefix = strcmp(folder,"/") ? folder : "";
+  int count = 0;
+  struct dirent *dent;
+  while ((dent = readdir(dp))!=NULL) {
+    if (!strcmp(dent->d_name,".") || !strcmp(dent->d_name,"..")) continue;
+    // the pin check file and a rekey journal are not store files
+    if (!*prefix && (!strcmp(dent->d_name,".safefs") || !strcmp(dent->d_name,&FSCK_JOURNAL[1]))) continue;
+    int type = dent->d_type;
+    if (type==DT_UNKNOWN) {
+      struct stat st;
+      if (fstatat(dir,dent->d_name,&st,AT_SYMLINK_NOFOLLOW)<0) {
+        report("stat",folder,dent->d_name,errno);
+        totals->errors++;
+        continue;
+      }
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+    }
+    if (type==DT_DIR) {
+      char child[PATH_MAX];
+      if (snprintf(child,sizeof(child),"%s/%s",prefix,dent->d_name)>=(int)sizeof(child)) {
+        report("queue",folder,dent->d_name,ENAMETOOLONG);
+        totals->errors++;
+      } else if (push_folder(child)<0) {
+        report("queue",child,"",ENOMEM);
+        totals->errors++;
+      }
+    } else if (type==DT_REG) {
+      strcpy(names[count++],dent->d_name);
+      if (count==FSCK_BATCH) {
+        check_batch(dir,folder,names,count,totals);
+        count = 0;
+      }
+    } else {
+      totals->other++;
+    }
+  }
+  if (count>0) check_batch(dir,folder,names,count,totals);
+  closedir(dp);
+}
+
+static void* worker(void *arg) {
+  fsck_totals *totals = arg;
+  char (*names)[NAME_MAX+1] = malloc(FSCK_BATCH*sizeof(*names));
+  char *folder;
+  while ((folder = pop_folder())!=NULL) {
+    if (names==NULL) {
+      report("check folder",folder,"",ENOMEM);
+      totals->errors++;
+    } else {
+      check_folder(folder,totals,names);
+    }
+    free(folder);
+    done_folder();
+  }
+  free(names);
+  return NULL;
+}
+
+static void read_pin(const char* env, const char* prompt, char pin[11]) {
+  char *pwd = getenv(env);
+  if (pwd==NULL) {
+    pwd = getpass(prompt);
+  }
+  if (strlen(pwd)!=10) {
+    memset(pwd,0,strlen(pwd));
+    fprintf(stderr,"Invalid pin code length\n");
+    exit(1);
+  }
+  strcpy(pin,pwd);
+  memset(pwd,0,strlen(pwd));
+}
+
+int main(int argc, char** argv) {
+
+  // interpret the command line options
+  int rounds = 5;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char storage[PATH_MAX];
+  memset(storage,0,sizeof(storage));
+  for(int i=1; i<argc; i++) {
+    if (!strcmp("-3",argv[i])) { rounds = 3; }
+    else if (!strcmp("-5",argv[i])) { rounds = 5; }
+    else if (!strcmp("-8",argv[i])) { rounds = 8; }
+    else if (strlen(argv[i])>2 && !(memcmp("-j",argv[i],2))) threads = atoi(&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-r",argv[i],2))) rate = strtoull(&argv[i][2],NULL,10);
+    else if (strlen(argv[i])>2 && !(memcmp("-s",argv[i],2))) strncpy(storage,&argv[i][2],sizeof(storage)-1);
+  }
+  if (strlen(storage)==0 || threads<1) {
+    fprintf(stderr,"Syntax: safefs-fsck [-3|-5|-8] [-j<threads>] [-r<files-per-second>] -s<file-system-storage-path>\n");
+    exit(1);
+  }
+
+  char pin[11];
+  read_pin("SAFEFS_PIN","Enter the 10-digit pin code:",pin);
+  char root[PATH_MAX];
+  if (realpath(storage,root)==NULL) {
+    perror("Failed to find the storage folder");
+    exit(1);
+  }
+  int rc = sfs_store_open(&store,root,pin,rounds);
+  memset(pin,0,sizeof(pin));
+  if (rc==-EACCES) {
+    fprintf(stderr,"Incorrect pin code provided\n");
+    exit(1);
+  } else if (rc<0) {
+    errno = -rc;
+    perror("Failed to open the storage folder and its .safefs");
+    exit(1);
+  }
+
+  // a live mount keeps its share of the disk and the processors
+#ifdef __APPLE__
+  setiopolicy_np(IOPOL_TYPE_DISK,IOPOL_SCOPE_PROCESS,IOPOL_THROTTLE);
+#endif
+  setpriority(PRIO_PROCESS,0,10);
+
+  clock_gettime(CLOCK_MONOTONIC,&begin);
+  push_folder("/");
+  pthread_t *pool = calloc(threads,sizeof(pthread_t));
+  fsck_totals *totals = calloc(threads,sizeof(fsck_totals));
+  int started = 0;
+  for(int i=0; pool && totals && i<threads; i++) {
+    if (pthread_create(&pool[started],NULL,worker,&totals[started])==0) started++;
+  }
+  if (started==0) {
+    fprintf(stderr,"Failed to start worker threads\n");
+    exit(1);
+  }
+  fsck_totals sum;
+  memset(&sum,0,sizeof(sum));
+  for(int i=0; i<started; i++) {
+    pthread_join(pool[i],NULL);
+    sum.files += totals[i].files;
+    sum.folders += totals[i].folders;
+    sum.bytes += totals[i].bytes;
+    sum.short_files += totals[i].short_files;
+    sum.bad += totals[i].bad;
+    sum.errors += totals[i].errors;
+    sum.other += totals[i].other;
+  }
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  double seconds = (end.tv_sec-begin.tv_sec) + (end.tv_nsec-begin.tv_nsec)/1e9;
+  printf("Checked %llu files %llu bytes in %llu folders in %.3f seconds = %.0f files/s using %d threads, %llu short, %llu bad headers, %llu other, %llu errors\n",
+    (unsigned long long)sum.files,(unsigned long long)sum.bytes,(unsigned long long)sum.folders,seconds,seconds>0 ? sum.files/seconds : 0.0,started,
+    (unsigned long long)sum.short_files,(unsigned long long)sum.bad,(unsigned long long)sum.other,(unsigned long long)sum.errors);
+  free(pool);
+  free(totals);
+  return sum.short_files || sum.bad || sum.errors ? 1 : 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Offline bulk copy into and out of a safefs store without going through the FUSE mount.
+ *
+ * safefs-pack   copies a plain text tree into a store, writing a new salt and rotor header for each file
+ * safefs-unpack copies a store back out as plain text for restores and exports
+ *
+ * The source tree is walked first and then every file is split into large chunks that are
+ * enciphered or deciphered by a pool of threads, so a single large file still uses all cores.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "sfs.h"
+
+// each worker takes this much of a file at a time
+#define PACK_CHUNK 8388608
+#define PACK_BLOCK 4096
+
+typedef struct pack_file {
+  char *path;          // relative to both roots with a leading slash
+  mode_t mode;
+  time_t atime;
+  time_t mtime;
+  off_t size;          // plain text size
+  uint64_t chunks;
+  uint64_t done;
+  int state;           // 0 = not opened, 1 = open, -1 = failed to open
+  int error;           // errno of the first failure
+  int in_fd;
+  int out_fd;
+  unsigned char *map;
+  size_t map_size;
+  sfs_header header;
+  pthread_mutex_t mutex;
+} pack_file;
+
+static int unpack = 0;
+static sfs_store store;
+static char plainroot[PATH_MAX];
+static pack_file **files = NULL;
+static size_t file_count = 0;
+static size_t file_capacity = 0;
+static size_t next_file = 0;
+static uint64_t next_chunk = 0;
+static uint64_t total_bytes = 0;
+static int errors = 0;
+static pthread_mutex_t mutexjob = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail(const char* what, const char* path, int error) {
+  fprintf(stderr,"Failed to %s [%s]: %s\n",what,path,strerror(error));
+  pthread_mutex_lock(&mutexjob);
+  errors++;
+  pthread_mutex_unlock(&mutexjob);
+}
+
+static int plain_path(const char* path, char fpath[PATH_MAX]) {
+  int len = snprintf(fpath,PATH_MAX,"%s%s",plainroot,path);
+  if (len<0 || len>=PATH_MAX) return -ENAMETOOLONG;
+  // finder metadata is stored with a trailing dot
+  if (len>=11 && !strcmp("/.DS_Store.",&fpath[len-11])) fpath[len-1] = 0;
+  return 0;
+}
+
+static int source_path(const char* path, char fpath[PATH_MAX]) {
+  return unpack ? sfs_resolve(&store,path,fpath) : plain_path(path,fpath);
+}
+
+static int target_path(const char* path, char fpath[PATH_MAX]) {
+  return unpack ? plain_path(path,fpath) : sfs_resolve(&store,path,fpath);
+}
+
+static int add_file(const char* path, struct stat* st) {
+  if (file_count==file_capacity) {
+    size_t capacity = file_capacity ? file_capacity*2 : 1024;
+    pack_file **grown = realloc(files,capacity*sizeof(pack_file*));
+    if (grown==NULL) return -ENOMEM;
+    files = grown;
+    file_capacity = capacity;
+  }
+  pack_file *f = calloc(1,sizeof(pack_file));
+  if (f==NULL || (f->path = strdup(path))==NULL) {
+    free(f);
+    return -ENOMEM;
+  }
+  f->mode = st->st_mode & 07777;
+  f->atime = st->st_atime;
+  f->mtime = st->st_mtime;
+  f->size = unpack ? sfs_plain_size(st->st_size) : st->st_size;
+  // empty files still need one job so that they are created
+  f->chunks = f->size>0 ? (f->size+PACK_CHUNK-1)/PACK_CHUNK : 1;
+  f->in_fd = -1;
+  f->out_fd = -1;
+  pthread_mutex_init(&f->mutex,NULL);
+  files[file_count++] = f;
+  return 0;
+}
+
+static void walk(const char* path) {
+  char fpath[PATH_MAX];
+  if (source_path(path,fpath)<0) {
+    fail("open directory with a path that is too long",path,ENAMETOOLONG);
+    return;
+  }
+  DIR *dp = opendir(fpath);
+  if (dp==NULL) {
+    fail("open directory",fpath,errno);
+    return;
+  }
+  struct dirent *dent;
+  while ((dent = readdir(dp))!=NULL) {
+    if (!strcmp(dent->d_name,".") || !strcmp(dent->d_name,"..")) continue;
+    char child[PATH_MAX];
+    int len = snprintf(child,sizeof(child),"%s/%s",strcmp(path,"/") ? path : "",dent->d_name);
+    // the pin check file, an unfinished rekey journal and the warm set belong to the store and are never copied
+    if (!strcmp(child,"/.safefs") || !strcmp(child,"/.safefs-rekey") || !strcmp(child,"/.safefs-warm")) continue;
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    // a path cut short would be copied under the wrong name, so the walk checks every path the copy will use
+    if (len<0 || len>=PATH_MAX || source_path(child,from)<0 || target_path(child,to)<0) {
+      fail("copy file with a path that is too long",child,ENAMETOOLONG);
+      continue;
+    }
+    struct stat st;
+    if (lstat(from,&st)<0) {
+      fail("stat",from,errno);
+    } else if (S_ISDIR(st.st_mode)) {
+      if (mkdir(to,(st.st_mode&07777)|S_IRWXU)<0 && errno!=EEXIST) fail("create directory",to,errno);
+      else walk(child);
+    } else if (S_ISREG(st.st_mode)) {
+      if (unpack && st.st_size<SFS_HEADER) fail("unpack file without a header",from,EIO);
+      else if (add_file(child,&st)<0) fail("queue",from,ENOMEM);
+    } else if (S_ISLNK(st.st_mode)) {
+      // symbolic links are stored as plain links by the daemon
+      char link[PATH_MAX];
+      ssize_t len = readlink(from,link,sizeof(link)-1);
+      if (len<0) fail("read link",from,errno);
+      else {
+        link[len] = 0;
+        unlink(to);
+        if (symlink(link,to)<0) fail("create link",to,errno);
+      }
+    } else {
+      fprintf(stderr,"Skipping special file [%s]\n",from);
+    }
+  }
+  closedir(dp);
+}
+
+static int open_file(pack_file *f) {
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  // the walk checked both paths so neither is cut short here
+  if (source_path(f->path,from)<0 || target_path(f->path,to)<0) return -ENAMETOOLONG;
+  struct stat st;
+  f->in_fd = open(from,O_RDONLY);
+  if (f->in_fd<0) return -errno;
+  if (fstat(f->in_fd,&st)<0) return -errno;
+  off_t size = unpack ? sfs_plain_size(st.st_size) : st.st_size;
+  if (size!=f->size || (unpack && st.st_size<SFS_HEADER)) return -EAGAIN;
+  if (st.st_size>0) {
+    f->map_size = st.st_size;
+    f->map = mmap(NULL,f->map_size,PROT_READ,MAP_PRIVATE,f->in_fd,0);
+    if (f->map==MAP_FAILED) {
+      f->map = NULL;
+      return -errno;
+    }
+    madvise(f->map,f->map_size,MADV_SEQUENTIAL);
+  }
+  if (unpack) {
+    sfs_decode_header(&store,f->map,&f->header);
+    f->out_fd = open(to,O_CREAT | O_TRUNC | O_WRONLY,f->mode|S_IRUSR|S_IWUSR);
+    if (f->out_fd<0) return -errno;
+    if (ftruncate(f->out_fd,f->size)<0) return -errno;
+  } else {
+    f->out_fd = open(to,O_CREAT | O_TRUNC | O_WRONLY,f->mode|S_IRUSR|S_IWUSR);
+    if (f->out_fd<0) return -errno;
+    sfs_new_header(&store,&f->header);
+    int rc = sfs_write_header(f->out_fd,&f->header);
+    if (rc<0) return rc;
+    if (ftruncate(f->out_fd,sfs_backing_offset(f->size))<0) return -errno;
+  }
+  return 0;
+}
+
+static int prepare_file(pack_file *f) {
+  pthread_mutex_lock(&f->mutex);
+  if (f->state==0) {
+    int rc = open_file(f);
+    if (rc<0) {
+      f->error = -rc;
+      f->state = -1;
+    } else {
+      f->state = 1;
+    }
+  }
+  int state = f->state;
+  pthread_mutex_unlock(&f->mutex);
+  return state;
+}
+
+static void finish_file(pack_file *f, int error) {
+  pthread_mutex_lock(&f->mutex);
+  if (error && !f->error) f->error = error;
+  int last = ++f->done==f->chunks;
+  pthread_mutex_unlock(&f->mutex);
+  if (!last) return;
+  if (f->map) munmap(f->map,f->map_size);
+  if (f->in_fd>=0) close(f->in_fd);
+  if (f->out_fd>=0) {
+    struct timeval times[2] = { { f->atime, 0 }, { f->mtime, 0 } };
+    futimes(f->out_fd,times);
+    if (fchmod(f->out_fd,f->mode)<0 && !f->error) f->error = errno;
+    if (close(f->out_fd)<0 && !f->error) f->error = errno;
+  }
+  memset(&f->header,0,sizeof(sfs_header));
+  if (f->error) {
+    char from[PATH_MAX];
+    source_path(f->path,from);
+    if (f->error==EAGAIN) fail("copy file that changed size after the walk",from,EIO);
+    else fail(unpack ? "unpack" : "pack",from,f->error);
+  }
+}
+
+static int write_all(int fd, const unsigned char* data, size_t size, off_t ofs) {
+  while (size>0) {
+    ssize_t rc = pwrite(fd,data,size,ofs);
+    if (rc<0 && errno==EINTR) continue;
+    if (rc<0) return errno;
+    if (rc==0) return EIO;
+    data += rc;
+    size -= rc;
+    ofs += rc;
+  }
+  return 0;
+}
+
+static int write_nonzero(int fd, const unsigned char* data, size_t size, off_t ofs) {
+  // blocks of zeros are skipped so the holes of a sparse file survive the copy into the extended output
+  size_t pos = 0;
+  while (pos<size) {
+    size_t end = pos+PACK_BLOCK-(ofs+pos)%PACK_BLOCK;
+    if (end>size) end = size;
+    size_t i = pos;
+    while (i<end && data[i]==0) i++;
+    if (i<end) {
+      int error = write_all(fd,&data[pos],end-pos,ofs+pos);
+      if (error) return error;
+    }
+    pos = end;
+  }
+  return 0;
+}
+
+static void* worker(void *arg) {
+  unsigned char *buf = malloc(PACK_CHUNK);
+  uint64_t bytes = 0;
+  for(;;) {
+    // claim the next chunk of the current file
+    pthread_mutex_lock(&mutexjob);
+    if (buf==NULL || next_file>=file_count) {
+      pthread_mutex_unlock(&mutexjob);
+      break;
+    }
+    pack_file *f = files[next_file];
+    uint64_t chunk = next_chunk++;
+    if (next_chunk>=f->chunks) {
+      next_file++;
+      next_chunk = 0;
+    }
+    pthread_mutex_unlock(&mutexjob);
+    int error = 0;
+    if (prepare_file(f)>0 && f->size>0) {
+      off_t ofs = chunk*PACK_CHUNK;
+      size_t len = f->size-ofs<PACK_CHUNK ? f->size-ofs : PACK_CHUNK;
+      if (unpack && !sfs_backing_data(f->in_fd,sfs_backing_offset(ofs),sfs_backing_offset(ofs+len))) {
+        // a hole in the store is plain text zeros and the output was already extended over it
+      } else if (unpack) {
+        memcpy(buf,&f->map[sfs_backing_offset(ofs)],len);
+        sfs_decipher_sparse(&store,&f->header,f->in_fd,ofs,buf,len);
+        error = write_nonzero(f->out_fd,buf,len,ofs);
+      } else {
+        memcpy(buf,&f->map[ofs],len);
+        sfs_encipher(&store,&f->header,ofs,buf,len);
+        error = write_all(f->out_fd,buf,len,sfs_backing_offset(ofs));
+      }
+      if (!error) bytes += len;
+    }
+    finish_file(f,error);
+  }
+  if (buf) {
+    memset(buf,0,PACK_CHUNK);
+    free(buf);
+  }
+  pthread_mutex_lock(&mutexjob);
+  total_bytes += bytes;
+  pthread_mutex_unlock(&mutexjob);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+
+  const char *name = strrchr(argv[0],'/') ? strrchr(argv[0],'/')+1 : argv[0];
+  unpack = strstr(name,"unpack")!=NULL;
+
+  // interpret the command line options
+  int rounds = 5;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char storage[PATH_MAX];
+  char plain[PATH_MAX];
+  memset(storage,0,sizeof(storage));
+  memset(plain,0,sizeof(plain));
+  for(int i=1; i<argc; i++) {
+    if (!strcmp("-3",argv[i])) { rounds = 3; }
+    else if (!strcmp("-5",argv[i])) { rounds = 5; }
+    else if (!strcmp("-8",argv[i])) { rounds = 8; }
+    else if (strlen(argv[i])>2 && !(memcmp("-j",argv[i],2))) threads = atoi(&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-s",argv[i],2))) strncpy(storage,&argv[i][2],sizeof(storage)-1);
+    else if (strlen(argv[i])>2 && !(memcmp("-p",argv[i],2))) strncpy(plain,&argv[i][2],sizeof(plain)-1);
+  }
+  if (strlen(storage)==0 || strlen(plain)==0 || threads<1) {
+    if (unpack) fprintf(stderr,"Syntax: safefs-unpack [-3|-5|-8] [-j<threads>] -s<file-system-storage-path> -p<plain-text-output-path>\n");
+    else fprintf(stderr,"Syntax: safefs-pack [-3|-5|-8] [-j<threads>] -p<plain-text-input-path> -s<file-system-storage-path>\n");
+    exit(1);
+  }
+
+  // the output folder is created if it does not exist yet
+  if (mkdir(unpack ? plain : storage,0700)<0 && errno!=EEXIST) {
+    perror("Failed to create output folder");
+    exit(1);
+  }
+  if (realpath(plain,plainroot)==NULL) {
+    perror("Failed to find plain text folder");
+    exit(1);
+  }
+
+  // open the store the same way as the daemon
+  {
+    char *pwd = getenv("SAFEFS_PIN");
+    if (pwd==NULL) {
+      pwd = getpass("Enter the 10-digit pin code:");
+    }
+    if (strlen(pwd)!=10) {
+      memset(pwd,0,strlen(pwd));
+      fprintf(stderr,"Invalid pin code length\n");
+      exit(1);
+    }
+    int rc = sfs_store_open(&store,storage,pwd,rounds);
+    memset(pwd,0,strlen(pwd));
+    if (rc==-EACCES) {
+      fprintf(stderr,"Incorrect pin code provided\n");
+      exit(1);
+    } else if (rc<0) {
+      errno = -rc;
+      perror("Failed to open the storage folder and its .safefs");
+      exit(1);
+    }
+  }
+
+  // walk the source tree creating folders and links, then copy the files in parallel
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC,&begin);
+  walk("/");
+  pthread_t *pool = calloc(threads,sizeof(pthread_t));
+  int started = 0;
+  for(int i=0; pool && i<threads; i++) {
+    if (pthread_create(&pool[i],NULL,worker,NULL)==0) started++;
+  }
+  if (started==0) {
+    fprintf(stderr,"Failed to start worker threads\n");
+    exit(1);
+  }
+  for(int i=0; i<started; i++) {
+    pthread_join(pool[i],NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  double seconds = (end.tv_sec-begin.tv_sec) + (end.tv_nsec-begin.tv_nsec)/1e9;
+
+  printf("%s %zu files %llu bytes in %.3f seconds = %.3f GB/s using %d threads, %d errors\n",
+    unpack ? "Unpacked" : "Packed",file_count,(unsigned long long)total_bytes,seconds,
+    seconds>0 ? total_bytes/1e9/seconds : 0.0,started,errors);
+  return errors ? 1 : 0;
+
+}
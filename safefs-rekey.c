@@ -0,0 +1,656 @@
+/*
+ * Change the pin code of a safefs store in place.
+ *
+ * Every file is streamed through decipher with the old keys and encipher with the new keys and its
+ * rotor is encoded again with the new digest. Files are shared out to a pool of threads.
+ *
+ * Progress is kept in the .safefs-rekey folder of the store so an interrupted run carries on where it
+ * stopped when it is started again with the same pin codes:
+ * - .safefs  the pin check file for the new pin, moved over the real one once every file is done
+ * - log      one line per chunk and file finished: "P <offset> <path>" or "D <path>"
+ * - redo.<n> the chunk each thread is about to overwrite, enciphered with the new keys
+ * A chunk is only written to the file once its redo record is on disk, so a torn write is repaired
+ * by writing the redo record again on the next run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "sfs.h"
+#include "md5.h"
+
+// each thread rewrites this much of a file at a time
+#define REKEY_CHUNK 8388608
+#define REKEY_JOURNAL "/.safefs-rekey"
+
+// redo records are an 8 byte magic, the offset (-1 for the header), the length and the path length,
+// then the path, the data and an MD5 of everything before it
+#define REDO_MAGIC "SFSREDO1"
+#define REDO_HEADER 24
+
+typedef struct rekey_file {
+  char *path;      // relative to the store root with a leading slash
+  off_t size;      // plain text size when the store was walked
+  off_t progress;  // bytes already enciphered with the new keys
+  int done;        // the header has been encoded with the new digest
+} rekey_file;
+
+static sfs_store old_store;
+static sfs_store new_store;
+static char journal[PATH_MAX];
+static rekey_file *files = NULL;
+static size_t file_count = 0;
+static size_t file_capacity = 0;
+static size_t next_file = 0;
+static uint64_t total_bytes = 0;
+static int errors = 0;
+static int log_fd = -1;
+static pthread_mutex_t mutexjob = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mutexjournal = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t condjournal = PTHREAD_COND_INITIALIZER;
+static uint64_t log_written = 0;  // lines appended to the log
+static uint64_t log_synced = 0;   // lines known to be on disk
+static int log_syncing = 0;
+static int log_failed = 0;        // a failed fsync is never retried, the lines it covered may be lost
+
+static void fail(const char* what, const char* path, int error) {
+  fprintf(stderr,"Failed to %s [%s]: %s\n",what,path,strerror(error));
+  pthread_mutex_lock(&mutexjob);
+  errors++;
+  pthread_mutex_unlock(&mutexjob);
+}
+
+static int join_path(char fpath[PATH_MAX], const char* dir, const char* name) {
+  // a store path cut short would send the rekey to the wrong file
+  int len = snprintf(fpath,PATH_MAX,"%s/%s",dir,name);
+  return len<0 || len>=PATH_MAX ? -ENAMETOOLONG : 0;
+}
+
+static void put_u32(unsigned char* buf, uint32_t value) {
+  for(int i=0; i<4; i++) buf[i] = value>>(i*8);
+}
+
+static void put_u64(unsigned char* buf, uint64_t value) {
+  for(int i=0; i<8; i++) buf[i] = value>>(i*8);
+}
+
+static uint32_t get_u32(const unsigned char* buf) {
+  uint32_t value = 0;
+  for(int i=3; i>=0; i--) value = (value<<8) | buf[i];
+  return value;
+}
+
+static uint64_t get_u64(const unsigned char* buf) {
+  uint64_t value = 0;
+  for(int i=7; i>=0; i--) value = (value<<8) | buf[i];
+  return value;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t size, off_t ofs) {
+  while (size>0) {
+    ssize_t rc = pwrite(fd,data,size,ofs);
+    if (rc<0 && errno==EINTR) continue;
+    if (rc<0) return -errno;
+    if (rc==0) return -EIO;
+    data += rc;
+    size -= rc;
+    ofs += rc;
+  }
+  return 0;
+}
+
+static int write_data(int fd, const unsigned char* data, size_t size, off_t ofs) {
+#ifdef SEEK_HOLE
+  // only the data segments are rewritten so the holes of a sparse file stay holes
+  off_t end = ofs+size;
+  off_t pos = ofs;
+  while (pos<end) {
+    off_t next = lseek(fd,pos,SEEK_DATA);
+    if (next<0 && errno==ENXIO) break;
+    if (next<pos) next = pos;
+    if (next>=end) break;
+    off_t hole = lseek(fd,next,SEEK_HOLE);
+    if (hole<=next || hole>end) hole = end;
+    int rc = write_all(fd,&data[next-ofs],hole-next,next);
+    if (rc<0) return rc;
+    pos = hole;
+  }
+  return 0;
+#else
+  return write_all(fd,data,size,ofs);
+#endif
+}
+
+static int log_append(const char* line) {
+  // every line must be on disk before the next redo record can replace the one it describes,
+  // one worker syncs for all lines written so far while the others wait for that sync to cover theirs
+  pthread_mutex_lock(&mutexjournal);
+  int rc = write_all(log_fd,(const unsigned char*)line,strlen(line),lseek(log_fd,0,SEEK_END));
+  uint64_t line_no = ++log_written;
+  while (rc==0 && log_synced<line_no) {
+    if (log_failed) {
+      rc = log_failed;
+    } else if (log_syncing) {
+      pthread_cond_wait(&condjournal,&mutexjournal);
+    } else {
+      uint64_t covered = log_written;
+      log_syncing = 1;
+      pthread_mutex_unlock(&mutexjournal);
+      int synced = fsync(log_fd)<0 ? -errno : 0;
+      pthread_mutex_lock(&mutexjournal);
+      log_syncing = 0;
+      if (synced<0) log_failed = synced;
+      else log_synced = covered;
+      pthread_cond_broadcast(&condjournal);
+    }
+  }
+  pthread_mutex_unlock(&mutexjournal);
+  return rc;
+}
+
+static int log_progress(const char* path, int64_t ofs, uint32_t len) {
+  char line[PATH_MAX+64];
+  if (ofs<0) snprintf(line,sizeof(line),"D %s\n",path);
+  else snprintf(line,sizeof(line),"P %lld %s\n",(long long)(ofs+len),path);
+  return log_append(line);
+}
+
+static unsigned char* redo_data(unsigned char* record, const char* path) {
+  return &record[REDO_HEADER+strlen(path)];
+}
+
+static int redo_commit(int fd, unsigned char* record, const char* path, int64_t ofs, uint32_t len) {
+  // the data has already been placed at redo_data(record,path)
+  uint32_t path_len = strlen(path);
+  memcpy(record,REDO_MAGIC,8);
+  put_u64(&record[8],ofs);
+  put_u32(&record[16],len);
+  put_u32(&record[20],path_len);
+  memcpy(&record[REDO_HEADER],path,path_len);
+  size_t size = REDO_HEADER+path_len+len;
+  MD5_CTX context;
+  MD5Init(&context);
+  MD5Update(&context,record,size);
+  MD5Final(&record[size],&context);
+  int rc = write_all(fd,record,size+16,0);
+  if (rc==0 && fsync(fd)<0) rc = -errno;
+  return rc;
+}
+
+static int redo_apply(const char* slot) {
+  // a record that is incomplete was never written to its file so it is simply dropped
+  int fd = open(slot,O_RDONLY);
+  if (fd<0) return -errno;
+  struct stat st;
+  if (fstat(fd,&st)<0 || st.st_size<REDO_HEADER+16) {
+    close(fd);
+    return 0;
+  }
+  unsigned char *record = malloc(st.st_size);
+  if (record==NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+  int rc = 0;
+  if (pread(fd,record,st.st_size,0)==st.st_size && !memcmp(record,REDO_MAGIC,8)) {
+    int64_t ofs = get_u64(&record[8]);
+    uint32_t len = get_u32(&record[16]);
+    uint32_t path_len = get_u32(&record[20]);
+    size_t size = (size_t)REDO_HEADER+path_len+len;
+    unsigned char digest[16];
+    if (path_len<PATH_MAX && size+16<=(size_t)st.st_size) {
+      MD5_CTX context;
+      MD5Init(&context);
+      MD5Update(&context,record,size);
+      MD5Final(digest,&context);
+    }
+    if (path_len<PATH_MAX && size+16<=(size_t)st.st_size && !memcmp(digest,&record[size],16)) {
+      char path[PATH_MAX];
+      char fpath[PATH_MAX];
+      memcpy(path,&record[REDO_HEADER],path_len);
+      path[path_len] = 0;
+      sfs_resolve(&old_store,path,fpath);
+      int target = open(fpath,O_WRONLY);
+      if (target<0) rc = -errno;
+      else {
+        rc = write_all(target,&record[REDO_HEADER+path_len],len,ofs<0 ? 0 : sfs_backing_offset(ofs));
+        if (rc==0 && fsync(target)<0) rc = -errno;
+        close(target);
+      }
+      if (rc==0) rc = log_progress(path,ofs,len);
+      if (rc<0) fail("repeat interrupted write to",fpath,-rc);
+    }
+  }
+  memset(record,0,st.st_size);
+  free(record);
+  close(fd);
+  return rc;
+}
+
+static int add_file(const char* path, off_t size) {
+  if (file_count==file_capacity) {
+    size_t capacity = file_capacity ? file_capacity*2 : 1024;
+    rekey_file *grown = realloc(files,capacity*sizeof(rekey_file));
+    if (grown==NULL) return -ENOMEM;
+    files = grown;
+    file_capacity = capacity;
+  }
+  rekey_file *f = &files[file_count];
+  memset(f,0,sizeof(rekey_file));
+  f->path = strdup(path);
+  if (f->path==NULL) return -ENOMEM;
+  f->size = size;
+  file_count++;
+  return 0;
+}
+
+static void walk(const char* path) {
+  char fpath[PATH_MAX];
+  sfs_resolve(&old_store,path,fpath);
+  DIR *dp = opendir(fpath);
+  if (dp==NULL) {
+    fail("open directory",fpath,errno);
+    return;
+  }
+  struct dirent *dent;
+  while ((dent = readdir(dp))!=NULL) {
+    if (!strcmp(dent->d_name,".") || !strcmp(dent->d_name,"..")) continue;
+    char child[PATH_MAX];
+    int len = snprintf(child,sizeof(child),"%s/%s",strcmp(path,"/") ? path : "",dent->d_name);
+    if (len<0 || len>=PATH_MAX) {
+      fail("rekey file with a path that is too long",child,ENAMETOOLONG);
+      continue;
+    }
+    if (!strcmp(child,"/.safefs") || !strcmp(child,REKEY_JOURNAL)) continue;
+    if (strchr(child,'\n')) {
+      fail("rekey file with a new line in its name",child,EINVAL);
+      continue;
+    }
+    sfs_resolve(&old_store,child,fpath);
+    struct stat st;
+    if (lstat(fpath,&st)<0) fail("stat",fpath,errno);
+    else if (S_ISDIR(st.st_mode)) walk(child);
+    else if (S_ISREG(st.st_mode)) {
+      if (st.st_size<SFS_HEADER) fprintf(stderr,"Skipping file without a header [%s]\n",fpath);
+      else if (add_file(child,sfs_plain_size(st.st_size))<0) fail("queue",fpath,ENOMEM);
+    }
+  }
+  closedir(dp);
+}
+
+static int compare_path(const void* a, const void* b) {
+  return strcmp(((const rekey_file*)a)->path,((const rekey_file*)b)->path);
+}
+
+static int compare_remaining(const void* a, const void* b) {
+  // start with the most work so the last files to finish are small ones
+  off_t x = ((const rekey_file*)a)->size-((const rekey_file*)a)->progress;
+  off_t y = ((const rekey_file*)b)->size-((const rekey_file*)b)->progress;
+  return x<y ? 1 : x>y ? -1 : 0;
+}
+
+static void load_progress(void) {
+  // the files are sorted by path here so the log can be matched against them
+  qsort(files,file_count,sizeof(rekey_file),compare_path);
+  char log_path[PATH_MAX];
+  if (join_path(log_path,journal,"log")<0) {
+    fail("read the rekey log",journal,ENAMETOOLONG);
+    return;
+  }
+  FILE *log = fopen(log_path,"r");
+  if (log==NULL) return;
+  char line[PATH_MAX+64];
+  while (fgets(line,sizeof(line),log)!=NULL) {
+    size_t len = strlen(line);
+    if (len==0 || line[len-1]!='\n') break;
+    line[len-1] = 0;
+    long long ofs = 0;
+    char *path = NULL;
+    if (line[0]=='D' && line[1]==' ') path = &line[2];
+    else if (line[0]=='P' && line[1]==' ') {
+      ofs = strtoll(&line[2],&path,10);
+      if (path && *path==' ') path++;
+      else path = NULL;
+    }
+    if (path==NULL) continue;
+    rekey_file key;
+    key.path = path;
+    rekey_file *f = bsearch(&key,files,file_count,sizeof(rekey_file),compare_path);
+    if (f==NULL) continue;
+    if (line[0]=='D') f->done = 1;
+    else if (ofs>f->progress) f->progress = ofs;
+  }
+  fclose(log);
+}
+
+static int rekey_file_contents(rekey_file *f, int fd, sfs_header *old_header, sfs_header *new_header, int slot, unsigned char *record) {
+  struct stat st;
+  memset(&st,0,sizeof(st));
+  int rc = 0;
+  if (fstat(fd,&st)<0) rc = -errno;
+  off_t size = sfs_plain_size(st.st_size);
+  unsigned char *data = redo_data(record,f->path);
+  for(off_t ofs=f->progress; rc==0 && ofs<size; ofs+=REKEY_CHUNK) {
+    uint32_t len = size-ofs<REKEY_CHUNK ? size-ofs : REKEY_CHUNK;
+    if (!sfs_backing_data(fd,sfs_backing_offset(ofs),sfs_backing_offset(ofs+len))) {
+      // holes are plain text zeros under any key so they are left as they are
+      rc = log_progress(f->path,ofs,len);
+      continue;
+    }
+    ssize_t got = pread(fd,data,len,sfs_backing_offset(ofs));
+    if (got<0) rc = -errno;
+    else if ((uint32_t)got!=len) rc = -EIO;
+    else {
+      sfs_decipher_sparse(&old_store,old_header,fd,ofs,data,len);
+      sfs_encipher(&new_store,new_header,ofs,data,len);
+      rc = redo_commit(slot,record,f->path,ofs,len);
+      if (rc==0) rc = write_data(fd,data,len,sfs_backing_offset(ofs));
+      if (rc==0 && fsync(fd)<0) rc = -errno;
+      if (rc==0) rc = log_progress(f->path,ofs,len);
+      if (rc==0) {
+        pthread_mutex_lock(&mutexjob);
+        total_bytes += len;
+        pthread_mutex_unlock(&mutexjob);
+      }
+    }
+  }
+  if (rc==0) {
+    // the header is written last so a file is only done when every chunk uses the new keys
+    sfs_encode_header(new_header,data);
+    rc = redo_commit(slot,record,f->path,-1,SFS_HEADER);
+    if (rc==0) rc = write_all(fd,data,SFS_HEADER,0);
+    if (rc==0 && fsync(fd)<0) rc = -errno;
+    if (rc==0) rc = log_progress(f->path,-1,SFS_HEADER);
+  }
+  return rc;
+}
+
+static void rekey_failed(rekey_file *f, int rc) {
+  char fpath[PATH_MAX];
+  sfs_resolve(&old_store,f->path,fpath);
+  fail("rekey",fpath,-rc);
+}
+
+static void rekey_batch(rekey_file **batch, int count, int slot, unsigned char *record) {
+  int fds[SFS_BATCH];
+  unsigned char raw[SFS_BATCH][SFS_HEADER];
+  unsigned char salts[SFS_BATCH][SFS_SALT];
+  unsigned char digests[SFS_BATCH][16];
+  sfs_header old_headers[SFS_BATCH];
+  sfs_header new_headers[SFS_BATCH];
+  // read every header first, files that cannot be read are dropped from the batch
+  int ready = 0;
+  for(int i=0; i<count; i++) {
+    char fpath[PATH_MAX];
+    sfs_resolve(&old_store,batch[i]->path,fpath);
+    int fd = open(fpath,O_RDWR);
+    int rc = fd<0 ? -errno : 0;
+    if (rc==0) {
+      ssize_t len = pread(fd,raw[ready],SFS_HEADER,0);
+      if (len<0) rc = -errno;
+      else if (len!=SFS_HEADER) rc = -EIO;
+    }
+    if (rc<0) {
+      if (fd>=0) close(fd);
+      rekey_failed(batch[i],rc);
+      continue;
+    }
+    batch[ready] = batch[i];
+    fds[ready++] = fd;
+  }
+  // the rotors stay the same, only the digests that encode them change
+  sfs_decode_headers(&old_store,raw,old_headers,ready);
+  for(int i=0; i<ready; i++) memcpy(salts[i],old_headers[i].salt,SFS_SALT);
+  sfs_rotor_digests(&new_store,salts,digests,ready);
+  for(int i=0; i<ready; i++) {
+    memcpy(&new_headers[i],&old_headers[i],sizeof(sfs_header));
+    memcpy(new_headers[i].rotor_digest,digests[i],16);
+  }
+  for(int i=0; i<ready; i++) {
+    int rc = rekey_file_contents(batch[i],fds[i],&old_headers[i],&new_headers[i],slot,record);
+    if (rc<0) rekey_failed(batch[i],rc);
+    close(fds[i]);
+  }
+  memset(raw,0,sizeof(raw));
+  memset(digests,0,sizeof(digests));
+  memset(old_headers,0,sizeof(old_headers));
+  memset(new_headers,0,sizeof(new_headers));
+}
+
+static void* worker(void *arg) {
+  char slot_path[PATH_MAX];
+  int len = snprintf(slot_path,sizeof(slot_path),"%s/redo.%ld",journal,(long)(intptr_t)arg);
+  if (len<0 || len>=PATH_MAX) {
+    fail("create redo record",journal,ENAMETOOLONG);
+    return NULL;
+  }
+  int slot = open(slot_path,O_CREAT | O_WRONLY,0600);
+  unsigned char *record = malloc(REDO_HEADER+PATH_MAX+REKEY_CHUNK+16);
+  if (slot<0 || record==NULL) {
+    fail("create redo record",slot_path,slot<0 ? errno : ENOMEM);
+    if (slot>=0) close(slot);
+    free(record);
+    return NULL;
+  }
+  for(;;) {
+    // small files are claimed together so their headers are derived in one pass, large ones alone
+    rekey_file *batch[SFS_BATCH];
+    int count = 0;
+    off_t claimed = 0;
+    pthread_mutex_lock(&mutexjob);
+    while (count<SFS_BATCH && next_file<file_count && claimed<REKEY_CHUNK) {
+      rekey_file *f = &files[next_file++];
+      claimed += f->size-f->progress;
+      batch[count++] = f;
+    }
+    pthread_mutex_unlock(&mutexjob);
+    if (count==0) break;
+    rekey_batch(batch,count,slot,record);
+  }
+  memset(record,0,REDO_HEADER+PATH_MAX+REKEY_CHUNK+16);
+  free(record);
+  close(slot);
+  return NULL;
+}
+
+static void read_pin(const char* env, const char* prompt, char pin[11]) {
+  char *pwd = getenv(env);
+  if (pwd==NULL) {
+    pwd = getpass(prompt);
+  }
+  if (strlen(pwd)!=10) {
+    memset(pwd,0,strlen(pwd));
+    fprintf(stderr,"Invalid pin code length\n");
+    exit(1);
+  }
+  strcpy(pin,pwd);
+  memset(pwd,0,strlen(pwd));
+}
+
+static void remove_journal(void) {
+  char fpath[PATH_MAX];
+  DIR *dp = opendir(journal);
+  if (dp!=NULL) {
+    struct dirent *dent;
+    while ((dent = readdir(dp))!=NULL) {
+      if (!strcmp(dent->d_name,".") || !strcmp(dent->d_name,"..")) continue;
+      if (join_path(fpath,journal,dent->d_name)<0) continue;
+      unlink(fpath);
+    }
+    closedir(dp);
+  }
+  rmdir(journal);
+}
+
+int main(int argc, char** argv) {
+
+  // interpret the command line options
+  int rounds = 5;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char storage[PATH_MAX];
+  memset(storage,0,sizeof(storage));
+  for(int i=1; i<argc; i++) {
+    if (!strcmp("-3",argv[i])) { rounds = 3; }
+    else if (!strcmp("-5",argv[i])) { rounds = 5; }
+    else if (!strcmp("-8",argv[i])) { rounds = 8; }
+    else if (strlen(argv[i])>2 && !(memcmp("-j",argv[i],2))) threads = atoi(&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-s",argv[i],2))) strncpy(storage,&argv[i][2],sizeof(storage)-1);
+  }
+  if (strlen(storage)==0 || threads<1) {
+    fprintf(stderr,"Syntax: safefs-rekey [-3|-5|-8] [-j<threads>] -s<file-system-storage-path>\n");
+    exit(1);
+  }
+
+  char old_pin[11];
+  char new_pin[11];
+  read_pin("SAFEFS_PIN","Enter the current 10-digit pin code:",old_pin);
+  read_pin("SAFEFS_NEW_PIN","Enter the new 10-digit pin code:",new_pin);
+
+  // derive the new keys first, the new pin check file lives in the journal until the end
+  char root[PATH_MAX];
+  if (realpath(storage,root)==NULL) {
+    perror("Failed to find the storage folder");
+    exit(1);
+  }
+  char new_check[PATH_MAX];
+  char log_path[PATH_MAX];
+  int len = snprintf(journal,sizeof(journal),"%s%s",root,REKEY_JOURNAL);
+  if (len<0 || len>=PATH_MAX || join_path(new_check,journal,".safefs")<0 || join_path(log_path,journal,"log")<0) {
+    errno = ENAMETOOLONG;
+    perror("Failed to find the rekey journal");
+    exit(1);
+  }
+  memset(&new_store,0,sizeof(sfs_store));
+  strcpy(new_store.rootdir,journal);
+  sfs_store_init(&new_store,new_pin,rounds);
+  if (access(journal,F_OK)==0 && access(new_check,F_OK)<0 && access(log_path,F_OK)==0) {
+    // an earlier run moved the new pin check file into place but did not finish removing the journal
+    strcpy(new_store.rootdir,root);
+    int rc = sfs_check_pin(&new_store);
+    memset(new_pin,0,sizeof(new_pin));
+    memset(old_pin,0,sizeof(old_pin));
+    if (rc<0) {
+      fprintf(stderr,"The store was already rekeyed with a different pin code\n");
+      exit(1);
+    }
+    remove_journal();
+    printf("Rekey already complete\n");
+    return 0;
+  }
+
+  // the current pin must still unlock the store
+  int rc = sfs_store_open(&old_store,root,old_pin,rounds);
+  memset(old_pin,0,sizeof(old_pin));
+  if (rc==-EACCES) {
+    fprintf(stderr,"Incorrect pin code provided\n");
+    exit(1);
+  } else if (rc<0) {
+    errno = -rc;
+    perror("Failed to open the storage folder and its .safefs");
+    exit(1);
+  }
+  if (mkdir(journal,0700)<0 && errno!=EEXIST) {
+    perror("Failed to create the rekey journal");
+    exit(1);
+  }
+  // until the log exists no file has been touched, so a half written pin check file can be replaced
+  if (access(log_path,F_OK)<0) unlink(new_check);
+  rc = sfs_check_pin(&new_store);
+  memset(new_pin,0,sizeof(new_pin));
+  if (rc==-EACCES) {
+    fprintf(stderr,"The new pin code does not match the interrupted rekey\n");
+    exit(1);
+  } else if (rc<0) {
+    errno = -rc;
+    perror("Failed to create the new .safefs in the rekey journal");
+    exit(1);
+  }
+  log_fd = open(log_path,O_CREAT | O_WRONLY,0600);
+  if (log_fd<0) {
+    perror("Failed to open the rekey log");
+    exit(1);
+  }
+
+  // repeat any write that was interrupted and then find out how far each file got
+  {
+    DIR *dp = opendir(journal);
+    struct dirent *dent;
+    while (dp && (dent = readdir(dp))!=NULL) {
+      if (strncmp(dent->d_name,"redo.",5)) continue;
+      char slot[PATH_MAX];
+      if (join_path(slot,journal,dent->d_name)<0) fail("repeat redo record",dent->d_name,ENAMETOOLONG);
+      else if (redo_apply(slot)==0) unlink(slot);
+    }
+    if (dp) closedir(dp);
+  }
+  if (errors) {
+    fprintf(stderr,"Cannot continue until the interrupted writes are repaired\n");
+    exit(1);
+  }
+
+  struct timespec begin;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC,&begin);
+  walk("/");
+  load_progress();
+  size_t remaining = 0;
+  for(size_t i=0; i<file_count; i++) {
+    if (!files[i].done) files[remaining++] = files[i];
+    else free(files[i].path);
+  }
+  size_t skipped = file_count-remaining;
+  file_count = remaining;
+  qsort(files,file_count,sizeof(rekey_file),compare_remaining);
+
+  pthread_t *pool = calloc(threads,sizeof(pthread_t));
+  int started = 0;
+  for(int i=0; pool && i<threads; i++) {
+    if (pthread_create(&pool[started],NULL,worker,(void*)(intptr_t)started)==0) started++;
+  }
+  if (started==0) {
+    fprintf(stderr,"Failed to start worker threads\n");
+    exit(1);
+  }
+  for(int i=0; i<started; i++) {
+    pthread_join(pool[i],NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  double seconds = (end.tv_sec-begin.tv_sec) + (end.tv_nsec-begin.tv_nsec)/1e9;
+  printf("Rekeyed %zu files %llu bytes in %.3f seconds = %.3f GB/s using %d threads, %zu already done, %d errors\n",
+    file_count,(unsigned long long)total_bytes,seconds,seconds>0 ? total_bytes/1e9/seconds : 0.0,started,skipped,errors);
+  if (errors) {
+    fprintf(stderr,"Run safefs-rekey again with the same pin codes to finish\n");
+    return 1;
+  }
+
+  // every file uses the new keys so the new pin check file can replace the old one
+  char old_check[PATH_MAX];
+  if (join_path(old_check,root,".safefs")<0) {
+    errno = ENAMETOOLONG;
+    perror("Failed to replace .safefs");
+    return 1;
+  }
+  if (rename(new_check,old_check)<0) {
+    perror("Failed to replace .safefs");
+    return 1;
+  }
+  int dir = open(root,O_RDONLY);
+  if (dir>=0) {
+    fsync(dir);
+    close(dir);
+  }
+  close(log_fd);
+  remove_journal();
+  return 0;
+
+}
@@ -2,9 +2,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
+#include <stdint.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+
+// every store file starts with a header of this size
+#define STORE_HEADER 260
+#define CHUNK_SIZE 4194304
+#define CHUNK_MANIFEST (STORE_HEADER+48)
+#define PACK_LIMIT 4096
+#define PACK_FILES 16
+#define COMPRESS_BLOCK 16384
+// more bulk writers than fuse has worker threads, each sending requests of QOS_REQUEST
+#define QOS_WRITERS 12
+#define QOS_REQUEST 1048576
+#define QOS_FILE 8388608
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+// the darwin calls take a position and options
+#ifdef __APPLE__
+#define getxattr(path,name,val,size) getxattr(path,name,val,size,0,0)
+#define setxattr(path,name,val,size,flags) setxattr(path,name,val,size,0,flags)
+#define listxattr(path,names,size) listxattr(path,names,size,0)
+#define removexattr(path,name) removexattr(path,name,0)
+#endif
 
 int check_file_create(const char* store, const char* access) {
   fprintf(stderr,"Check that file creation works\n");
@@ -48,7 +78,7 @@ int check_file_write(const char* store, const char* access) {
       return 1;
     }
     if (stat.st_size!=5) {
-      fprintf(stderr,"File size is incorrect after writing. %lld\n",stat.st_size);
+      fprintf(stderr,"File size is incorrect after writing. %lld\n",(long long)stat.st_size);
       close(fd);
       return 1;
     }
@@ -109,7 +139,7 @@ int check_file_truncate(const char* store, const char* access) {
       return 1;
     }
     if (stat.st_size!=0) {
-      fprintf(stderr,"File size is incorrect after truncating. %lld\n",stat.st_size);
+      fprintf(stderr,"File size is incorrect after truncating. %lld\n",(long long)stat.st_size);
       close(fd);
       return 1;
     }
@@ -329,17 +359,1305 @@ int check_rainbow_test(const char* store, const char* access) {
   return 0;
 }
 
+#ifdef __APPLE__
+int check_preallocate(const char* store, const char* access) {
+  fprintf(stderr,"Check that preallocation keeps the size and the data\n");
+  char fpath[PATH_MAX];
+  strcpy(fpath,access);
+  strcat(fpath,"p");
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = 0;
+  if (pwrite(fd,"hello",5,0)!=5) {
+    perror("Failed to write to file");
+    rc = 1;
+  }
+  fstore_t fst = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, 1048576, 0 };
+  if (rc==0 && fcntl(fd,F_PREALLOCATE,&fst)<0) {
+    perror("Failed to preallocate file");
+    rc = 1;
+  }
+  struct stat stat;
+  if (rc==0 && (fstat(fd,&stat)<0 || stat.st_size!=5)) {
+    fprintf(stderr,"File size is incorrect after preallocating. %lld\n",stat.st_size);
+    rc = 1;
+  }
+  unsigned char data[5];
+  if (rc==0 && (pread(fd,data,5,0)!=5 || memcmp("hello",data,5))) {
+    fprintf(stderr,"Incorrect data read after preallocating\n");
+    rc = 1;
+  }
+  close(fd);
+  unlink(fpath);
+  return rc;
+}
+#else
+int check_preallocate(const char* store, const char* access) {
+  fprintf(stderr,"Check that preallocation past the end of a file reads back as zeros\n");
+  char fpath[PATH_MAX];
+  strcpy(fpath,access);
+  strcat(fpath,"p");
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = 0;
+  if (pwrite(fd,"hello",5,0)!=5) {
+    perror("Failed to write to file");
+    rc = 1;
+  }
+  if (rc==0 && fallocate(fd,0,0,1048576)<0) {
+    perror("Failed to preallocate file");
+    rc = 1;
+  }
+  struct stat stat;
+  if (rc==0 && (fstat(fd,&stat)<0 || stat.st_size!=1048576)) {
+    fprintf(stderr,"File size is incorrect after preallocating. %lld\n",(long long)stat.st_size);
+    rc = 1;
+  }
+  static unsigned char data[1048576];
+  if (rc==0 && (pread(fd,data,sizeof(data),0)!=sizeof(data) || memcmp("hello",data,5))) {
+    fprintf(stderr,"Incorrect data read after preallocating\n");
+    rc = 1;
+  }
+  for(size_t i=5; rc==0 && i<sizeof(data); i++) {
+    if (data[i]!=0) {
+      fprintf(stderr,"Preallocated byte %zu is not zero\n",i);
+      rc = 1;
+    }
+  }
+  close(fd);
+  unlink(fpath);
+  return rc;
+}
+#endif
+
+#ifdef __APPLE__
+int check_seek(const char* store, const char* access, int sparse) {
+  // osxfuse does not forward lseek so the kernel answers from the size alone
+  return 0;
+}
+#else
+int check_seek(const char* store, const char* access, int sparse) {
+  fprintf(stderr,sparse ? "Check that a hole is found in a sparse file\n" : "Check that a file without -sparse is data from start to end\n");
+  char fpath[PATH_MAX];
+  strcpy(fpath,access);
+  strcat(fpath,"h");
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = 0;
+  // cached writes have to reach the store before the daemon is asked where its holes are
+  if (pwrite(fd,"hello",5,0)!=5 || pwrite(fd,"world",5,4194304)!=5 || fsync(fd)<0) {
+    perror("Failed to write to file");
+    rc = 1;
+  }
+  off_t size = 4194309;
+  off_t hole = lseek(fd,0,SEEK_HOLE);
+  if (rc==0 && (sparse ? hole<=0 || hole>=size : hole!=size)) {
+    fprintf(stderr,"Hole found at the wrong offset. %lld\n",(long long)hole);
+    rc = 1;
+  }
+  off_t data = lseek(fd,1048576,SEEK_DATA);
+  if (rc==0 && (sparse ? data<=1048576 || data>4194304 : data!=1048576)) {
+    fprintf(stderr,"Data found at the wrong offset. %lld\n",(long long)data);
+    rc = 1;
+  }
+  if (rc==0 && (lseek(fd,size,SEEK_DATA)>=0 || errno!=ENXIO)) {
+    fprintf(stderr,"Data found past the end of the file\n");
+    rc = 1;
+  }
+  close(fd);
+  unlink(fpath);
+  return rc;
+}
+#endif
+
+int check_stats_file(const char* store, const char* access) {
+  fprintf(stderr,"Check that the statistics file is readable\n");
+  char fpath[PATH_MAX];
+  strcpy(fpath,access);
+  strcat(fpath,".safefs-stats");
+  int fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open statistics file");
+    return 1;
+  }
+  char text[65536];
+  int rc = pread(fd,text,sizeof(text)-1,0);
+  close(fd);
+  if (rc<=0) {
+    perror("Failed to read statistics file");
+    return 1;
+  }
+  text[rc] = 0;
+  if (strstr(text,"y_write")==NULL || strstr(text,"histogram y_read")==NULL) {
+    fprintf(stderr,"Statistics file is missing operation counters\n");
+    return 1;
+  }
+  fd = open(fpath, O_WRONLY);
+  if (fd>=0) {
+    fprintf(stderr,"Statistics file should be read only\n");
+    close(fd);
+    return 1;
+  }
+  return 0;
+}
+
+
+// the checks of the mount modes write a pattern set by the position and a seed, seed 0 is zeros
+static unsigned char pattern(off_t ofs, int seed) {
+  return seed==0 ? 0 : (unsigned char)(ofs*seed+ofs/4093+seed);
+}
+
+static int write_pattern(int fd, off_t from, off_t to, int seed) {
+  static unsigned char data[1048576];
+  for(off_t ofs=from; ofs<to; ) {
+    size_t len = to-ofs<(off_t)sizeof(data) ? (size_t)(to-ofs) : sizeof(data);
+    for(size_t i=0; i<len; i++) data[i] = pattern(ofs+i,seed);
+    if (pwrite(fd,data,len,ofs)!=(ssize_t)len) {
+      perror("Failed to write to file");
+      return 1;
+    }
+    ofs += len;
+  }
+  return 0;
+}
+
+static int read_pattern(int fd, off_t from, off_t to, int seed) {
+  static unsigned char data[1048576];
+  for(off_t ofs=from; ofs<to; ) {
+    size_t len = to-ofs<(off_t)sizeof(data) ? (size_t)(to-ofs) : sizeof(data);
+    if (pread(fd,data,len,ofs)!=(ssize_t)len) {
+      fprintf(stderr,"Failed to read all bytes at %lld\n",(long long)ofs);
+      return 1;
+    }
+    for(size_t i=0; i<len; i++) {
+      if (data[i]!=pattern(ofs+i,seed)) {
+        fprintf(stderr,"Incorrect data read at %lld\n",(long long)(ofs+i));
+        return 1;
+      }
+    }
+    ofs += len;
+  }
+  return 0;
+}
+
+static int check_size(int fd, off_t size) {
+  struct stat stat;
+  if (fstat(fd,&stat)<0) {
+    perror("Failed to check file size");
+    return 1;
+  }
+  if (stat.st_size!=size) {
+    fprintf(stderr,"File size is %lld instead of %lld\n",(long long)stat.st_size,(long long)size);
+    return 1;
+  }
+  return 0;
+}
+
+static off_t store_size(const char* store, const char* name) {
+  // -1 when the store holds no file of that name
+  char fpath[PATH_MAX];
+  struct stat stat;
+  snprintf(fpath,sizeof(fpath),"%s%s",store,name);
+  return lstat(fpath,&stat)<0 ? -1 : stat.st_size;
+}
+
+static int count_entries(const char* store, const char* folder) {
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%s%s",store,folder);
+  DIR *dp = opendir(fpath);
+  if (dp==NULL) return 0;
+  int count = 0;
+  struct dirent *dent;
+  while ((dent = readdir(dp))!=NULL) {
+    if (dent->d_name[0]!='.') count++;
+  }
+  closedir(dp);
+  return count;
+}
+
+static int wait_entries(const char* store, const char* folder, int count) {
+  // the last close of a file returns before the mount has released it
+  for(int i=0; i<50 && count_entries(store,folder)!=count; i++) usleep(100000);
+  if (count_entries(store,folder)!=count) {
+    fprintf(stderr,"Store folder %s holds %d entries instead of %d\n",folder,count_entries(store,folder),count);
+    return 1;
+  }
+  return 0;
+}
+
+int check_chunk_split(const char* store, const char* access) {
+  fprintf(stderr,"Check that a file growing past one chunk is split and read through every handle\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sc",access);
+  unlink(fpath);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  // opened before the split, so it still points at the file the manifest replaces
+  int early = open(fpath, O_RDWR);
+  if (early<0) {
+    perror("Failed to open file twice");
+    close(fd);
+    return 1;
+  }
+  int rc = write_pattern(fd,0,6*CHUNK_SIZE/4,1);
+  if (rc==0 && fsync(fd)<0) {
+    perror("Failed to sync file");
+    rc = 1;
+  }
+  if (rc==0 && store_size(store,"c")!=CHUNK_MANIFEST) {
+    fprintf(stderr,"Store file is %lld bytes instead of a manifest\n",(long long)store_size(store,"c"));
+    rc = 1;
+  }
+  if (rc==0) rc = wait_entries(store,".safefs-chunks",1);
+  if (rc==0) rc = check_size(early,6*CHUNK_SIZE/4);
+  if (rc==0) rc = read_pattern(early,0,6*CHUNK_SIZE/4,1);
+  // a write across the chunk boundary through one handle is read through the other
+  unsigned char data[3];
+  if (rc==0 && pwrite(early,"xyz",3,CHUNK_SIZE-1)!=3) {
+    perror("Failed to write to file");
+    rc = 1;
+  }
+  if (rc==0 && (pread(fd,data,3,CHUNK_SIZE-1)!=3 || memcmp("xyz",data,3))) {
+    fprintf(stderr,"Incorrect data read through the other handle\n");
+    rc = 1;
+  }
+  if (rc==0) rc = write_pattern(early,CHUNK_SIZE-1,CHUNK_SIZE+2,1);
+  close(early);
+  close(fd);
+  return rc;
+}
+
+int check_chunk_manifest_forgery(const char* store, const char* access) {
+  fprintf(stderr,"Check that a small file holding what a manifest holds is not taken for one\n");
+  // the forgery names the chunk folder of c so an unlink that took it for a manifest would remove those chunks
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%s.safefs-chunks",store);
+  DIR *dp = opendir(fpath);
+  if (dp==NULL) {
+    perror("Failed to open the chunk folder");
+    return 1;
+  }
+  unsigned char forged[48];
+  memset(forged,0,sizeof(forged));
+  memcpy(forged,"SFSCHNK1",8);
+  for(int i=0; i<8; i++) forged[8+i] = (uint64_t)(6*CHUNK_SIZE/4)>>(i*8);
+  struct dirent *dent;
+  while ((dent = readdir(dp))!=NULL) {
+    if (dent->d_name[0]=='.' || strlen(dent->d_name)!=32) continue;
+    for(int i=0; i<16; i++) {
+      unsigned int byte;
+      sscanf(&dent->d_name[i*2],"%2x",&byte);
+      forged[16+i] = byte;
+    }
+  }
+  closedir(dp);
+  snprintf(fpath,sizeof(fpath),"%sm",access);
+  int rc = 0;
+  // without a tag, then with room for one so the store file has the exact size of a manifest
+  for(size_t size=32; rc==0 && size<=48; size+=16) {
+    unlink(fpath);
+    int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd<0) {
+      perror("Failed to open file");
+      return 1;
+    }
+    if (pwrite(fd,forged,size,0)!=(ssize_t)size) {
+      perror("Failed to write to file");
+      rc = 1;
+    }
+    close(fd);
+    fd = open(fpath, O_RDONLY);
+    if (fd<0) {
+      perror("Failed to open file");
+      return 1;
+    }
+    unsigned char data[64];
+    if (rc==0) rc = check_size(fd,size);
+    if (rc==0 && (pread(fd,data,sizeof(data),0)!=(ssize_t)size || memcmp(forged,data,size))) {
+      fprintf(stderr,"Incorrect data read from a file that starts like a manifest\n");
+      rc = 1;
+    }
+    close(fd);
+    if (unlink(fpath)<0) {
+      perror("Failed to unlink file");
+      rc = 1;
+    }
+  }
+  if (rc==0 && count_entries(store,".safefs-chunks")!=1) {
+    fprintf(stderr,"Unlinking a file that starts like a manifest removed chunks\n");
+    rc = 1;
+  }
+  snprintf(fpath,sizeof(fpath),"%sc",access);
+  int fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  if (rc==0) rc = read_pattern(fd,0,6*CHUNK_SIZE/4,1);
+  close(fd);
+  return rc;
+}
+
+int check_chunk_truncate(const char* store, const char* access) {
+  fprintf(stderr,"Check that a split file shrinks, grows with zeros and is made whole again\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sc",access);
+  int fd = open(fpath, O_RDWR);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = 0;
+  if (ftruncate(fd,CHUNK_SIZE+3)<0 || truncate(fpath,3*CHUNK_SIZE)<0) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_size(fd,3*CHUNK_SIZE);
+  if (rc==0) rc = read_pattern(fd,0,CHUNK_SIZE+3,1);
+  if (rc==0) rc = read_pattern(fd,CHUNK_SIZE+3,3*CHUNK_SIZE,0);
+  if (rc==0 && (ftruncate(fd,0)<0 || fsync(fd)<0)) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  if (rc==0 && store_size(store,"c")!=STORE_HEADER) {
+    fprintf(stderr,"Store file is %lld bytes after truncating to zero\n",(long long)store_size(store,"c"));
+    rc = 1;
+  }
+  if (rc==0) rc = wait_entries(store,".safefs-chunks",0);
+  if (rc==0) rc = write_pattern(fd,0,6*CHUNK_SIZE/4,2);
+  if (rc==0 && fsync(fd)<0) {
+    perror("Failed to sync file");
+    rc = 1;
+  }
+  if (rc==0) rc = wait_entries(store,".safefs-chunks",1);
+  close(fd);
+  return rc;
+}
+
+int check_chunk_rename_unlink(const char* store, const char* access) {
+  fprintf(stderr,"Check that a split file keeps its chunks through a rename and loses them with its last handle\n");
+  char fpath[PATH_MAX];
+  char fpath2[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sc",access);
+  snprintf(fpath2,sizeof(fpath2),"%sd",access);
+  if (rename(fpath,fpath2)<0) {
+    perror("Failed to rename file");
+    return 1;
+  }
+  int fd = open(fpath2, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = read_pattern(fd,0,6*CHUNK_SIZE/4,2);
+  if (rc==0 && unlink(fpath2)<0) {
+    perror("Failed to unlink file");
+    rc = 1;
+  }
+  if (rc==0 && count_entries(store,".safefs-chunks")!=1) {
+    fprintf(stderr,"Chunks were removed while the file was still open\n");
+    rc = 1;
+  }
+  if (rc==0) rc = read_pattern(fd,0,6*CHUNK_SIZE/4,2);
+  close(fd);
+  if (rc==0) rc = wait_entries(store,".safefs-chunks",0);
+  return rc;
+}
+
+int check_chunk_keep(const char* store, const char* access) {
+  fprintf(stderr,"Check that a split file is left for the next mount\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sr",access);
+  unlink(fpath);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = write_pattern(fd,0,9*CHUNK_SIZE/4,3);
+  // the size in the manifest is only brought up to date when the file is synced or closed
+  if (rc==0 && (ftruncate(fd,2*CHUNK_SIZE+5)<0 || ftruncate(fd,5*CHUNK_SIZE/2)<0)) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  close(fd);
+  return rc;
+}
+
+int check_chunk_remount(const char* store, const char* access) {
+  fprintf(stderr,"Check that a split file reads back after a remount\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sr",access);
+  int fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = check_size(fd,5*CHUNK_SIZE/2);
+  if (rc==0) rc = read_pattern(fd,0,2*CHUNK_SIZE+5,3);
+  if (rc==0) rc = read_pattern(fd,2*CHUNK_SIZE+5,5*CHUNK_SIZE/2,0);
+  close(fd);
+  if (rc==0 && store_size(store,"r")!=CHUNK_MANIFEST) {
+    fprintf(stderr,"Store file is %lld bytes instead of a manifest\n",(long long)store_size(store,"r"));
+    rc = 1;
+  }
+  if (rc==0 && unlink(fpath)<0) {
+    perror("Failed to unlink file");
+    rc = 1;
+  }
+  if (rc==0) rc = wait_entries(store,".safefs-chunks",0);
+  return rc;
+}
+
+static int pack_size(int index) {
+  // every packed file of the -pack checks is named s<index> and fits in a record
+  return 100+index*230;
+}
+
+static int check_packed(const char* store, const char* name) {
+  if (store_size(store,name)>=0) {
+    fprintf(stderr,"File %s has a store file of its own instead of a record\n",name);
+    return 1;
+  }
+  return 0;
+}
+
+static int check_file(const char* access, const char* name, off_t size, off_t written, int seed) {
+  // the file holds the pattern up to written and zeros after
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%s%s",access,name);
+  int fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    fprintf(stderr,"Failed to open file %s: %s\n",name,strerror(errno));
+    return 1;
+  }
+  int rc = check_size(fd,size);
+  if (rc==0) rc = read_pattern(fd,0,written,seed);
+  if (rc==0) rc = read_pattern(fd,written,size,0);
+  close(fd);
+  return rc;
+}
+
+int check_pack_small(const char* store, const char* access) {
+  fprintf(stderr,"Check that small files are kept as records and read back\n");
+  char fpath[PATH_MAX];
+  int rc = 0;
+  for(int i=0; rc==0 && i<PACK_FILES; i++) {
+    snprintf(fpath,sizeof(fpath),"%ss%d",access,i);
+    int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd<0) {
+      perror("Failed to open file");
+      return 1;
+    }
+    rc = write_pattern(fd,0,pack_size(i),i+1);
+    close(fd);
+  }
+  // a folder that only holds packed files
+  snprintf(fpath,sizeof(fpath),"%sf",access);
+  if (rc==0 && mkdir(fpath,0700)<0) {
+    perror("Failed to create folder");
+    rc = 1;
+  }
+  snprintf(fpath,sizeof(fpath),"%sf/p",access);
+  int fd = rc==0 ? open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600) : -1;
+  if (rc==0 && fd<0) {
+    perror("Failed to open file");
+    rc = 1;
+  }
+  if (rc==0) rc = write_pattern(fd,0,pack_size(PACK_FILES),PACK_FILES+1);
+  if (fd>=0) close(fd);
+  for(int i=0; rc==0 && i<PACK_FILES; i++) {
+    char name[16];
+    snprintf(name,sizeof(name),"s%d",i);
+    rc = check_packed(store,name);
+    if (rc==0) rc = check_file(access,name,pack_size(i),pack_size(i),i+1);
+  }
+  if (rc==0) rc = check_packed(store,"f/p");
+  // the folder listing is served from the index
+  DIR *dp = opendir(access);
+  if (rc==0 && dp==NULL) {
+    perror("Failed to open folder");
+    rc = 1;
+  }
+  int count = 0;
+  struct dirent *dent;
+  while (dp!=NULL && (dent = readdir(dp))!=NULL) {
+    if (dent->d_name[0]=='s') count++;
+    if (rc==0 && !strcmp(dent->d_name,".safefs-pack")) {
+      fprintf(stderr,"Folder lists the segment folder\n");
+      rc = 1;
+    }
+  }
+  if (dp!=NULL) closedir(dp);
+  if (rc==0 && count!=PACK_FILES) {
+    fprintf(stderr,"Folder lists %d packed files instead of %d\n",count,PACK_FILES);
+    rc = 1;
+  }
+  if (rc==0 && count_entries(store,".safefs-pack")==0) {
+    fprintf(stderr,"Store holds no segments\n");
+    rc = 1;
+  }
+  return rc;
+}
+
+int check_pack_move(const char* store, const char* access) {
+  fprintf(stderr,"Check that a packed file growing past the limit moves out under every handle\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%ss1",access);
+  int fd = open(fpath, O_RDWR);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int other = open(fpath, O_RDONLY);
+  if (other<0) {
+    perror("Failed to open file twice");
+    close(fd);
+    return 1;
+  }
+  int rc = write_pattern(fd,0,PACK_LIMIT+5000,2);
+  if (rc==0 && fsync(fd)<0) {
+    perror("Failed to sync file");
+    rc = 1;
+  }
+  if (rc==0 && store_size(store,"s1")!=STORE_HEADER+PACK_LIMIT+5000) {
+    fprintf(stderr,"Store file is %lld bytes after moving out\n",(long long)store_size(store,"s1"));
+    rc = 1;
+  }
+  if (rc==0) rc = check_size(other,PACK_LIMIT+5000);
+  if (rc==0) rc = read_pattern(other,0,PACK_LIMIT+5000,2);
+  close(other);
+  close(fd);
+  return rc;
+}
+
+static int check_pack_grown(const char* access) {
+  // past the end of the record it moved out with, a file grown by truncate reads garbage as any file does without -sparse
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%ss2",access);
+  int fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = check_size(fd,PACK_LIMIT+4000);
+  if (rc==0) rc = read_pattern(fd,0,50,3);
+  if (rc==0) rc = read_pattern(fd,50,3000,0);
+  close(fd);
+  return rc;
+}
+
+int check_pack_truncate(const char* store, const char* access) {
+  fprintf(stderr,"Check that a packed file shrinks and grows with zeros, and moves out when grown past the limit\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%ss2",access);
+  int rc = 0;
+  if (truncate(fpath,50)<0 || truncate(fpath,3000)<0) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_file(access,"s2",3000,50,3);
+  if (rc==0) rc = check_packed(store,"s2");
+  if (rc==0 && truncate(fpath,PACK_LIMIT+4000)<0) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_pack_grown(access);
+  if (rc==0 && store_size(store,"s2")!=STORE_HEADER+PACK_LIMIT+4000) {
+    fprintf(stderr,"Store file is %lld bytes after growing past the limit\n",(long long)store_size(store,"s2"));
+    rc = 1;
+  }
+  return rc;
+}
+
+int check_pack_rename_unlink(const char* store, const char* access) {
+  fprintf(stderr,"Check that packed files are renamed, unlinked and unlinked while open\n");
+  char fpath[PATH_MAX];
+  char fpath2[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%ss3",access);
+  snprintf(fpath2,sizeof(fpath2),"%st3",access);
+  int rc = 0;
+  if (rename(fpath,fpath2)<0) {
+    perror("Failed to rename file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_file(access,"t3",pack_size(3),pack_size(3),4);
+  if (rc==0) rc = check_packed(store,"t3");
+  struct stat stat;
+  if (rc==0 && lstat(fpath,&stat)==0) {
+    fprintf(stderr,"File is still found under its old name\n");
+    rc = 1;
+  }
+  snprintf(fpath,sizeof(fpath),"%sf",access);
+  snprintf(fpath2,sizeof(fpath2),"%sg",access);
+  if (rc==0 && rename(fpath,fpath2)<0) {
+    perror("Failed to rename folder");
+    rc = 1;
+  }
+  if (rc==0) rc = check_file(access,"g/p",pack_size(PACK_FILES),pack_size(PACK_FILES),PACK_FILES+1);
+  snprintf(fpath,sizeof(fpath),"%ss4",access);
+  if (rc==0 && unlink(fpath)<0) {
+    perror("Failed to unlink file");
+    rc = 1;
+  }
+  if (rc==0 && lstat(fpath,&stat)==0) {
+    fprintf(stderr,"File is still found after unlink\n");
+    rc = 1;
+  }
+  snprintf(fpath,sizeof(fpath),"%ss5",access);
+  int fd = rc==0 ? open(fpath, O_RDWR) : -1;
+  if (rc==0 && fd<0) {
+    perror("Failed to open file");
+    rc = 1;
+  }
+  if (rc==0 && unlink(fpath)<0) {
+    perror("Failed to unlink file");
+    rc = 1;
+  }
+  if (rc==0) rc = read_pattern(fd,0,pack_size(5),6);
+  if (fd>=0) close(fd);
+  return rc;
+}
+
+static int check_pack_gone(const char* access, const char* name) {
+  char fpath[PATH_MAX];
+  struct stat stat;
+  snprintf(fpath,sizeof(fpath),"%s%s",access,name);
+  if (lstat(fpath,&stat)==0) {
+    fprintf(stderr,"File %s is found again after a remount\n",name);
+    return 1;
+  }
+  return 0;
+}
+
+int check_pack_rename_long(const char* store, const char* access) {
+  fprintf(stderr,"Check that a folder is not renamed when a packed file in it would get too long a name\n");
+  // nested folders and a long name take the packed file to 3950 bytes, a folder name 200 bytes longer puts it past PATH_MAX
+  char fpath[PATH_MAX];
+  char fpath2[PATH_MAX];
+  char part[256];
+  memset(part,'n',200);
+  part[200] = 0;
+  size_t prefix = strlen(access);
+  size_t length = snprintf(fpath,sizeof(fpath),"%sr",access);
+  int depth = 0;
+  int rc = 0;
+  while (rc==0 && length-prefix+203<3950) {
+    if (mkdir(fpath,0700)<0) {
+      perror("Failed to create folder");
+      rc = 1;
+    }
+    length += snprintf(&fpath[length],sizeof(fpath)-length,"/%s",part);
+    depth++;
+  }
+  if (rc==0 && mkdir(fpath,0700)<0) {
+    perror("Failed to create folder");
+    rc = 1;
+  }
+  size_t name = 3950-(length-prefix)-1;
+  fpath[length] = '/';
+  memset(&fpath[length+1],'p',name);
+  fpath[length+1+name] = 0;
+  int fd = rc==0 ? open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600) : -1;
+  if (rc==0 && fd<0) {
+    perror("Failed to open file");
+    rc = 1;
+  }
+  if (rc==0) rc = write_pattern(fd,0,100,5);
+  if (fd>=0) close(fd);
+  if (rc==0) rc = check_packed(store,&fpath[prefix]);
+  char folder[PATH_MAX];
+  snprintf(folder,sizeof(folder),"%sr",access);
+  snprintf(fpath2,sizeof(fpath2),"%sr%s",access,part);
+  if (rc==0 && rename(folder,fpath2)==0) {
+    fprintf(stderr,"Folder was renamed past the longest name of a packed file\n");
+    rc = 1;
+  } else if (rc==0 && errno!=ENAMETOOLONG) {
+    perror("Folder rename failed with another error");
+    rc = 1;
+  }
+  if (rc==0) rc = check_file(access,&fpath[prefix],100,100,5);
+  // the folders come down from the deepest
+  unlink(fpath);
+  for(int i=depth; i>=0; i--) {
+    fpath[length] = 0;
+    rmdir(fpath);
+    length -= i>0 ? 201 : 0;
+  }
+  return rc;
+}
+
+int check_pack_remount(const char* store, const char* access) {
+  fprintf(stderr,"Check that the index rebuilt from the segments after a remount matches\n");
+  int rc = 0;
+  for(int i=6; rc==0 && i<PACK_FILES; i++) {
+    char name[16];
+    snprintf(name,sizeof(name),"s%d",i);
+    rc = check_file(access,name,pack_size(i),pack_size(i),i+1);
+  }
+  if (rc==0) rc = check_file(access,"s0",pack_size(0),pack_size(0),1);
+  if (rc==0) rc = check_file(access,"s1",PACK_LIMIT+5000,PACK_LIMIT+5000,2);
+  if (rc==0) rc = check_pack_grown(access);
+  if (rc==0) rc = check_file(access,"t3",pack_size(3),pack_size(3),4);
+  if (rc==0) rc = check_file(access,"g/p",pack_size(PACK_FILES),pack_size(PACK_FILES),PACK_FILES+1);
+  if (rc==0) rc = check_pack_gone(access,"s3");
+  if (rc==0) rc = check_pack_gone(access,"s4");
+  if (rc==0) rc = check_pack_gone(access,"s5");
+  if (rc==0) rc = check_pack_gone(access,"f");
+  return rc;
+}
+
+static int check_compressed(const char* store, const char* name, off_t most) {
+  // a compressed file takes no more than most bytes of the store past its header
+  off_t size = store_size(store,name);
+  if (size<0 || size>STORE_HEADER+most) {
+    fprintf(stderr,"Store file %s is %lld bytes instead of at most %lld\n",name,(long long)size,(long long)(STORE_HEADER+most));
+    return 1;
+  }
+  return 0;
+}
+
+int check_compress_store(const char* store, const char* access) {
+  fprintf(stderr,"Check that a file is stored compressed, keeps blocks that do not compress and leaves holes empty\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sz",access);
+  unlink(fpath);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = write_pattern(fd,0,8*COMPRESS_BLOCK+100,1);
+  if (rc==0 && fsync(fd)<0) {
+    perror("Failed to sync file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_compressed(store,"z",2*COMPRESS_BLOCK);
+  // a block of noise is stored as is
+  static unsigned char noise[COMPRESS_BLOCK];
+  unsigned int seed = 7;
+  for(size_t i=0; i<sizeof(noise); i++) noise[i] = rand_r(&seed);
+  if (rc==0 && pwrite(fd,noise,sizeof(noise),3*COMPRESS_BLOCK)!=(ssize_t)sizeof(noise)) {
+    perror("Failed to write to file");
+    rc = 1;
+  }
+  // far past the end, so the blocks between are holes
+  if (rc==0) rc = write_pattern(fd,40*COMPRESS_BLOCK+5,40*COMPRESS_BLOCK+105,2);
+  close(fd);
+  fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  static unsigned char data[COMPRESS_BLOCK];
+  if (rc==0) rc = check_size(fd,40*COMPRESS_BLOCK+105);
+  if (rc==0) rc = read_pattern(fd,0,3*COMPRESS_BLOCK,1);
+  if (rc==0 && (pread(fd,data,sizeof(data),3*COMPRESS_BLOCK)!=(ssize_t)sizeof(data) || memcmp(noise,data,sizeof(data)))) {
+    fprintf(stderr,"Incorrect data read from a block that does not compress\n");
+    rc = 1;
+  }
+  if (rc==0) rc = read_pattern(fd,4*COMPRESS_BLOCK,8*COMPRESS_BLOCK+100,1);
+  if (rc==0) rc = read_pattern(fd,8*COMPRESS_BLOCK+100,40*COMPRESS_BLOCK+5,0);
+  if (rc==0) rc = read_pattern(fd,40*COMPRESS_BLOCK+5,40*COMPRESS_BLOCK+105,2);
+  close(fd);
+  if (rc==0) rc = check_compressed(store,"z",6*COMPRESS_BLOCK);
+  return rc;
+}
+
+int check_compress_truncate(const char* store, const char* access) {
+  fprintf(stderr,"Check that a compressed file shrinks inside a block, grows with zeros and takes rewrites of committed blocks\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sz",access);
+  int fd = open(fpath, O_RDWR);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = 0;
+  if (ftruncate(fd,2*COMPRESS_BLOCK+7)<0 || truncate(fpath,5*COMPRESS_BLOCK)<0) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_size(fd,5*COMPRESS_BLOCK);
+  if (rc==0) rc = read_pattern(fd,0,2*COMPRESS_BLOCK+7,1);
+  if (rc==0) rc = read_pattern(fd,2*COMPRESS_BLOCK+7,5*COMPRESS_BLOCK,0);
+  // the first block is in the committed index, so it moves to a new slot
+  if (rc==0) rc = write_pattern(fd,0,COMPRESS_BLOCK+9,3);
+  if (rc==0 && fsync(fd)<0) {
+    perror("Failed to sync file");
+    rc = 1;
+  }
+  close(fd);
+  fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  if (rc==0) rc = check_size(fd,5*COMPRESS_BLOCK);
+  if (rc==0) rc = read_pattern(fd,0,COMPRESS_BLOCK+9,3);
+  if (rc==0) rc = read_pattern(fd,COMPRESS_BLOCK+9,2*COMPRESS_BLOCK+7,1);
+  if (rc==0) rc = read_pattern(fd,2*COMPRESS_BLOCK+7,5*COMPRESS_BLOCK,0);
+  close(fd);
+  if (rc==0 && truncate(fpath,0)<0) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_file(access,"z",0,0,0);
+  if (rc==0) rc = check_compressed(store,"z",COMPRESS_BLOCK);
+  return rc;
+}
+
+int check_compress_rename_unlink(const char* store, const char* access) {
+  fprintf(stderr,"Check that compressed files are renamed, unlinked and unlinked while open\n");
+  char fpath[PATH_MAX];
+  char fpath2[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sz",access);
+  snprintf(fpath2,sizeof(fpath2),"%sy",access);
+  int fd = open(fpath, O_RDWR);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = write_pattern(fd,0,3*COMPRESS_BLOCK+11,4);
+  close(fd);
+  if (rc==0 && rename(fpath,fpath2)<0) {
+    perror("Failed to rename file");
+    rc = 1;
+  }
+  if (rc==0) rc = check_file(access,"y",3*COMPRESS_BLOCK+11,3*COMPRESS_BLOCK+11,4);
+  if (rc==0) rc = check_compressed(store,"y",COMPRESS_BLOCK);
+  // unlinked with the block last written still held, which is read back through the open handle
+  fd = rc==0 ? open(fpath2, O_RDWR) : -1;
+  if (rc==0 && fd<0) {
+    perror("Failed to open file");
+    rc = 1;
+  }
+  if (rc==0) rc = write_pattern(fd,COMPRESS_BLOCK,COMPRESS_BLOCK+50,5);
+  if (rc==0 && unlink(fpath2)<0) {
+    perror("Failed to unlink file");
+    rc = 1;
+  }
+  if (rc==0) rc = read_pattern(fd,COMPRESS_BLOCK,COMPRESS_BLOCK+50,5);
+  if (rc==0) rc = read_pattern(fd,2*COMPRESS_BLOCK,3*COMPRESS_BLOCK+11,4);
+  if (fd>=0) close(fd);
+  struct stat stat;
+  if (rc==0 && lstat(fpath2,&stat)==0) {
+    fprintf(stderr,"File is still found after unlink\n");
+    rc = 1;
+  }
+  return rc;
+}
+
+int check_compress_keep(const char* store, const char* access) {
+  fprintf(stderr,"Check that a compressed file is left for the next mount\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sk",access);
+  unlink(fpath);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = write_pattern(fd,0,6*COMPRESS_BLOCK+13,6);
+  // committed once by the sync and again with the newer size and blocks when the handle is released
+  if (rc==0 && fsync(fd)<0) {
+    perror("Failed to sync file");
+    rc = 1;
+  }
+  if (rc==0 && ftruncate(fd,4*COMPRESS_BLOCK+3)<0) {
+    perror("Failed to truncate file");
+    rc = 1;
+  }
+  if (rc==0) rc = write_pattern(fd,COMPRESS_BLOCK,COMPRESS_BLOCK+500,7);
+  close(fd);
+  return rc;
+}
+
+int check_compress_remount(const char* store, const char* access) {
+  fprintf(stderr,"Check that a compressed file reads back from its superblock and index after a remount\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sk",access);
+  struct stat stat;
+  // the size comes from the superblock before the file is opened
+  if (lstat(fpath,&stat)<0) {
+    perror("Failed to check file");
+    return 1;
+  }
+  if (stat.st_size!=4*COMPRESS_BLOCK+3) {
+    fprintf(stderr,"File size is %lld instead of %lld\n",(long long)stat.st_size,(long long)(4*COMPRESS_BLOCK+3));
+    return 1;
+  }
+  int fd = open(fpath, O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open file");
+    return 1;
+  }
+  int rc = read_pattern(fd,0,COMPRESS_BLOCK,6);
+  if (rc==0) rc = read_pattern(fd,COMPRESS_BLOCK,COMPRESS_BLOCK+500,7);
+  if (rc==0) rc = read_pattern(fd,COMPRESS_BLOCK+500,4*COMPRESS_BLOCK+3,6);
+  close(fd);
+  if (rc==0) rc = check_compressed(store,"k",2*COMPRESS_BLOCK);
+  if (rc==0 && unlink(fpath)<0) {
+    perror("Failed to unlink file");
+    rc = 1;
+  }
+  if (rc==0 && store_size(store,"k")>=0) {
+    fprintf(stderr,"Store file is still found after unlink\n");
+    rc = 1;
+  }
+  return rc;
+}
+
+static const char* qos_access;
+
+static void* qos_writer(void* arg) {
+  // o_direct sends each write to the daemon as it is made rather than when the page cache is written back
+  long w = (long)arg;
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sq%ld",qos_access,w);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR | O_DIRECT, 0600);
+  if (fd<0) {
+    perror("Failed to create file");
+    return (void*)1;
+  }
+  unsigned char *data = NULL;
+  if (posix_memalign((void**)&data,4096,QOS_REQUEST)!=0) {
+    close(fd);
+    return (void*)1;
+  }
+  long rc = 0;
+  for(off_t ofs=0; rc==0 && ofs<QOS_FILE; ofs+=QOS_REQUEST) {
+    for(size_t i=0; i<QOS_REQUEST; i++) data[i] = pattern(ofs+i,w+1);
+    if (pwrite(fd,data,QOS_REQUEST,ofs)!=QOS_REQUEST) {
+      perror("Failed to write to file");
+      rc = 1;
+    }
+  }
+  for(off_t ofs=0; rc==0 && ofs<QOS_FILE; ofs+=QOS_REQUEST) {
+    if (pread(fd,data,QOS_REQUEST,ofs)!=QOS_REQUEST) {
+      perror("Failed to read file");
+      rc = 1;
+    }
+    for(size_t i=0; rc==0 && i<QOS_REQUEST; i++) {
+      if (data[i]!=pattern(ofs+i,w+1)) {
+        fprintf(stderr,"Incorrect data read at %lld\n",(long long)(ofs+i));
+        rc = 1;
+      }
+    }
+  }
+  free(data);
+  close(fd);
+  unlink(fpath);
+  return (void*)rc;
+}
+
+int check_qos_mixed(const char* store, const char* access) {
+  fprintf(stderr,"Check that small reads are answered while more bulk writers than fuse threads wait for a slot\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sqi",access);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR | O_DIRECT, 0600);
+  if (fd<0) {
+    perror("Failed to create file");
+    return 1;
+  }
+  int rc = write_pattern(fd,0,QOS_REQUEST,9);
+  qos_access = access;
+  pthread_t writers[QOS_WRITERS];
+  int started = 0;
+  for(long w=0; rc==0 && w<QOS_WRITERS; w++) {
+    if (pthread_create(&writers[w],NULL,qos_writer,(void*)w)==0) started++;
+    else rc = 1;
+  }
+  // random 4KB reads are interactive, none of them may sit behind the queue of bulk writes
+  unsigned char data[4096] __attribute__((aligned(4096)));
+  double slowest = 0;
+  for(int i=0; rc==0 && i<200; i++) {
+    off_t ofs = (off_t)(rand()%(QOS_REQUEST/4096))*4096;
+    struct timespec begin;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC,&begin);
+    if (pread(fd,data,sizeof(data),ofs)!=sizeof(data)) {
+      perror("Failed to read file");
+      rc = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    double seconds = (end.tv_sec-begin.tv_sec)+(end.tv_nsec-begin.tv_nsec)/1e9;
+    if (seconds>slowest) slowest = seconds;
+    for(size_t j=0; rc==0 && j<sizeof(data); j++) {
+      if (data[j]!=pattern(ofs+j,9)) {
+        fprintf(stderr,"Incorrect data read at %lld\n",(long long)(ofs+j));
+        rc = 1;
+      }
+    }
+  }
+  for(int w=0; w<started; w++) {
+    void *failed = NULL;
+    pthread_join(writers[w],&failed);
+    if (failed!=NULL) rc = 1;
+  }
+  close(fd);
+  unlink(fpath);
+  if (rc==0 && slowest>1.0) {
+    fprintf(stderr,"A small read took %.3f seconds under bulk load\n",slowest);
+    rc = 1;
+  }
+  return rc;
+}
+
+#ifdef __APPLE__
+int check_copy_range(const char* store, const char* access) {
+  // there is no copy_file_range on darwin
+  return 0;
+}
+#else
+int check_copy_range(const char* store, const char* access) {
+  fprintf(stderr,"Check that copy_file_range copies a range between files\n");
+  char fpath[PATH_MAX];
+  char fpath2[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sc",access);
+  snprintf(fpath2,sizeof(fpath2),"%sd",access);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to create file");
+    return 1;
+  }
+  int fd2 = open(fpath2, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd2<0) {
+    perror("Failed to create file");
+    close(fd);
+    return 1;
+  }
+  // the range starts and ends inside a block and is longer than one copy chunk of the daemon
+  int rc = write_pattern(fd,0,3000000,3);
+  if (rc==0) rc = write_pattern(fd2,0,3000000,0);
+  off_t in = 1000;
+  off_t out = 1000;
+  while (rc==0 && in<2501000) {
+    ssize_t done = copy_file_range(fd,&in,fd2,&out,2501000-in,0);
+    if (done<=0) {
+      perror("Failed to copy file range");
+      rc = 1;
+    }
+  }
+  if (rc==0) rc = check_size(fd2,3000000);
+  if (rc==0) rc = read_pattern(fd2,0,1000,0);
+  if (rc==0) rc = read_pattern(fd2,1000,2501000,3);
+  if (rc==0) rc = read_pattern(fd2,2501000,3000000,0);
+  if (rc==0) rc = read_pattern(fd,0,3000000,3);
+  close(fd);
+  close(fd2);
+  unlink(fpath);
+  unlink(fpath2);
+  return rc;
+}
+#endif
+
+int check_xattr_cache(const char* store, const char* access) {
+  fprintf(stderr,"Check that cached extended attributes follow set, rename and remove\n");
+  char fpath[PATH_MAX];
+  char fpath2[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%sx",access);
+  snprintf(fpath2,sizeof(fpath2),"%sy",access);
+  int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+  if (fd<0) {
+    perror("Failed to create file");
+    return 1;
+  }
+  close(fd);
+  char value[64];
+  int rc = 0;
+  if (setxattr(fpath,"user.safefs","one",3,0)<0) {
+    perror("Failed to set attribute");
+    rc = 1;
+  }
+  // the second read is answered from the cache
+  for(int i=0; rc==0 && i<2; i++) {
+    if (getxattr(fpath,"user.safefs",value,sizeof(value))!=3 || memcmp(value,"one",3)) {
+      fprintf(stderr,"Attribute does not read back as set\n");
+      rc = 1;
+    }
+  }
+  if (rc==0 && setxattr(fpath,"user.safefs","three",5,0)<0) {
+    perror("Failed to set attribute");
+    rc = 1;
+  }
+  if (rc==0 && (getxattr(fpath,"user.safefs",value,sizeof(value))!=5 || memcmp(value,"three",5))) {
+    fprintf(stderr,"Attribute reads back the cached value after it was set again\n");
+    rc = 1;
+  }
+  char names[256];
+  ssize_t size = rc==0 ? listxattr(fpath,names,sizeof(names)-1) : 0;
+  if (rc==0) {
+    names[size>0 ? size : 0] = 0;
+    int found = 0;
+    for(ssize_t i=0; i<size; i+=strlen(&names[i])+1) {
+      if (!strcmp("user.safefs",&names[i])) found = 1;
+    }
+    if (!found) {
+      fprintf(stderr,"Attribute is missing from the list\n");
+      rc = 1;
+    }
+  }
+  if (rc==0 && rename(fpath,fpath2)<0) {
+    perror("Failed to rename file");
+    rc = 1;
+  }
+  if (rc==0 && getxattr(fpath,"user.safefs",value,sizeof(value))>=0) {
+    fprintf(stderr,"Attribute is still found under the old name after rename\n");
+    rc = 1;
+  }
+  if (rc==0 && (getxattr(fpath2,"user.safefs",value,sizeof(value))!=5 || memcmp(value,"three",5))) {
+    fprintf(stderr,"Attribute is not found under the new name after rename\n");
+    rc = 1;
+  }
+  if (rc==0 && removexattr(fpath2,"user.safefs")<0) {
+    perror("Failed to remove attribute");
+    rc = 1;
+  }
+  if (rc==0 && getxattr(fpath2,"user.safefs",value,sizeof(value))>=0) {
+    fprintf(stderr,"Attribute is still found after remove\n");
+    rc = 1;
+  }
+  unlink(fpath);
+  unlink(fpath2);
+  return rc;
+}
+
+int check_warm_open(const char* store, const char* access) {
+  fprintf(stderr,"Check that files opened on a -w mount are written and read back\n");
+  char fpath[PATH_MAX];
+  int rc = 0;
+  // the files are left for the remount check, opening them again puts them in the warm set
+  for(int i=0; rc==0 && i<4; i++) {
+    snprintf(fpath,sizeof(fpath),"%sw%d",access,i);
+    int fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd<0) {
+      perror("Failed to create file");
+      return 1;
+    }
+    rc = write_pattern(fd,0,10000*(i+1),i+1);
+    close(fd);
+    for(int j=0; rc==0 && j<=i; j++) {
+      fd = open(fpath, O_RDONLY);
+      if (fd<0) {
+        perror("Failed to open file");
+        return 1;
+      }
+      rc = read_pattern(fd,0,10000*(i+1),i+1);
+      close(fd);
+    }
+  }
+  return rc;
+}
+
+int check_warm_remount(const char* store, const char* access) {
+  fprintf(stderr,"Check that the warm set was saved at unmount and files read back after the remount\n");
+  if (store_size(store,".safefs-warm")<=0) {
+    fprintf(stderr,"Warm set is missing from the store\n");
+    return 1;
+  }
+  char fpath[PATH_MAX];
+  int rc = 0;
+  for(int i=0; i<4; i++) {
+    snprintf(fpath,sizeof(fpath),"%sw%d",access,i);
+    int fd = open(fpath, O_RDONLY);
+    if (fd<0) {
+      perror("Failed to open file");
+      return 1;
+    }
+    if (rc==0) rc = check_size(fd,10000*(i+1));
+    if (rc==0) rc = read_pattern(fd,0,10000*(i+1),i+1);
+    close(fd);
+    unlink(fpath);
+  }
+  return rc;
+}
+
+int check_dense_seek(const char* store, const char* access) {
+  return check_seek(store,access,0);
+}
+
+int check_sparse_seek(const char* store, const char* access) {
+  return check_seek(store,access,1);
+}
+
+typedef int (*check)(const char* store, const char* access);
+
+// every mode runs these first
+static const check base_checks[] = {
+  check_file_create,
+  check_file_write,
+  check_file_read,
+  check_file_truncate,
+  check_file_unlink,
+  check_random_write_test,
+  check_copy_range,
+};
+
+// a mode is named by its daemon flag, the checks that hold only for it follow the base checks
+#define MODE_CHECKS 6
+struct mode {
+  const char* flag;
+  check checks[MODE_CHECKS];
+  check remount;
+};
+
+static const struct mode modes[] = {
+  { "", { check_rainbow_test, check_preallocate, check_stats_file, check_dense_seek }, NULL },
+  { "-sparse", { check_rainbow_test, check_preallocate, check_stats_file, check_sparse_seek }, NULL },
+  { "-mmap", { check_rainbow_test, check_preallocate, check_stats_file, check_dense_seek }, NULL },
+  { "-direct", { check_rainbow_test, check_preallocate, check_stats_file, check_dense_seek }, NULL },
+  { "-x", { check_rainbow_test, check_xattr_cache }, NULL },
+  { "-w", { check_rainbow_test, check_warm_open }, check_warm_remount },
+  { "-q", { check_rainbow_test, check_qos_mixed }, NULL },
+  { "-chunk", { check_chunk_split, check_chunk_manifest_forgery, check_chunk_truncate, check_chunk_rename_unlink, check_chunk_keep }, check_chunk_remount },
+  { "-pack", { check_pack_small, check_pack_move, check_pack_truncate, check_pack_rename_unlink, check_pack_rename_long }, check_pack_remount },
+  { "-compress", { check_compress_store, check_compress_truncate, check_compress_rename_unlink, check_compress_keep }, check_compress_remount },
+};
+
+static const struct mode* find_mode(const char* flag) {
+  // the number the daemon takes after -x, -w and -q may be left on, -q1 is -q
+  for(size_t i=0; i<sizeof(modes)/sizeof(modes[0]); i++) {
+    size_t len = strlen(modes[i].flag);
+    if (!strncmp(modes[i].flag,flag,len) && strspn(&flag[len],"0123456789")==strlen(&flag[len])) {
+      if (len>0 || strlen(flag)==0) return &modes[i];
+    }
+  }
+  return NULL;
+}
+
 int main(int argc, char** argv) {
+  // a mount mode runs the checks that hold for it, -remount checks what the run before the remount left
+  const char* flag = "";
+  int remount = 0;
+  while (argc>3 && argv[1][0]=='-') {
+    if (!strcmp("-remount",argv[1])) remount = 1;
+    else flag = argv[1];
+    argc--;
+    argv++;
+  }
+  const struct mode* mode = find_mode(flag);
+  if (argc!=3 || mode==NULL || (remount && mode->remount==NULL)) {
+    fprintf(stderr,"Syntax: safefs-test [-sparse|-mmap|-direct|-x|-w|-q|-chunk|-pack|-compress] [-remount] <store-path>/ <mount-point>/\n");
+    return 1;
+  }
   char* store = argv[1];
   char* access = argv[2];
+  if (remount) return mode->remount(store,access);
   int rc = 0;
-  rc |= check_file_create(store,access);
-  rc |= check_file_write(store,access);
-  rc |= check_file_read(store,access);
-  rc |= check_file_truncate(store,access);
-  rc |= check_file_unlink(store,access);
-  rc |= check_rainbow_test(store,access);
-  rc |= check_random_write_test(store,access);
+  for(size_t i=0; i<sizeof(base_checks)/sizeof(base_checks[0]); i++) rc |= base_checks[i](store,access);
+  for(int i=0; i<MODE_CHECKS && mode->checks[i]!=NULL; i++) rc |= mode->checks[i](store,access);
   return rc;
 }
-
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+int data_ascii = 0;
+
+void dump_record(trace_record* record) {
+  // same layout the daemon used to write to the log file in -trace mode
+  time_t record_time = record->time_ns/1000000000ULL;
+  struct tm *tm = localtime(&record_time);
+  char buf[30];
+  asctime_r(tm,buf);
+  buf[strlen(buf)-1]=0;
+  uint64_t width = record->width ? record->width : 64;
+  printf("%s : %-14.*s : %.*s : offset=%llu size=%u",buf,record->cmd_len,record->cmd,record->type_len,record->type,
+    (unsigned long long)record->offset,record->size);
+  for(uint64_t ptr=0; ptr<record->size; ptr++) {
+    if ((ptr%width)==0) printf("\n%08llx",(unsigned long long)(record->offset+ptr));
+    if (data_ascii && record->data[ptr]>31 && record->data[ptr]<127) {
+      printf("  %c",record->data[ptr]);
+    } else {
+      printf(" %02x",record->data[ptr]);
+    }
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  char *path = NULL;
+  for(int i=1; i<argc; i++) {
+    if (!strcmp("-dump-ascii",argv[i])) data_ascii = 1;
+    else path = argv[i];
+  }
+  if (path==NULL) {
+    fprintf(stderr,"Syntax: safefs-tracedump [-dump-ascii] <trace-file-path>\n");
+    exit(1);
+  }
+  int fd = open(path,O_RDONLY);
+  if (fd<0) {
+    perror("Failed to open trace file");
+    exit(1);
+  }
+  unsigned char header[TRACE_FILE_HEADER];
+  if (read(fd,header,sizeof(header))!=sizeof(header) || trace_check_file_header(header)<0) {
+    fprintf(stderr,"Not a safefs trace file\n");
+    close(fd);
+    exit(1);
+  }
+  size_t capacity = 1048576;
+  size_t used = 0;
+  unsigned char *buf = malloc(capacity);
+  if (buf==NULL) {
+    fprintf(stderr,"Out of memory\n");
+    exit(1);
+  }
+  int rc = 0;
+  for(;;) {
+    ssize_t len = read(fd,&buf[used],capacity-used);
+    if (len<0) {
+      if (errno==EINTR) continue;
+      perror("Failed to read trace file");
+      rc = 1;
+      break;
+    }
+    used += len;
+    size_t pos = 0;
+    trace_record record;
+    int n;
+    while ((n = trace_decode(&buf[pos],used-pos,&record))>0) {
+      dump_record(&record);
+      pos += n;
+    }
+    if (n<0) {
+      fprintf(stderr,"Corrupt trace record\n");
+      rc = 1;
+      break;
+    }
+    memmove(buf,&buf[pos],used-pos);
+    used -= pos;
+    if (len==0) {
+      // a daemon killed before unmount can leave a partial record at the end
+      if (used>0) fprintf(stderr,"Truncated trace record at end of file\n");
+      break;
+    }
+    if (used==capacity || (used>=TRACE_RECORD_HEADER && record.length>capacity)) {
+      size_t grown = capacity*2;
+      while (used>=TRACE_RECORD_HEADER && record.length>grown) grown *= 2;
+      unsigned char *bigger = realloc(buf,grown);
+      if (bigger==NULL) {
+        fprintf(stderr,"Out of memory\n");
+        rc = 1;
+        break;
+      }
+      buf = bigger;
+      capacity = grown;
+    }
+  }
+  free(buf);
+  close(fd);
+  return rc;
+}
@@ -52,186 +52,718 @@
 #include <pwd.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/mman.h>
 
-#include "cipher.h"
 #include "logging.h"
 #include "state.h"
-#include "md5.h"
+#include "stats.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+#include "lockprof.h"
+#include "cache.h"
+#include "map.h"
+#include "pool.h"
+#include "chunk.h"
+#include "pack.h"
+#include "compress.h"
+#include "qos.h"
+#include "xattr.h"
+#include "warm.h"
+
+#ifndef __APPLE__
+// only macOS has resource forks so elsewhere extended attributes take no position or options,
+// the options that remain are the create or replace flags which libfuse passes through as they are
+#define getxattr(path,name,val,size,pos,opts) getxattr(path,name,val,size)
+#define setxattr(path,name,val,size,pos,opts) setxattr(path,name,val,size,opts)
+#define listxattr(path,names,size,opts) listxattr(path,names,size)
+#define removexattr(path,name,opts) removexattr(path,name)
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+#endif
+
+#ifdef SAFEFS_FUSE3
+// libfuse 3 fillers also take flags, for entries found by readdirplus
+#define fill_dir(filler,buf,name,st) (filler)(buf,name,st,0,0)
+#else
+#define fill_dir(filler,buf,name,st) (filler)(buf,name,st,0)
+#endif
+
+int calculate_and_write_rotor_to_fh(sfs_header* header, int fh, const char* cmd, const char* path, struct y_state *y_state) {
+  int rc = 0;
+  unsigned char out[SFS_HEADER];
+  pool_take(&y_state->store,header,out);
+  logdata(cmd,"rotor plain text",16,0,header->f_ring,SFS_ROTOR);
+  logdata(cmd,"rotor cipher text",16,0,&out[SFS_SALT],SFS_ROTOR);
+  // the salt and the encoded rotor are written together
+  SYS_TIMED(rc,STATS_SYS_PWRITE,"pwrite",fh,0,SFS_HEADER,pwrite(fh,out,SFS_HEADER,0));
+  memset(out,0,SFS_HEADER);
+  if (rc<0) {
+    rc = logerr(cmd,"pwrite failed for write header: %s",path);
+    return rc;
+  } else if (rc!=SFS_HEADER) {
+    logerr(cmd,"pwrite failed for write header: %s",path);
+    rc = -EIO;
+    return rc;
+  } else {
+    rc = 0;
+  }
+  return rc;
+}
 
-void calculate_rotor_digest_from_salt(unsigned char salt[4], unsigned char* rotor_digest, struct y_state *y_state) {
-  MD5_CTX context;
-  MD5Init (&context);
-  MD5Update (&context, y_state->offsets, 8);
-  MD5Update (&context, y_state->safe_digest, 16);
-  MD5Update (&context, y_state->offsets, 8);
-  MD5Update (&context, salt, 4);
-  MD5Final (rotor_digest, &context);
+int calculate_and_write_rotor(const char* cmd, const char* path, btnode* node, struct fuse_file_info* info, struct y_state *y_state) {
+  return calculate_and_write_rotor_to_fh(&node->header, info->fh, cmd, path, y_state);
 }
 
-// calculate the MD5 hash to use to encode the rotors
-void calculate_salt_and_rotor_digest(unsigned char salt[4], unsigned char* rotor_digest, struct y_state *y_state) {
+int resolve(const char* path, char fpath[PATH_MAX]) {
+  return sfs_resolve(&Y_STATE->store,path,fpath);
+}
+
+// the statistics report is served as a read-only virtual file in the mount root
+int is_stats_file(const char* path) {
+  return (path!=NULL && !strcmp("/.safefs-stats",path));
+}
 
-  // calculate the random salt
-  for(int i=0; i<4; i++) {
-    salt[i] = random();
+void stat_stats_file(struct stat *stat) {
+  memset(stat,0,sizeof(struct stat));
+  stat->st_mode = S_IFREG | 0444;
+  stat->st_nlink = 1;
+  stat->st_uid = getuid();
+  stat->st_gid = getgid();
+  stat->st_mtime = time(NULL);
+  stat->st_atime = stat->st_mtime;
+  stat->st_ctime = stat->st_mtime;
+}
+
+int open_stats_file(struct fuse_file_info *info) {
+  if ((info->flags&O_ACCMODE)!=O_RDONLY) return -EACCES;
+  // render a snapshot on open so that every read of the handle sees a consistent report
+  char *text;
+  size_t size;
+  int rc = stats_report(&text,&size);
+  if (rc<0) return rc;
+  // a descriptor on /dev/null gives the handle a unique key in the node list
+  int fd = open("/dev/null",O_RDONLY);
+  if (fd<0) {
+    rc = logerr("y_open","open /dev/null for stats");
+    free(text);
+    return rc;
   }
+  info->fh = fd;
+  // the file has no size so its reads must reach us rather than the page cache
+  info->direct_io = 1;
+  btnode* node = addLink(fd,&Y_STATE->list);
+  node->report = text;
+  node->report_size = size;
+  return 0;
+}
 
-  // calculate the digest to use for encoding the rotor
-  calculate_rotor_digest_from_salt(salt,rotor_digest,y_state);
+int read_report(btnode *node, char *data, size_t size, off_t ofs) {
+  if (ofs>=(off_t)node->report_size) return 0;
+  if (size>node->report_size-ofs) size = node->report_size-ofs;
+  memcpy(data,&node->report[ofs],size);
+  return size;
+}
 
+int encipher_and_write(const char *cmd, const char *path, sfs_header *header, int fh, off_t ofs, unsigned char *buf, size_t size) {
+  CIPHER_TIMED(STATS_ENCIPHER,"encipher",fh,ofs,size,sfs_encipher(&Y_STATE->store,header,ofs,buf,size));
+  ssize_t rc;
+  SYS_TIMED(rc,STATS_SYS_PWRITE,"pwrite",fh,sfs_backing_offset(ofs),size,pwrite(fh,buf,size,sfs_backing_offset(ofs)));
+  if (rc<0) return logerr(cmd,"pwrite fh=%d ofs=%d size=%d path=%s",fh,ofs,size,path);
+  if ((size_t)rc!=size) return -EIO;
+  return 0;
 }
 
-int calculate_and_write_rotor_to_fh(unsigned char* f_ring, unsigned char* r_ring, unsigned char salt[4], unsigned char rotor_digest[16], int fh, const char* cmd, const char* path, struct y_state *y_state) {
+int write_zeros(const char *cmd, const char *path, sfs_header *header, int fh, off_t ofs, off_t len) {
+  // zero bytes in the backing file decipher to garbage so the plain text zeros are enciphered like any write
+  size_t chunk = len<SFS_COPY_CHUNK ? len : SFS_COPY_CHUNK;
+  unsigned char *buf = malloc(chunk>0 ? chunk : 1);
+  if (buf==NULL) return -ENOMEM;
   int rc = 0;
-  calculate_salt_and_rotor_digest(salt,rotor_digest,y_state);
-  generate_random_rotor(f_ring,r_ring);
-  unsigned char out[256];
-  memcpy(out,f_ring,256);
-  logdata(cmd,"rotor plain text",16,0,out,256);
-  encode_rotor(out,rotor_digest);
-  logdata(cmd,"rotor cipher text",16,0,out,256);
-  rc = pwrite(fh,salt,4,0);
-  if (rc<0) {
-    rc = logerr(cmd,"pwrite failed for write salt: %s",path);
-    return rc;
-  } else if (rc!=4) {
-    logerr(cmd,"pwrite failed for write salt: %s",path);
-    rc = -EIO;
-    return rc;
+  for(off_t done=0; rc==0 && done<len; done+=chunk) {
+    size_t size = len-done<(off_t)chunk ? (size_t)(len-done) : chunk;
+    memset(buf,0,size);
+    rc = encipher_and_write(cmd,path,header,fh,ofs+done,buf,size);
   }
-  rc = pwrite(fh,out,256,4);
-  memset(out,0,256);
+  free(buf);
+  return rc;
+}
+
+int stat_backing(const char *cmd, const char *path, int fh, struct stat *st) {
+  int rc;
+  SYS_TIMED(rc,STATS_SYS_STAT,"fstat",fh,0,0,fstat(fh,st));
+  if (rc<0) return logerr(cmd,"fstat fh=%d path=%s",fh,path);
+  if (st->st_blksize<=0) st->st_blksize = 4096;
+  return 0;
+}
+
+// sparse mounts serialise the changes to each backing file so padding never lands on bytes another thread is writing
+#define SPARSE_LOCKS 64
+pthread_mutex_t mutexsparse[SPARSE_LOCKS];
+
+pthread_mutex_t* lock_sparse(int fh) {
+  struct stat st;
+  pthread_mutex_t *mutex = &mutexsparse[fstat(fh,&st)<0 ? 0 : st.st_ino%SPARSE_LOCKS];
+  lockprof_lock(mutex,LOCK_SPARSE);
+  return mutex;
+}
+
+void unlock_sparse(pthread_mutex_t *mutex) {
+  lockprof_unlock(mutex,LOCK_SPARSE);
+}
+
+int pad_end_of_file(const char *cmd, const char *path, sfs_header *header, int fh, off_t eof, off_t blk, off_t limit) {
+  // the rest of the block holding the end of file is zero bytes that become visible when the file grows
+  if (eof%blk==0) return 0;
+  off_t block = eof-eof%blk;
+  off_t end = block+blk<limit ? block+blk : limit;
+  if (end<=eof || !sfs_backing_data(fh,block,eof)) return 0;
+  return write_zeros(cmd,path,header,fh,eof-SFS_HEADER,end-eof);
+}
+
+int sparse_grow(const char *cmd, const char *path, sfs_header *header, int fh, off_t size) {
+  struct stat st;
+  int rc = stat_backing(cmd,path,fh,&st);
+  if (rc==0 && sfs_backing_offset(size)>st.st_size) {
+    rc = pad_end_of_file(cmd,path,header,fh,st.st_size,st.st_blksize,sfs_backing_offset(size));
+  }
+  return rc;
+}
+
+int is_zero(const char *data, size_t size) {
+  for(size_t i=0; i<size; i++) {
+    if (data[i]) return 0;
+  }
+  return 1;
+}
+
+int sparse_write(const char *path, btnode *node, struct fuse_file_info *info, const char *data, size_t size, off_t ofs) {
+  struct stat st;
+  int rc = stat_backing("y_write",path,info->fh,&st);
+  if (rc<0) return rc;
+  off_t blk = st.st_blksize;
+  off_t eof = st.st_size;
+  off_t b = sfs_backing_offset(ofs);
+  off_t e = b+size;
+  // zeros written over a hole leave the hole in place and only the size changes
+  if (is_zero(data,size) && !sfs_backing_data(info->fh,b,e)) {
+    if (e>eof) {
+      rc = pad_end_of_file("y_write",path,&node->header,info->fh,eof,blk,e);
+      if (rc==0) {
+        SYS_TIMED(rc,STATS_SYS_TRUNCATE,"ftruncate",info->fh,e,0,ftruncate(info->fh,e));
+        if (rc<0) rc = logerr("y_write","ftruncate fh=%d path=%s",info->fh,path);
+      }
+    }
+    return rc<0 ? rc : (int)size;
+  }
+  // the rest of each block the write allocates must hold enciphered zeros rather than zero bytes
+  off_t lo = b;
+  off_t hi = e;
+  off_t head = b-b%blk;
+  if (head<b) {
+    if (!sfs_backing_data(info->fh,head,b)) lo = head;
+    else if (eof>head && eof<b) lo = eof;
+  }
+  if (lo<SFS_HEADER) lo = SFS_HEADER;
+  if (eof<head) rc = pad_end_of_file("y_write",path,&node->header,info->fh,eof,blk,head);
+  off_t tail = e%blk ? e-e%blk+blk : e;
+  if (e<eof && e<tail) {
+    off_t limit = tail<eof ? tail : eof;
+    if (!sfs_backing_data(info->fh,e,limit)) hi = limit;
+  }
+  unsigned char *buf = rc==0 ? calloc(1,hi-lo) : NULL;
+  if (rc==0 && buf==NULL) rc = -ENOMEM;
+  if (rc==0) {
+    memcpy(&buf[b-lo],data,size);
+    rc = encipher_and_write("y_write",path,&node->header,info->fh,lo-SFS_HEADER,buf,hi-lo);
+    free(buf);
+  }
+  return rc<0 ? rc : (int)size;
+}
+
+int sparse_truncate(const char *path, const char *fpath, off_t off) {
+  int fh;
+  SYS_TIMED(fh,STATS_SYS_OPEN,"open",-1,0,0,open(fpath,O_RDWR));
+  if (fh<0) return logerr("y_truncate","open path=%s",path);
+  unsigned char in[SFS_HEADER];
+  sfs_header header;
+  int rc;
+  SYS_TIMED(rc,STATS_SYS_PREAD,"pread",fh,0,SFS_HEADER,pread(fh,in,SFS_HEADER,0));
   if (rc<0) {
-    rc = logerr(cmd,"pwrite failed for write rotor: %s",path);
-    return rc;
-  } else if (rc!=256) {
-    logerr(cmd,"pwrite failed for write rotor: %s",path);
+    rc = logerr("y_truncate","pread failed to read header path=%s",path);
+  } else if (rc!=SFS_HEADER) {
+    logerr("y_truncate","pread failed to read header path=%s",path);
     rc = -EIO;
-    return rc;
   } else {
-    rc = 0;
+    sfs_decode_header(&Y_STATE->store,in,&header);
+    pthread_mutex_t *mutex = lock_sparse(fh);
+    rc = sparse_grow("y_truncate",path,&header,fh,off);
+    if (rc==0) {
+      SYS_TIMED(rc,STATS_SYS_TRUNCATE,"ftruncate",fh,sfs_backing_offset(off),0,ftruncate(fh,sfs_backing_offset(off)));
+      if (rc<0) rc = logerr("y_truncate","ftruncate path=%s offset=%d",path,off);
+    }
+    unlock_sparse(mutex);
   }
+  memset(in,0,SFS_HEADER);
+  memset(&header,0,sizeof(sfs_header));
+  close(fh);
   return rc;
 }
 
-int calculate_and_write_rotor(const char* cmd, const char* path, btnode* node, struct fuse_file_info* info, struct y_state *y_state) {
-  return calculate_and_write_rotor_to_fh(node->f_ring, node->r_ring, node->salt, node->rotor_digest, info->fh, cmd, path, y_state);
-}
+// a -direct mount moves file data through a second handle that bypasses the page cache, so only plain text stays in memory
+#define DIRECT_ALIGN 4096
+#define DIRECT_LOCKS 64
+pthread_mutex_t mutexdirect[DIRECT_LOCKS];
+pthread_key_t direct_key;
 
-int is_ds_store(const char* path) {
-  return (path!=NULL & strlen(path)>=10 && !strcmp("/.DS_Store",&path[strlen(path)-10]));
+struct direct_buffer {
+  unsigned char *data;
+  size_t size;
+};
+
+void direct_free(void *arg) {
+  struct direct_buffer *buffer = arg;
+  free(buffer->data);
+  free(buffer);
 }
 
-void resolve(const char* path, char fpath[PATH_MAX]) {
-  strcpy(fpath,Y_STATE->rootdir);
-  strncat(fpath,path,PATH_MAX-strlen(Y_STATE->rootdir));
-  if (is_ds_store(path)) {
-    strcat(fpath,".");
+unsigned char* direct_buffer(size_t size) {
+  // each fuse thread keeps one aligned bounce buffer and grows it to the largest request it has seen
+  struct direct_buffer *buffer = pthread_getspecific(direct_key);
+  if (buffer==NULL) {
+    if ((buffer = calloc(1,sizeof(struct direct_buffer)))==NULL) return NULL;
+    pthread_setspecific(direct_key,buffer);
   }
+  if (buffer->size<size) {
+    void *data = NULL;
+    if (posix_memalign(&data,DIRECT_ALIGN,size)!=0) return NULL;
+    free(buffer->data);
+    buffer->data = data;
+    buffer->size = size;
+  }
+  return buffer->data;
 }
 
-void determine_rotor_offsets(struct y_state *y_state, char *pwd) {
+// partially covered blocks are read, patched and written back so writes to each backing file are serialised
+pthread_mutex_t* lock_direct(ino_t ino) {
+  pthread_mutex_t *mutex = &mutexdirect[ino%DIRECT_LOCKS];
+  lockprof_lock(mutex,LOCK_DIRECT);
+  return mutex;
+}
 
-  // calculate the rotor offsets from the pin code
-  memset(y_state->offsets,0,8);
-  for(int i=0; i<8; i++) {
-    y_state->offsets[i] = 0;
-    for(int j=0; j<6; j++) {
-      y_state->offsets[i] <<= 1;
-      y_state->offsets[i] += (i+j);
-      y_state->offsets[i] += pwd[(i+j)%10];
-    }
+void unlock_direct(pthread_mutex_t *mutex) {
+  if (mutex!=NULL) lockprof_unlock(mutex,LOCK_DIRECT);
+}
+
+pthread_mutex_t* lock_direct_node(btnode *node) {
+  return node!=NULL && node->direct>=0 ? lock_direct(node->ino) : NULL;
+}
+
+pthread_mutex_t* lock_direct_path(const char *fpath) {
+  struct stat st;
+  if (!Y_STATE->direct) return NULL;
+  int rc;
+  SYS_TIMED(rc,STATS_SYS_STAT,"lstat",-1,0,0,lstat(fpath,&st));
+  return rc==0 ? lock_direct(st.st_ino) : NULL;
+}
+
+static int open_uncached(const char *fpath, int mode) {
+#ifdef __APPLE__
+  int fd = open(fpath,mode);
+  if (fd>=0 && fcntl(fd,F_NOCACHE,1)<0) {
+    close(fd);
+    fd = -1;
   }
+  return fd;
+#else
+  return open(fpath,mode | O_DIRECT);
+#endif
+}
 
-  // calculate the MD5 hash to use to check the correct pin was entered
-  {
-    MD5_CTX context;
-    MD5Init (&context);
-    MD5Update (&context, y_state->offsets, 8);
-    MD5Update (&context, pwd, 8);
-    MD5Update (&context, y_state->offsets, 8);
-    MD5Final (y_state->safe_digest, &context);
+void direct_open(btnode *node, const char *fpath, int flags) {
+  struct stat st;
+  if (!Y_STATE->direct) return;
+  // the handle always reads because the edges of an unaligned write are read back first
+  int mode = (flags & O_ACCMODE)==O_RDONLY ? O_RDONLY : O_RDWR;
+  int fd;
+  SYS_TIMED(fd,STATS_SYS_OPEN,"open",-1,0,0,open_uncached(fpath,mode));
+  if (fd>=0 && fstat(fd,&st)<0) {
+    close(fd);
+    fd = -1;
+  }
+  // a backing file system without direct i/o is used through the cached handle instead
+  if (fd<0) {
+    logdebug("direct_open","failed to open uncached path=%s",fpath);
+    return;
   }
+  node->direct = fd;
+  node->dev = st.st_dev;
+  node->ino = st.st_ino;
+}
 
+void direct_close(btnode *node) {
+  if (node==NULL || node->direct<0) return;
+  int rc;
+  SYS_TIMED(rc,STATS_SYS_CLOSE,"close",node->direct,0,0,close(node->direct));
+  node->direct = -1;
 }
 
-void check_rotor_offsets_match(struct y_state *y_state) {
+ssize_t direct_pread(int fh, unsigned char *buf, size_t size, off_t ofs) {
+  ssize_t rc;
+  SYS_TIMED(rc,STATS_SYS_PREAD,"pread",fh,ofs,size,pread(fh,buf,size,ofs));
+  return rc;
+}
 
-  // determine the path of .safefs in the store
-  char fpath[PATH_MAX];
-  strcpy(fpath,y_state->rootdir);
-  strcat(fpath,"/.safefs");
+int direct_read(const char *path, btnode *node, struct fuse_file_info *info, char *data, size_t size, off_t ofs) {
+  // the aligned span around the request is read and deciphered out of the bounce buffer into the reply
+  off_t b = sfs_backing_offset(ofs);
+  off_t lo = b-b%DIRECT_ALIGN;
+  off_t hi = (b+size+DIRECT_ALIGN-1)/DIRECT_ALIGN*DIRECT_ALIGN;
+  unsigned char *buf = direct_buffer(hi-lo);
+  if (buf==NULL) return -ENOMEM;
+  ssize_t got = direct_pread(node->direct,buf,hi-lo,lo);
+  if (got<0) return logerr("y_read","pread fh=%d ofs=%d size=%d path=%s",node->direct,ofs,size,path);
+  int rc = got>b-lo ? got-(b-lo) : 0;
+  if (rc>(int)size) rc = size;
+  if (trace_on) logdata("y_read","cipher text",64,ofs,&buf[b-lo],rc);
+  CIPHER_TIMED(STATS_DECIPHER,"decipher",info->fh,ofs,rc,sfs_decipher_to(&Y_STATE->store,&node->header,ofs,&buf[b-lo],(unsigned char*)data,rc));
+  if (trace_on) logdata("y_read","plain text",64,ofs,(unsigned char*)data,rc);
+  return rc;
+}
 
-  // check the .safefs file or create it if missing
-  int fd = open(fpath,O_RDONLY,0600);
-  if (fd<0) {
-    // cant open so try to create it
-    fd = open(fpath,O_CREAT | O_TRUNC | O_WRONLY | O_EXCL,0600);
-    if (fd<0) {
-      perror("Failed to create .safefs");
-      exit(1);
-    } else {
-      // write the rotor settings for the file
-      unsigned char f_ring[256];
-      unsigned char r_ring[256];
-      unsigned char salt[4];
-      unsigned char rotor_digest[16];
-      int rc = calculate_and_write_rotor_to_fh(f_ring, r_ring, salt, rotor_digest, fd, "initialise", ".safefs", y_state);
-      if (rc!=0) {
-        perror("Failed to write rotor to .safefs");
-        close(fd);
-        exit(1);
+int direct_edge(const char *path, btnode *node, unsigned char *buf, off_t block) {
+  // a block that is only partly written keeps the rest of its bytes, anything past the end of file is zeros
+  ssize_t got = direct_pread(node->direct,buf,DIRECT_ALIGN,block);
+  if (got<0) return logerr("y_write","pread fh=%d ofs=%d size=%d path=%s",node->direct,block,DIRECT_ALIGN,path);
+  memset(&buf[got],0,DIRECT_ALIGN-got);
+  return 0;
+}
+
+int direct_write(const char *path, btnode *node, struct fuse_file_info *info, const char *data, size_t size, off_t ofs) {
+  struct stat st;
+  off_t b = sfs_backing_offset(ofs);
+  off_t e = b+size;
+  int rc = stat_backing("y_write",path,node->direct,&st);
+  if (rc<0) return rc;
+  off_t lo = b-b%DIRECT_ALIGN;
+  off_t hi = (e+DIRECT_ALIGN-1)/DIRECT_ALIGN*DIRECT_ALIGN;
+  // a last block that reaches past the end of file goes through the cached handle so the file never grows past e
+  off_t end = e==hi || hi<=st.st_size ? hi : e-e%DIRECT_ALIGN;
+  if (end>b) {
+    off_t last = e<end ? e : end;
+    unsigned char *buf = direct_buffer(end-lo);
+    if (buf==NULL) return -ENOMEM;
+    if (lo<b) rc = direct_edge(path,node,buf,lo);
+    if (rc==0 && last<end && (end-DIRECT_ALIGN>lo || lo==b)) rc = direct_edge(path,node,&buf[end-DIRECT_ALIGN-lo],end-DIRECT_ALIGN);
+    if (rc<0) return rc;
+    if (trace_on) logdata("y_write","plain text",64,ofs,(const unsigned char*)data,last-b);
+    CIPHER_TIMED(STATS_ENCIPHER,"encipher",info->fh,ofs,last-b,sfs_encipher_to(&Y_STATE->store,&node->header,ofs,(const unsigned char*)data,&buf[b-lo],last-b));
+    ssize_t put;
+    SYS_TIMED(put,STATS_SYS_PWRITE,"pwrite",node->direct,lo,end-lo,pwrite(node->direct,buf,end-lo,lo));
+    if (put<0) return logerr("y_write","pwrite fh=%d ofs=%d size=%d path=%s",node->direct,ofs,size,path);
+    if (put!=end-lo) return -EIO;
+  }
+  if (end<e) {
+    off_t from = end>b ? end : b;
+    unsigned char *buf = direct_buffer(e-from);
+    if (buf==NULL) return -ENOMEM;
+    CIPHER_TIMED(STATS_ENCIPHER,"encipher",info->fh,from-SFS_HEADER,e-from,sfs_encipher_to(&Y_STATE->store,&node->header,from-SFS_HEADER,(const unsigned char*)&data[from-b],buf,e-from));
+    ssize_t put;
+    SYS_TIMED(put,STATS_SYS_PWRITE,"pwrite",info->fh,from,e-from,pwrite(info->fh,buf,e-from,from));
+    if (put<0) return logerr("y_write","pwrite fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path);
+    if (put!=e-from) return -EIO;
+  }
+  return size;
+}
+
+// the block cache is keyed by backing inode so every handle on a file shares the deciphered blocks
+void cache_key(btnode *node, int fh) {
+  struct stat st;
+  if (!cache_enabled()) return;
+  if (node->chunk!=NULL) {
+    chunk_key(node->chunk,&node->dev,&node->ino);
+    node->cached = 1;
+    return;
+  }
+  int rc;
+  SYS_TIMED(rc,STATS_SYS_STAT,"fstat",fh,0,0,fstat(fh,&st));
+  if (rc==0) {
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+    node->cached = 1;
+  }
+}
+
+void cache_drop(btnode *node, off_t from, off_t to) {
+  if (node->cached) cache_invalidate(node->dev,node->ino,from,to);
+}
+
+int cache_stat(const char *fpath, struct stat *st) {
+  // only looked up when the cache is on so an uncached mount makes no extra syscalls
+  if (!cache_enabled()) return 0;
+  int rc;
+  SYS_TIMED(rc,STATS_SYS_STAT,"lstat",-1,0,0,lstat(fpath,st));
+  return rc==0 && S_ISREG(st->st_mode);
+}
+
+int cached_read(const char *path, btnode *node, struct fuse_file_info *info, char *data, size_t size, off_t ofs) {
+  unsigned char *buf = NULL;
+  size_t done = 0;
+  int rc = 0;
+  while (done<size) {
+    off_t pos = ofs+done;
+    uint64_t epoch = 0;
+    ssize_t got = cache_read(node->dev,node->ino,pos,(unsigned char*)&data[done],size-done,&epoch);
+    if (got<0) {
+      // a miss reads and deciphers the whole block so the next reader of any part of it is served from memory
+      uint64_t block = pos/CACHE_BLOCK;
+      off_t bofs = block*CACHE_BLOCK;
+      if (buf==NULL && (buf = malloc(CACHE_BLOCK))==NULL) {
+        rc = -ENOMEM;
+        break;
       }
-      // write the digest ciphertext to the file
-      unsigned char out[16];
-      memcpy(out,y_state->safe_digest,16);
-      encipher(f_ring,y_state->offsets,0,out,0,16,y_state->endian,y_state->rounds);
-      rc = pwrite(fd,out,16,260);
-      if (rc!=16) {
-        perror("Failed to write digest to .safefs");
-        close(fd);
-        exit(1);
+      ssize_t len;
+      if (node->direct>=0) {
+        len = direct_read(path,node,info,(char*)buf,CACHE_BLOCK,bofs);
+        if (len<0) {
+          rc = len;
+          break;
+        }
+      } else if (node->chunk!=NULL) {
+        len = chunk_read(node->chunk,buf,CACHE_BLOCK,bofs);
+        if (len<0) {
+          errno = -len;
+          rc = logerr("y_read","chunk read ofs=%d size=%d path=%s",bofs,CACHE_BLOCK,path);
+          break;
+        }
+      } else if (node->compress!=NULL) {
+        len = compress_read(node->compress,buf,CACHE_BLOCK,bofs);
+        if (len<0) {
+          errno = -len;
+          rc = logerr("y_read","compress read ofs=%d size=%d path=%s",bofs,CACHE_BLOCK,path);
+          break;
+        }
+      } else {
+        SYS_TIMED(len,STATS_SYS_PREAD,"pread",info->fh,sfs_backing_offset(bofs),CACHE_BLOCK,pread(info->fh,buf,CACHE_BLOCK,sfs_backing_offset(bofs)));
+        if (len<0) {
+          rc = logerr("y_read","pread fh=%d ofs=%d size=%d path=%s",info->fh,bofs,CACHE_BLOCK,path);
+          break;
+        }
+        if (trace_on) logdata("y_read","cipher text",64,bofs,buf,len);
+        CIPHER_TIMED(STATS_DECIPHER,"decipher",info->fh,bofs,len,Y_STATE->sparse ? sfs_decipher_sparse(&Y_STATE->store,&node->header,info->fh,bofs,buf,len) : sfs_decipher(&Y_STATE->store,&node->header,bofs,buf,len));
+        if (trace_on) logdata("y_read","plain text",64,bofs,buf,len);
       }
-      close(fd);
-    }
-  } else {
-    // read the rotor settings for the file
-    unsigned char salt[4];
-    unsigned char rotor_digest[16];
-    unsigned char f_ring[256];
-    unsigned char r_ring[256];
-    int rc = pread(fd,salt,4,0);
-    if (rc!=4) {
-      perror("Failed to read salt from .safefs");
-      close(fd);
-      exit(1);
-    }
-    calculate_rotor_digest_from_salt(salt,rotor_digest,y_state);
-    rc = pread(fd,f_ring,256,4);
-    if (rc!=256) {
-      perror("Failed to read rotor from .safefs");
-      close(fd);
-      exit(1);
+      if (len>0) cache_insert(node->dev,node->ino,block,buf,len,epoch);
+      size_t inner = pos-bofs;
+      got = (size_t)len>inner ? (size_t)len-inner : 0;
+      if ((size_t)got>size-done) got = size-done;
+      memcpy(&data[done],&buf[inner],got);
     }
-    decode_rotor(f_ring,rotor_digest);
-    derive_reverse_rotor(f_ring,r_ring);
-    // read and decipher the md5 hash stored in the file
-    unsigned char out[16];
-    rc = pread(fd,out,16,260);
-    if (rc!=16) {
-      perror("Failed to read digest from .safefs");
-      close(fd);
-      exit(1);
-    }
-    decipher(r_ring,y_state->offsets,0,out,0,16,y_state->endian,y_state->rounds);
+    done += got;
+    // stopping short of a block boundary means the end of the file was reached
+    if (got==0 || (pos+got)%CACHE_BLOCK!=0) break;
+  }
+  if (buf!=NULL) {
+    memset(buf,0,CACHE_BLOCK);
+    free(buf);
+  }
+  return done>0 || rc==0 ? (int)done : rc;
+}
+
+// a -mmap mount shares one mapping per backing file between all of its handles
+void map_open(btnode *node, const char *fpath, int fh) {
+  if (!Y_STATE->mapped) return;
+  node->map = map_attach(fpath,fh);
+  // a file that cannot be mapped is read and written through its handle instead
+  if (node->map==NULL) logdebug("map_open","failed to map path=%s",fpath);
+}
+
+// anything that changes the size of a mapped file holds the mapping alone and maps the new size afterwards
+map_file* map_lock(map_file *map) {
+  if (map!=NULL) {
+    map_hold(map);
+    pthread_rwlock_wrlock(&map->lock);
+  }
+  return map;
+}
+
+map_file* map_lock_path(const char *fpath) {
+  struct stat st;
+  if (!Y_STATE->mapped) return NULL;
+  int rc;
+  SYS_TIMED(rc,STATS_SYS_STAT,"lstat",-1,0,0,lstat(fpath,&st));
+  map_file *map = rc==0 ? map_find(st.st_dev,st.st_ino) : NULL;
+  if (map!=NULL) pthread_rwlock_wrlock(&map->lock);
+  return map;
+}
+
+void map_unlock(map_file *map) {
+  if (map==NULL) return;
+  int rc = map_refresh(map);
+  if (rc<0) { errno = -rc; logerr("map_unlock","failed to map the new size"); }
+  pthread_rwlock_unlock(&map->lock);
+  map_detach(map);
+}
+
+int mapped_read(const char *path, btnode *node, struct fuse_file_info *info, char *data, size_t size, off_t ofs) {
+  map_file *map = node->map;
+  off_t b = sfs_backing_offset(ofs);
+  int rc = 0;
+  pthread_rwlock_rdlock(&map->lock);
+  if (map->size<0) {
+    errno = EIO;
+    rc = logerr("y_read","mapping lost fh=%d path=%s",info->fh,path);
+  } else if (b<map->size) {
+    // deciphered straight from the page cache into the reply with no syscall and no copy
+    rc = map->size-b<(off_t)size ? map->size-b : (off_t)size;
+    if (trace_on) logdata("y_read","cipher text",64,ofs,&map->base[b],rc);
+    CIPHER_TIMED(STATS_DECIPHER,"decipher",info->fh,ofs,rc,sfs_decipher_to(&Y_STATE->store,&node->header,ofs,&map->base[b],(unsigned char*)data,rc));
+    if (trace_on) logdata("y_read","plain text",64,ofs,(unsigned char*)data,rc);
+  }
+  pthread_rwlock_unlock(&map->lock);
+  return rc;
+}
+
+int mapped_write(const char *path, btnode *node, struct fuse_file_info *info, const char *data, size_t size, off_t ofs) {
+  map_file *map = node->map;
+  off_t b = sfs_backing_offset(ofs);
+  int rc = 0;
+  pthread_rwlock_rdlock(&map->lock);
+  if (map->size<b+(off_t)size) {
+    // growing the file replaces the mapping so the shared lock is traded for the exclusive one
+    pthread_rwlock_unlock(&map->lock);
+    pthread_rwlock_wrlock(&map->lock);
+    rc = map_refresh(map);
+    if (rc==0 && map->size<b+(off_t)size) rc = map_grow(map,b+size);
+    if (rc<0) { errno = -rc; rc = logerr("y_write","grow mapping fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path); }
+  }
+  if (rc==0) {
+    // enciphered straight from the request into the page cache, writers to disjoint ranges run in parallel
+    if (trace_on) logdata("y_write","plain text",64,ofs,(const unsigned char*)data,size);
+    CIPHER_TIMED(STATS_ENCIPHER,"encipher",info->fh,ofs,size,sfs_encipher_to(&Y_STATE->store,&node->header,ofs,(const unsigned char*)data,&map->base[b],size));
+    if (trace_on) logdata("y_write","cipher text",64,ofs,&map->base[b],size);
+    rc = size;
+  }
+  pthread_rwlock_unlock(&map->lock);
+  return rc;
+}
+
+// a -chunk mount shares one chunk entry per backing file between all of its handles
+int chunked_open(btnode *node, const char *fpath) {
+  if (!Y_STATE->chunked) return 0;
+  node->chunk = chunk_attach(&Y_STATE->store,fpath,&node->header);
+  // without the entry a manifest would be read back as the data of the file
+  if (node->chunk==NULL) {
+    errno = EIO;
+    return logerr("chunked_open","failed to attach path=%s",fpath);
+  }
+  return 0;
+}
+
+// a -compress mount shares one block index per backing file between all of its handles
+int compressed_open(btnode *node, const char *fpath) {
+  if (!Y_STATE->compressed) return 0;
+  node->compress = compress_attach(&Y_STATE->store,fpath,&node->header);
+  // without the entry the superblock and compressed blocks would be read back as the data of the file
+  if (node->compress==NULL) {
+    errno = EIO;
+    return logerr("compressed_open","failed to attach path=%s",fpath);
+  }
+  return 0;
+}
+
+// a -pack mount keeps small files as records in segment files, a handle on one is a placeholder
+// on /dev/null that pack.c swaps for a backing file of its own once the file outgrows the limit
+void packed_moved(int fh, const sfs_header *header) {
+  btnode *node = findLink(fh,&Y_STATE->list);
+  if (node==NULL) return;
+  memcpy(&node->header,header,sizeof(sfs_header));
+  cache_key(node,fh);
+  cache_drop(node,0,INT64_MAX);
+}
+
+// returns 1 when info->fh is a handle on a packed file
+int packed_open(const char *cmd, const char *path, struct fuse_file_info *info, int create, mode_t mode) {
+  if (!Y_STATE->packed || (!create && !pack_stat(path,NULL))) return 0;
+  int fd;
+  SYS_TIMED(fd,STATS_SYS_OPEN,"open",-1,0,0,open("/dev/null",O_RDWR));
+  if (fd<0) return logerr(cmd,"open /dev/null for path=%s",path);
+  // the node is listed first so a move on another thread finds it
+  btnode *node = addLink(fd,&Y_STATE->list);
+  pack_entry *entry = NULL;
+  int rc = 0;
+  if (create) rc = pack_create(path,mode,fd,&entry);
+  else if ((entry = pack_open(path,fd,(info->flags&O_TRUNC)==O_TRUNC))==NULL) rc = -errno;
+  if (entry==NULL) {
+    delLink(fd,&Y_STATE->list);
     close(fd);
-    // check that the md5 hash matches
-    if (memcmp(y_state->safe_digest,out,16)) {
-      fprintf(stderr,"Incorrect pin code provided\n");
-      exit(1);
-    }
+    // a file removed since it was found is opened from the backing store
+    if (rc==-ENOENT && !create) return 0;
+    errno = -rc;
+    return logerr(cmd,"pack path=%s",path);
   }
+  node->pack = entry;
+  info->fh = fd;
+  qos_open(fd);
+  return 1;
+}
+
+int packed_parent(const char *fpath) {
+  char parent[PATH_MAX];
+  snprintf(parent,sizeof(parent),"%s",fpath);
+  char *slash = strrchr(parent,'/');
+  if (slash!=NULL) *slash = 0;
+  struct stat st;
+  if (lstat(parent,&st)<0) return -errno;
+  return S_ISDIR(st.st_mode) ? 0 : -ENOTDIR;
+}
 
+void packed_promote(const char *cmd, const char *path) {
+  // links, extended attributes and flags live on backing files so a packed file is moved out first
+  int rc = pack_promote(path);
+  if (rc<0) { errno = -rc; logerr(cmd,"move out path=%s",path); }
+}
+
+// returns 1 when the rename was settled by the index and rc holds its result
+int packed_rename(const char *path, const char *path2, const char *fpath, const char *fpath2, int *rc) {
+  struct stat st, st2;
+  int exists2 = lstat(fpath2,&st2)==0;
+  *rc = 0;
+  if (exists2 && S_ISDIR(st2.st_mode) && pack_children(path2)>0) {
+    *rc = -ENOTEMPTY;
+  } else if (pack_stat(path,NULL)) {
+    if (exists2 && S_ISDIR(st2.st_mode)) *rc = -EISDIR;
+    else if (!exists2) *rc = packed_parent(fpath2);
+    else if (unlink(fpath2)<0) *rc = -errno;
+    if (*rc==0) *rc = pack_rename(path,path2);
+    if (*rc>0) *rc = 0;
+  } else if (lstat(fpath,&st)==0 && S_ISDIR(st.st_mode) && pack_stat(path2,NULL)) {
+    *rc = -ENOTDIR;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+typedef struct packed_filler {
+  void *buf;
+  fuse_fill_dir_t filler;
+} packed_filler;
+
+int packed_add(void *ctx, const char *name, const struct stat *st) {
+  packed_filler *fill = ctx;
+  return fill_dir(fill->filler,fill->buf,name,st);
+}
+
+// a prefetched file has its size worked out as y_getattr would, so a -compress mount caches its superblock
+void warmed_stat(void *arg, const char *fpath, struct stat *st) {
+  struct y_state *y_state = arg;
+  if (y_state->chunked) chunk_stat(&y_state->store,fpath,st);
+  if (y_state->compressed) compress_stat(&y_state->store,fpath,st);
 }
 
 // ----------------------------------------------------------------------
@@ -239,415 +771,895 @@ void check_rotor_offsets_match(struct y_state *y_state) {
 // ----------------------------------------------------------------------
 
 int y_getattr(const char *path, struct stat *stat) { 
+  uint64_t start = stats_begin(STATS_Y_GETATTR);
+  PROBE_OP_ENTRY("y_getattr",path,-1,0,0);
   logdebug("y_getattr","path=%s",path);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = lstat(fpath,stat);
-  if (rc<0) { if (errno!=ENOENT) rc = logerr("y_getattr","stat path=%s",path); else rc = -errno; }
-  else { 
-    if (stat->st_size>=260) stat->st_size -= 260; /* hide the first 260 bytes */ 
-    logdebug("y_getattr","st_size=%lu",stat->st_size);
+  if (is_stats_file(path)) {
+    stat_stats_file(stat);
+  } else if (!Y_STATE->packed || !pack_stat(path,stat)) {
+    SYS_TIMED(rc,STATS_SYS_STAT,"lstat",-1,0,0,lstat(fpath,stat));
+    if (rc<0) { if (errno!=ENOENT) rc = logerr("y_getattr","stat path=%s",path); else rc = -errno; }
+    else { 
+      if ((!Y_STATE->chunked || !chunk_stat(&Y_STATE->store,fpath,stat)) && (!Y_STATE->compressed || !compress_stat(&Y_STATE->store,fpath,stat))) stat->st_size = sfs_plain_size(stat->st_size); /* hide the header */
+      logdebug("y_getattr","st_size=%lu",stat->st_size);
+    }
   }
   loginfo("y_getattr","path=%s rc=%d",path,rc);
+  OP_RETURN(STATS_Y_GETATTR,start,"y_getattr",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_readlink(const char *path, char *link, size_t size) { 
+  uint64_t start = stats_begin(STATS_Y_READLINK);
+  PROBE_OP_ENTRY("y_readlink",path,-1,0,size);
   logdebug("y_readlink","path=%s size=%d",path,size);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = readlink(fpath,link,size-1);
-  if (rc<0) rc = logerr("y_readlink","readlink path=%s",path);
-  else { 
-    link[rc] = 0; rc = 0; 
-    logdebug("y_readlink","link=%s",link);
+  if (Y_STATE->packed && pack_stat(path,NULL)) {
+    rc = -EINVAL;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"readlink",-1,0,size-1,readlink(fpath,link,size-1));
+    if (rc<0) rc = logerr("y_readlink","readlink path=%s",path);
+    else { 
+      link[rc] = 0; rc = 0; 
+      logdebug("y_readlink","link=%s",link);
+    }
   }
   loginfo("y_readlink","path=%s size=%d rc=%d",path,size,rc);
+  OP_RETURN(STATS_Y_READLINK,start,"y_readlink",path,-1,0,size,rc,0);
   return rc; 
 }
 
 //int y_getdir(const char *path, fuse_dirh_t dirh, fuse_dirfil_t dirfil) { }
 
 int y_mknod(const char *path, mode_t mode, dev_t dev) { 
+  uint64_t start = stats_begin(STATS_Y_MKNOD);
+  PROBE_OP_ENTRY("y_mknod",path,-1,0,0);
   logdebug("y_mknod","path=%s mode=%d",path,mode);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = mknod(fpath,mode,dev);
-  if (rc<0) rc = logerr("y_mknod","mknod path=%s",path);
+  if (Y_STATE->packed && pack_stat(path,NULL)) {
+    rc = -EEXIST;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"mknod",-1,0,0,mknod(fpath,mode,dev));
+    if (rc<0) rc = logerr("y_mknod","mknod path=%s",path);
+  }
   loginfo("y_mknod","path=%s mode=%d rc=%d",path,mode,rc);
+  OP_RETURN(STATS_Y_MKNOD,start,"y_mknod",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_mkdir(const char *path, mode_t mode) { 
+  uint64_t start = stats_begin(STATS_Y_MKDIR);
+  PROBE_OP_ENTRY("y_mkdir",path,-1,0,0);
   logdebug("y_mkdir","path=%s mode=%d",path,mode);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = mkdir(fpath,mode);
-  if (rc<0) rc = logerr("y_mkdir","mkdir path=%s",path);
+  if (Y_STATE->packed && pack_stat(path,NULL)) {
+    rc = -EEXIST;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"mkdir",-1,0,0,mkdir(fpath,mode));
+    if (rc<0) rc = logerr("y_mkdir","mkdir path=%s",path);
+  }
   loginfo("y_mkdir","path=%s mode=%d rc=%d",path,mode,rc);
+  OP_RETURN(STATS_Y_MKDIR,start,"y_mkdir",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_unlink(const char *path) {
+  uint64_t start = stats_begin(STATS_Y_UNLINK);
+  PROBE_OP_ENTRY("y_unlink",path,-1,0,0);
   logdebug("y_unlink","path=%s",path);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = unlink(fpath);
-  if (rc<0) rc = logerr("y_unlink","unlink path=%s",path);
+  rc = Y_STATE->packed ? pack_unlink(path) : 0;
+  if (rc!=0) {
+    if (rc<0) { errno = -rc; rc = logerr("y_unlink","unlink packed path=%s",path); }
+    else rc = 0;
+  } else {
+    struct stat st;
+    int cached = cache_stat(fpath,&st);
+    chunk_file *chunk = Y_STATE->chunked ? chunk_lookup(&Y_STATE->store,fpath) : NULL;
+    if (cached && chunk!=NULL) chunk_key(chunk,&st.st_dev,&st.st_ino);
+    if (Y_STATE->compressed) compress_forget(fpath);
+    SYS_TIMED(rc,STATS_SYS_META,"unlink",-1,0,0,unlink(fpath));
+    if (rc<0) rc = logerr("y_unlink","unlink path=%s",path);
+    else if (cached && st.st_nlink<=1) cache_forget(st.st_dev,st.st_ino);
+    if (rc==0) xattr_forget(path);
+    if (rc==0) chunk_unlinked(chunk);
+    chunk_detach(chunk);
+  }
   loginfo("y_unlink","path=%s rc=%d",path,rc);
+  OP_RETURN(STATS_Y_UNLINK,start,"y_unlink",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_rmdir(const char *path) {
+  uint64_t start = stats_begin(STATS_Y_RMDIR);
+  PROBE_OP_ENTRY("y_rmdir",path,-1,0,0);
   logdebug("y_rmdir","path=%s",path);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = rmdir(fpath);
-  if (rc<0) rc = logerr("y_rmdir","rmdir path=%s",path);
+  if (Y_STATE->packed && pack_children(path)>0) {
+    // the backing folder looks empty while packed files are listed in it
+    rc = -ENOTEMPTY;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"rmdir",-1,0,0,rmdir(fpath));
+    if (rc<0) rc = logerr("y_rmdir","rmdir path=%s",path);
+    else xattr_forget(path);
+  }
   loginfo("y_rmdir","path=%s rc=%d",path,rc);
+  OP_RETURN(STATS_Y_RMDIR,start,"y_rmdir",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_symlink(const char *target, const char *path) {
+  uint64_t start = stats_begin(STATS_Y_SYMLINK);
+  PROBE_OP_ENTRY("y_symlink",path,-1,0,0);
   logdebug("y_symlink","target=%s path=%s",target,path);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = symlink(target,fpath);
-  if (rc<0) rc = logerr("y_symlink","symlink target=%s path=%s",target,path);
+  if (Y_STATE->packed && pack_stat(path,NULL)) {
+    rc = -EEXIST;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"symlink",-1,0,0,symlink(target,fpath));
+    if (rc<0) rc = logerr("y_symlink","symlink target=%s path=%s",target,path);
+  }
   loginfo("y_symlink","target=%s path=%s rc=%d",target,path,rc);
+  OP_RETURN(STATS_Y_SYMLINK,start,"y_symlink",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_rename(const char *path, const char *path2) {
+  uint64_t start = stats_begin(STATS_Y_RENAME);
+  PROBE_OP_ENTRY("y_rename",path,-1,0,0);
   logdebug("y_rename","path=%s path2=%s",path,path2);
   int rc = 0;
   char fpath[PATH_MAX];
   char fpath2[PATH_MAX];
   resolve(path,fpath);
   resolve(path2,fpath2);
-  rc = rename(fpath,fpath2);
-  if (rc<0) rc = logerr("y_rename","rename path=%s path2=%s",path,path2);
+  if (Y_STATE->packed && packed_rename(path,path2,fpath,fpath2,&rc)) {
+    if (rc<0) { errno = -rc; rc = logerr("y_rename","rename packed path=%s path2=%s",path,path2); }
+  } else {
+    // a file replaced by the rename is gone unless it has other links
+    struct stat st;
+    int cached = cache_stat(fpath2,&st);
+    chunk_file *chunk = Y_STATE->chunked ? chunk_lookup(&Y_STATE->store,fpath2) : NULL;
+    if (cached && chunk!=NULL) chunk_key(chunk,&st.st_dev,&st.st_ino);
+    if (Y_STATE->compressed) compress_forget(fpath2);
+    SYS_TIMED(rc,STATS_SYS_META,"rename",-1,0,0,rename(fpath,fpath2));
+    if (rc<0) rc = logerr("y_rename","rename path=%s path2=%s",path,path2);
+    else if (cached && st.st_nlink<=1) cache_forget(st.st_dev,st.st_ino);
+    if (rc==0) chunk_unlinked(chunk);
+    chunk_detach(chunk);
+    if (rc==0 && xattr_enabled()) {
+      // the attributes of both paths change hands, as do those of every path below a renamed folder
+      xattr_forget(path);
+      xattr_forget(path2);
+      if (lstat(fpath2,&st)==0 && S_ISDIR(st.st_mode)) xattr_forget_all();
+    }
+    if (rc==0 && Y_STATE->packed) {
+      // a packed file replaced by the rename goes and the packed files in a renamed folder follow it
+      pack_unlink(path2);
+      if (lstat(fpath2,&st)==0 && S_ISDIR(st.st_mode)) rc = pack_rename_dir(path,path2);
+      // none of the packed files moved, so the folder goes back to where they are
+      if (rc==-ENAMETOOLONG) rename(fpath2,fpath);
+      if (rc<0) { errno = -rc; rc = logerr("y_rename","rename packed folder path=%s path2=%s",path,path2); }
+    }
+  }
   loginfo("y_rename","path=%s path2=%s rc=%d",path,path2,rc);
+  OP_RETURN(STATS_Y_RENAME,start,"y_rename",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_link(const char *path, const char *path2) {
+  uint64_t start = stats_begin(STATS_Y_LINK);
+  PROBE_OP_ENTRY("y_link",path,-1,0,0);
   logdebug("y_link","path=%s path2=%s",path,path2);
   int rc = 0;
   char fpath[PATH_MAX];
   char fpath2[PATH_MAX];
   resolve(path,fpath);
   resolve(path2,fpath2);
-  rc = link(fpath,fpath2);
-  if (rc<0) rc = logerr("y_link","link path=%s path2=%s",path,path2);
+  if (Y_STATE->packed && pack_stat(path2,NULL)) {
+    rc = -EEXIST;
+  } else {
+    if (Y_STATE->packed) packed_promote("y_link",path);
+    SYS_TIMED(rc,STATS_SYS_META,"link",-1,0,0,link(fpath,fpath2));
+    if (rc<0) rc = logerr("y_link","link path=%s path2=%s",path,path2);
+  }
   loginfo("y_link","path=%s path2=%s rc=%d",path,path2,rc);
+  OP_RETURN(STATS_Y_LINK,start,"y_link",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_chmod(const char *path, mode_t mode) {
+  uint64_t start = stats_begin(STATS_Y_CHMOD);
+  PROBE_OP_ENTRY("y_chmod",path,-1,0,0);
   logdebug("y_chmod","path=%s mode=%x",path,mode);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = chmod(fpath,mode);
-  if (rc<0) rc = logerr("y_chmod","chmod path=%s mode=%d",path,mode);
+  rc = Y_STATE->packed ? pack_chmod(path,mode) : 0;
+  if (rc!=0) {
+    if (rc<0) { errno = -rc; rc = logerr("y_chmod","chmod packed path=%s mode=%d",path,mode); }
+    else rc = 0;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"chmod",-1,0,0,chmod(fpath,mode));
+    if (rc<0) rc = logerr("y_chmod","chmod path=%s mode=%d",path,mode);
+  }
   loginfo("y_chmod","path=%s mode=%x rc=%d",path,mode,rc);
+  OP_RETURN(STATS_Y_CHMOD,start,"y_chmod",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_chown(const char *path, uid_t uid, gid_t gid) {
+  uint64_t start = stats_begin(STATS_Y_CHOWN);
+  PROBE_OP_ENTRY("y_chown",path,-1,0,0);
   logdebug("y_chown","path=%s uid=%d gid=%d",path,uid,gid);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  if (uid!=0 || gid!=0)
-    rc = chown(fpath,uid,gid);
-  if (rc<0) rc = logerr("y_chown","chown path=%s uid=%d gid=%d",path,uid,gid);
+  int packed = Y_STATE->packed && (uid!=0 || gid!=0) ? pack_chown(path,uid,gid) : 0;
+  if (packed<0) {
+    errno = -packed;
+    rc = logerr("y_chown","chown packed path=%s uid=%d gid=%d",path,uid,gid);
+  } else if (packed==0 && (uid!=0 || gid!=0)) {
+    SYS_TIMED(rc,STATS_SYS_META,"chown",-1,0,0,chown(fpath,uid,gid));
+    if (rc<0) rc = logerr("y_chown","chown path=%s uid=%d gid=%d",path,uid,gid);
+  }
   loginfo("y_chown","path=%s uid=%d gid=%d rc=%d",path,uid,gid,rc);
+  OP_RETURN(STATS_Y_CHOWN,start,"y_chown",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_truncate(const char *path, off_t off) {
+  uint64_t start = stats_begin(STATS_Y_TRUNCATE);
+  PROBE_OP_ENTRY("y_truncate",path,-1,off,0);
   logdebug("y_truncate","path=%s offset=%d",path,off);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  // truncate the file skipping the first 260 bytes
-  rc = truncate(fpath,off+260);
-  if (rc<0) rc = logerr("y_truncate","truncate path=%s offset=%d",path,off);
+  struct stat st;
+  int cached = 0;
+  // a packed file that grows past the limit is moved out and truncated like a backing file
+  rc = Y_STATE->packed ? pack_truncate(path,off) : 0;
+  if (rc==0) cached = cache_stat(fpath,&st);
+  if (rc!=0) {
+    if (rc<0) { errno = -rc; rc = logerr("y_truncate","truncate packed path=%s offset=%d",path,off); }
+    else rc = 0;
+  } else if (Y_STATE->sparse) {
+    // the header is needed to encipher the zeros after the old end of a growing file
+    rc = sparse_truncate(path,fpath,off);
+  } else if (Y_STATE->chunked) {
+    // a manifest is only changed through the chunk entry of the file
+    chunk_file *chunk = chunk_attach(&Y_STATE->store,fpath,NULL);
+    if (chunk==NULL) rc = logerr("y_truncate","attach path=%s",path);
+    else rc = chunk_truncate(chunk,path,off);
+    if (rc<0 && chunk!=NULL) { errno = -rc; rc = logerr("y_truncate","truncate path=%s offset=%d",path,off); }
+    // the blocks of a split file stay under the inode it was opened on
+    if (rc==0 && cached) chunk_key(chunk,&st.st_dev,&st.st_ino);
+    chunk_detach(chunk);
+  } else if (Y_STATE->compressed) {
+    // the superblock and the index are only changed through the entry of the file
+    compress_file *compress = compress_attach(&Y_STATE->store,fpath,NULL);
+    if (compress==NULL) rc = logerr("y_truncate","attach path=%s",path);
+    else rc = compress_truncate(compress,off);
+    if (rc<0 && compress!=NULL) { errno = -rc; rc = logerr("y_truncate","truncate path=%s offset=%d",path,off); }
+    compress_detach(compress);
+  } else {
+    // truncate the file skipping the header, a mapping of it must not outlive the end it had
+    pthread_mutex_t *mutex = lock_direct_path(fpath);
+    map_file *map = map_lock_path(fpath);
+    SYS_TIMED(rc,STATS_SYS_TRUNCATE,"truncate",-1,sfs_backing_offset(off),0,truncate(fpath,sfs_backing_offset(off)));
+    if (rc<0) rc = logerr("y_truncate","truncate path=%s offset=%d",path,off);
+    map_unlock(map);
+    unlock_direct(mutex);
+  }
+  if (rc==0 && cached) cache_invalidate(st.st_dev,st.st_ino,off,INT64_MAX);
   loginfo("y_truncate","path=%s offset=%d rc=%d",path,off,rc);
+  OP_RETURN(STATS_Y_TRUNCATE,start,"y_truncate",path,-1,off,0,rc,0);
   return rc; 
 }
 
 int y_utime(const char *path, struct utimbuf *time) {
+  uint64_t start = stats_begin(STATS_Y_UTIME);
+  PROBE_OP_ENTRY("y_utime",path,-1,0,0);
   logdebug("y_utime","path=%s actime=%lu modtime=%lu",path,time->actime,time->modtime);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = utime(fpath,time);
-  if (rc<0) rc = logerr("y_utime","utime path=%s",path);
+  rc = Y_STATE->packed ? pack_utime(path,time->actime,time->modtime) : 0;
+  if (rc!=0) {
+    if (rc<0) { errno = -rc; rc = logerr("y_utime","utime packed path=%s",path); }
+    else rc = 0;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"utime",-1,0,0,utime(fpath,time));
+    if (rc<0) rc = logerr("y_utime","utime path=%s",path);
+  }
   loginfo("y_utime","path=%s actime=%lu modtime=%lu rc=%d",path,time->actime,time->modtime,rc);
+  OP_RETURN(STATS_Y_UTIME,start,"y_utime",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_open(const char *path, struct fuse_file_info *info) {
+  uint64_t start = stats_begin(STATS_Y_OPEN);
+  PROBE_OP_ENTRY("y_open",path,-1,0,0);
   logdebug("y_open","path=%s flags=%d",path,info->flags);
   int rc = 0;
   int fd;
   char fpath[PATH_MAX];
-  unsigned char salt[4];
-  unsigned char rotor_digest[16];
-  unsigned char f_ring[256];
-  unsigned char r_ring[256];
+  unsigned char in[SFS_HEADER];
+  sfs_header header;
   int loaded = 0;
   int truncate = 0;
   resolve(path,fpath);
   // try to read the existing rotor settings for the file
   int flags = info->flags;
-  fd = open(fpath,O_RDONLY); 
-  if (fd>=0) {
-    rc = pread(fd,salt,4,0);
-    if (rc!=4) {
-      rc = logerr("y_open","pread failed to read salt path=%s",path);
-    } else {
-      calculate_rotor_digest_from_salt(salt,rotor_digest,Y_STATE);
-      rc = pread(fd,f_ring,256,4);
-      if (rc!=256) {
-        rc = logerr("y_open","pread failed to read rotor path=%s",path);
+  if (is_stats_file(path)) {
+    rc = open_stats_file(info);
+  } else if ((rc = packed_open("y_open",path,info,0,0))!=0) {
+    if (rc>0) rc = 0;
+  } else {
+    SYS_TIMED(fd,STATS_SYS_OPEN,"open",-1,0,0,open(fpath,O_RDONLY));
+    if (fd>=0) {
+      SYS_TIMED(rc,STATS_SYS_PREAD,"pread",fd,0,SFS_SALT,pread(fd,in,SFS_SALT,0));
+      if (rc!=SFS_SALT) {
+        rc = logerr("y_open","pread failed to read salt path=%s",path);
       } else {
-        logdata("y_open","rotor cipher text",16,0,f_ring,256);
-        decode_rotor(f_ring,rotor_digest);
-        logdata("y_open","rotor plain text",16,0,f_ring,256);
-        derive_reverse_rotor(f_ring,r_ring);
-        loaded = 1;
-        rc = 0;
+        SYS_TIMED(rc,STATS_SYS_PREAD,"pread",fd,SFS_SALT,SFS_ROTOR,pread(fd,&in[SFS_SALT],SFS_ROTOR,SFS_SALT));
+        if (rc!=SFS_ROTOR) {
+          rc = logerr("y_open","pread failed to read rotor path=%s",path);
+        } else {
+          logdata("y_open","rotor cipher text",16,0,&in[SFS_SALT],SFS_ROTOR);
+          // a header read before, or prefetched from the warm set at mount, is not decoded again
+          if (!warm_lookup(in,&header)) {
+            sfs_decode_header(&Y_STATE->store,in,&header);
+            warm_insert(in,&header);
+          }
+          logdata("y_open","rotor plain text",16,0,header.f_ring,SFS_ROTOR);
+          loaded = 1;
+          rc = 0;
+        }
       }
-    }
-    close(fd);
-  } else {
-    rc = logerr("y_open","open path=%s",path);
-  }
-  // dont use the standard O_TRUNC function because it truncates to zero bytes
-  if ((flags&O_TRUNC)==O_TRUNC) {
-    flags ^= O_TRUNC;
-    truncate = 1;
-  }
-  // if the rotor settings were read then open the file with the requested flags
-  if (rc==0) {
-    fd = open(fpath,flags);
-    if (fd<0) {
+      int closed;
+      SYS_TIMED(closed,STATS_SYS_CLOSE,"close",fd,0,0,close(fd));
+    } else {
       rc = logerr("y_open","open path=%s",path);
-    } else { 
-      logdebug("y_open","fd=%d path=%s",fd,path);
-      info->fh = fd; 
-      btnode* node = addLink(fd,&Y_STATE->list); 
-      if (!loaded) {
-        if ((flags&O_CREAT)==O_CREAT) {
-          rc = calculate_and_write_rotor("y_open",path,node,info,Y_STATE);
+    }
+    // dont use the standard O_TRUNC function because it truncates to zero bytes
+    if ((flags&O_TRUNC)==O_TRUNC) {
+      flags ^= O_TRUNC;
+      truncate = 1;
+    }
+#ifdef SAFEFS_FUSE3
+    // the writeback cache reads the rest of a page it only partly wrote, even through a write only handle,
+    // and the kernel places appends itself so O_APPEND would move every pwrite to the end of the file
+    if (Y_STATE->writeback && (flags&O_ACCMODE)==O_WRONLY) flags = (flags&~O_ACCMODE) | O_RDWR;
+    flags &= ~O_APPEND;
+#endif
+    // if the rotor settings were read then open the file with the requested flags
+    if (rc==0) {
+      SYS_TIMED(fd,STATS_SYS_OPEN,"open",-1,0,0,open(fpath,flags));
+      if (fd<0) {
+        rc = logerr("y_open","open path=%s",path);
+      } else { 
+        logdebug("y_open","fd=%d path=%s",fd,path);
+        info->fh = fd; 
+        qos_open(fd);
+        btnode* node = addLink(fd,&Y_STATE->list); 
+        if (!loaded) {
+          if ((flags&O_CREAT)==O_CREAT) {
+            rc = calculate_and_write_rotor("y_open",path,node,info,Y_STATE);
+          } else {
+            logerr("y_open","failed to load rotor settings path=%s",path);
+            rc = -EIO;
+          }
         } else {
-          logerr("y_open","failed to load rotor settings path=%s",path);
-          rc = -EIO;
+          memcpy(&node->header,&header,sizeof(sfs_header));
         }
-      } else {
-        memcpy(node->salt,salt,4);
-        memcpy(node->rotor_digest,rotor_digest,16);
-        memcpy(node->f_ring,f_ring,256);
-        memcpy(node->r_ring,r_ring,256);
-      }
-      if (rc==0) {
-        if (truncate) {
-          rc = ftruncate(info->fh, 260);
-          if (rc<0) rc = logerr("y_open","ftruncate path=%s pos=%d",path,0);
+        if (rc==0) map_open(node,fpath,fd);
+        if (rc==0) direct_open(node,fpath,flags);
+        if (rc==0) rc = chunked_open(node,fpath);
+        if (rc==0) rc = compressed_open(node,fpath);
+        if (rc==0 && truncate && node->chunk!=NULL) {
+          rc = chunk_truncate(node->chunk,path,0);
+          if (rc<0) { errno = -rc; rc = logerr("y_open","truncate path=%s pos=%d",path,0); }
+        } else if (rc==0 && truncate && node->compress!=NULL) {
+          rc = compress_truncate(node->compress,0);
+          if (rc<0) { errno = -rc; rc = logerr("y_open","truncate path=%s pos=%d",path,0); }
+        } else if (rc==0) {
+          if (truncate) {
+            pthread_mutex_t *mutex = lock_direct_node(node);
+            map_file *map = map_lock(node->map);
+            SYS_TIMED(rc,STATS_SYS_TRUNCATE,"ftruncate",info->fh,SFS_HEADER,0,ftruncate(info->fh, SFS_HEADER));
+            if (rc<0) rc = logerr("y_open","ftruncate path=%s pos=%d",path,0);
+            map_unlock(map);
+            unlock_direct(mutex);
+          }
+        }
+        if (rc==0) {
+          // a new file may reuse the inode of a deleted one
+          cache_key(node,fd);
+          if (!loaded || truncate) cache_drop(node,0,INT64_MAX);
+          warm_touch(path);
         }
       }
     }
   }
-  memset(salt,0,4);
-  memset(rotor_digest,0,16);
-  memset(f_ring,0,256);
-  memset(r_ring,0,256);
+  memset(in,0,SFS_HEADER);
+  memset(&header,0,sizeof(sfs_header));
   loginfo("y_open","fh=%d path=%s flags=%d rc=%d",info->fh,path,info->flags,rc);
+  OP_RETURN(STATS_Y_OPEN,start,"y_open",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
-int y_read(const char *path, char *data, size_t size, off_t ofs, struct fuse_file_info *info) {
+int read_request(const char *path, char *data, size_t size, off_t ofs, struct fuse_file_info *info, int qos) {
+  uint64_t start = stats_begin(STATS_Y_READ);
+  PROBE_OP_ENTRY("y_read",path,info->fh,ofs,size);
   logdebug("y_read","fh=%d path=%s size=%d ofs=%d",info->fh,path,size,ofs);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
   // get the node entry for this file descriptor
   btnode *node = findLink(info->fh,&Y_STATE->list);
+  // a packed file is read from its held plain text until it has been moved out
+  int moved = 1;
+  if (node!=NULL && node->report==NULL && node->pack!=NULL) rc = pack_read(node->pack,(unsigned char*)data,size,ofs,&moved);
   if (node==NULL) {
     logerr("y_read","find path=%s failed to find node",path);
     rc = -EIO;
-    return rc;
-  }
-  // read from the file skipping the first 260 bytes
-  rc = pread(info->fh,data,size,ofs+260);
-  if (rc<0) { 
-    rc = logerr("y_read","pread fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path);
-  } else { 
-    if (trace_on) {
-      logdata("y_read","forward rotors",16,0,node->f_ring,256);
-      logdata("y_read","reverse rotors",16,0,node->r_ring,256);
-      logdata("y_read","rotor offsets",16,0,Y_STATE->offsets,8);
-      logdata("y_read","cipher text",64,ofs,(unsigned char*)data,rc);
-    }
-    decipher(node->r_ring,Y_STATE->offsets,ofs,(unsigned char*)data,0,rc,Y_STATE->endian,Y_STATE->rounds);
-    if (trace_on) {
-      logdata("y_read","plain text",64,ofs,(unsigned char*)data,rc);
+  } else if (node->report!=NULL) {
+    rc = read_report(node,data,size,ofs);
+  } else if (!moved) {
+    if (trace_on) logdata("y_read","plain text",64,ofs,(unsigned char*)data,rc);
+  } else if (node->map!=NULL) {
+    rc = mapped_read(path,node,info,data,size,ofs);
+  } else if (node->cached) {
+    rc = cached_read(path,node,info,data,size,ofs);
+  } else if (node->chunk!=NULL) {
+    rc = chunk_read(node->chunk,(unsigned char*)data,size,ofs);
+    if (rc<0) { errno = -rc; rc = logerr("y_read","chunk read fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path); }
+    else if (trace_on) logdata("y_read","plain text",64,ofs,(unsigned char*)data,rc);
+  } else if (node->compress!=NULL) {
+    rc = compress_read(node->compress,(unsigned char*)data,size,ofs);
+    if (rc<0) { errno = -rc; rc = logerr("y_read","compress read fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path); }
+    else if (trace_on) logdata("y_read","plain text",64,ofs,(unsigned char*)data,rc);
+  } else if (node->direct>=0) {
+    rc = direct_read(path,node,info,data,size,ofs);
+  } else {
+    // read from the file skipping the header
+    SYS_TIMED(rc,STATS_SYS_PREAD,"pread",info->fh,sfs_backing_offset(ofs),size,pread(info->fh,data,size,sfs_backing_offset(ofs)));
+    if (rc<0) { 
+      rc = logerr("y_read","pread fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path);
+    } else { 
+      if (trace_on) {
+        logdata("y_read","forward rotors",16,0,node->header.f_ring,256);
+        logdata("y_read","reverse rotors",16,0,node->header.r_ring,256);
+        logdata("y_read","rotor offsets",16,0,Y_STATE->store.offsets,8);
+        logdata("y_read","cipher text",64,ofs,(unsigned char*)data,rc);
+      }
+      // a bulk read is deciphered a slice at a time and steps aside for interactive requests between slices
+      size_t len;
+      for(size_t done=0; done<(size_t)rc; done+=len) {
+        len = qos_slice(qos,done,rc);
+        CIPHER_TIMED(STATS_DECIPHER,"decipher",info->fh,ofs+done,len,Y_STATE->sparse ? sfs_decipher_sparse(&Y_STATE->store,&node->header,info->fh,ofs+done,(unsigned char*)data+done,len) : sfs_decipher(&Y_STATE->store,&node->header,ofs+done,(unsigned char*)data+done,len));
+      }
+      if (trace_on) {
+        logdata("y_read","plain text",64,ofs,(unsigned char*)data,rc);
+      }
     }
   }
   loginfo("y_read","fh=%d path=%s size=%d ofs=%d rc=%d",info->fh,path,size,ofs,rc);
+  OP_RETURN(STATS_Y_READ,start,"y_read",path,info->fh,ofs,size,rc,rc>0 ? rc : 0);
   return rc; 
 }
 
-int y_write(const char *path, const char *data, size_t size, off_t ofs, struct fuse_file_info *info) { 
+int y_read(const char *path, char *data, size_t size, off_t ofs, struct fuse_file_info *info) {
+  // with -q a bulk read waits for one of the bulk slots, an interactive one goes straight in
+  int qos = qos_classify(info->fh,ofs,size);
+  qos_begin(qos);
+  int rc = read_request(path,data,size,ofs,info,qos);
+  qos_end(qos);
+  return rc;
+}
+
+int write_request(const char *path, const char *data, size_t size, off_t ofs, struct fuse_file_info *info, int qos) { 
+  uint64_t start = stats_begin(STATS_Y_WRITE);
+  PROBE_OP_ENTRY("y_write",path,info->fh,ofs,size);
   logdebug("y_write","fh=%d path=%s offset=%d size=%d",info->fh,path,ofs,size);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
   // get the node entry for this file descriptor
   btnode *node = findLink(info->fh,&Y_STATE->list);
+  // a write past the limit moves a packed file out and goes on to its new backing file
+  int moved = 1;
+  if (node!=NULL && node->pack!=NULL) {
+    if (trace_on) logdata("y_write","plain text",64,ofs,(const unsigned char*)data,size);
+    rc = pack_write(node->pack,(const unsigned char*)data,size,ofs,&moved);
+    if (rc<0) { errno = -rc; rc = logerr("y_write","pack write fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path); }
+  }
   if (node==NULL) {
     logerr("y_write","find path=%s failed to find node",path);
     rc = -EIO;
-    loginfo("y_write","rc=%d",rc);
-    return rc;
+  } else if (rc<0 || !moved) {
+    // the record took the write, or it failed
+  } else if (node->chunk!=NULL) {
+    // writes to one file are serialized so a file is converted and its manifest updated only once
+    if (trace_on) logdata("y_write","plain text",64,ofs,(const unsigned char*)data,size);
+    rc = chunk_write(node->chunk,path,(const unsigned char*)data,size,ofs);
+    if (rc<0) { errno = -rc; rc = logerr("y_write","chunk write fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path); }
+    cache_drop(node,ofs,ofs+size);
+  } else if (node->compress!=NULL) {
+    // the block being written is held decompressed and is compressed again once another block is touched
+    if (trace_on) logdata("y_write","plain text",64,ofs,(const unsigned char*)data,size);
+    rc = compress_write(node->compress,(const unsigned char*)data,size,ofs);
+    if (rc<0) { errno = -rc; rc = logerr("y_write","compress write fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path); }
+    cache_drop(node,ofs,ofs+size);
+  } else if (Y_STATE->sparse) {
+    pthread_mutex_t *mutex = lock_sparse(info->fh);
+    rc = sparse_write(path,node,info,data,size,ofs);
+    cache_drop(node,ofs,ofs+size);
+    unlock_sparse(mutex);
+  } else if (node->direct>=0) {
+    pthread_mutex_t *mutex = lock_direct(node->ino);
+    rc = direct_write(path,node,info,data,size,ofs);
+    cache_drop(node,ofs,ofs+size);
+    unlock_direct(mutex);
+  } else if (node->map!=NULL && node->map->writable) {
+    rc = mapped_write(path,node,info,data,size,ofs);
+    cache_drop(node,ofs,ofs+size);
+  } else {
+    // encipher the plain text into a buffer in one pass and then write to the file skipping the header
+    unsigned char *buf = malloc(size);
+    if (buf==NULL) {
+      rc = -ENOMEM;
+    } else {
+      if (trace_on) {
+        logdata("y_write","forward rotors",16,0,node->header.f_ring,256);
+        logdata("y_write","reverse rotors",16,0,node->header.r_ring,256);
+        logdata("y_write","rotor offsets",16,0,Y_STATE->store.offsets,8);
+        logdata("y_write","plain text",64,ofs,(const unsigned char*)data,size);
+      }
+      // a bulk write is enciphered a slice at a time and steps aside for interactive requests between slices
+      size_t len;
+      for(size_t done=0; done<size; done+=len) {
+        len = qos_slice(qos,done,size);
+        CIPHER_TIMED(STATS_ENCIPHER,"encipher",info->fh,ofs+done,len,sfs_encipher_to(&Y_STATE->store,&node->header,ofs+done,(const unsigned char*)data+done,buf+done,len));
+      }
+      if (trace_on) {
+        logdata("y_write","cipher text",64,ofs,buf,size);
+      }
+      // a file mapped read only still sees the new size
+      map_file *map = map_lock(node->map);
+      SYS_TIMED(rc,STATS_SYS_PWRITE,"pwrite",info->fh,sfs_backing_offset(ofs),size,pwrite(info->fh,buf,size,sfs_backing_offset(ofs)));
+      if (rc<0) {
+        rc = logerr("y_write","pwrite fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path);
+      }
+      map_unlock(map);
+      // cached blocks are dropped after the write so a reader that raced with it cannot cache the old text
+      cache_drop(node,ofs,ofs+size);
+      free(buf);
+    }
+  }
+  loginfo("y_write","fh=%d path=%s offset=%d size=%d rc=%d",info->fh,path,ofs,size,rc);
+  OP_RETURN(STATS_Y_WRITE,start,"y_write",path,info->fh,ofs,size,rc,rc>0 ? rc : 0);
+  return rc; 
+}
+
+int y_write(const char *path, const char *data, size_t size, off_t ofs, struct fuse_file_info *info) { 
+  // with -q a bulk write waits for one of the bulk slots, an interactive one goes straight in
+  int qos = qos_classify(info->fh,ofs,size);
+  qos_begin(qos);
+  int rc = write_request(path,data,size,ofs,info,qos);
+  qos_end(qos);
+  return rc;
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+ssize_t y_copy_file_range(const char *path, struct fuse_file_info *info, off_t ofs, const char *path2, struct fuse_file_info *info2, off_t ofs2, size_t size, int flags) {
+  uint64_t start = stats_begin(STATS_Y_COPY_FILE_RANGE);
+  PROBE_OP_ENTRY("y_copy_file_range",path,info->fh,ofs,size);
+  logdebug("y_copy_file_range","fh=%d path=%s ofs=%d fh2=%d path2=%s ofs2=%d size=%d",info->fh,path,ofs,info2->fh,path2,ofs2,size);
+  ssize_t rc = 0;
+  // get the node entries so each side is ciphered with its own rotor
+  btnode *node = findLink(info->fh,&Y_STATE->list);
+  btnode *node2 = findLink(info2->fh,&Y_STATE->list);
+  if (node==NULL || node2==NULL) {
+    logerr("y_copy_file_range","find path=%s path2=%s failed to find node",path,path2);
+    rc = -EIO;
+  } else if (node->report!=NULL || flags!=0 || Y_STATE->sparse || Y_STATE->direct || Y_STATE->chunked || Y_STATE->packed || Y_STATE->compressed) {
+    // the kernel falls back to read and write
+    rc = -EOPNOTSUPP;
+  } else {
+    struct stat st, st2;
+    if (fstat(info->fh,&st)<0 || fstat(info2->fh,&st2)<0) {
+      rc = logerr("y_copy_file_range","fstat path=%s path2=%s",path,path2);
+    } else if (st.st_dev==st2.st_dev && st.st_ino==st2.st_ino && ofs<ofs2+(off_t)size && ofs2<ofs+(off_t)size) {
+      rc = -EINVAL;
+    }
   }
-  // encipher the plain text and then write to the file skipping the first 260 bytes
-  unsigned char *buf = malloc(size);
-  memcpy(buf,data,size);
-  if (trace_on) {
-    logdata("y_write","forward rotors",16,0,node->f_ring,256);
-    logdata("y_write","reverse rotors",16,0,node->r_ring,256);
-    logdata("y_write","rotor offsets",16,0,Y_STATE->offsets,8);
-    logdata("y_write","plain text",64,ofs,buf,size);
+  unsigned char *buf = NULL;
+  size_t chunk = size<SFS_COPY_CHUNK ? size : SFS_COPY_CHUNK;
+  if (rc==0 && (buf = malloc(chunk>0 ? chunk : 1))==NULL) rc = -ENOMEM;
+  // a copy is bulk work as soon as it is large enough and steps aside for interactive requests between chunks
+  int qos = buf!=NULL ? qos_classify(info2->fh,ofs2,size) : QOS_INTERACTIVE;
+  if (buf!=NULL) qos_begin(qos);
+  size_t done = 0;
+  while (rc==0 && done<size) {
+    if (done>0) qos_yield(qos);
+    size_t len = size-done<chunk ? size-done : chunk;
+    off_t in = ofs+done;
+    off_t out = ofs2+done;
+    ssize_t got;
+    SYS_TIMED(got,STATS_SYS_PREAD,"pread",info->fh,sfs_backing_offset(in),len,pread(info->fh,buf,len,sfs_backing_offset(in)));
+    if (got<0) {
+      rc = logerr("y_copy_file_range","pread fh=%d ofs=%d size=%d path=%s",info->fh,in,len,path);
+      break;
+    }
+    if (got==0) break;
+    // one pass over the buffer from the source rotor to the destination rotor
+    CIPHER_TIMED(STATS_DECIPHER,"decipher",info->fh,in,got,sfs_decipher(&Y_STATE->store,&node->header,in,buf,got));
+    CIPHER_TIMED(STATS_ENCIPHER,"encipher",info2->fh,out,got,sfs_encipher(&Y_STATE->store,&node2->header,out,buf,got));
+    // the copy may grow a mapped destination, its readers and writers are only held up for one chunk
+    map_file *map = map_lock(node2->map);
+    ssize_t put;
+    SYS_TIMED(put,STATS_SYS_PWRITE,"pwrite",info2->fh,sfs_backing_offset(out),got,pwrite(info2->fh,buf,got,sfs_backing_offset(out)));
+    map_unlock(map);
+    if (put<0) {
+      rc = logerr("y_copy_file_range","pwrite fh=%d ofs=%d size=%d path=%s",info2->fh,out,got,path2);
+      break;
+    }
+    done += put;
+    if (put<got) break;
   }
-  encipher(node->f_ring,Y_STATE->offsets,ofs,buf,0,size,Y_STATE->endian,Y_STATE->rounds);
-  if (trace_on) {
-    logdata("y_write","cipher text",64,ofs,buf,size);
+  if (buf!=NULL) {
+    qos_end(qos);
+    memset(buf,0,chunk);
+    free(buf);
   }
-  rc = pwrite(info->fh,buf,size,ofs+260);
-  if (rc<0) {
-    rc = logerr("y_write","pwrite fh=%d ofs=%d size=%d path=%s",info->fh,ofs,size,path);
+  // a partial copy reports the bytes that were copied
+  if (done>0) {
+    cache_drop(node2,ofs2,ofs2+done);
+    rc = done;
   }
-  free(buf);
-  loginfo("y_write","fh=%d path=%s offset=%d size=%d rc=%d",info->fh,path,ofs,size,rc);
-  return rc; 
+  loginfo("y_copy_file_range","fh=%d path=%s fh2=%d path2=%s size=%d rc=%d",info->fh,path,info2->fh,path2,size,rc);
+  OP_RETURN(STATS_Y_COPY_FILE_RANGE,start,"y_copy_file_range",path,info->fh,ofs,size,rc,rc>0 ? rc : 0);
+  return rc;
 }
+#endif
 
 int y_statfs(const char *path, struct statvfs *stat) { 
+  uint64_t start = stats_begin(STATS_Y_STATFS);
+  PROBE_OP_ENTRY("y_statfs",path,-1,0,0);
   logdebug("y_statfs","path=%s",path);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = statvfs(fpath,stat);
+  SYS_TIMED(rc,STATS_SYS_META,"statvfs",-1,0,0,statvfs(fpath,stat));
   if (rc<0) rc = logerr("y_statfs","statvfs path=%s",path);
   loginfo("y_statfs","path=%s rc=%d",path,rc);
+  OP_RETURN(STATS_Y_STATFS,start,"y_statfs",path,-1,0,0,rc,0);
   return rc; 
 }
 
 //int y_flush(const char *path, struct fuse_file_info *info) { }
 
 int y_release(const char *path, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_RELEASE);
+  PROBE_OP_ENTRY("y_release",path,info->fh,0,0);
   logdebug("y_release","close fh=%d path=%s",info->fh,path);
   int rc = 0;
-  rc = close(info->fh);
+  btnode *node = Y_STATE->mapped || Y_STATE->direct || Y_STATE->chunked || Y_STATE->packed || Y_STATE->compressed ? findLink(info->fh,&Y_STATE->list) : NULL;
+  if (node!=NULL && node->map!=NULL) map_detach(node->map);
+  if (node!=NULL) chunk_detach(node->chunk);
+  // the held block and the index of a compressed file are written when its last handle goes
+  if (node!=NULL) compress_detach(node->compress);
+  // the record of a packed file is written when its last handle goes
+  if (node!=NULL && node->pack!=NULL) pack_release(node->pack,info->fh);
+  direct_close(node);
+  // the node goes first because a create on another thread can be given the same fd as soon as it is closed
+  delLink(info->fh,&Y_STATE->list);
+  SYS_TIMED(rc,STATS_SYS_CLOSE,"close",info->fh,0,0,close(info->fh));
   if (rc<0) rc = logerr("y_release","close fh=%d path=%s",info->fh,path);
   logdebug("y_release","%d %s",info->fh,path);
-  delLink(info->fh,&Y_STATE->list);
   info->fh = 0;
   loginfo("y_release","fh=%d path=%s rc=%d",info->fh,path,rc);
+  OP_RETURN(STATS_Y_RELEASE,start,"y_release",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
 int y_fsync(const char *path, int datasync, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_FSYNC);
+  PROBE_OP_ENTRY("y_fsync",path,info->fh,0,0);
   logdebug("y_fsync","path=%s datasync=%d",path,datasync);
   int rc = 0;
-  rc = fsync(info->fh);
-  if (rc<0) rc = logerr("y_fsync","fsync path=%s",path);
+  btnode *node = Y_STATE->mapped || Y_STATE->chunked || Y_STATE->packed || Y_STATE->compressed ? findLink(info->fh,&Y_STATE->list) : NULL;
+  int moved = 1;
+  if (node!=NULL && node->map!=NULL) {
+    // pages written through the mapping are flushed to the backing file before it is synced
+    map_file *map = node->map;
+    pthread_rwlock_rdlock(&map->lock);
+    if (map->size>0) {
+      SYS_TIMED(rc,STATS_SYS_FSYNC,"msync",info->fh,0,map->size,msync(map->base,map->size,MS_SYNC));
+      if (rc<0) rc = logerr("y_fsync","msync path=%s",path);
+    }
+    pthread_rwlock_unlock(&map->lock);
+  } else if (node!=NULL && node->chunk!=NULL) {
+    // the chunks and the manifest are synced before the handle itself
+    rc = chunk_fsync(node->chunk);
+    if (rc<0) { errno = -rc; rc = logerr("y_fsync","chunk fsync path=%s",path); }
+  } else if (node!=NULL && node->compress!=NULL) {
+    // the held block and the index are written and synced before the superblock points at them
+    rc = compress_fsync(node->compress);
+    if (rc<0) { errno = -rc; rc = logerr("y_fsync","compress fsync path=%s",path); }
+  } else if (node!=NULL && node->pack!=NULL) {
+    // a packed file is synced with the segment holding its record, its handle is only a placeholder
+    rc = pack_fsync(node->pack,&moved);
+    if (rc<0) { errno = -rc; rc = logerr("y_fsync","pack fsync path=%s",path); }
+  }
+  if (rc==0 && moved) {
+    SYS_TIMED(rc,STATS_SYS_FSYNC,"fsync",info->fh,0,0,fsync(info->fh));
+    if (rc<0) rc = logerr("y_fsync","fsync path=%s",path);
+  }
   loginfo("y_fsync","path=%s datasync=%d rc=%d",path,datasync,rc);
+  OP_RETURN(STATS_Y_FSYNC,start,"y_fsync",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
 int y_setxattr(const char *path, const char *name, const char *val, size_t size, int pos, uint32_t opts) {
+  uint64_t start = stats_begin(STATS_Y_SETXATTR);
+  PROBE_OP_ENTRY("y_setxattr",path,-1,pos,size);
   logdebug("y_setxattr","path=%s name=%s size=%d pos=%d opts=%d",path,name,size,pos,opts);
   logdata("y_setxattr","value",64,0,(unsigned char*)val,size);
-  if (!strcmp("com.apple.quarantine",name)) return 0;
   int rc = 0;
   char fpath[PATH_MAX];
-  resolve(path,fpath);
-  if (strcmp("com.apple.ResourceFork",name)) pos=0; // only ResourceFork uses this field, all others must be zero
-  rc = setxattr(fpath,name,val,size,pos,opts);
-  if (rc<0) rc = logerr("y_setxattr","setxattr path=%s name=%s",path,name);
+  if (!strcmp("com.apple.quarantine",name)) {
+    logdebug("y_setxattr","path=%s name=%s ignored",path,name);
+  } else {
+    resolve(path,fpath);
+    if (strcmp("com.apple.ResourceFork",name)) pos=0; // only ResourceFork uses this field, all others must be zero
+    if (Y_STATE->packed) packed_promote("y_setxattr",path);
+    SYS_TIMED(rc,STATS_SYS_XATTR,"setxattr",-1,pos,size,setxattr(fpath,name,val,size,pos,opts));
+    xattr_forget(path);
+    if (rc<0) rc = logerr("y_setxattr","setxattr path=%s name=%s",path,name);
+  }
   loginfo("y_setxattr","path=%s name=%s size=%d pos=%d opts=%d rc=%d",path,name,size,pos,opts,rc);
+  OP_RETURN(STATS_Y_SETXATTR,start,"y_setxattr",path,-1,pos,size,rc,0);
   return rc; 
 }
 
 int y_getxattr(const char *path, const char *name, char *val, size_t size, uint32_t opts) { 
+  uint64_t start = stats_begin(STATS_Y_GETXATTR);
+  PROBE_OP_ENTRY("y_getxattr",path,-1,0,size);
   logdebug("y_getxattr","path=%s name=%s size=%d opts=%d",path,name,size,opts);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = getxattr(fpath,name,val,size,0,opts);
-  if (rc<0) { if (errno!=ENOATTR) rc = logerr("y_getxattr","getxattr path=%s name=%s",path,name); else rc = -errno; }
-  else { logdata("y_getxattr","value",64,0,(unsigned char*)val,rc); }
+  // Finder and Spotlight ask every file they show for the same few attributes, and most of them are missing
+  int cacheable = xattr_enabled() && opts==0 && strcmp("com.apple.ResourceFork",name);
+  uint64_t epoch = 0;
+  ssize_t hit;
+  // a value that may be cached is read whole so a later call of any size can be answered from it
+  char value[XATTR_VALUE];
+  if (is_stats_file(path) || (Y_STATE->packed && pack_stat(path,NULL))) {
+    rc = -ENOATTR;
+  } else if (cacheable && xattr_lookup(path,name,val,size,&hit,&epoch)) {
+    rc = hit;
+    logdebug("y_getxattr","path=%s name=%s cached",path,name);
+  } else {
+    if (cacheable) SYS_TIMED(rc,STATS_SYS_XATTR,"getxattr",-1,0,sizeof(value),getxattr(fpath,name,value,sizeof(value),0,opts));
+    if (!cacheable || (rc<0 && errno==ERANGE)) {
+      cacheable = 0;
+      SYS_TIMED(rc,STATS_SYS_XATTR,"getxattr",-1,0,size,getxattr(fpath,name,val,size,0,opts));
+    }
+    if (cacheable && (rc>=0 || errno==ENOATTR)) {
+      int error = errno;
+      xattr_insert(path,name,value,rc>=0 ? rc : -ENOATTR,epoch);
+      errno = error;
+      if (rc>0 && size>0 && size<(size_t)rc) { rc = -1; errno = ERANGE; }
+      else if (rc>0 && size>0) memcpy(val,value,rc);
+    }
+    if (rc<0) { if (errno!=ENOATTR) rc = logerr("y_getxattr","getxattr path=%s name=%s",path,name); else rc = -errno; }
+    else { logdata("y_getxattr","value",64,0,(unsigned char*)val,rc); }
+  }
   loginfo("y_getxattr","path=%s name=%s size=%d opts=%d rc=%d",path,name,size,opts,rc);
+  OP_RETURN(STATS_Y_GETXATTR,start,"y_getxattr",path,-1,0,size,rc,0);
   return rc; 
 }
 
 int y_listxattr(const char *path, char *name, size_t size) { 
+  uint64_t start = stats_begin(STATS_Y_LISTXATTR);
+  PROBE_OP_ENTRY("y_listxattr",path,-1,0,size);
   logdebug("y_listxattr","path=%s size=%d",path,size);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = listxattr(fpath,name,size,0);
-  if (rc<0) rc = logerr("y_listxattr","listxattr path=%s name=%s",path,name);
+  int cacheable = xattr_enabled();
+  uint64_t epoch = 0;
+  ssize_t hit;
+  // the name list is read whole when it may be cached, like a value
+  char names[XATTR_VALUE];
+  if (is_stats_file(path) || (Y_STATE->packed && pack_stat(path,NULL))) {
+    // the statistics file and packed files list no attributes
+  } else if (cacheable && xattr_lookup(path,NULL,name,size,&hit,&epoch)) {
+    rc = hit;
+    logdebug("y_listxattr","path=%s cached",path);
+  } else {
+    if (cacheable) SYS_TIMED(rc,STATS_SYS_XATTR,"listxattr",-1,0,sizeof(names),listxattr(fpath,names,sizeof(names),0));
+    if (!cacheable || (rc<0 && errno==ERANGE)) {
+      cacheable = 0;
+      SYS_TIMED(rc,STATS_SYS_XATTR,"listxattr",-1,0,size,listxattr(fpath,name,size,0));
+    }
+    if (cacheable && rc>=0) {
+      int error = errno;
+      xattr_insert(path,NULL,names,rc,epoch);
+      errno = error;
+      if (rc>0 && size>0 && size<(size_t)rc) { rc = -1; errno = ERANGE; }
+      else if (rc>0 && size>0) memcpy(name,names,rc);
+    }
+    if (rc<0) rc = logerr("y_listxattr","listxattr path=%s name=%s",path,name);
+  }
   loginfo("y_listxattr","path=%s size=%d rc=%d",path,size,rc);
+  OP_RETURN(STATS_Y_LISTXATTR,start,"y_listxattr",path,-1,0,size,rc,0);
   return rc; 
 }
 
 int y_removexattr(const char *path, const char *name) { 
+  uint64_t start = stats_begin(STATS_Y_REMOVEXATTR);
+  PROBE_OP_ENTRY("y_removexattr",path,-1,0,0);
   logdebug("y_removexattr","path=%s name=%s",path,name);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = removexattr(fpath,name,0);
+  if (Y_STATE->packed) packed_promote("y_removexattr",path);
+  SYS_TIMED(rc,STATS_SYS_XATTR,"removexattr",-1,0,0,removexattr(fpath,name,0));
+  xattr_forget(path);
   if (rc<0) rc = logerr("y_removexattr","removexattr path=%s name=%s",path,name);
   loginfo("y_removexattr","path=%s name=%s rc=%d",path,name,rc);
+  OP_RETURN(STATS_Y_REMOVEXATTR,start,"y_removexattr",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_opendir(const char *path, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_OPENDIR);
+  PROBE_OP_ENTRY("y_opendir",path,-1,0,0);
   logdebug("y_opendir","path=%s",path);
   int rc = 0;
   DIR *dp;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  dp = opendir(fpath);
+  SYS_TIMED(rc,STATS_SYS_DIR,"opendir",-1,0,0,(dp = opendir(fpath))==NULL ? -1 : 0);
   info->fh = (intptr_t)dp;
   if (dp==NULL) rc = logerr("y_opendir","opendir path=%s",path);
   loginfo("y_opendir","path=%s rc=%d",path,rc);
+  OP_RETURN(STATS_Y_OPENDIR,start,"y_opendir",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
 int y_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_READDIR);
+  PROBE_OP_ENTRY("y_readdir",path,info->fh,offset,0);
   logdebug("y_readdir","path=%s",path);
   int rc = 0;
   DIR *dp;
   struct dirent *dent = NULL;
+  packed_filler fill = { buf, filler };
   //dp = (DIR*)(uintptr_t)info->fh;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  dp = opendir(fpath);
+  SYS_TIMED(rc,STATS_SYS_DIR,"opendir",-1,0,0,(dp = opendir(fpath))==NULL ? -1 : 0);
   if (dp==NULL) {
     rc = logerr("y_readdir","opendir path=%s",path);
   } else {
@@ -659,103 +1671,421 @@ int y_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
         struct stat st;
         st.st_ino = dent->d_ino;
         st.st_mode = dent->d_type << 12;
+        // the chunks of large files are only reached through their manifests
+        if (!strcmp(path,"/") && !strcmp(dent->d_name,&CHUNK_DIR[1])) continue;
+        if (!strcmp(path,"/") && !strcmp(dent->d_name,&PACK_DIR[1])) continue;
+        if (!strcmp(path,"/") && (!strcmp(dent->d_name,&WARM_FILE[1]) || !strcmp(dent->d_name,&WARM_TEMP[1]))) continue;
         if (!strcmp(dent->d_name,".DS_Store.")) {
-          if (filler(buf, ".DS_Store", &st, 0) != 0) {
+          if (fill_dir(filler, buf, ".DS_Store", &st) != 0) {
             logerr("y_readdir","filler path=%s",path);
             rc = -ENOMEM;
             break;
           }
         } else {
-          if (filler(buf, dent->d_name, &st, 0) != 0) {
+          if (fill_dir(filler, buf, dent->d_name, &st) != 0) {
             logerr("y_readdir","filler path=%s",path);
             rc = -ENOMEM;
             break;
           }
         }
       } while (( dent = readdir(dp)) != NULL);
+      // packed files are listed from the index after the backing entries
+      if (rc==0 && Y_STATE->packed && pack_list(path,packed_add,&fill)<0) {
+        logerr("y_readdir","filler path=%s",path);
+        rc = -ENOMEM;
+      }
     }
     closedir(dp);
   }
   loginfo("y_readdir","path=%s rc=%d",path,rc);
+  OP_RETURN(STATS_Y_READDIR,start,"y_readdir",path,info->fh,offset,0,rc,0);
   return rc;
 }
 
 int y_releasedir(const char *path, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_RELEASEDIR);
+  PROBE_OP_ENTRY("y_releasedir",path,info->fh,0,0);
   logdebug("y_releasedir","path=%s",path);
   int rc = 0;
   DIR *dp;
   dp = (DIR*)(uintptr_t)info->fh;
-  rc = closedir(dp);
+  SYS_TIMED(rc,STATS_SYS_DIR,"closedir",-1,0,0,closedir(dp));
   if (rc<0) rc = logerr("y_releasedir","releasedir path=%s",path);
   else info->fh = 0;
   loginfo("y_releasedir","path=%s rc=%d",path,rc);
+  OP_RETURN(STATS_Y_RELEASEDIR,start,"y_releasedir",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
 //int y_fsyncdir(const char *path, int arg1, struct fuse_file_info *info) { }
 
 void *y_init(struct fuse_conn_info *conn) { 
+  // fuse has daemonized by now so the dump thread survives
+  int rc = stats_listen(SIGUSR1,Y_STATE->logfile);
+  if (rc<0) { errno = -rc; logerr("y_init","failed to listen for SIGUSR1"); }
+  if (strlen(Y_STATE->metrics)>0) {
+    rc = metrics_listen(Y_STATE->metrics);
+    if (rc<0) { errno = -rc; logerr("y_init","failed to listen on metrics socket %s",Y_STATE->metrics); }
+  }
+  rc = pool_start(&Y_STATE->store);
+  if (rc<0) { errno = -rc; logerr("y_init","failed to start the header pool"); }
+  if (Y_STATE->packed) {
+    // segments take their headers from the pool
+    rc = pack_start(&Y_STATE->store,packed_moved);
+    if (rc<0) { errno = -rc; logerr("y_init","failed to load the pack index"); }
+  }
+  if (warm_enabled()) {
+    // prefetch threads have no fuse context so they are handed the state
+    rc = warm_start(&Y_STATE->store,warmed_stat,Y_STATE);
+    if (rc<0) { errno = -rc; logerr("y_init","failed to load the warm set"); }
+  }
   return Y_STATE; 
 }
 
-void y_destroy(void *conn) { }
+void y_destroy(void *conn) { 
+  lockprof_dump(Y_STATE->logfile);
+  metrics_stop();
+  trace_close();
+  if (trace_dropped()>0) {
+    errno = EIO;
+    logerr("y_destroy","trace file write failed, %llu records dropped",(unsigned long long)trace_dropped());
+  }
+  cache_stop();
+  xattr_stop();
+  warm_stop();
+  if (Y_STATE->packed) pack_stop();
+  pool_stop();
+}
 
 int y_access(const char *path, int mask) { 
+  uint64_t start = stats_begin(STATS_Y_ACCESS);
+  PROBE_OP_ENTRY("y_access",path,-1,0,0);
   logdebug("y_access","path=%s mask=%d",path,mask);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = access(fpath,mask);
-  if (rc<0) { if (errno!=EACCES) rc = logerr("y_access","access path=%s mask=%d",path,mask); else rc = -errno; }
+  struct stat st;
+  if (is_stats_file(path)) {
+    rc = (mask&(W_OK|X_OK)) ? -EACCES : 0;
+  } else if (Y_STATE->packed && pack_stat(path,&st)) {
+    // every packed file belongs to the user running the mount so only its owner bits count
+    rc = ((mask<<6) & ~st.st_mode & 0700) ? -EACCES : 0;
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"access",-1,0,0,access(fpath,mask));
+    if (rc<0) { if (errno!=EACCES) rc = logerr("y_access","access path=%s mask=%d",path,mask); else rc = -errno; }
+  }
   logdebug("y_access","path=%s mask=%d rc=%d",path,mask,rc);
+  OP_RETURN(STATS_Y_ACCESS,start,"y_access",path,-1,0,0,rc,0);
   return rc; 
 }
 
 int y_create(const char *path, mode_t mode, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_CREATE);
+  PROBE_OP_ENTRY("y_create",path,-1,0,0);
   logdebug("y_create","path=%s mode=%d",path,mode);
   int rc = 0;
   int fd;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, mode);
-  if (fd<0) {
-    rc = logerr("y_create","creat path=%s mode=%d",path,mode);
-  } else { 
-    logdebug("y_create","fd=%d path=%s",fd,path);
-    info->fh = fd; 
-    btnode* node = addLink(fd,&Y_STATE->list); 
-    rc = calculate_and_write_rotor("y_create",path,node,info,Y_STATE);
+  struct stat st;
+  if (Y_STATE->packed && lstat(fpath,&st)<0) {
+    // a new file starts out packed, an existing backing file is truncated in place
+    rc = packed_parent(fpath);
+    if (rc==0) rc = packed_open("y_create",path,info,1,mode);
+    else { errno = -rc; rc = logerr("y_create","creat packed path=%s mode=%d",path,mode); }
+    if (rc>0) rc = 0;
+  } else {
+    // an existing file that is already mapped is truncated by the open
+    map_file *map = map_lock_path(fpath);
+    // and an existing chunked file loses its chunks and takes the new header
+    chunk_file *chunk = Y_STATE->chunked ? chunk_lookup(&Y_STATE->store,fpath) : NULL;
+    chunk_lock(chunk);
+    // and an open compressed file drops its blocks and takes the new header
+    compress_file *compress = Y_STATE->compressed ? compress_lookup(fpath) : NULL;
+    compress_lock(compress);
+    SYS_TIMED(fd,STATS_SYS_OPEN,"open",-1,0,0,open(fpath, O_CREAT | O_TRUNC | O_RDWR, mode));
+    if (fd<0) {
+      rc = logerr("y_create","creat path=%s mode=%d",path,mode);
+      compress_unlock(compress);
+      compress_detach(compress);
+      chunk_unlock(chunk);
+      chunk_detach(chunk);
+      map_unlock(map);
+    } else { 
+      logdebug("y_create","fd=%d path=%s",fd,path);
+      info->fh = fd; 
+      qos_open(fd);
+      btnode* node = addLink(fd,&Y_STATE->list); 
+      rc = calculate_and_write_rotor("y_create",path,node,info,Y_STATE);
+      if (rc==0 && chunk!=NULL) chunk_reset(chunk,&node->header);
+      if (rc==0 && compress!=NULL) compress_reset(compress,&node->header);
+      compress_unlock(compress);
+      chunk_unlock(chunk);
+      map_unlock(map);
+      if (rc==0 && chunk!=NULL) node->chunk = chunk;
+      else chunk_detach(chunk);
+      if (rc==0 && chunk==NULL) rc = chunked_open(node,fpath);
+      if (rc==0 && compress!=NULL) node->compress = compress;
+      else compress_detach(compress);
+      if (rc==0 && compress==NULL) rc = compressed_open(node,fpath);
+      if (rc==0) {
+        map_open(node,fpath,fd);
+        direct_open(node,fpath,O_RDWR);
+        cache_key(node,fd);
+        cache_drop(node,0,INT64_MAX);
+      }
+    }
   }
   loginfo("y_create","path=%s mode=%d rc=%d",path,mode,rc);
+  OP_RETURN(STATS_Y_CREATE,start,"y_create",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
 int y_ftruncate(const char *path, off_t pos, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_FTRUNCATE);
+  PROBE_OP_ENTRY("y_ftruncate",path,info->fh,pos,0);
   logdebug("y_ftruncate","path=%s pos=%d",path,pos);
   int rc = 0;
-  // truncate the file skipping the first 260 bytes
-  rc = ftruncate(info->fh, pos+260);
-  if (rc<0) rc = logerr("y_ftruncate","ftruncate path=%s pos=%d",path,pos);
+  pthread_mutex_t *mutex = NULL;
+  btnode *packed = Y_STATE->packed ? findLink(info->fh,&Y_STATE->list) : NULL;
+  int moved = 1;
+  if (packed!=NULL && packed->pack!=NULL) rc = pack_ftruncate(packed->pack,pos,&moved);
+  if (rc<0 || !moved) {
+    if (rc<0) { errno = -rc; rc = logerr("y_ftruncate","truncate packed path=%s pos=%d",path,pos); }
+  } else {
+    if (Y_STATE->sparse) {
+      // a file that grows must not expose the zero bytes after its old end
+      btnode *node = findLink(info->fh,&Y_STATE->list);
+      if (node==NULL) {
+        logerr("y_ftruncate","find path=%s failed to find node",path);
+        rc = -EIO;
+      } else {
+        mutex = lock_sparse(info->fh);
+        rc = sparse_grow("y_ftruncate",path,&node->header,info->fh,pos);
+      }
+    }
+    btnode *chunked = Y_STATE->chunked || Y_STATE->compressed ? findLink(info->fh,&Y_STATE->list) : NULL;
+    if (chunked!=NULL && chunked->chunk!=NULL) {
+      rc = chunk_truncate(chunked->chunk,path,pos);
+      if (rc<0) { errno = -rc; rc = logerr("y_ftruncate","truncate path=%s pos=%d",path,pos); }
+    } else if (chunked!=NULL && chunked->compress!=NULL) {
+      rc = compress_truncate(chunked->compress,pos);
+      if (rc<0) { errno = -rc; rc = logerr("y_ftruncate","truncate path=%s pos=%d",path,pos); }
+    } else if (rc==0) {
+      // truncate the file skipping the header
+      btnode *node = Y_STATE->mapped || Y_STATE->direct ? findLink(info->fh,&Y_STATE->list) : NULL;
+      pthread_mutex_t *direct = lock_direct_node(node);
+      map_file *map = map_lock(node!=NULL ? node->map : NULL);
+      SYS_TIMED(rc,STATS_SYS_TRUNCATE,"ftruncate",info->fh,sfs_backing_offset(pos),0,ftruncate(info->fh, sfs_backing_offset(pos)));
+      if (rc<0) rc = logerr("y_ftruncate","ftruncate path=%s pos=%d",path,pos);
+      map_unlock(map);
+      unlock_direct(direct);
+    }
+    if (rc==0 && cache_enabled()) {
+      btnode *node = findLink(info->fh,&Y_STATE->list);
+      if (node!=NULL) cache_drop(node,pos,INT64_MAX);
+    }
+    if (mutex!=NULL) unlock_sparse(mutex);
+  }
   loginfo("y_ftruncate","path=%s pos=%d rc=%d",path,pos,rc);
+  OP_RETURN(STATS_Y_FTRUNCATE,start,"y_ftruncate",path,info->fh,pos,0,rc,0);
   return rc; 
 }
 
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+off_t y_lseek(const char *path, off_t ofs, int whence, struct fuse_file_info *info) {
+  uint64_t start = stats_begin(STATS_Y_LSEEK);
+  PROBE_OP_ENTRY("y_lseek",path,info->fh,ofs,whence);
+  logdebug("y_lseek","path=%s ofs=%d whence=%d",path,ofs,whence);
+  off_t rc = 0;
+  btnode *node = Y_STATE->chunked || Y_STATE->packed || Y_STATE->compressed ? findLink(info->fh,&Y_STATE->list) : NULL;
+  struct stat st;
+  memset(&st,0,sizeof(st));
+  // the kernel handles the other modes itself, holes are found in the backing file past the header
+  if (whence!=SEEK_DATA && whence!=SEEK_HOLE) {
+    rc = -EINVAL;
+  } else if (node!=NULL && (chunk_fstat(node->chunk,&st) || compress_fstat(node->compress,&st) || (node->pack!=NULL && pack_fstat(node->pack,&st)))) {
+    // a chunked, compressed or packed file is reported as data from start to end
+    if (ofs>=st.st_size) rc = -ENXIO;
+    else rc = whence==SEEK_DATA ? ofs : st.st_size;
+  } else if (!Y_STATE->sparse) {
+    // without -sparse a hole in the backing file deciphers to garbage so the whole file is data
+    SYS_TIMED(rc,STATS_SYS_STAT,"fstat",info->fh,0,0,fstat(info->fh,&st));
+    if (rc<0) rc = logerr("y_lseek","fstat path=%s",path);
+    else if (ofs>=sfs_plain_size(st.st_size)) rc = -ENXIO;
+    else rc = whence==SEEK_DATA ? ofs : sfs_plain_size(st.st_size);
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"lseek",info->fh,sfs_backing_offset(ofs),whence,lseek(info->fh,sfs_backing_offset(ofs),whence));
+    if (rc<0) rc = errno==ENXIO ? -ENXIO : logerr("y_lseek","lseek path=%s ofs=%d whence=%d",path,ofs,whence);
+    else rc -= SFS_HEADER;
+  }
+  loginfo("y_lseek","path=%s ofs=%d whence=%d rc=%d",path,ofs,whence,rc);
+  OP_RETURN(STATS_Y_LSEEK,start,"y_lseek",path,info->fh,ofs,whence,rc,0);
+  return rc;
+}
+#endif
+
+// linux fallocate modes, osxfuse only ever asks for space to be reserved without a change of size
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+int reserve_backing(int fh, off_t ofs, off_t len, int mode) {
+#ifdef __APPLE__
+  // F_PREALLOCATE counts from the physical end of the file and never changes its size
+  struct stat st;
+  if (fstat(fh,&st)<0) return -1;
+  if (sfs_backing_offset(ofs+len)<=st.st_size) return 0;
+  fstore_t store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, sfs_backing_offset(ofs+len)-st.st_size, 0 };
+  if (fcntl(fh,F_PREALLOCATE,&store)<0) {
+    store.fst_flags = F_ALLOCATEALL;
+    if (fcntl(fh,F_PREALLOCATE,&store)<0) return -1;
+  }
+  return 0;
+#else
+  return fallocate(fh,mode & FALLOC_FL_KEEP_SIZE,sfs_backing_offset(ofs),len);
+#endif
+}
+
+int y_fallocate(const char *path, int mode, off_t ofs, off_t len, struct fuse_file_info *info) {
+  uint64_t start = stats_begin(STATS_Y_FALLOCATE);
+  PROBE_OP_ENTRY("y_fallocate",path,info->fh,ofs,len);
+  logdebug("y_fallocate","path=%s mode=%d ofs=%d len=%d",path,mode,ofs,len);
+  int rc = 0;
+  btnode *node = findLink(info->fh,&Y_STATE->list);
+  // a mapped file is reserved and punched with the mapping held so it is mapped at its new size
+  // the zeros are written through the cached handle so they must not race a block being patched
+  pthread_mutex_t *direct = lock_direct_node(node);
+  map_file *map = map_lock(node!=NULL ? node->map : NULL);
+  if (node==NULL) {
+    logerr("y_fallocate","find path=%s failed to find node",path);
+    rc = -EIO;
+  } else if (node->report!=NULL) {
+    rc = -EBADF;
+  } else if (node->chunk!=NULL) {
+    // the backing blocks of a chunked file are spread over its chunks
+    rc = -EOPNOTSUPP;
+  } else if (node->compress!=NULL) {
+    // a range of a compressed file has no fixed place in its backing file
+    rc = -EOPNOTSUPP;
+  } else if (node->pack!=NULL && (rc = pack_move(node->pack))<0) {
+    // space is only reserved for a packed file once it has a backing file of its own
+    errno = -rc;
+    rc = logerr("y_fallocate","move out path=%s",path);
+  } else if (ofs<0 || len<=0) {
+    rc = -EINVAL;
+#ifndef __APPLE__
+  } else if ((mode & FALLOC_FL_PUNCH_HOLE)==FALLOC_FL_PUNCH_HOLE) {
+    // a punched range must read back as plain text zeros and never changes the size
+    struct stat st;
+    if ((mode & FALLOC_FL_KEEP_SIZE)==0 || (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))!=0) {
+      rc = -EOPNOTSUPP;
+    } else {
+      pthread_mutex_t *mutex = Y_STATE->sparse ? lock_sparse(info->fh) : NULL;
+      rc = stat_backing("y_fallocate",path,info->fh,&st);
+      off_t size = sfs_plain_size(st.st_size);
+      if (rc==0 && ofs<size) {
+        if (ofs+len>size) len = size-ofs;
+        // sparse mounts release the whole blocks and only encipher zeros into the partial ones at each end
+        off_t b = sfs_backing_offset(ofs);
+        off_t e = b+len;
+        off_t first = b%st.st_blksize ? b-b%st.st_blksize+st.st_blksize : b;
+        off_t last = e-e%st.st_blksize;
+        if (!Y_STATE->sparse || first>=last) {
+          rc = write_zeros("y_fallocate",path,&node->header,info->fh,ofs,len);
+        } else {
+          SYS_TIMED(rc,STATS_SYS_TRUNCATE,"fallocate",info->fh,first,last-first,fallocate(info->fh,FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,first,last-first));
+          if (rc<0) rc = logerr("y_fallocate","punch path=%s ofs=%d len=%d",path,ofs,len);
+          if (rc==0 && b<first) rc = write_zeros("y_fallocate",path,&node->header,info->fh,ofs,first-b);
+          if (rc==0 && last<e) rc = write_zeros("y_fallocate",path,&node->header,info->fh,last-SFS_HEADER,e-last);
+        }
+        cache_drop(node,ofs,ofs+len);
+      }
+      if (mutex!=NULL) unlock_sparse(mutex);
+    }
+  } else if ((mode & ~FALLOC_FL_KEEP_SIZE)!=0) {
+    rc = -EOPNOTSUPP;
+#endif
+  } else {
+    // only the backing blocks are reserved, shifted past the header
+    pthread_mutex_t *mutex = NULL;
+    int reserve = 1;
+#ifndef __APPLE__
+    if (Y_STATE->sparse) {
+      // a reserved block reads back as data once its pages are cached, so a hole preserving mount only grows the size
+      reserve = 0;
+      struct stat st;
+      if ((mode & FALLOC_FL_KEEP_SIZE)==0) {
+        mutex = lock_sparse(info->fh);
+        rc = sparse_grow("y_fallocate",path,&node->header,info->fh,ofs+len);
+        if (rc==0) rc = stat_backing("y_fallocate",path,info->fh,&st);
+        if (rc==0 && sfs_backing_offset(ofs+len)>st.st_size) {
+          SYS_TIMED(rc,STATS_SYS_TRUNCATE,"ftruncate",info->fh,sfs_backing_offset(ofs+len),0,ftruncate(info->fh,sfs_backing_offset(ofs+len)));
+          if (rc<0) rc = logerr("y_fallocate","ftruncate path=%s ofs=%d len=%d",path,ofs,len);
+        }
+      }
+    }
+#endif
+    struct stat before;
+    if (rc==0 && reserve) rc = stat_backing("y_fallocate",path,info->fh,&before);
+    if (rc==0 && reserve) {
+      SYS_TIMED(rc,STATS_SYS_TRUNCATE,"fallocate",info->fh,sfs_backing_offset(ofs),len,reserve_backing(info->fh,ofs,len,mode));
+      if (rc<0) rc = logerr("y_fallocate","fallocate path=%s ofs=%d len=%d",path,ofs,len);
+    }
+    // the reserved blocks past the old end read back as zero bytes, which decipher to garbage
+    struct stat after;
+    if (rc==0 && reserve && (rc = stat_backing("y_fallocate",path,info->fh,&after))==0 && after.st_size>before.st_size) {
+      off_t eof = sfs_plain_size(before.st_size);
+      rc = write_zeros("y_fallocate",path,&node->header,info->fh,eof,sfs_plain_size(after.st_size)-eof);
+    }
+    // a file that grew has a new last block
+    if (rc==0) cache_drop(node,ofs,ofs+len);
+    if (mutex!=NULL) unlock_sparse(mutex);
+  }
+  map_unlock(map);
+  unlock_direct(direct);
+  loginfo("y_fallocate","path=%s mode=%d ofs=%d len=%d rc=%d",path,mode,ofs,len,rc);
+  OP_RETURN(STATS_Y_FALLOCATE,start,"y_fallocate",path,info->fh,ofs,len,rc,0);
+  return rc;
+}
+
 int y_fgetattr(const char *path, struct stat *stat, struct fuse_file_info *info) { 
+  uint64_t start = stats_begin(STATS_Y_FGETATTR);
+  PROBE_OP_ENTRY("y_fgetattr",path,info->fh,0,0);
   logdebug("y_fgetattr","path=%s",path);
   int rc = 0;
-  rc = fstat(info->fh,stat);
-  if (rc<0) rc = logerr("y_fgetattr","fstat path=%s",path);
-  else { if (stat->st_size>=260) stat->st_size -= 260; /* hide the first 260 bytes */ }
+  btnode *node = Y_STATE->chunked || Y_STATE->packed || Y_STATE->compressed ? findLink(info->fh,&Y_STATE->list) : NULL;
+  if (is_stats_file(path)) {
+    stat_stats_file(stat);
+  } else if (node==NULL || node->pack==NULL || !pack_fstat(node->pack,stat)) {
+    SYS_TIMED(rc,STATS_SYS_STAT,"fstat",info->fh,0,0,fstat(info->fh,stat));
+    if (rc<0) rc = logerr("y_fgetattr","fstat path=%s",path);
+    else if (node==NULL || (!chunk_fstat(node->chunk,stat) && !compress_fstat(node->compress,stat))) stat->st_size = sfs_plain_size(stat->st_size); /* hide the header */
+  }
   loginfo("y_fgetattr","path=%s size=%lu rc=%d",path,stat->st_size,rc);
+  OP_RETURN(STATS_Y_FGETATTR,start,"y_fgetattr",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
 int y_lock(const char *path, struct fuse_file_info *info, int cmd, struct flock *flock) { 
+  uint64_t start = stats_begin(STATS_Y_LOCK);
+  PROBE_OP_ENTRY("y_lock",path,info->fh,0,0);
   logdebug("y_lock","path=%s cmd=%d",path,cmd);
   int rc = 0;
-  rc = fcntl(info->fh,cmd,flock);
-  if (rc<0) rc = logerr("y_lock","fcntl path=%s",path);
+  // every placeholder handle is on /dev/null so a packed file is moved out before it is locked
+  btnode *node = Y_STATE->packed ? findLink(info->fh,&Y_STATE->list) : NULL;
+  if (node!=NULL && node->pack!=NULL && (rc = pack_move(node->pack))<0) {
+    errno = -rc;
+    rc = logerr("y_lock","move out path=%s",path);
+  } else {
+    SYS_TIMED(rc,STATS_SYS_META,"fcntl",info->fh,0,0,fcntl(info->fh,cmd,flock));
+    if (rc<0) rc = logerr("y_lock","fcntl path=%s",path);
+  }
   loginfo("y_lock","path=%s cmd=%d rc=%d",path,cmd,rc);
+  OP_RETURN(STATS_Y_LOCK,start,"y_lock",path,info->fh,0,0,rc,0);
   return rc; 
 }
 
@@ -772,20 +2102,144 @@ int y_lock(const char *path, struct fuse_file_info *info, int cmd, struct flock
 //int y_setchgtime(const char *path, const struct timespec *tv) { }
 //int y_setcrtime(const char *path, const struct timespec *tv) { }
 
+#ifdef __APPLE__
 int y_chflags(const char *path, uint32_t flags) { 
+  uint64_t start = stats_begin(STATS_Y_CHFLAGS);
+  PROBE_OP_ENTRY("y_chflags",path,-1,0,0);
   logdebug("y_chflags","path=%s flags=%d",path,flags);
   int rc = 0;
   char fpath[PATH_MAX];
   resolve(path,fpath);
-  rc = chflags(fpath,flags);
+  if (Y_STATE->packed) packed_promote("y_chflags",path);
+  SYS_TIMED(rc,STATS_SYS_META,"chflags",-1,0,0,chflags(fpath,flags));
   if (rc<0) rc = logerr("y_chflags","chflags path=%s flags=%d",path,flags);
   loginfo("y_chflags","path=%s flags=%d rc=%d",path,flags,rc);
+  OP_RETURN(STATS_Y_CHFLAGS,start,"y_chflags",path,-1,0,0,rc,0);
   return rc;
 }
+#endif
 
 //int y_setattr_x(const char *path, struct setattr_x *arg1) { }
 //int y_fsetattr_x(const char *path, struct setattr_x *arg1, struct fuse_file_info *info) { }
 
+#ifdef SAFEFS_FUSE3
+
+// ----------------------------------------------------------------------
+// libfuse 3 passes the open handle to calls that had f-variants and drops the macOS arguments
+// ----------------------------------------------------------------------
+
+// writes are gathered up to this and the kernel asks for as many pages per request
+#define FUSE3_MAX_WRITE 1048576
+
+int y3_getattr(const char *path, struct stat *stat, struct fuse_file_info *info) {
+  return info ? y_fgetattr(path,stat,info) : y_getattr(path,stat);
+}
+
+int y3_rename(const char *path, const char *path2, unsigned int flags) {
+  // RENAME_EXCHANGE and RENAME_NOREPLACE would need both names locked against the pack and chunk indexes
+  return flags ? -EINVAL : y_rename(path,path2);
+}
+
+int y3_chmod(const char *path, mode_t mode, struct fuse_file_info *info) {
+  return y_chmod(path,mode);
+}
+
+int y3_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *info) {
+  return y_chown(path,uid,gid);
+}
+
+int y3_truncate(const char *path, off_t off, struct fuse_file_info *info) {
+  return info ? y_ftruncate(path,off,info) : y_truncate(path,off);
+}
+
+int y3_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *info) {
+  // times are kept to the second as they are on macOS
+  struct utimbuf times;
+  struct stat st;
+  memset(&st,0,sizeof(st));
+  if (tv[0].tv_nsec==UTIME_OMIT || tv[1].tv_nsec==UTIME_OMIT) {
+    int rc = y_getattr(path,&st);
+    if (rc<0) return rc;
+  }
+  time_t now = time(NULL);
+  times.actime = tv[0].tv_nsec==UTIME_NOW ? now : tv[0].tv_nsec==UTIME_OMIT ? st.st_atime : tv[0].tv_sec;
+  times.modtime = tv[1].tv_nsec==UTIME_NOW ? now : tv[1].tv_nsec==UTIME_OMIT ? st.st_mtime : tv[1].tv_sec;
+  return y_utime(path,&times);
+}
+
+int y3_setxattr(const char *path, const char *name, const char *val, size_t size, int flags) {
+  return y_setxattr(path,name,val,size,0,flags);
+}
+
+int y3_getxattr(const char *path, const char *name, char *val, size_t size) {
+  return y_getxattr(path,name,val,size,0);
+}
+
+int y3_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info, enum fuse_readdir_flags flags) {
+  return y_readdir(path,buf,filler,offset,info);
+}
+
+void *y3_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  cfg->use_ino = 1;
+  cfg->hard_remove = 1;
+  // reads of one file may overlap and lookups in one folder run side by side, the fuse threads are ready for both
+  conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_PARALLEL_DIROPS);
+  // small writes are enciphered as a page or more at once, unless -odirect_io keeps plain text out of the page cache
+  if (!cfg->direct_io && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    Y_STATE->writeback = 1;
+  }
+  conn->max_write = FUSE3_MAX_WRITE;
+  conn->max_readahead = FUSE3_MAX_WRITE;
+  loginfo("y_init","capable=%x want=%x max_write=%u max_readahead=%u writeback=%d",conn->capable,conn->want,conn->max_write,conn->max_readahead,Y_STATE->writeback);
+  return y_init(conn);
+}
+
+struct fuse_operations y_ops = {
+
+  .getattr = y3_getattr,
+  .readlink = y_readlink,
+  .mknod = y_mknod,
+  .mkdir = y_mkdir,
+  .unlink = y_unlink,
+  .rmdir = y_rmdir,
+  .symlink = y_symlink,
+  .rename = y3_rename,
+  .link = y_link,
+  .chmod = y3_chmod,
+  .chown = y3_chown,
+  .truncate = y3_truncate,
+  .utimens = y3_utimens,
+  .open = y_open,
+  .read = y_read,
+  .write = y_write,
+  .statfs = y_statfs,
+  .release = y_release,
+  .fsync = y_fsync,
+  .setxattr = y3_setxattr,
+  .getxattr = y3_getxattr,
+  .listxattr = y_listxattr,
+  .removexattr = y_removexattr,
+  .opendir = y_opendir,
+  .readdir = y3_readdir,
+  .releasedir = y_releasedir,
+  .init = y3_init,
+  .destroy = y_destroy,
+  .access = y_access,
+  .create = y_create,
+  .lock = y_lock,
+  .fallocate = y_fallocate,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+  .lseek = y_lseek,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+  .copy_file_range = y_copy_file_range,
+#endif
+
+};
+
+#else
+
 struct fuse_operations y_ops = {
 
   .getattr = y_getattr,
@@ -821,10 +2275,21 @@ struct fuse_operations y_ops = {
   .ftruncate = y_ftruncate,
   .fgetattr = y_fgetattr,
   .lock = y_lock,
-  .chflags = y_chflags
+#ifdef __APPLE__
+  .chflags = y_chflags,
+#endif
+  .fallocate = y_fallocate,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+  .lseek = y_lseek,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+  .copy_file_range = y_copy_file_range,
+#endif
 
 };
 
+#endif
+
 int main(int argc, char** argv) {
 
   struct y_state *y_state;
@@ -840,34 +2305,85 @@ int main(int argc, char** argv) {
     fprintf(stderr,"Out of memory\n");
     exit(1);
   }
-  y_state->rounds = 5;
+  int rounds = 5;
 
   // interpret the command line options
   char  options[1024];
   char  storage[1024];
   char  mount[1024];
   char  logfile[1024];
+  char  metrics[1024];
+  char  tracefile[1024];
+  long  cache_mb = 0;
+  int   bulk_threads = 0;
+  long  xattr_kb = 0;
+  long  warm_entries = 0;
   memset(options,0,sizeof(options));
   memset(storage,0,sizeof(storage));
   memset(mount,0,sizeof(mount));
   memset(logfile,0,sizeof(logfile));
+  memset(metrics,0,sizeof(metrics));
+  memset(tracefile,0,sizeof(tracefile));
   for(int i=1; i<argc; i++) {
-    if (!strcmp("-3",argv[i])) { y_state->rounds = 3; }
-    else if (!strcmp("-5",argv[i])) { y_state->rounds = 5; }
-    else if (!strcmp("-8",argv[i])) { y_state->rounds = 8; }
+    if (!strcmp("-3",argv[i])) { rounds = 3; }
+    else if (!strcmp("-5",argv[i])) { rounds = 5; }
+    else if (!strcmp("-8",argv[i])) { rounds = 8; }
     if (!strcmp("-trace",argv[i])) { trace_on = 1; debug_on = 1; info_on = 1; }
     else if (!strcmp("-debug",argv[i])) { debug_on = 1; info_on = 1; }
     else if (!strcmp("-info",argv[i])) { info_on = 1; }
-    else if (!strcmp("-dump-ascii",argv[i])) { data_ascii = 1; }
+    else if (!strcmp("-lockprof",argv[i])) { lockprof_on = 1; }
+    else if (!strcmp("-sparse",argv[i])) { y_state->sparse = 1; }
+    else if (!strcmp("-mmap",argv[i])) { y_state->mapped = 1; }
+    else if (!strcmp("-direct",argv[i])) { y_state->direct = 1; }
+    else if (!strcmp("-chunk",argv[i])) { y_state->chunked = 1; }
+    else if (!strcmp("-pack",argv[i])) { y_state->packed = 1; }
+    else if (!strcmp("-compress",argv[i])) { y_state->compressed = 1; }
     else if (strlen(argv[i])>2 && !(memcmp("-o",argv[i],2))) strcpy(options,argv[i]);
     else if (strlen(argv[i])>2 && !(memcmp("-s",argv[i],2))) strcpy(storage,&argv[i][2]);
     else if (strlen(argv[i])>2 && !(memcmp("-m",argv[i],2))) strcpy(mount,&argv[i][2]);
     else if (strlen(argv[i])>2 && !(memcmp("-l",argv[i],2))) strcpy(logfile,&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-u",argv[i],2))) strcpy(metrics,&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-t",argv[i],2))) strcpy(tracefile,&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-c",argv[i],2))) cache_mb = atol(&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-q",argv[i],2))) bulk_threads = atoi(&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-x",argv[i],2))) xattr_kb = atol(&argv[i][2]);
+    else if (strlen(argv[i])>2 && !(memcmp("-w",argv[i],2))) warm_entries = atol(&argv[i][2]);
   }
   if (strlen(storage)==0 || strlen(mount)==0) {
-    fprintf(stderr,"Syntax: safefs [-trace|-debug|-info] [-dump-ascii] [-3|-5|-8] [-o<options>] [-l<log-file-path>] -s<file-system-storage-path> -m<mount-point>\n");
+    fprintf(stderr,"Syntax: safefs [-trace|-debug|-info] [-lockprof] [-sparse|-mmap|-direct|-chunk|-pack|-compress] [-3|-5|-8] [-o<options>] [-l<log-file-path>] [-t<trace-file-path>] [-u<metrics-socket-path>] [-c<cache-megabytes>] [-q<bulk-threads>] [-x<xattr-cache-kilobytes>] [-w<warm-set-entries>] -s<file-system-storage-path> -m<mount-point>\n");
+    exit(1);
+  }
+  if (y_state->sparse && y_state->mapped) {
+    // a mapping would allocate every hole it touched
+    fprintf(stderr,"Cannot combine -sparse with -mmap\n");
     exit(1);
   }
+  if (y_state->direct && (y_state->sparse || y_state->mapped)) {
+    // a mapping lives in the page cache and sparse writes go through the cached handle
+    fprintf(stderr,"Cannot combine -direct with -sparse or -mmap\n");
+    exit(1);
+  }
+  if (y_state->chunked && (y_state->sparse || y_state->mapped || y_state->direct)) {
+    // chunk files are read and written through their own handles
+    fprintf(stderr,"Cannot combine -chunk with -sparse, -mmap or -direct\n");
+    exit(1);
+  }
+  if (y_state->packed && (y_state->sparse || y_state->mapped || y_state->direct || y_state->chunked)) {
+    // packed files have no backing file of their own until they outgrow the limit
+    fprintf(stderr,"Cannot combine -pack with -sparse, -mmap, -direct or -chunk\n");
+    exit(1);
+  }
+  if (y_state->compressed && (y_state->sparse || y_state->mapped || y_state->direct || y_state->chunked || y_state->packed)) {
+    // compressed blocks have no fixed place in the backing file to map, punch or split
+    fprintf(stderr,"Cannot combine -compress with -sparse, -mmap, -direct, -chunk or -pack\n");
+    exit(1);
+  }
+#ifdef SAFEFS_FUSE3
+  // volumes have no names on linux and the page cache is left on for the writeback cache unless -odirect_io is given
+  if (strlen(options)==0) {
+    strcpy(options,"-oexec");
+  }
+#else
   if (strlen(options)==0) {
     strcpy(options,"-ovolname=safe");
   } else if (strstr(options,"volname=")==NULL) {
@@ -876,6 +2392,7 @@ int main(int argc, char** argv) {
   if (strstr(options,"direct_io")==NULL) {
     strcat(options,",direct_io");
   }
+#endif
   if (strstr(options,"hard_remove")==NULL) {
     strcat(options,",hard_remove");
   }
@@ -888,6 +2405,9 @@ int main(int argc, char** argv) {
   if (strlen(logfile)==0) {
     strcpy(logfile,"safefs.log");
   }
+  if (strlen(tracefile)==0) {
+    strcpy(tracefile,"safefs.trace");
+  }
   if (storage[strlen(storage)-1]!='/') {
     strcat(storage,"/");
   }
@@ -895,8 +2415,33 @@ int main(int argc, char** argv) {
     strcat(mount,"/");
   }
 
-  // seed the random number generator
-  srandomdev();
+  // the plain text block cache is allocated up front so its size is a hard bound
+  if (cache_mb>0 && cache_init((uint64_t)cache_mb*1048576)<0) {
+    fprintf(stderr,"Cannot allocate a %ldMB block cache\n",cache_mb);
+    exit(1);
+  }
+
+  // the extended attribute cache holds values, name lists and attributes found missing up to its size
+  if (xattr_kb>0 && xattr_init((uint64_t)xattr_kb*1024)<0) {
+    fprintf(stderr,"Cannot allocate a %ldKB extended attribute cache\n",xattr_kb);
+    exit(1);
+  }
+
+  // the most opened paths are kept in the store and their headers read again in the background at the next mount
+  if (warm_entries>0 && warm_init((uint64_t)warm_entries)<0) {
+    fprintf(stderr,"Cannot allocate a %ld entry warm set\n",warm_entries);
+    exit(1);
+  }
+
+  // bulk reads and writes share this many slots and step aside for interactive ones
+  if (bulk_threads>0) qos_init(bulk_threads);
+
+  // writes to a sparse file are serialized per inode
+  for(int i=0; i<SPARSE_LOCKS; i++) pthread_mutex_init(&mutexsparse[i],NULL);
+
+  // as are writes on a -direct mount, each fuse thread frees its own bounce buffer when it exits
+  for(int i=0; i<DIRECT_LOCKS; i++) pthread_mutex_init(&mutexdirect[i],NULL);
+  pthread_key_create(&direct_key,direct_free);
 
   // create the fuse log file
   y_state->logfile = fopen(logfile,"w");
@@ -905,10 +2450,25 @@ int main(int argc, char** argv) {
     exit(1);
   }
 
-  // set the storage location as the root directory
-  strcpy(y_state->rootdir,realpath(storage,NULL));
+  // create the binary trace file for data captured in -trace mode
+  if (trace_on && trace_open(tracefile)<0) {
+    fprintf(stderr,"Cannot open trace file [%s] for writing\n",tracefile);
+    exit(1);
+  }
+
+  // the metrics socket is created after fuse daemonizes and changes directory so make its path absolute
+  if (strlen(metrics)>0) {
+    if (metrics[0]!='/') {
+      if (getcwd(y_state->metrics,sizeof(y_state->metrics))==NULL) {
+        fprintf(stderr,"Cannot determine current directory for metrics socket\n");
+        exit(1);
+      }
+      strcat(y_state->metrics,"/");
+    }
+    strcat(y_state->metrics,metrics);
+  }
 
-  // determine which rotor offsets to use
+  // open the store using the rotor offsets derived from the pin code and check the md5 hash matches
   {
     char *pwd = getenv("SAFEFS_PIN");
     if (pwd==NULL) {
@@ -919,33 +2479,34 @@ int main(int argc, char** argv) {
       fprintf(stderr,"Invalid pin code length\n");
 	  exit(1);
     }
-    determine_rotor_offsets(y_state,pwd);
+    int rc = sfs_store_open(&y_state->store,storage,pwd,rounds);
     memset(pwd,0,strlen(pwd));
+    if (rc==-EACCES) {
+      fprintf(stderr,"Incorrect pin code provided\n");
+      exit(1);
+    } else if (rc<0) {
+      errno = -rc;
+      perror("Failed to open the storage folder and its .safefs");
+      exit(1);
+    }
   }
 
-  // determine if little endian or big endian
-  y_state->endian = determine_endianness(y_state->offsets);
-
-  // check the md5 hash matches
-  check_rotor_offsets_match(y_state);
-
   // validate that the cipher algorithm is working properly
   {
-    unsigned char f_ring[256];
-    unsigned char r_ring[256];
-    generate_random_rotor(f_ring,r_ring);
+    sfs_header header;
+    sfs_new_header(&y_state->store,&header);
     unsigned char orig[65536];
 	unsigned char check[65536];
 	for(int i=0; i<65536; i++) {
 	  check[i] = i;
 	}
 	memcpy(orig,check,65536);
-    encipher(f_ring,y_state->offsets,0,check,0,65536,y_state->endian,y_state->rounds);
+    sfs_encipher(&y_state->store,&header,0,check,65536);
 	if (!memcmp(orig,check,65536)) {
       fprintf(stderr,"encipher algorithm broken\n");
 	  exit(1);
 	}
-    decipher(r_ring,y_state->offsets,0,check,0,65536,y_state->endian,y_state->rounds);
+    sfs_decipher(&y_state->store,&header,0,check,65536);
 	if (memcmp(orig,check,65536)) {
       fprintf(stderr,"decipher algorithm broken\n");
 	  exit(1);
@@ -0,0 +1,359 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sfs.h"
+#include "lz4.h"
+
+int check_store_open(const char* root) {
+  fprintf(stderr,"Check that a store can only be opened with its pin code\n");
+  sfs_store store;
+  int rc = sfs_store_open(&store,root,"0000000000",5);
+  if (rc<0) {
+    fprintf(stderr,"Failed to open store: %s\n",strerror(-rc));
+    return 1;
+  }
+  rc = sfs_store_open(&store,root,"1111111111",5);
+  if (rc!=-EACCES) {
+    fprintf(stderr,"Store opened with the wrong pin code. %d\n",rc);
+    return 1;
+  }
+  return 0;
+}
+
+int check_file_write_read(const char* root) {
+  fprintf(stderr,"Check that file writing and reading works\n");
+  sfs_store store;
+  sfs_file *file;
+  if (sfs_store_open(&store,root,"0000000000",5)<0) return 1;
+  int rc = sfs_open(&store,"/x",O_CREAT | O_RDWR,0600,&file);
+  if (rc<0) {
+    fprintf(stderr,"Failed to create file: %s\n",strerror(-rc));
+    return 1;
+  }
+  if (sfs_pwrite(file,"hello",5,0)!=5) {
+    fprintf(stderr,"Failed to write to file\n");
+    sfs_close(file);
+    return 1;
+  }
+  struct stat stat;
+  if (sfs_fstat(file,&stat)<0 || stat.st_size!=5) {
+    fprintf(stderr,"File size is incorrect after writing. %lld\n",(long long)stat.st_size);
+    sfs_close(file);
+    return 1;
+  }
+  sfs_close(file);
+  // the backing file holds the header and the cipher text
+  char fpath[PATH_MAX];
+  sfs_resolve(&store,"/x",fpath);
+  unsigned char raw[SFS_HEADER+5];
+  int fd = open(fpath,O_RDONLY);
+  if (fd<0 || pread(fd,raw,sizeof(raw),0)!=sizeof(raw) || pread(fd,raw,1,sizeof(raw))!=0) {
+    fprintf(stderr,"Backing file is not %d bytes larger than the plain text\n",SFS_HEADER);
+    if (fd>=0) close(fd);
+    return 1;
+  }
+  close(fd);
+  if (!memcmp("hello",&raw[SFS_HEADER],5)) {
+    fprintf(stderr,"Plain text was stored in the backing file\n");
+    return 1;
+  }
+  rc = sfs_open(&store,"/x",O_RDONLY,0,&file);
+  if (rc<0) {
+    fprintf(stderr,"Failed to open file: %s\n",strerror(-rc));
+    return 1;
+  }
+  unsigned char data[5];
+  if (sfs_pread(file,data,5,0)!=5 || memcmp("hello",data,5)) {
+    fprintf(stderr,"Incorrect data read from file\n");
+    sfs_close(file);
+    return 1;
+  }
+  sfs_close(file);
+  return 0;
+}
+
+int check_file_truncate(const char* root) {
+  fprintf(stderr,"Check that file truncation keeps the header\n");
+  sfs_store store;
+  sfs_file *file;
+  if (sfs_store_open(&store,root,"0000000000",5)<0) return 1;
+  int rc = sfs_open(&store,"/x",O_WRONLY | O_TRUNC,0,&file);
+  if (rc<0) {
+    fprintf(stderr,"Failed to open file: %s\n",strerror(-rc));
+    return 1;
+  }
+  struct stat stat;
+  if (sfs_fstat(file,&stat)<0 || stat.st_size!=0) {
+    fprintf(stderr,"File size is incorrect after truncating. %lld\n",(long long)stat.st_size);
+    sfs_close(file);
+    return 1;
+  }
+  if (sfs_pwrite(file,"world",5,0)!=5 || sfs_ftruncate(file,3)<0) {
+    fprintf(stderr,"Failed to write and truncate file\n");
+    sfs_close(file);
+    return 1;
+  }
+  sfs_close(file);
+  rc = sfs_open(&store,"/x",O_RDONLY,0,&file);
+  if (rc<0) {
+    fprintf(stderr,"Failed to reopen file: %s\n",strerror(-rc));
+    return 1;
+  }
+  unsigned char data[5];
+  if (sfs_pread(file,data,5,0)!=3 || memcmp("wor",data,3)) {
+    fprintf(stderr,"Incorrect data read from truncated file\n");
+    sfs_close(file);
+    return 1;
+  }
+  sfs_close(file);
+  return 0;
+}
+
+int check_random_write_test(const char* root) {
+  fprintf(stderr,"Check random writes work\n");
+  sfs_store store;
+  sfs_file *file;
+  if (sfs_store_open(&store,root,"0000000000",5)<0) return 1;
+  int rc = sfs_open(&store,"/y",O_CREAT | O_RDWR,0600,&file);
+  if (rc<0) {
+    fprintf(stderr,"Failed to create file: %s\n",strerror(-rc));
+    return 1;
+  }
+  // writes larger than the encipher buffer are split
+  size_t size = 300000;
+  unsigned char *orig = calloc(1,size);
+  unsigned char *check = malloc(size);
+  if (sfs_pwrite(file,orig,size,0)!=(ssize_t)size) {
+    fprintf(stderr,"Failed to write to file\n");
+    rc = 1;
+  }
+  for(int i=0; i<1000 && rc==0; i++) {
+    size_t ofs = random()%size;
+    size_t len = random()%(size-ofs);
+    for(size_t j=0; j<len; j++) orig[ofs+j] = random();
+    if (sfs_pwrite(file,&orig[ofs],len,ofs)!=(ssize_t)len) {
+      fprintf(stderr,"Failed to write to file\n");
+      rc = 1;
+      break;
+    }
+  }
+  if (rc==0) {
+    if (sfs_pread(file,check,size,0)!=(ssize_t)size || memcmp(orig,check,size)) {
+      fprintf(stderr,"Incorrect data read after random writes\n");
+      rc = 1;
+    }
+  }
+  sfs_close(file);
+  free(orig);
+  free(check);
+  return rc;
+}
+
+int check_copy_range(const char* root) {
+  fprintf(stderr,"Check that a copy between files re-enciphers with the destination rotor\n");
+  sfs_store store;
+  sfs_file *in, *out;
+  if (sfs_store_open(&store,root,"0000000000",5)<0) return 1;
+  if (sfs_open(&store,"/c1",O_CREAT | O_RDWR | O_TRUNC,0600,&in)<0) return 1;
+  if (sfs_open(&store,"/c2",O_CREAT | O_RDWR | O_TRUNC,0600,&out)<0) {
+    sfs_close(in);
+    return 1;
+  }
+  // larger than one copy chunk and copied to a different offset
+  size_t size = SFS_COPY_CHUNK*2+1000;
+  unsigned char *orig = malloc(size);
+  unsigned char *check = malloc(size);
+  for(size_t i=0; i<size; i++) orig[i] = random();
+  int rc = 0;
+  if (sfs_pwrite(in,orig,size,0)!=(ssize_t)size) {
+    fprintf(stderr,"Failed to write to file\n");
+    rc = 1;
+  }
+  if (rc==0 && sfs_copy_range(in,10,out,100,size)!=(ssize_t)(size-10)) {
+    fprintf(stderr,"Copy did not stop at the end of the source\n");
+    rc = 1;
+  }
+  if (rc==0 && (sfs_pread(out,check,size,100)!=(ssize_t)(size-10) || memcmp(&orig[10],check,size-10))) {
+    fprintf(stderr,"Incorrect data read from copy\n");
+    rc = 1;
+  }
+  if (rc==0 && sfs_copy_range(in,0,in,100,1000)!=-EINVAL) {
+    fprintf(stderr,"Overlapping copy within a file was not refused\n");
+    rc = 1;
+  }
+  sfs_close(in);
+  sfs_close(out);
+  free(orig);
+  free(check);
+  return rc;
+}
+
+int check_sparse_read(const char* root) {
+  fprintf(stderr,"Check that a hole in the backing file reads as zeros\n");
+  sfs_store store;
+  sfs_file *file;
+  if (sfs_store_open(&store,root,"0000000000",5)<0) return 1;
+  if (sfs_open(&store,"/s",O_CREAT | O_RDWR | O_TRUNC,0600,&file)<0) return 1;
+  // the file ends with data after a hole that spans whole blocks
+  size_t size = 1048576;
+  unsigned char *check = malloc(size);
+  int rc = 0;
+  if (sfs_pwrite(file,"hello",5,0)!=5 || sfs_ftruncate(file,size-5)<0 || sfs_pwrite(file,"world",5,size-5)!=5) {
+    fprintf(stderr,"Failed to write sparse file\n");
+    rc = 1;
+  }
+  struct stat stat;
+  if (rc==0 && (sfs_fstat(file,&stat)<0 || stat.st_blocks*512>=stat.st_size)) {
+    fprintf(stderr,"Backing file system does not keep holes, skipping\n");
+    sfs_close(file);
+    free(check);
+    return 0;
+  }
+  if (rc==0 && (sfs_pread(file,check,size,0)!=(ssize_t)size || memcmp("hello",check,5) || memcmp("world",&check[size-5],5))) {
+    fprintf(stderr,"Incorrect data read around the hole\n");
+    rc = 1;
+  }
+  for(size_t i=65536; rc==0 && i<size-65536; i++) {
+    if (check[i]) {
+      fprintf(stderr,"Hole did not read as zeros at %zu\n",i);
+      rc = 1;
+    }
+  }
+  sfs_close(file);
+  free(check);
+  return rc;
+}
+
+int check_header_batch(const char* root) {
+  fprintf(stderr,"Check that headers decoded together match those decoded one at a time\n");
+  sfs_store store;
+  if (sfs_store_open(&store,root,"0000000000",5)<0) return 1;
+  // an odd count leaves some lanes of the last pass unused
+  int count = 2*SFS_BATCH+5;
+  unsigned char (*encoded)[SFS_HEADER] = malloc(count*SFS_HEADER);
+  sfs_header *single = malloc(count*sizeof(sfs_header));
+  sfs_header *batch = malloc(count*sizeof(sfs_header));
+  int rc = 0;
+  for(int i=0; i<count; i++) {
+    sfs_header header;
+    sfs_new_header(&store,&header);
+    sfs_encode_header(&header,encoded[i]);
+    sfs_decode_header(&store,encoded[i],&single[i]);
+    if (memcmp(&header,&single[i],sizeof(sfs_header))) {
+      fprintf(stderr,"Header %d differs after encoding and decoding\n",i);
+      rc = 1;
+    }
+  }
+  sfs_decode_headers(&store,encoded,batch,count);
+  for(int i=0; i<count; i++) {
+    if (memcmp(&single[i],&batch[i],sizeof(sfs_header))) {
+      fprintf(stderr,"Header %d differs when decoded in a batch\n",i);
+      rc = 1;
+    }
+  }
+  free(encoded);
+  free(single);
+  free(batch);
+  return rc;
+}
+
+int check_lz4_round_trip(const char* root) {
+  fprintf(stderr,"Check that compressed blocks decompress to what was compressed\n");
+  size_t size = 65536;
+  unsigned char *plain = malloc(size);
+  unsigned char *packed = malloc(LZ4_BOUND(size));
+  unsigned char *check = malloc(size);
+  const char *words[] = { "open ", "read ", "write", "path:", "size:", "}\n{  " };
+  int rc = 0;
+  // runs, text, random bytes and short inputs each take a different path through the format
+  for(int kind=0; kind<4; kind++) {
+    size_t len = kind==3 ? 13 : size;
+    for(size_t i=0, w=0; i<len; i++) {
+      if (kind==0) plain[i] = i<len/2 ? 'a' : 'b';
+      else if (kind==1) { plain[i] = words[w%6][i%5]; if (i%5==4) w += random()%3; }
+      else plain[i] = random();
+    }
+    size_t got = lz4_compress(plain,len,packed,LZ4_BOUND(len));
+    ssize_t back = got>0 ? lz4_decompress(packed,got,check,size) : -1;
+    if (got==0 || back!=(ssize_t)len || memcmp(plain,check,len)) {
+      fprintf(stderr,"Block of kind %d did not round trip, %zu compressed to %zu\n",kind,len,got);
+      rc = 1;
+    }
+    if (kind==0 && got>len/64) {
+      fprintf(stderr,"Runs compressed to %zu of %zu\n",got,len);
+      rc = 1;
+    }
+    // a block cut short must be refused rather than read past its end
+    if (got>1 && lz4_decompress(packed,got-1,check,size)==(ssize_t)len && memcmp(plain,check,len)) {
+      fprintf(stderr,"Truncated block of kind %d was accepted\n",kind);
+      rc = 1;
+    }
+  }
+  if (lz4_compress(plain,size,packed,size/2)!=0) {
+    fprintf(stderr,"Random bytes fit in half their size\n");
+    rc = 1;
+  }
+  free(plain);
+  free(packed);
+  free(check);
+  return rc;
+}
+
+int check_path_too_long(const char* root) {
+  fprintf(stderr,"Check that a path too long for the store is refused\n");
+  sfs_store store;
+  int rc = sfs_store_open(&store,root,"0000000000",5);
+  if (rc<0) {
+    fprintf(stderr,"Failed to open store: %s\n",strerror(-rc));
+    return 1;
+  }
+  // the longest path that fits is resolved, one more byte or the finder dot is refused
+  char path[PATH_MAX];
+  char fpath[PATH_MAX];
+  size_t room = PATH_MAX-1-strlen(store.rootdir);
+  memset(path,'a',room);
+  path[0] = '/';
+  path[room] = 0;
+  rc = sfs_resolve(&store,path,fpath);
+  if (rc!=0 || strlen(fpath)!=PATH_MAX-1) {
+    fprintf(stderr,"Longest path was not resolved. %d\n",rc);
+    return 1;
+  }
+  strcpy(&path[room-10],"/.DS_Store");
+  rc = sfs_resolve(&store,path,fpath);
+  if (rc!=-ENAMETOOLONG || fpath[0]!=0) {
+    fprintf(stderr,"Finder dot was written past the end of the path. %d\n",rc);
+    return 1;
+  }
+  memset(path,'a',room+1);
+  path[0] = '/';
+  path[room+1] = 0;
+  sfs_file *file;
+  rc = sfs_open(&store,path,O_CREAT | O_RDWR,0600,&file);
+  if (rc!=-ENAMETOOLONG) {
+    fprintf(stderr,"Path one byte too long was opened. %d\n",rc);
+    if (rc==0) sfs_close(file);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  char* root = argv[1];
+  int rc = 0;
+  rc |= check_store_open(root);
+  rc |= check_file_write_read(root);
+  rc |= check_file_truncate(root);
+  rc |= check_random_write_test(root);
+  rc |= check_copy_range(root);
+  rc |= check_sparse_read(root);
+  rc |= check_header_batch(root);
+  rc |= check_lz4_round_trip(root);
+  rc |= check_path_too_long(root);
+  return rc;
+}
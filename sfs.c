@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "cipher.h"
+#include "md5.h"
+#include "rng.h"
+#include "sfs.h"
+
+void sfs_store_init(sfs_store* store, const char* pin, int rounds) {
+
+  // calculate the rotor offsets from the pin code
+  memset(store->offsets,0,8);
+  for(int i=0; i<8; i++) {
+    store->offsets[i] = 0;
+    for(int j=0; j<6; j++) {
+      store->offsets[i] <<= 1;
+      store->offsets[i] += (i+j);
+      store->offsets[i] += pin[(i+j)%10];
+    }
+  }
+
+  // calculate the MD5 hash to use to check the correct pin was entered
+  {
+    MD5_CTX context;
+    MD5Init (&context);
+    MD5Update (&context, store->offsets, 8);
+    MD5Update (&context, (unsigned char*)pin, 8);
+    MD5Update (&context, store->offsets, 8);
+    MD5Final (store->safe_digest, &context);
+  }
+
+  // determine if little endian or big endian
+  store->endian = determine_endianness(store->offsets);
+  store->rounds = rounds;
+
+}
+
+void sfs_rotor_digest(sfs_store* store, const unsigned char salt[SFS_SALT], unsigned char digest[16]) {
+  MD5_CTX context;
+  MD5Init (&context);
+  MD5Update (&context, store->offsets, 8);
+  MD5Update (&context, store->safe_digest, 16);
+  MD5Update (&context, store->offsets, 8);
+  MD5Update (&context, (unsigned char*)salt, SFS_SALT);
+  MD5Final (digest, &context);
+}
+
+void sfs_rotor_digests(sfs_store* store, unsigned char salts[][SFS_SALT], unsigned char digests[][16], int count) {
+  // the same message as sfs_rotor_digest laid out whole for each salt
+  unsigned char message[MD5_LANES][32+SFS_SALT];
+  unsigned char *inputs[MD5_LANES];
+  for(int base=0; base<count; base+=MD5_LANES) {
+    int n = count-base<MD5_LANES ? count-base : MD5_LANES;
+    for(int i=0; i<n; i++) {
+      memcpy(message[i],store->offsets,8);
+      memcpy(&message[i][8],store->safe_digest,16);
+      memcpy(&message[i][24],store->offsets,8);
+      memcpy(&message[i][32],salts[base+i],SFS_SALT);
+      inputs[i] = message[i];
+    }
+    MD5Multi (&digests[base], inputs, (unsigned int)(32+SFS_SALT), (unsigned int)n);
+  }
+  memset(message,0,sizeof(message));
+}
+
+void sfs_new_header(sfs_store* store, sfs_header* header) {
+  // a random salt gives each file its own digest for encoding the random rotor
+  rng_bytes(header->salt,SFS_SALT);
+  sfs_rotor_digest(store,header->salt,header->rotor_digest);
+  generate_random_rotor(header->f_ring,header->r_ring);
+}
+
+void sfs_encode_header(const sfs_header* header, unsigned char out[SFS_HEADER]) {
+  unsigned char digest[16];
+  memcpy(digest,header->rotor_digest,16);
+  memcpy(out,header->salt,SFS_SALT);
+  memcpy(&out[SFS_SALT],header->f_ring,SFS_ROTOR);
+  encode_rotor(&out[SFS_SALT],digest);
+  memset(digest,0,16);
+}
+
+static void sfs_decode_rotor(const unsigned char in[SFS_HEADER], sfs_header* header) {
+  memcpy(header->f_ring,&in[SFS_SALT],SFS_ROTOR);
+  decode_rotor(header->f_ring,header->rotor_digest);
+  derive_reverse_rotor(header->f_ring,header->r_ring);
+}
+
+void sfs_decode_header(sfs_store* store, const unsigned char in[SFS_HEADER], sfs_header* header) {
+  memcpy(header->salt,in,SFS_SALT);
+  sfs_rotor_digest(store,header->salt,header->rotor_digest);
+  sfs_decode_rotor(in,header);
+}
+
+void sfs_decode_headers(sfs_store* store, unsigned char in[][SFS_HEADER], sfs_header* headers, int count) {
+  unsigned char salts[SFS_BATCH][SFS_SALT];
+  unsigned char digests[SFS_BATCH][16];
+  for(int base=0; base<count; base+=SFS_BATCH) {
+    int n = count-base<SFS_BATCH ? count-base : SFS_BATCH;
+    for(int i=0; i<n; i++) memcpy(salts[i],in[base+i],SFS_SALT);
+    sfs_rotor_digests(store,salts,digests,n);
+    for(int i=0; i<n; i++) {
+      memcpy(headers[base+i].salt,salts[i],SFS_SALT);
+      memcpy(headers[base+i].rotor_digest,digests[i],16);
+      sfs_decode_rotor(in[base+i],&headers[base+i]);
+    }
+  }
+  memset(digests,0,sizeof(digests));
+}
+
+void sfs_encipher(sfs_store* store, sfs_header* header, uint64_t pos, unsigned char* data, uint64_t len) {
+  encipher(header->f_ring,store->offsets,pos,data,0,len,store->endian,store->rounds);
+}
+
+void sfs_decipher(sfs_store* store, sfs_header* header, uint64_t pos, unsigned char* data, uint64_t len) {
+  decipher(header->r_ring,store->offsets,pos,data,0,len,store->endian,store->rounds);
+}
+
+void sfs_encipher_to(sfs_store* store, sfs_header* header, uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len) {
+  encipher_to(header->f_ring,store->offsets,pos,in,out,len,store->endian,store->rounds);
+}
+
+void sfs_decipher_to(sfs_store* store, sfs_header* header, uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len) {
+  decipher_to(header->r_ring,store->offsets,pos,in,out,len,store->endian,store->rounds);
+}
+
+off_t sfs_backing_offset(off_t ofs) {
+  return ofs+SFS_HEADER;
+}
+
+off_t sfs_plain_size(off_t size) {
+  // hide the header of the backing file
+  return size>=SFS_HEADER ? size-SFS_HEADER : size;
+}
+
+int sfs_resolve(sfs_store* store, const char* path, char fpath[PATH_MAX]) {
+  // finder metadata files are stored with a trailing dot so they are never mistaken for the real thing
+  size_t len = strlen(path);
+  const char* dot = len>=10 && !strcmp("/.DS_Store",&path[len-10]) ? "." : "";
+  int rc = snprintf(fpath,PATH_MAX,"%s%s%s",store->rootdir,path,dot);
+  if (rc<0 || rc>=PATH_MAX) {
+    // a cut short path could name another file so the caller is left with none
+    fpath[0] = 0;
+    return -ENAMETOOLONG;
+  }
+  return 0;
+}
+
+int sfs_backing_data(int fd, off_t from, off_t to) {
+#ifdef SEEK_DATA
+  // anything but a clear answer counts as data so a caller never writes over it
+  off_t next = lseek(fd,from,SEEK_DATA);
+  if (next<0) return errno==ENXIO ? 0 : 1;
+  return next<to;
+#else
+  return 1;
+#endif
+}
+
+void sfs_decipher_sparse(sfs_store* store, sfs_header* header, int fd, off_t ofs, unsigned char* data, size_t len) {
+#ifdef SEEK_HOLE
+  off_t start = sfs_backing_offset(ofs);
+  off_t end = start+len;
+  off_t pos = start;
+  while (pos<end) {
+    off_t hole = lseek(fd,pos,SEEK_HOLE);
+    if (hole<pos || hole>end) hole = end;
+    sfs_decipher(store,header,pos-SFS_HEADER,&data[pos-start],hole-pos);
+    if (hole==end) break;
+    off_t next = lseek(fd,hole,SEEK_DATA);
+    if (next<hole || next>end) next = end;
+    memset(&data[hole-start],0,next-hole);
+    pos = next;
+  }
+#else
+  sfs_decipher(store,header,ofs,data,len);
+#endif
+}
+
+int sfs_read_header(sfs_store* store, int fd, sfs_header* header) {
+  unsigned char in[SFS_HEADER];
+  ssize_t rc = pread(fd,in,SFS_HEADER,0);
+  if (rc<0) return -errno;
+  if (rc!=SFS_HEADER) return -EIO;
+  sfs_decode_header(store,in,header);
+  memset(in,0,SFS_HEADER);
+  return 0;
+}
+
+int sfs_write_header(int fd, const sfs_header* header) {
+  unsigned char out[SFS_HEADER];
+  sfs_encode_header(header,out);
+  ssize_t rc = pwrite(fd,out,SFS_HEADER,0);
+  memset(out,0,SFS_HEADER);
+  if (rc<0) return -errno;
+  if (rc!=SFS_HEADER) return -EIO;
+  return 0;
+}
+
+int sfs_check_pin(sfs_store* store) {
+
+  // determine the path of .safefs in the store
+  char fpath[PATH_MAX];
+  int rc = sfs_resolve(store,"/.safefs",fpath);
+  if (rc<0) return rc;
+
+  // the md5 hash of the pin code is kept enciphered after the header of .safefs
+  sfs_header header;
+  unsigned char out[16];
+  int fd = open(fpath,O_RDONLY);
+  if (fd<0) {
+    // cant open so try to create it
+    fd = open(fpath,O_CREAT | O_TRUNC | O_WRONLY | O_EXCL,0600);
+    if (fd<0) return -errno;
+    sfs_new_header(store,&header);
+    rc = sfs_write_header(fd,&header);
+    if (rc==0) {
+      memcpy(out,store->safe_digest,16);
+      sfs_encipher(store,&header,0,out,16);
+      ssize_t len = pwrite(fd,out,16,SFS_HEADER);
+      if (len<0) rc = -errno;
+      else if (len!=16) rc = -EIO;
+    }
+  } else {
+    rc = sfs_read_header(store,fd,&header);
+    if (rc==0) {
+      ssize_t len = pread(fd,out,16,SFS_HEADER);
+      if (len<0) rc = -errno;
+      else if (len!=16) rc = -EIO;
+      else {
+        sfs_decipher(store,&header,0,out,16);
+        // check that the md5 hash matches
+        if (memcmp(store->safe_digest,out,16)) rc = -EACCES;
+      }
+    }
+  }
+  close(fd);
+  memset(&header,0,sizeof(header));
+  memset(out,0,16);
+  return rc;
+
+}
+
+int sfs_store_open(sfs_store* store, const char* rootdir, const char* pin, int rounds) {
+  if (pin==NULL || strlen(pin)!=10) return -EINVAL;
+  if (rounds!=3 && rounds!=5 && rounds!=8) return -EINVAL;
+  memset(store,0,sizeof(sfs_store));
+  if (realpath(rootdir,store->rootdir)==NULL) return -errno;
+  sfs_store_init(store,pin,rounds);
+  int rc = sfs_check_pin(store);
+  if (rc<0) memset(store,0,sizeof(sfs_store));
+  return rc;
+}
+
+int sfs_open(sfs_store* store, const char* path, int flags, mode_t mode, sfs_file** file) {
+  char fpath[PATH_MAX];
+  int rc = sfs_resolve(store,path,fpath);
+  if (rc<0) return rc;
+  sfs_file *f = calloc(1,sizeof(sfs_file));
+  if (f==NULL) return -ENOMEM;
+  f->store = store;
+  // the header must always be readable and O_TRUNC would also remove it
+  int backing = flags & ~(O_TRUNC | O_APPEND);
+  if ((flags&O_ACCMODE)==O_WRONLY) backing = (backing & ~O_ACCMODE) | O_RDWR;
+  f->fd = open(fpath,backing,mode);
+  if (f->fd<0) {
+    rc = -errno;
+    free(f);
+    return rc;
+  }
+  rc = sfs_read_header(store,f->fd,&f->header);
+  if (rc==-EIO && (flags&O_CREAT)==O_CREAT) {
+    // only an empty file is given a new header, a short one is damaged
+    struct stat st;
+    if (fstat(f->fd,&st)<0) rc = -errno;
+    else if (st.st_size==0) {
+      sfs_new_header(store,&f->header);
+      rc = sfs_write_header(f->fd,&f->header);
+    }
+  }
+  if (rc==0 && (flags&O_TRUNC)==O_TRUNC) {
+    if (ftruncate(f->fd,SFS_HEADER)<0) rc = -errno;
+  }
+  if (rc<0) {
+    close(f->fd);
+    memset(f,0,sizeof(sfs_file));
+    free(f);
+    return rc;
+  }
+  *file = f;
+  return 0;
+}
+
+ssize_t sfs_pread(sfs_file* file, void* data, size_t size, off_t ofs) {
+  ssize_t rc = pread(file->fd,data,size,sfs_backing_offset(ofs));
+  if (rc<0) return -errno;
+  sfs_decipher_sparse(file->store,&file->header,file->fd,ofs,data,rc);
+  return rc;
+}
+
+ssize_t sfs_pwrite(sfs_file* file, const void* data, size_t size, off_t ofs) {
+  // encipher into a bounded buffer so large writes do not need a copy of the whole request
+  unsigned char buf[65536];
+  size_t done = 0;
+  while (done<size) {
+    size_t len = size-done<sizeof(buf) ? size-done : sizeof(buf);
+    memcpy(buf,(const unsigned char*)data+done,len);
+    sfs_encipher(file->store,&file->header,ofs+done,buf,len);
+    ssize_t rc = pwrite(file->fd,buf,len,sfs_backing_offset(ofs+done));
+    if (rc<0) {
+      rc = -errno;
+      memset(buf,0,sizeof(buf));
+      return done>0 ? (ssize_t)done : rc;
+    }
+    done += rc;
+    if ((size_t)rc<len) break;
+  }
+  memset(buf,0,sizeof(buf));
+  return done;
+}
+
+ssize_t sfs_copy_range(sfs_file* in, off_t off_in, sfs_file* out, off_t off_out, size_t size) {
+  // overlapping ranges of the same file would read back what the copy has just written
+  struct stat si, so;
+  if (fstat(in->fd,&si)<0 || fstat(out->fd,&so)<0) return -errno;
+  if (si.st_dev==so.st_dev && si.st_ino==so.st_ino && off_in<off_out+(off_t)size && off_out<off_in+(off_t)size) return -EINVAL;
+  // the cipher text is deciphered with the source rotor and enciphered with the destination rotor in one buffer
+  size_t chunk = size<SFS_COPY_CHUNK ? size : SFS_COPY_CHUNK;
+  unsigned char *buf = malloc(chunk>0 ? chunk : 1);
+  if (buf==NULL) return -ENOMEM;
+  size_t done = 0;
+  ssize_t rc = 0;
+  while (done<size) {
+    size_t len = size-done<chunk ? size-done : chunk;
+    rc = pread(in->fd,buf,len,sfs_backing_offset(off_in+done));
+    if (rc<=0) break;
+    len = rc;
+    sfs_decipher_sparse(in->store,&in->header,in->fd,off_in+done,buf,len);
+    sfs_encipher(out->store,&out->header,off_out+done,buf,len);
+    rc = pwrite(out->fd,buf,len,sfs_backing_offset(off_out+done));
+    if (rc<=0) break;
+    done += rc;
+    if ((size_t)rc<len) break;
+  }
+  if (rc<0) rc = -errno;
+  memset(buf,0,chunk);
+  free(buf);
+  return done>0 || rc>=0 ? (ssize_t)done : rc;
+}
+
+int sfs_ftruncate(sfs_file* file, off_t size) {
+  if (ftruncate(file->fd,sfs_backing_offset(size))<0) return -errno;
+  return 0;
+}
+
+int sfs_fstat(sfs_file* file, struct stat* stat) {
+  if (fstat(file->fd,stat)<0) return -errno;
+  stat->st_size = sfs_plain_size(stat->st_size);
+  return 0;
+}
+
+int sfs_fsync(sfs_file* file) {
+  if (fsync(file->fd)<0) return -errno;
+  return 0;
+}
+
+int sfs_close(sfs_file* file) {
+  int rc = close(file->fd)<0 ? -errno : 0;
+  memset(file,0,sizeof(sfs_file));
+  free(file);
+  return rc;
+}
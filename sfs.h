@@ -0,0 +1,76 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// server side copies move this much cipher text per pass
+#define SFS_COPY_CHUNK 1048576
+
+// each store file starts with a 4 byte salt and a 256 byte encoded rotor
+#define SFS_SALT 4
+#define SFS_ROTOR 256
+#define SFS_HEADER 260
+
+// bulk tools gather this many headers so their digests share one multi-buffer md5 pass
+#define SFS_BATCH 16
+
+// the keys derived from the pin code that are shared by every file in a store
+typedef struct sfs_store {
+  char          rootdir[PATH_MAX];
+  int           endian; // 1 = little endian , 0 = big endian
+  int           rounds; // 1 = least secure , 8 = most secure
+  unsigned char offsets[8];
+  unsigned char safe_digest[16];
+} sfs_store;
+
+// the decoded header of a single store file
+typedef struct sfs_header {
+  unsigned char salt[SFS_SALT];
+  unsigned char rotor_digest[16];
+  unsigned char f_ring[256];
+  unsigned char r_ring[256];
+} sfs_header;
+
+// an open store file
+typedef struct sfs_file {
+  int fd;
+  sfs_store *store;
+  sfs_header header;
+} sfs_file;
+
+// key derivation and header encoding without any file access
+void sfs_store_init(sfs_store* store, const char* pin, int rounds);
+void sfs_rotor_digest(sfs_store* store, const unsigned char salt[SFS_SALT], unsigned char digest[16]);
+void sfs_new_header(sfs_store* store, sfs_header* header);
+void sfs_encode_header(const sfs_header* header, unsigned char out[SFS_HEADER]);
+void sfs_decode_header(sfs_store* store, const unsigned char in[SFS_HEADER], sfs_header* header);
+void sfs_rotor_digests(sfs_store* store, unsigned char salts[][SFS_SALT], unsigned char digests[][16], int count);
+void sfs_decode_headers(sfs_store* store, unsigned char in[][SFS_HEADER], sfs_header* headers, int count);
+void sfs_encipher(sfs_store* store, sfs_header* header, uint64_t pos, unsigned char* data, uint64_t len);
+void sfs_decipher(sfs_store* store, sfs_header* header, uint64_t pos, unsigned char* data, uint64_t len);
+void sfs_encipher_to(sfs_store* store, sfs_header* header, uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len);
+void sfs_decipher_to(sfs_store* store, sfs_header* header, uint64_t pos, const unsigned char* in, unsigned char* out, uint64_t len);
+off_t sfs_backing_offset(off_t ofs);
+off_t sfs_plain_size(off_t size);
+// sfs_resolve leaves fpath empty and returns -ENAMETOOLONG when the store path does not fit
+int sfs_resolve(sfs_store* store, const char* path, char fpath[PATH_MAX]);
+
+// holes in a backing file hold no cipher text and read back as plain text zeros, sfs_backing_data takes backing offsets
+int sfs_backing_data(int fd, off_t from, off_t to);
+void sfs_decipher_sparse(sfs_store* store, sfs_header* header, int fd, off_t ofs, unsigned char* data, size_t len);
+
+// store access for applications that do not go through the fuse mount, all return -errno on failure
+int sfs_store_open(sfs_store* store, const char* rootdir, const char* pin, int rounds);
+int sfs_check_pin(sfs_store* store);
+int sfs_read_header(sfs_store* store, int fd, sfs_header* header);
+int sfs_write_header(int fd, const sfs_header* header);
+int sfs_open(sfs_store* store, const char* path, int flags, mode_t mode, sfs_file** file);
+ssize_t sfs_pread(sfs_file* file, void* data, size_t size, off_t ofs);
+ssize_t sfs_pwrite(sfs_file* file, const void* data, size_t size, off_t ofs);
+ssize_t sfs_copy_range(sfs_file* in, off_t off_in, sfs_file* out, off_t off_out, size_t size);
+int sfs_ftruncate(sfs_file* file, off_t size);
+int sfs_fstat(sfs_file* file, struct stat* stat);
+int sfs_fsync(sfs_file* file);
+int sfs_close(sfs_file* file);
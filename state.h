@@ -1,18 +1,28 @@
 
+#ifdef SAFEFS_FUSE3
+// safefs-linux is built against libfuse 3, its include path comes from pkg-config
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#else
 #define FUSE_USE_VERSION 26
 
 #include <osxfuse/fuse/fuse.h>
+#endif
 #include "node.h"
 
 struct y_state {
   btnode*       list;
-  char          rootdir[PATH_MAX];
+  sfs_store     store;
+  int           sparse;  // backing holes are kept and read back as plain text zeros
+  int           mapped;  // reads and writes go through a shared mapping of the backing file
+  int           direct;  // file data bypasses the page cache so only plain text is held in memory
+  int           chunked; // files larger than a chunk are kept as a manifest and chunk files
+  int           packed;  // small files are kept as records in shared segment files
+  int           compressed; // new files are kept as blocks compressed before they are enciphered
+  int           writeback; // the kernel gathers writes in its page cache and sends them later, libfuse 3 only
+  char          metrics[PATH_MAX]; // unix socket path for the OpenMetrics endpoint or empty
   FILE*         logfile;
-  int           endian; // 1 = little endian , 0 = big endian
-  int           rounds; // 1 = least secure , 8 = most secure
-  unsigned char offsets[8];
-  unsigned char safe_digest[16];
-  //unsigned char rotor_digest[16];
 };
 
 #define Y_STATE ((struct y_state *) fuse_get_context()->private_data)
@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "logging.h"
+#include "lockprof.h"
+#include "cache.h"
+#include "xattr.h"
+#include "sfs.h"
+#include "warm.h"
+
+struct stats_counter {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+};
+
+// each thread owns one block so the hot path never touches shared memory
+struct stats_block {
+  struct stats_counter counter[STATS_COUNT];
+  uint64_t entered; // fuse operations started by the thread
+  uint64_t exited;  // fuse operations finished by the thread
+  int current;      // fuse operation the thread is executing
+  int in_use;
+  struct stats_block *next;
+};
+
+static const char* stats_names[STATS_COUNT] = {
+  "y_getattr", "y_readlink", "y_mknod", "y_mkdir", "y_unlink", "y_rmdir", "y_symlink", "y_rename",
+  "y_link", "y_chmod", "y_chown", "y_truncate", "y_utime", "y_open", "y_read", "y_write",
+  "y_statfs", "y_release", "y_fsync", "y_setxattr", "y_getxattr", "y_listxattr", "y_removexattr", "y_opendir",
+  "y_readdir", "y_releasedir", "y_access", "y_create", "y_ftruncate", "y_fgetattr", "y_lock", "y_chflags",
+  "y_copy_file_range", "y_fallocate", "y_lseek",
+  "encipher", "decipher", "compress", "decompress",
+  "sys_open", "sys_close", "sys_pread", "sys_pwrite", "sys_stat", "sys_truncate", "sys_fsync", "sys_xattr",
+  "sys_dir", "sys_meta", "qos_wait",
+  "lock_sum", "lock_log", "lock_sparse", "lock_cache", "lock_map", "lock_direct", "lock_pool", "lock_chunk", "lock_pack", "lock_compress", "lock_qos", "lock_xattr", "lock_warm"
+};
+
+static pthread_mutex_t mutexstats = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static struct stats_block *stats_blocks = NULL;
+static __thread struct stats_block *stats_local = NULL;
+static uint64_t stats_epoch = 0;
+static int stats_pipe[2] = { -1, -1 };
+
+uint64_t stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int stats_bucket(uint64_t ns) {
+  if (ns<4) return (int)ns;
+  int msb = 63 - __builtin_clzll(ns);
+  int bucket = (msb-1)*4 + (int)((ns>>(msb-2))&3);
+  return bucket<STATS_BUCKETS ? bucket : STATS_BUCKETS-1;
+}
+
+uint64_t stats_bucket_limit(int bucket) {
+  // the largest value that falls into the bucket
+  if (bucket<3) return bucket;
+  bucket++;
+  return ((uint64_t)(4+(bucket&3)) << (bucket/4-1)) - 1;
+}
+
+static void stats_detach(void *block) {
+  // keep the counts of exited threads but let the next new thread reuse the block
+  pthread_mutex_lock(&mutexstats);
+  ((struct stats_block*)block)->in_use = 0;
+  pthread_mutex_unlock(&mutexstats);
+}
+
+static void stats_create_key(void) {
+  pthread_key_create(&stats_key,stats_detach);
+}
+
+static struct stats_block* stats_attach(void) {
+  // callers may still need errno from the syscall being timed
+  int saved = errno;
+  pthread_once(&stats_once,stats_create_key);
+  pthread_mutex_lock(&mutexstats);
+  struct stats_block *block = stats_blocks;
+  while (block && block->in_use) block = block->next;
+  if (block==NULL) {
+    block = calloc(1,sizeof(struct stats_block));
+    if (block==NULL) {
+      pthread_mutex_unlock(&mutexstats);
+      errno = saved;
+      return NULL;
+    }
+    block->next = stats_blocks;
+    stats_blocks = block;
+  }
+  block->in_use = 1;
+  block->current = -1;
+  pthread_mutex_unlock(&mutexstats);
+  pthread_setspecific(stats_key,block);
+  stats_local = block;
+  errno = saved;
+  return block;
+}
+
+uint64_t stats_begin(int id) {
+  struct stats_block *block = stats_local;
+  if (block==NULL) block = stats_attach();
+  if (block!=NULL) {
+    block->entered++;
+    block->current = id;
+  }
+  return stats_clock();
+}
+
+void stats_end(int id, uint64_t start, int rc, uint64_t bytes) {
+  stats_record(id,start,rc,bytes);
+  struct stats_block *block = stats_local;
+  if (block!=NULL) {
+    block->exited++;
+    block->current = -1;
+  }
+}
+
+int stats_current(void) {
+  struct stats_block *block = stats_local;
+  return block ? block->current : -1;
+}
+
+const char* stats_name(int id) {
+  return (id>=0 && id<STATS_COUNT) ? stats_names[id] : "none";
+}
+
+void stats_record(int id, uint64_t start, int rc, uint64_t bytes) {
+  uint64_t ns = stats_clock() - start;
+  struct stats_block *block = stats_local;
+  if (block==NULL) {
+    block = stats_attach();
+    if (block==NULL) return;
+  }
+  struct stats_counter *counter = &block->counter[id];
+  counter->calls++;
+  if (rc<0) counter->errors++;
+  counter->bytes += bytes;
+  counter->total_ns += ns;
+  if (ns>counter->max_ns) counter->max_ns = ns;
+  counter->buckets[stats_bucket(ns)]++;
+}
+
+uint64_t stats_uptime(void) {
+  return stats_epoch ? (stats_clock()-stats_epoch)/1000000000ULL : 0;
+}
+
+static uint64_t stats_percentile(struct stats_counter *counter, int percent) {
+  uint64_t rank = (counter->calls*percent+99)/100;
+  uint64_t seen = 0;
+  for(int b=0; b<STATS_BUCKETS; b++) {
+    seen += counter->buckets[b];
+    if (seen>=rank && seen>0) return stats_bucket_limit(b);
+  }
+  return counter->max_ns;
+}
+
+// backing file calls made outside safefs.c are timed under the same ids, errors come back as -errno
+int stats_open(const char* fpath, int flags, mode_t mode) {
+  uint64_t sys = stats_clock();
+  int fd = open(fpath,flags,mode);
+  int error = errno;
+  stats_record(STATS_SYS_OPEN,sys,fd,0);
+  errno = error;
+  return fd;
+}
+
+void stats_close(int fd) {
+  uint64_t sys = stats_clock();
+  close(fd);
+  stats_record(STATS_SYS_CLOSE,sys,0,0);
+}
+
+ssize_t stats_pread(int fd, unsigned char* buf, size_t size, off_t ofs) {
+  uint64_t sys = stats_clock();
+  ssize_t rc = pread(fd,buf,size,ofs);
+  if (rc<0) rc = -errno;
+  stats_record(STATS_SYS_PREAD,sys,rc,rc>0 ? rc : 0);
+  return rc;
+}
+
+int stats_pwrite(int fd, const unsigned char* buf, size_t size, off_t ofs) {
+  uint64_t sys = stats_clock();
+  ssize_t rc = pwrite(fd,buf,size,ofs);
+  if (rc<0) rc = -errno;
+  stats_record(STATS_SYS_PWRITE,sys,rc,rc>0 ? rc : 0);
+  if (rc<0) return rc;
+  return (size_t)rc==size ? 0 : -EIO;
+}
+
+int stats_fsync(int fd) {
+  uint64_t sys = stats_clock();
+  int rc = fsync(fd)<0 ? -errno : 0;
+  stats_record(STATS_SYS_FSYNC,sys,rc,0);
+  return rc;
+}
+
+int stats_fstat(int fd, struct stat* st) {
+  uint64_t sys = stats_clock();
+  int rc = fstat(fd,st)<0 ? -errno : 0;
+  stats_record(STATS_SYS_STAT,sys,rc,0);
+  return rc;
+}
+
+void stats_encipher(sfs_store* store, sfs_header* header, off_t pos, const unsigned char* in, unsigned char* out, size_t len) {
+  uint64_t cipher = stats_clock();
+  sfs_encipher_to(store,header,pos,in,out,len);
+  stats_record(STATS_ENCIPHER,cipher,0,len);
+}
+
+void stats_decipher(sfs_store* store, sfs_header* header, off_t pos, unsigned char* data, size_t len) {
+  uint64_t cipher = stats_clock();
+  sfs_decipher(store,header,pos,data,len);
+  stats_record(STATS_DECIPHER,cipher,0,len);
+}
+
+// appends to a text that grows as needed, for every report built from the counters
+int stats_append(char **text, size_t *size, size_t *capacity, const char* fmt, ...) {
+  for(;;) {
+    va_list va;
+    va_start(va,fmt);
+    int len = vsnprintf(*text+*size,*capacity-*size,fmt,va);
+    va_end(va);
+    if (len<0) return -EIO;
+    if (*size+len<*capacity) {
+      *size += len;
+      return 0;
+    }
+    char *grown = realloc(*text,*capacity*2+len);
+    if (grown==NULL) return -ENOMEM;
+    *text = grown;
+    *capacity = *capacity*2+len;
+  }
+}
+
+static uint64_t stats_collect(struct stats_counter total[STATS_COUNT]) {
+  uint64_t entered = 0;
+  uint64_t exited = 0;
+  // sum the per thread blocks without stopping the threads that own them
+  pthread_mutex_lock(&mutexstats);
+  for(struct stats_block *block=stats_blocks; block; block=block->next) {
+    entered += block->entered;
+    exited += block->exited;
+    for(int id=0; id<STATS_COUNT; id++) {
+      struct stats_counter *from = &block->counter[id];
+      struct stats_counter *to = &total[id];
+      to->calls += from->calls;
+      to->errors += from->errors;
+      to->bytes += from->bytes;
+      to->total_ns += from->total_ns;
+      if (from->max_ns>to->max_ns) to->max_ns = from->max_ns;
+      for(int b=0; b<STATS_BUCKETS; b++) to->buckets[b] += from->buckets[b];
+    }
+  }
+  pthread_mutex_unlock(&mutexstats);
+  // the counters are read racily so never report a negative number of operations in flight
+  return entered>exited ? entered-exited : 0;
+}
+
+int stats_summarise(struct stats_summary summary[STATS_COUNT], uint64_t *inflight) {
+  struct stats_counter *total = calloc(STATS_COUNT,sizeof(struct stats_counter));
+  if (total==NULL) return -ENOMEM;
+  *inflight = stats_collect(total);
+  for(int id=0; id<STATS_COUNT; id++) {
+    summary[id].calls = total[id].calls;
+    summary[id].errors = total[id].errors;
+    summary[id].bytes = total[id].bytes;
+    summary[id].total_ns = total[id].total_ns;
+    summary[id].max_ns = total[id].max_ns;
+    summary[id].p50_ns = total[id].calls ? stats_percentile(&total[id],50) : 0;
+    summary[id].p90_ns = total[id].calls ? stats_percentile(&total[id],90) : 0;
+    summary[id].p99_ns = total[id].calls ? stats_percentile(&total[id],99) : 0;
+  }
+  free(total);
+  return 0;
+}
+
+int stats_report(char** text, size_t* size) {
+  struct stats_counter *total = calloc(STATS_COUNT,sizeof(struct stats_counter));
+  if (total==NULL) return -ENOMEM;
+  size_t capacity = 16384;
+  *size = 0;
+  *text = malloc(capacity);
+  if (*text==NULL) {
+    free(total);
+    return -ENOMEM;
+  }
+  uint64_t inflight = stats_collect(total);
+  int rc = stats_append(text,size,&capacity,"uptime_sec=%llu inflight=%llu\n%-14s %12s %10s %16s %10s %10s %10s %10s %10s\n",
+    (unsigned long long)stats_uptime(),(unsigned long long)inflight,
+    "name","calls","errors","bytes","avg_us","p50_us","p90_us","p99_us","max_us");
+  for(int id=0; id<STATS_COUNT && rc==0; id++) {
+    struct stats_counter *counter = &total[id];
+    if (counter->calls==0) continue;
+    rc = stats_append(text,size,&capacity,"%-14s %12llu %10llu %16llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+      stats_names[id],
+      (unsigned long long)counter->calls,(unsigned long long)counter->errors,(unsigned long long)counter->bytes,
+      counter->total_ns/1000.0/counter->calls,
+      stats_percentile(counter,50)/1000.0,stats_percentile(counter,90)/1000.0,stats_percentile(counter,99)/1000.0,
+      counter->max_ns/1000.0);
+  }
+  if (rc==0 && cache_enabled()) {
+    struct cache_summary cache;
+    cache_summarise(&cache);
+    uint64_t lookups = cache.hits+cache.misses;
+    rc = stats_append(text,size,&capacity,"cache hits=%llu misses=%llu hit_rate=%.1f%% blocks=%llu/%llu evictions=%llu invalidations=%llu\n",
+      (unsigned long long)cache.hits,(unsigned long long)cache.misses,lookups ? 100.0*cache.hits/lookups : 0.0,
+      (unsigned long long)cache.blocks,(unsigned long long)cache.capacity,
+      (unsigned long long)cache.evictions,(unsigned long long)cache.invalidations);
+  }
+  if (rc==0 && xattr_enabled()) {
+    struct xattr_summary xattr;
+    xattr_summarise(&xattr);
+    uint64_t lookups = xattr.hits+xattr.misses;
+    rc = stats_append(text,size,&capacity,"xattr hits=%llu misses=%llu hit_rate=%.1f%% entries=%llu bytes=%llu/%llu evictions=%llu invalidations=%llu\n",
+      (unsigned long long)xattr.hits,(unsigned long long)xattr.misses,lookups ? 100.0*xattr.hits/lookups : 0.0,
+      (unsigned long long)xattr.entries,(unsigned long long)xattr.bytes,(unsigned long long)xattr.capacity,
+      (unsigned long long)xattr.evictions,(unsigned long long)xattr.invalidations);
+  }
+  if (rc==0 && warm_enabled()) {
+    struct warm_summary warm;
+    warm_summarise(&warm);
+    uint64_t lookups = warm.hits+warm.misses;
+    rc = stats_append(text,size,&capacity,"warm entries=%llu prefetched=%llu missing=%llu pending=%llu prefetch_ms=%.1f hits=%llu misses=%llu hit_rate=%.1f%% tracked=%llu\n",
+      (unsigned long long)warm.entries,(unsigned long long)warm.prefetched,(unsigned long long)warm.missing,
+      (unsigned long long)warm.pending,warm.prefetch_ns/1e6,
+      (unsigned long long)warm.hits,(unsigned long long)warm.misses,lookups ? 100.0*warm.hits/lookups : 0.0,
+      (unsigned long long)warm.tracked);
+  }
+  // histogram lines list each non-empty bucket as upper-bound-in-ns:count
+  for(int id=0; id<STATS_COUNT && rc==0; id++) {
+    struct stats_counter *counter = &total[id];
+    if (counter->calls==0) continue;
+    rc = stats_append(text,size,&capacity,"histogram %s",stats_names[id]);
+    for(int b=0; b<STATS_BUCKETS && rc==0; b++) {
+      if (counter->buckets[b]) rc = stats_append(text,size,&capacity," %llu:%llu",
+        (unsigned long long)stats_bucket_limit(b),(unsigned long long)counter->buckets[b]);
+    }
+    if (rc==0) rc = stats_append(text,size,&capacity,"\n");
+  }
+  free(total);
+  if (rc<0) {
+    free(*text);
+    *text = NULL;
+    *size = 0;
+  }
+  return rc;
+}
+
+void stats_dump(FILE* logfile) {
+  char *text;
+  size_t size;
+  if (stats_report(&text,&size)==0) {
+    logreport(logfile,"stats",text);
+    free(text);
+  }
+}
+
+static void stats_signal(int signo) {
+  // only async signal safe calls are allowed here so wake the dump thread through the pipe
+  int saved = errno;
+  char ch = 0;
+  if (write(stats_pipe[1],&ch,1)<0) { }
+  errno = saved;
+}
+
+static void* stats_listener(void *logfile) {
+  char ch;
+  for(;;) {
+    ssize_t rc = read(stats_pipe[0],&ch,1);
+    if (rc==1) {
+      stats_dump((FILE*)logfile);
+      lockprof_dump((FILE*)logfile);
+    }
+    else if (rc<0 && errno==EINTR) continue;
+    else break;
+  }
+  return NULL;
+}
+
+int stats_listen(int signo, FILE* logfile) {
+  stats_epoch = stats_clock();
+  if (pipe(stats_pipe)<0) return -errno;
+  pthread_t thread;
+  int rc = pthread_create(&thread,NULL,stats_listener,logfile);
+  if (rc!=0) return -rc;
+  pthread_detach(thread);
+  struct sigaction action;
+  memset(&action,0,sizeof(action));
+  action.sa_handler = stats_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(signo,&action,NULL)<0) return -errno;
+  return 0;
+}
@@ -0,0 +1,117 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+// statistic identifiers: one per fuse operation followed by the cipher, backing syscall, bulk request wait and lock wait timers
+enum stats_id {
+  STATS_Y_GETATTR,
+  STATS_Y_READLINK,
+  STATS_Y_MKNOD,
+  STATS_Y_MKDIR,
+  STATS_Y_UNLINK,
+  STATS_Y_RMDIR,
+  STATS_Y_SYMLINK,
+  STATS_Y_RENAME,
+  STATS_Y_LINK,
+  STATS_Y_CHMOD,
+  STATS_Y_CHOWN,
+  STATS_Y_TRUNCATE,
+  STATS_Y_UTIME,
+  STATS_Y_OPEN,
+  STATS_Y_READ,
+  STATS_Y_WRITE,
+  STATS_Y_STATFS,
+  STATS_Y_RELEASE,
+  STATS_Y_FSYNC,
+  STATS_Y_SETXATTR,
+  STATS_Y_GETXATTR,
+  STATS_Y_LISTXATTR,
+  STATS_Y_REMOVEXATTR,
+  STATS_Y_OPENDIR,
+  STATS_Y_READDIR,
+  STATS_Y_RELEASEDIR,
+  STATS_Y_ACCESS,
+  STATS_Y_CREATE,
+  STATS_Y_FTRUNCATE,
+  STATS_Y_FGETATTR,
+  STATS_Y_LOCK,
+  STATS_Y_CHFLAGS,
+  STATS_Y_COPY_FILE_RANGE,
+  STATS_Y_FALLOCATE,
+  STATS_Y_LSEEK,
+  STATS_ENCIPHER,
+  STATS_DECIPHER,
+  STATS_COMPRESS,
+  STATS_DECOMPRESS,
+  STATS_SYS_OPEN,
+  STATS_SYS_CLOSE,
+  STATS_SYS_PREAD,
+  STATS_SYS_PWRITE,
+  STATS_SYS_STAT,
+  STATS_SYS_TRUNCATE,
+  STATS_SYS_FSYNC,
+  STATS_SYS_XATTR,
+  STATS_SYS_DIR,
+  STATS_SYS_META,
+  STATS_QOS_WAIT,
+  STATS_LOCK_SUM,
+  STATS_LOCK_LOG,
+  STATS_LOCK_SPARSE,
+  STATS_LOCK_CACHE,
+  STATS_LOCK_MAP,
+  STATS_LOCK_DIRECT,
+  STATS_LOCK_POOL,
+  STATS_LOCK_CHUNK,
+  STATS_LOCK_PACK,
+  STATS_LOCK_COMPRESS,
+  STATS_LOCK_QOS,
+  STATS_LOCK_XATTR,
+  STATS_LOCK_WARM,
+  STATS_COUNT
+};
+
+// ids below this are fuse operations
+#define STATS_OPS STATS_ENCIPHER
+
+// latency histograms are log-linear: 4 linear buckets per power of two nanoseconds up to ~36 minutes
+#define STATS_BUCKETS 160
+
+// totals across all threads for exporters that need numbers rather than text
+struct stats_summary {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+};
+
+struct sfs_store;
+struct sfs_header;
+
+uint64_t stats_clock(void);
+uint64_t stats_begin(int id);
+void stats_end(int id, uint64_t start, int rc, uint64_t bytes);
+void stats_record(int id, uint64_t start, int rc, uint64_t bytes);
+int stats_current(void);
+const char* stats_name(int id);
+uint64_t stats_uptime(void);
+int stats_bucket(uint64_t ns);
+uint64_t stats_bucket_limit(int bucket);
+int stats_summarise(struct stats_summary summary[STATS_COUNT], uint64_t *inflight);
+int stats_open(const char* fpath, int flags, mode_t mode);
+void stats_close(int fd);
+ssize_t stats_pread(int fd, unsigned char* buf, size_t size, off_t ofs);
+int stats_pwrite(int fd, const unsigned char* buf, size_t size, off_t ofs);
+int stats_fsync(int fd);
+int stats_fstat(int fd, struct stat* st);
+void stats_encipher(struct sfs_store* store, struct sfs_header* header, off_t pos, const unsigned char* in, unsigned char* out, size_t len);
+void stats_decipher(struct sfs_store* store, struct sfs_header* header, off_t pos, unsigned char* data, size_t len);
+int stats_append(char **text, size_t *size, size_t *capacity, const char* fmt, ...);
+int stats_report(char** text, size_t* size);
+void stats_dump(FILE* logfile);
+int stats_listen(int signo, FILE* logfile);
@@ -0,0 +1,101 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include "trace.h"
+
+int check_round_trip(const char* tracedump, const char* root) {
+  fprintf(stderr,"Check that records written by the daemon are rendered by safefs-tracedump\n");
+  char fpath[PATH_MAX];
+  snprintf(fpath,sizeof(fpath),"%s/trace",root);
+  if (trace_open(fpath)<0) {
+    perror("Failed to open trace file");
+    return 1;
+  }
+  // the large record does not fit a thread buffer and is written straight through
+  static unsigned char large[300000];
+  memset(large,'a',sizeof(large));
+  trace_write("y_write","plain text",64,4096,(const unsigned char*)"hello",5);
+  trace_write("y_read","cipher text",16,0,large,sizeof(large));
+  trace_write("y_read","plain text",64,8192,(const unsigned char*)"\x01world",6);
+  trace_close();
+  if (trace_dropped()!=0) {
+    fprintf(stderr,"Records were dropped. %llu\n",(unsigned long long)trace_dropped());
+    return 1;
+  }
+  char command[PATH_MAX*2+32];
+  snprintf(command,sizeof(command),"%s -dump-ascii %s",tracedump,fpath);
+  FILE *out = popen(command,"r");
+  if (out==NULL) {
+    perror("Failed to run safefs-tracedump");
+    return 1;
+  }
+  // every record has a heading line, the large one has a line per 16 bytes
+  const char *expect[] = {
+    " : y_write        : plain text : offset=4096 size=5",
+    "00001000  h  e  l  l  o",
+    " : y_read         : cipher text : offset=0 size=300000",
+    "000493d0  a  a  a  a  a  a  a  a  a  a  a  a  a  a  a  a",
+    " : y_read         : plain text : offset=8192 size=6",
+    "00002000 01  w  o  r  l  d",
+  };
+  int found[6] = { 0 };
+  int headings = 0;
+  char line[256];
+  while (fgets(line,sizeof(line),out)!=NULL) {
+    if (strstr(line," : offset=")!=NULL) headings++;
+    for(int i=0; i<6; i++) {
+      if (strstr(line,expect[i])!=NULL) found[i] = 1;
+    }
+  }
+  int rc = pclose(out)!=0;
+  if (rc) fprintf(stderr,"safefs-tracedump failed\n");
+  if (headings!=3) {
+    fprintf(stderr,"Rendered %d records instead of 3\n",headings);
+    rc = 1;
+  }
+  for(int i=0; i<6; i++) {
+    if (!found[i]) {
+      fprintf(stderr,"Missing from the rendered trace: %s\n",expect[i]);
+      rc = 1;
+    }
+  }
+  unlink(fpath);
+  return rc;
+}
+
+#ifdef __linux__
+int check_failed_write(const char* tracedump, const char* root) {
+  fprintf(stderr,"Check that records are counted and not written once a trace write fails\n");
+  // every write to /dev/full fails with ENOSPC, including the file header
+  if (trace_open("/dev/full")<0) {
+    perror("Failed to open /dev/full");
+    return 1;
+  }
+  for(int i=0; i<4; i++) trace_write("y_write","plain text",64,i,(const unsigned char*)"hello",5);
+  trace_close();
+  if (trace_dropped()!=4) {
+    fprintf(stderr,"Dropped %llu records instead of 4\n",(unsigned long long)trace_dropped());
+    return 1;
+  }
+  return 0;
+}
+#else
+int check_failed_write(const char* tracedump, const char* root) {
+  // there is no always full device to write to
+  return 0;
+}
+#endif
+
+int main(int argc, char** argv) {
+  if (argc!=3) {
+    fprintf(stderr,"Syntax: trace-test <safefs-tracedump-path> <scratch-folder>\n");
+    return 1;
+  }
+  int rc = 0;
+  rc |= check_round_trip(argv[1],argv[2]);
+  rc |= check_failed_write(argv[1],argv[2]);
+  return rc;
+}
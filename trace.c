@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "trace.h"
+
+// each thread fills its own buffer and hands it to the kernel with one write when it is full
+#define TRACE_BUFFER 262144
+
+typedef struct trace_buffer {
+  unsigned char data[TRACE_BUFFER];
+  size_t used;
+  size_t records;
+  int in_use;
+  struct trace_buffer *next;
+} trace_buffer;
+
+static int trace_fd = -1;
+static int trace_failed = 0;     // set by the first failed write, later records are counted instead of written
+static uint64_t trace_drops = 0;
+static pthread_mutex_t mutextrace = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mutexwrite = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_buffer *trace_buffers = NULL;
+static __thread trace_buffer *trace_local = NULL;
+
+static void put_u16(unsigned char* buf, uint16_t value) {
+  buf[0] = value;
+  buf[1] = value>>8;
+}
+
+static void put_u32(unsigned char* buf, uint32_t value) {
+  for(int i=0; i<4; i++) buf[i] = value>>(i*8);
+}
+
+static void put_u64(unsigned char* buf, uint64_t value) {
+  for(int i=0; i<8; i++) buf[i] = value>>(i*8);
+}
+
+static uint16_t get_u16(const unsigned char* buf) {
+  return buf[0] | (buf[1]<<8);
+}
+
+static uint32_t get_u32(const unsigned char* buf) {
+  uint32_t value = 0;
+  for(int i=3; i>=0; i--) value = (value<<8) | buf[i];
+  return value;
+}
+
+static uint64_t get_u64(const unsigned char* buf) {
+  uint64_t value = 0;
+  for(int i=7; i>=0; i--) value = (value<<8) | buf[i];
+  return value;
+}
+
+static void write_vector(struct iovec *iov, int count, size_t records) {
+  // writes are serialised so the rest of a partial write is appended before any other thread's records
+  pthread_mutex_lock(&mutexwrite);
+  while (count>0 && !trace_failed) {
+    ssize_t rc = writev(trace_fd,iov,count);
+    if (rc<0 && errno==EINTR) continue;
+    if (rc<=0) {
+      // a record cut short cannot be followed by another, so tracing stops here
+      __atomic_store_n(&trace_failed,1,__ATOMIC_RELAXED);
+      break;
+    }
+    while (count>0 && (size_t)rc>=iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count>0) {
+      iov->iov_base = (unsigned char*)iov->iov_base+rc;
+      iov->iov_len -= rc;
+    }
+  }
+  if (trace_failed) __atomic_add_fetch(&trace_drops,records,__ATOMIC_RELAXED);
+  pthread_mutex_unlock(&mutexwrite);
+}
+
+static void flush_buffer(trace_buffer *buffer) {
+  if (buffer->used>0 && trace_fd>=0) {
+    struct iovec iov = { buffer->data, buffer->used };
+    write_vector(&iov,1,buffer->records);
+  }
+  buffer->used = 0;
+  buffer->records = 0;
+}
+
+static void release_buffer(void *buffer) {
+  // flush what an exiting thread captured and let the next new thread reuse its buffer
+  pthread_mutex_lock(&mutextrace);
+  flush_buffer((trace_buffer*)buffer);
+  ((trace_buffer*)buffer)->in_use = 0;
+  pthread_mutex_unlock(&mutextrace);
+}
+
+static void create_key(void) {
+  pthread_key_create(&trace_key,release_buffer);
+}
+
+static trace_buffer* attach_buffer(void) {
+  pthread_once(&trace_once,create_key);
+  pthread_mutex_lock(&mutextrace);
+  trace_buffer *buffer = trace_buffers;
+  while (buffer && buffer->in_use) buffer = buffer->next;
+  if (buffer==NULL) {
+    buffer = calloc(1,sizeof(trace_buffer));
+    if (buffer==NULL) {
+      pthread_mutex_unlock(&mutextrace);
+      return NULL;
+    }
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+  }
+  buffer->in_use = 1;
+  pthread_mutex_unlock(&mutextrace);
+  pthread_setspecific(trace_key,buffer);
+  trace_local = buffer;
+  return buffer;
+}
+
+int trace_open(const char* path) {
+  trace_fd = open(path,O_CREAT | O_TRUNC | O_WRONLY | O_APPEND,0600);
+  if (trace_fd<0) return -errno;
+  trace_failed = 0;
+  trace_drops = 0;
+  unsigned char header[TRACE_FILE_HEADER];
+  memset(header,0,sizeof(header));
+  memcpy(header,TRACE_MAGIC,8);
+  put_u32(&header[8],TRACE_VERSION);
+  struct iovec iov = { header, sizeof(header) };
+  write_vector(&iov,1,0);
+  return 0;
+}
+
+void trace_write(const char* fusecmd, const char* type, uint64_t width, uint64_t ofs, const unsigned char* data, size_t size) {
+  if (trace_fd<0) return;
+  if (__atomic_load_n(&trace_failed,__ATOMIC_RELAXED)) {
+    __atomic_add_fetch(&trace_drops,1,__ATOMIC_RELAXED);
+    return;
+  }
+  trace_buffer *buffer = trace_local;
+  if (buffer==NULL) {
+    buffer = attach_buffer();
+    if (buffer==NULL) return;
+  }
+  size_t cmd_len = strlen(fusecmd);
+  size_t type_len = strlen(type);
+  if (cmd_len>65535) cmd_len = 65535;
+  if (type_len>65535) type_len = 65535;
+  if (size>INT32_MAX-TRACE_RECORD_HEADER-cmd_len-type_len) size = INT32_MAX-TRACE_RECORD_HEADER-cmd_len-type_len;
+  size_t length = TRACE_RECORD_HEADER+cmd_len+type_len+size;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  unsigned char header[TRACE_RECORD_HEADER];
+  put_u32(&header[0],length);
+  put_u64(&header[4],(uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec);
+  put_u64(&header[12],ofs);
+  put_u32(&header[20],width);
+  put_u32(&header[24],size);
+  put_u16(&header[28],cmd_len);
+  put_u16(&header[30],type_len);
+  if (length>TRACE_BUFFER-buffer->used) flush_buffer(buffer);
+  if (length>TRACE_BUFFER) {
+    // too big to buffer so gather the pieces into a single write
+    struct iovec iov[4];
+    iov[0].iov_base = header;
+    iov[0].iov_len = TRACE_RECORD_HEADER;
+    iov[1].iov_base = (void*)fusecmd;
+    iov[1].iov_len = cmd_len;
+    iov[2].iov_base = (void*)type;
+    iov[2].iov_len = type_len;
+    iov[3].iov_base = (void*)data;
+    iov[3].iov_len = size;
+    write_vector(iov,4,1);
+    return;
+  }
+  unsigned char *ptr = &buffer->data[buffer->used];
+  memcpy(ptr,header,TRACE_RECORD_HEADER);
+  memcpy(ptr+TRACE_RECORD_HEADER,fusecmd,cmd_len);
+  memcpy(ptr+TRACE_RECORD_HEADER+cmd_len,type,type_len);
+  memcpy(ptr+TRACE_RECORD_HEADER+cmd_len+type_len,data,size);
+  buffer->used += length;
+  buffer->records++;
+}
+
+void trace_flush(void) {
+  // only safe when the owning threads are idle, e.g. on unmount
+  pthread_mutex_lock(&mutextrace);
+  for(trace_buffer *buffer=trace_buffers; buffer; buffer=buffer->next) {
+    flush_buffer(buffer);
+  }
+  pthread_mutex_unlock(&mutextrace);
+}
+
+void trace_close(void) {
+  if (trace_fd>=0) {
+    trace_flush();
+    close(trace_fd);
+    trace_fd = -1;
+  }
+}
+
+uint64_t trace_dropped(void) {
+  return __atomic_load_n(&trace_drops,__ATOMIC_RELAXED);
+}
+
+int trace_check_file_header(const unsigned char header[TRACE_FILE_HEADER]) {
+  if (memcmp(header,TRACE_MAGIC,8)) return -EINVAL;
+  if (get_u32(&header[8])!=TRACE_VERSION) return -EINVAL;
+  return 0;
+}
+
+int trace_decode(const unsigned char* buf, size_t len, trace_record* record) {
+  // returns the record length, zero when more input is needed or -EINVAL for a corrupt record
+  if (len<TRACE_RECORD_HEADER) return 0;
+  record->length = get_u32(&buf[0]);
+  record->time_ns = get_u64(&buf[4]);
+  record->offset = get_u64(&buf[12]);
+  record->width = get_u32(&buf[20]);
+  record->size = get_u32(&buf[24]);
+  record->cmd_len = get_u16(&buf[28]);
+  record->type_len = get_u16(&buf[30]);
+  if ((uint64_t)TRACE_RECORD_HEADER+record->cmd_len+record->type_len+record->size!=record->length) return -EINVAL;
+  if (len<record->length) return 0;
+  record->cmd = (const char*)&buf[TRACE_RECORD_HEADER];
+  record->type = (const char*)&buf[TRACE_RECORD_HEADER+record->cmd_len];
+  record->data = &buf[TRACE_RECORD_HEADER+record->cmd_len+record->type_len];
+  return record->length;
+}
@@ -0,0 +1,33 @@
+
+#include <unistd.h>
+#include <stdint.h>
+
+// trace files start with an 8 byte magic and a 4 byte version followed by records
+#define TRACE_MAGIC "SAFEFSTR"
+#define TRACE_VERSION 1
+#define TRACE_FILE_HEADER 16
+
+// each record is a 32 byte little endian header followed by the command, the type and the raw data
+#define TRACE_RECORD_HEADER 32
+
+typedef struct trace_record {
+  uint32_t length;   // total bytes in the record including the header
+  uint64_t time_ns;  // wall clock time the data was captured
+  uint64_t offset;   // file offset of the first data byte
+  uint32_t width;    // bytes per line when rendered
+  uint32_t size;     // number of data bytes
+  uint16_t cmd_len;
+  uint16_t type_len;
+  const char *cmd;
+  const char *type;
+  const unsigned char *data;
+} trace_record;
+
+int trace_open(const char* path);
+void trace_write(const char* fusecmd, const char* type, uint64_t width, uint64_t ofs, const unsigned char* data, size_t size);
+void trace_flush(void);
+void trace_close(void);
+// records lost after a write to the trace file failed, tracing stops at the first failure
+uint64_t trace_dropped(void);
+int trace_check_file_header(const unsigned char header[TRACE_FILE_HEADER]);
+int trace_decode(const unsigned char* buf, size_t len, trace_record* record);
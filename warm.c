@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sfs.h"
+#include "warm.h"
+#include "stats.h"
+#include "lockprof.h"
+
+struct warm_count {
+  struct warm_count *next;  // next path in the same hash bucket
+  uint64_t hash;
+  uint64_t opens;
+  char *path;
+};
+
+// a decoded header filed under its cipher text, which already names the file and the pin it was written with
+struct warm_slot {
+  uint64_t used;  // when last looked up or filled, 0 for an empty slot
+  unsigned char in[SFS_HEADER];
+  sfs_header header;
+};
+
+struct warm_shard {
+  pthread_mutex_t mutex;
+  struct warm_count *buckets[WARM_BUCKETS];
+  uint64_t tracked;
+  uint64_t capacity;
+  struct warm_slot *slots;
+  size_t sets;    // of WARM_WAYS slots each
+  uint64_t clock; // orders the uses of the slots
+  uint64_t hits;
+  uint64_t misses;
+};
+
+static struct warm_shard *warm_shards = NULL;
+static uint64_t warm_entries = 0;
+static sfs_store *warm_store = NULL;
+static warm_stat warm_stat_fn = NULL;
+static void *warm_stat_arg = NULL;
+
+// the warm set read at mount, hottest first, and how far the prefetch threads have got through it
+static pthread_mutex_t mutexwarm = PTHREAD_MUTEX_INITIALIZER;
+static char **warm_paths = NULL;
+static size_t warm_path_count = 0;
+static size_t warm_next = 0;
+static uint64_t warm_prefetched = 0;
+static uint64_t warm_missing = 0;
+static uint64_t warm_started = 0;
+static uint64_t warm_finished = 0;
+static int warm_active = 0;
+static int warm_stopping = 0;
+static int warm_threads = 0;
+static pthread_t warm_thread[WARM_THREADS];
+
+static uint64_t warm_hash(const unsigned char* data, size_t len) {
+  // FNV-1a followed by a finalizer so the shard and bucket bits are both well mixed
+  uint64_t x = 0xcbf29ce484222325ULL;
+  for(size_t i=0; i<len; i++) x = (x^data[i])*0x100000001b3ULL;
+  x ^= x>>33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x>>33;
+  return x;
+}
+
+static struct warm_shard* warm_shard(uint64_t hash) {
+  return &warm_shards[hash%WARM_SHARDS];
+}
+
+static struct warm_count** warm_bucket(struct warm_shard *shard, uint64_t hash) {
+  return &shard->buckets[(hash/WARM_SHARDS)%WARM_BUCKETS];
+}
+
+static void warm_evict(struct warm_shard *shard, uint64_t hash) {
+  // only a few paths from the bucket of the new one are compared so a tree walk opening thousands of files stays cheap
+  struct warm_count **victim = NULL;
+  int seen = 0;
+  for(int b=0; b<WARM_BUCKETS && seen<WARM_PROBE; b++) {
+    struct warm_count **link = &shard->buckets[(hash/WARM_SHARDS+b)%WARM_BUCKETS];
+    for(; *link!=NULL; link=&(*link)->next, seen++) {
+      if (victim==NULL || (*link)->opens<(*victim)->opens) victim = link;
+    }
+  }
+  if (victim==NULL) return;
+  struct warm_count *count = *victim;
+  *victim = count->next;
+  shard->tracked--;
+  free(count);
+}
+
+static void warm_add(const char* path, uint64_t opens) {
+  size_t len = strlen(path)+1;
+  uint64_t hash = warm_hash((const unsigned char*)path,len-1);
+  struct warm_shard *shard = warm_shard(hash);
+  lockprof_lock(&shard->mutex,LOCK_WARM);
+  struct warm_count **bucket = warm_bucket(shard,hash);
+  struct warm_count *count = *bucket;
+  while (count!=NULL && (count->hash!=hash || strcmp(count->path,path))) count = count->next;
+  if (count!=NULL) {
+    count->opens += opens;
+    lockprof_unlock(&shard->mutex,LOCK_WARM);
+    return;
+  }
+  if (shard->tracked>=shard->capacity) warm_evict(shard,hash);
+  if (shard->tracked<shard->capacity && (count = malloc(sizeof(struct warm_count)+len))!=NULL) {
+    count->hash = hash;
+    count->opens = opens;
+    count->path = (char*)(count+1);
+    memcpy(count->path,path,len);
+    count->next = *bucket;
+    *bucket = count;
+    shard->tracked++;
+  }
+  lockprof_unlock(&shard->mutex,LOCK_WARM);
+}
+
+int warm_init(uint64_t entries) {
+  if (entries==0) return 0;
+  warm_shards = calloc(WARM_SHARDS,sizeof(struct warm_shard));
+  if (warm_shards==NULL) return -ENOMEM;
+  warm_entries = entries;
+  for(int s=0; s<WARM_SHARDS; s++) {
+    struct warm_shard *shard = &warm_shards[s];
+    pthread_mutex_init(&shard->mutex,NULL);
+    shard->capacity = (entries*WARM_TRACK+WARM_SHARDS-1)/WARM_SHARDS;
+    shard->sets = (entries*WARM_SLOTS+WARM_SHARDS*WARM_WAYS-1)/(WARM_SHARDS*WARM_WAYS);
+    shard->slots = calloc(shard->sets*WARM_WAYS,sizeof(struct warm_slot));
+    if (shard->slots==NULL) {
+      // the shards set up so far go again so a failed init leaves the warm set off
+      for(int t=0; t<=s; t++) {
+        free(warm_shards[t].slots);
+        pthread_mutex_destroy(&warm_shards[t].mutex);
+      }
+      free(warm_shards);
+      warm_shards = NULL;
+      warm_entries = 0;
+      return -ENOMEM;
+    }
+  }
+  return 0;
+}
+
+int warm_enabled(void) {
+  return warm_shards!=NULL;
+}
+
+static int warm_load(void) {
+  // the warm set is a magic line then one "<opens> <path>" line per path, hottest first
+  sfs_file *file;
+  int rc = sfs_open(warm_store,WARM_FILE,O_RDONLY,0,&file);
+  if (rc==-ENOENT) return 0;
+  if (rc<0) return rc;
+  struct stat st;
+  rc = sfs_fstat(file,&st);
+  size_t limit = warm_entries*(PATH_MAX+24)+sizeof(WARM_MAGIC);
+  size_t size = rc<0 ? 0 : (size_t)st.st_size<limit ? (size_t)st.st_size : limit;
+  char *text = rc<0 ? NULL : malloc(size+1);
+  warm_paths = rc<0 ? NULL : calloc(warm_entries,sizeof(char*));
+  if (rc==0 && (text==NULL || warm_paths==NULL)) rc = -ENOMEM;
+  ssize_t got = rc<0 ? 0 : sfs_pread(file,text,size,0);
+  if (got<0) rc = got;
+  sfs_close(file);
+  if (rc==0 && (got<(ssize_t)strlen(WARM_MAGIC) || memcmp(text,WARM_MAGIC,strlen(WARM_MAGIC)))) rc = -EINVAL;
+  if (rc==0) {
+    text[got] = 0;
+    char *line = text+strlen(WARM_MAGIC);
+    while (warm_path_count<warm_entries) {
+      char *end = strchr(line,'\n');
+      if (end==NULL) break;
+      *end = 0;
+      char *path;
+      uint64_t opens = strtoull(line,&path,10);
+      if (*path==' ' && path[1]=='/') {
+        path++;
+        warm_paths[warm_path_count] = strdup(path);
+        if (warm_paths[warm_path_count]==NULL) break;
+        warm_path_count++;
+        // the counts carry over to the next warm set at half weight so it follows what is used now
+        warm_add(path,(opens+1)/2);
+      }
+      line = end+1;
+    }
+  }
+  if (text!=NULL) {
+    memset(text,0,size+1);
+    free(text);
+  }
+  return rc;
+}
+
+static void warm_fetch(const char* path) {
+  char fpath[PATH_MAX];
+  sfs_resolve(warm_store,path,fpath);
+  struct stat st;
+  int found = 0;
+  // the stat brings the backing inode into memory and lets the mount mode cache what it works out from it
+  if (lstat(fpath,&st)==0) {
+    if (warm_stat_fn!=NULL) warm_stat_fn(warm_stat_arg,fpath,&st);
+    found = !S_ISREG(st.st_mode);
+    int fd = S_ISREG(st.st_mode) ? open(fpath,O_RDONLY) : -1;
+    if (fd>=0) {
+      unsigned char in[SFS_HEADER];
+      sfs_header header;
+      if (pread(fd,in,SFS_HEADER,0)==SFS_HEADER) {
+        sfs_decode_header(warm_store,in,&header);
+        warm_insert(in,&header);
+        found = 1;
+      }
+      close(fd);
+      memset(in,0,SFS_HEADER);
+      memset(&header,0,sizeof(sfs_header));
+    }
+  }
+  lockprof_lock(&mutexwarm,LOCK_WARM);
+  if (found) warm_prefetched++;
+  else warm_missing++;
+  lockprof_unlock(&mutexwarm,LOCK_WARM);
+}
+
+static void* warm_prefetcher(void *arg) {
+  lockprof_lock(&mutexwarm,LOCK_WARM);
+  while (!warm_stopping && warm_next<warm_path_count) {
+    const char *path = warm_paths[warm_next++];
+    lockprof_unlock(&mutexwarm,LOCK_WARM);
+    warm_fetch(path);
+    lockprof_lock(&mutexwarm,LOCK_WARM);
+  }
+  if (--warm_active==0) warm_finished = stats_clock();
+  lockprof_unlock(&mutexwarm,LOCK_WARM);
+  return NULL;
+}
+
+int warm_start(sfs_store* store, warm_stat stat, void* arg) {
+  if (warm_shards==NULL) return 0;
+  warm_store = store;
+  warm_stat_fn = stat;
+  warm_stat_arg = arg;
+  warm_started = stats_clock();
+  int rc = warm_load();
+  // the set is read by a few threads at once so the backing store sees several reads in flight
+  lockprof_lock(&mutexwarm,LOCK_WARM);
+  int threads = warm_path_count<WARM_THREADS ? (int)warm_path_count : WARM_THREADS;
+  for(int i=0; i<threads; i++) {
+    if (pthread_create(&warm_thread[warm_threads],NULL,warm_prefetcher,NULL)!=0) break;
+    warm_threads++;
+    warm_active++;
+  }
+  if (warm_threads==0) warm_finished = stats_clock();
+  lockprof_unlock(&mutexwarm,LOCK_WARM);
+  return rc;
+}
+
+void warm_touch(const char* path) {
+  if (warm_shards==NULL) return;
+  warm_add(path,1);
+}
+
+int warm_lookup(const unsigned char in[SFS_HEADER], sfs_header* header) {
+  if (warm_shards==NULL) return 0;
+  uint64_t hash = warm_hash(in,SFS_HEADER);
+  struct warm_shard *shard = warm_shard(hash);
+  lockprof_lock(&shard->mutex,LOCK_WARM);
+  struct warm_slot *set = &shard->slots[((hash/WARM_SHARDS)%shard->sets)*WARM_WAYS];
+  int hit = 0;
+  for(int w=0; w<WARM_WAYS && !hit; w++) {
+    if (!set[w].used || memcmp(set[w].in,in,SFS_HEADER)) continue;
+    memcpy(header,&set[w].header,sizeof(sfs_header));
+    set[w].used = ++shard->clock;
+    hit = 1;
+  }
+  if (hit) shard->hits++;
+  else shard->misses++;
+  lockprof_unlock(&shard->mutex,LOCK_WARM);
+  return hit;
+}
+
+void warm_insert(const unsigned char in[SFS_HEADER], const sfs_header* header) {
+  if (warm_shards==NULL) return;
+  uint64_t hash = warm_hash(in,SFS_HEADER);
+  struct warm_shard *shard = warm_shard(hash);
+  lockprof_lock(&shard->mutex,LOCK_WARM);
+  // a header takes the least recently used slot of its set, the one it replaces is decoded again when next opened
+  struct warm_slot *set = &shard->slots[((hash/WARM_SHARDS)%shard->sets)*WARM_WAYS];
+  struct warm_slot *slot = &set[0];
+  for(int w=0; w<WARM_WAYS; w++) {
+    if (set[w].used && !memcmp(set[w].in,in,SFS_HEADER)) {
+      slot = &set[w];
+      break;
+    }
+    if (set[w].used<slot->used) slot = &set[w];
+  }
+  slot->used = ++shard->clock;
+  memcpy(slot->in,in,SFS_HEADER);
+  memcpy(&slot->header,header,sizeof(sfs_header));
+  lockprof_unlock(&shard->mutex,LOCK_WARM);
+}
+
+void warm_summarise(struct warm_summary* summary) {
+  memset(summary,0,sizeof(struct warm_summary));
+  if (warm_shards==NULL) return;
+  for(int s=0; s<WARM_SHARDS; s++) {
+    struct warm_shard *shard = &warm_shards[s];
+    lockprof_lock(&shard->mutex,LOCK_WARM);
+    summary->hits += shard->hits;
+    summary->misses += shard->misses;
+    summary->tracked += shard->tracked;
+    lockprof_unlock(&shard->mutex,LOCK_WARM);
+  }
+  lockprof_lock(&mutexwarm,LOCK_WARM);
+  summary->entries = warm_path_count;
+  summary->prefetched = warm_prefetched;
+  summary->missing = warm_missing;
+  summary->pending = warm_path_count-warm_next;
+  if (warm_started>0) summary->prefetch_ns = (warm_finished>0 ? warm_finished : stats_clock())-warm_started;
+  lockprof_unlock(&mutexwarm,LOCK_WARM);
+}
+
+static int warm_order(const void* a, const void* b) {
+  uint64_t x = (*(struct warm_count* const*)a)->opens;
+  uint64_t y = (*(struct warm_count* const*)b)->opens;
+  return x>y ? -1 : x<y;
+}
+
+static int warm_save(void) {
+  // the most opened paths are written to a new file that replaces the old one only once it is complete
+  struct warm_count **counts = NULL;
+  size_t total = 0;
+  for(int s=0; s<WARM_SHARDS; s++) total += warm_shards[s].tracked;
+  if (total>0 && (counts = malloc(total*sizeof(struct warm_count*)))==NULL) return -ENOMEM;
+  size_t n = 0;
+  for(int s=0; s<WARM_SHARDS; s++) {
+    for(int b=0; b<WARM_BUCKETS; b++) {
+      for(struct warm_count *count=warm_shards[s].buckets[b]; count!=NULL && n<total; count=count->next) counts[n++] = count;
+    }
+  }
+  if (n>0) qsort(counts,n,sizeof(struct warm_count*),warm_order);
+  if (n>warm_entries) n = warm_entries;
+  size_t capacity = strlen(WARM_MAGIC)+1;
+  for(size_t i=0; i<n; i++) capacity += strlen(counts[i]->path)+24;
+  char *text = malloc(capacity);
+  if (text==NULL) {
+    free(counts);
+    return -ENOMEM;
+  }
+  size_t size = snprintf(text,capacity,"%s",WARM_MAGIC);
+  for(size_t i=0; i<n; i++) {
+    if (strchr(counts[i]->path,'\n')!=NULL) continue;
+    size += snprintf(&text[size],capacity-size,"%llu %s\n",(unsigned long long)counts[i]->opens,counts[i]->path);
+  }
+  free(counts);
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  int rc = sfs_resolve(warm_store,WARM_TEMP,from);
+  if (rc==0) rc = sfs_resolve(warm_store,WARM_FILE,to);
+  // one left by a save that did not finish may not even have a whole header
+  if (rc==0) unlink(from);
+  sfs_file *file;
+  if (rc==0) rc = sfs_open(warm_store,WARM_TEMP,O_WRONLY|O_CREAT|O_TRUNC,0600,&file);
+  if (rc==0) {
+    ssize_t wrote = sfs_pwrite(file,text,size,0);
+    if (wrote<0) rc = wrote;
+    else if ((size_t)wrote!=size) rc = -EIO;
+    if (rc==0) rc = sfs_fsync(file);
+    int closed = sfs_close(file);
+    if (rc==0) rc = closed;
+  }
+  if (rc==0 && rename(from,to)<0) rc = -errno;
+  // the rename is only durable once the folder holding both names is synced
+  int dir = rc<0 ? -1 : open(warm_store->rootdir,O_RDONLY | O_DIRECTORY);
+  if (rc==0 && dir<0) rc = -errno;
+  if (rc==0 && fsync(dir)<0) rc = -errno;
+  if (dir>=0) close(dir);
+  memset(text,0,capacity);
+  free(text);
+  return rc;
+}
+
+void warm_stop(void) {
+  if (warm_shards==NULL) return;
+  lockprof_lock(&mutexwarm,LOCK_WARM);
+  warm_stopping = 1;
+  lockprof_unlock(&mutexwarm,LOCK_WARM);
+  for(int i=0; i<warm_threads; i++) pthread_join(warm_thread[i],NULL);
+  warm_threads = 0;
+  if (warm_store!=NULL) warm_save();
+  for(size_t i=0; i<warm_path_count; i++) free(warm_paths[i]);
+  free(warm_paths);
+  warm_paths = NULL;
+  warm_path_count = 0;
+  for(int s=0; s<WARM_SHARDS; s++) {
+    struct warm_shard *shard = &warm_shards[s];
+    lockprof_lock(&shard->mutex,LOCK_WARM);
+    for(int b=0; b<WARM_BUCKETS; b++) {
+      while (shard->buckets[b]!=NULL) {
+        struct warm_count *next = shard->buckets[b]->next;
+        free(shard->buckets[b]);
+        shard->buckets[b] = next;
+      }
+    }
+    // the decoded rotors are wiped like those of closed files
+    if (shard->slots!=NULL) memset(shard->slots,0,shard->sets*WARM_WAYS*sizeof(struct warm_slot));
+    free(shard->slots);
+    lockprof_unlock(&shard->mutex,LOCK_WARM);
+    pthread_mutex_destroy(&shard->mutex);
+  }
+  free(warm_shards);
+  warm_shards = NULL;
+}
@@ -0,0 +1,44 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// a -w mount counts the opens of every path and keeps the most opened in an enciphered file in the store,
+// the next mount reads their headers and attributes in the background before anything asks for them
+#define WARM_FILE "/.safefs-warm"
+#define WARM_TEMP "/.safefs-warm.new"
+#define WARM_MAGIC "SFSWARM1\n"
+#define WARM_SHARDS 16
+#define WARM_BUCKETS 1024
+// opens are counted for up to this many paths per warm set entry, then the least opened of the next few makes room
+#define WARM_TRACK 4
+#define WARM_PROBE 8
+// decoded headers are kept in this many slots per warm set entry, looked up by their cipher text in sets of WARM_WAYS
+#define WARM_SLOTS 4
+#define WARM_WAYS 4
+#define WARM_THREADS 4
+
+// called for each prefetched path after its backing file has been stat'ed, to fill the caches of the mount mode
+typedef void (*warm_stat)(void* arg, const char* fpath, struct stat* st);
+
+// totals for the statistics report and the metrics exporter
+struct warm_summary {
+  uint64_t entries;     // paths in the warm set
+  uint64_t prefetched;  // of them whose header was read at mount
+  uint64_t missing;     // of them gone since the warm set was written
+  uint64_t pending;     // not reached yet
+  uint64_t prefetch_ns; // from mount until the last prefetch finished
+  uint64_t hits;        // opens that found their decoded header
+  uint64_t misses;
+  uint64_t tracked;     // paths whose opens are being counted
+};
+
+int warm_init(uint64_t entries);
+int warm_enabled(void);
+int warm_start(sfs_store* store, warm_stat stat, void* arg);
+void warm_touch(const char* path);
+int warm_lookup(const unsigned char in[SFS_HEADER], sfs_header* header);
+void warm_insert(const unsigned char in[SFS_HEADER], const sfs_header* header);
+void warm_summarise(struct warm_summary* summary);
+void warm_stop(void);
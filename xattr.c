@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "xattr.h"
+#include "stats.h"
+#include "lockprof.h"
+
+struct xattr_entry {
+  struct xattr_entry *next;   // next entry in the same hash bucket
+  struct xattr_entry *newer;  // least recently used order within the shard
+  struct xattr_entry *older;
+  uint64_t hash;              // of the path alone so every entry of a path shares a bucket
+  uint64_t expires;
+  ssize_t len;                // bytes of the value or name list, or a negative errno such as -ENOATTR
+  size_t bytes;               // charged against the capacity of the shard
+  char *path;
+  char *name;                 // NULL for the name list of the path
+  char *value;
+};
+
+struct xattr_shard {
+  pthread_mutex_t mutex;
+  struct xattr_entry *buckets[XATTR_BUCKETS];
+  struct xattr_entry *newest;
+  struct xattr_entry *oldest;
+  uint64_t epoch; // bumped by every invalidation so a fill that raced with a change is dropped
+  uint64_t bytes;
+  uint64_t capacity;
+  uint64_t entries;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+};
+
+static struct xattr_shard *xattr_shards = NULL;
+
+static uint64_t xattr_hash(const char* path) {
+  // FNV-1a followed by a finalizer so the shard and bucket bits are both well mixed
+  uint64_t x = 0xcbf29ce484222325ULL;
+  for(const unsigned char *p=(const unsigned char*)path; *p; p++) x = (x^*p)*0x100000001b3ULL;
+  x ^= x>>33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x>>33;
+  return x;
+}
+
+static struct xattr_shard* xattr_shard(uint64_t hash) {
+  return &xattr_shards[hash%XATTR_SHARDS];
+}
+
+static struct xattr_entry** xattr_bucket(struct xattr_shard *shard, uint64_t hash) {
+  return &shard->buckets[(hash/XATTR_SHARDS)%XATTR_BUCKETS];
+}
+
+static int xattr_same(const struct xattr_entry *entry, uint64_t hash, const char* path, const char* name) {
+  if (entry->hash!=hash || strcmp(entry->path,path)) return 0;
+  if (name==NULL || entry->name==NULL) return name==entry->name;
+  return !strcmp(entry->name,name);
+}
+
+static void xattr_unlink(struct xattr_shard *shard, struct xattr_entry *entry) {
+  struct xattr_entry **link = xattr_bucket(shard,entry->hash);
+  while (*link!=entry) link = &(*link)->next;
+  *link = entry->next;
+  if (entry->newer) entry->newer->older = entry->older;
+  else shard->newest = entry->older;
+  if (entry->older) entry->older->newer = entry->newer;
+  else shard->oldest = entry->newer;
+  shard->bytes -= entry->bytes;
+  shard->entries--;
+  // values may be security labels so they are wiped like the plain text of a block
+  memset(entry,0,entry->bytes);
+  free(entry);
+}
+
+int xattr_init(uint64_t bytes) {
+  if (bytes==0) return 0;
+  xattr_shards = calloc(XATTR_SHARDS,sizeof(struct xattr_shard));
+  if (xattr_shards==NULL) return -ENOMEM;
+  for(int s=0; s<XATTR_SHARDS; s++) {
+    pthread_mutex_init(&xattr_shards[s].mutex,NULL);
+    xattr_shards[s].capacity = bytes/XATTR_SHARDS;
+  }
+  return 0;
+}
+
+int xattr_enabled(void) {
+  return xattr_shards!=NULL;
+}
+
+int xattr_lookup(const char* path, const char* name, char* val, size_t size, ssize_t* rc, uint64_t* epoch) {
+  // a hit answers the call as getxattr or listxattr would, a miss returns 0 with the epoch to hand to xattr_insert
+  uint64_t hash = xattr_hash(path);
+  struct xattr_shard *shard = xattr_shard(hash);
+  lockprof_lock(&shard->mutex,LOCK_XATTR);
+  *epoch = shard->epoch;
+  struct xattr_entry *entry = *xattr_bucket(shard,hash);
+  while (entry!=NULL && !xattr_same(entry,hash,path,name)) entry = entry->next;
+  if (entry!=NULL && entry->expires<stats_clock()) {
+    xattr_unlink(shard,entry);
+    entry = NULL;
+  }
+  if (entry==NULL) {
+    shard->misses++;
+    lockprof_unlock(&shard->mutex,LOCK_XATTR);
+    return 0;
+  }
+  shard->hits++;
+  if (entry->len<0 || size==0) *rc = entry->len;
+  else if (size<(size_t)entry->len) *rc = -ERANGE;
+  else {
+    memcpy(val,entry->value,entry->len);
+    *rc = entry->len;
+  }
+  // a hit moves the entry to the newest end so a folder being browsed stays cached
+  if (entry->newer!=NULL) {
+    entry->newer->older = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else shard->oldest = entry->newer;
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    shard->newest->newer = entry;
+    shard->newest = entry;
+  }
+  lockprof_unlock(&shard->mutex,LOCK_XATTR);
+  return 1;
+}
+
+void xattr_insert(const char* path, const char* name, const char* val, ssize_t len, uint64_t epoch) {
+  if (xattr_shards==NULL || len>XATTR_VALUE) return;
+  uint64_t hash = xattr_hash(path);
+  struct xattr_shard *shard = xattr_shard(hash);
+  size_t plen = strlen(path)+1;
+  size_t nlen = name ? strlen(name)+1 : 0;
+  size_t bytes = sizeof(struct xattr_entry)+plen+nlen+(len>0 ? len : 0);
+  if (bytes>shard->capacity) return;
+  struct xattr_entry *entry = malloc(bytes);
+  if (entry==NULL) return;
+  memset(entry,0,sizeof(struct xattr_entry));
+  entry->hash = hash;
+  entry->len = len;
+  entry->bytes = bytes;
+  entry->path = (char*)(entry+1);
+  memcpy(entry->path,path,plen);
+  if (name) {
+    entry->name = entry->path+plen;
+    memcpy(entry->name,name,nlen);
+  }
+  entry->value = entry->path+plen+nlen;
+  if (len>0) memcpy(entry->value,val,len);
+  lockprof_lock(&shard->mutex,LOCK_XATTR);
+  if (shard->epoch!=epoch) {
+    lockprof_unlock(&shard->mutex,LOCK_XATTR);
+    memset(entry,0,bytes);
+    free(entry);
+    return;
+  }
+  entry->expires = stats_clock()+XATTR_TTL_NS;
+  struct xattr_entry **bucket = xattr_bucket(shard,hash);
+  for(struct xattr_entry *old=*bucket; old!=NULL; old=old->next) {
+    if (!xattr_same(old,hash,path,name)) continue;
+    xattr_unlink(shard,old);
+    break;
+  }
+  while (shard->bytes+bytes>shard->capacity && shard->oldest!=NULL) {
+    xattr_unlink(shard,shard->oldest);
+    shard->evictions++;
+  }
+  entry->next = *bucket;
+  *bucket = entry;
+  entry->older = shard->newest;
+  if (shard->newest) shard->newest->newer = entry;
+  else shard->oldest = entry;
+  shard->newest = entry;
+  shard->bytes += bytes;
+  shard->entries++;
+  lockprof_unlock(&shard->mutex,LOCK_XATTR);
+}
+
+void xattr_forget(const char* path) {
+  // every value, the name list and the missing attributes of the path go together
+  if (xattr_shards==NULL) return;
+  uint64_t hash = xattr_hash(path);
+  struct xattr_shard *shard = xattr_shard(hash);
+  lockprof_lock(&shard->mutex,LOCK_XATTR);
+  shard->epoch++;
+  struct xattr_entry *entry = *xattr_bucket(shard,hash);
+  while (entry!=NULL) {
+    struct xattr_entry *next = entry->next;
+    if (entry->hash==hash && !strcmp(entry->path,path)) {
+      xattr_unlink(shard,entry);
+      shard->invalidations++;
+    }
+    entry = next;
+  }
+  lockprof_unlock(&shard->mutex,LOCK_XATTR);
+}
+
+void xattr_forget_all(void) {
+  // a renamed folder moves every path below it, which are spread over all the shards
+  if (xattr_shards==NULL) return;
+  for(int s=0; s<XATTR_SHARDS; s++) {
+    struct xattr_shard *shard = &xattr_shards[s];
+    lockprof_lock(&shard->mutex,LOCK_XATTR);
+    shard->epoch++;
+    shard->invalidations += shard->entries;
+    while (shard->oldest!=NULL) xattr_unlink(shard,shard->oldest);
+    lockprof_unlock(&shard->mutex,LOCK_XATTR);
+  }
+}
+
+void xattr_summarise(struct xattr_summary* summary) {
+  memset(summary,0,sizeof(struct xattr_summary));
+  if (xattr_shards==NULL) return;
+  for(int s=0; s<XATTR_SHARDS; s++) {
+    struct xattr_shard *shard = &xattr_shards[s];
+    lockprof_lock(&shard->mutex,LOCK_XATTR);
+    summary->hits += shard->hits;
+    summary->misses += shard->misses;
+    summary->evictions += shard->evictions;
+    summary->invalidations += shard->invalidations;
+    summary->entries += shard->entries;
+    summary->bytes += shard->bytes;
+    summary->capacity += shard->capacity;
+    lockprof_unlock(&shard->mutex,LOCK_XATTR);
+  }
+}
+
+void xattr_stop(void) {
+  if (xattr_shards==NULL) return;
+  for(int s=0; s<XATTR_SHARDS; s++) {
+    struct xattr_shard *shard = &xattr_shards[s];
+    lockprof_lock(&shard->mutex,LOCK_XATTR);
+    while (shard->oldest!=NULL) xattr_unlink(shard,shard->oldest);
+    lockprof_unlock(&shard->mutex,LOCK_XATTR);
+    pthread_mutex_destroy(&shard->mutex);
+  }
+  free(xattr_shards);
+  xattr_shards = NULL;
+}
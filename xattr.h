@@ -0,0 +1,32 @@
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// extended attribute values, name lists and missing attributes are cached by path for a short time
+#define XATTR_SHARDS 16
+#define XATTR_BUCKETS 1024
+// an entry is trusted for this long so a change made behind the mount or through another hard link is seen soon
+#define XATTR_TTL_NS 2000000000ULL
+// larger values and name lists are always read from the backing file
+#define XATTR_VALUE 4096
+
+// totals across all shards for the statistics report and the metrics exporter
+struct xattr_summary {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  uint64_t entries;
+  uint64_t bytes;    // held by entries
+  uint64_t capacity; // bytes that fit
+};
+
+int xattr_init(uint64_t bytes);
+int xattr_enabled(void);
+int xattr_lookup(const char* path, const char* name, char* val, size_t size, ssize_t* rc, uint64_t* epoch);
+void xattr_insert(const char* path, const char* name, const char* val, ssize_t len, uint64_t epoch);
+void xattr_forget(const char* path);
+void xattr_forget_all(void);
+void xattr_summarise(struct xattr_summary* summary);
+void xattr_stop(void);